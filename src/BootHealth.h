@@ -0,0 +1,212 @@
+/*
+  -----------------------
+  Boot Health Check
+  -----------------------
+
+  A freshly updated image is on trial until it proves it works: the main
+  loop has to run and, since the image just arrived over the network, the
+  station has to get an IP and the OTA server has to be listening again.
+  Only then is the image marked valid. If that doesn't happen within
+  BOOT_HEALTH_DEADLINE_MS, the device boots back into the previous slot.
+
+  The deadline is enforced by a watchdog task rather than from loop(), so
+  an image that hangs in setup() or never calls handleOTA() is rolled back
+  too. An image that crashes before the deadline is caught by counting
+  trial boots.
+
+  The trial is tracked in NVS when the update is committed, so this works
+  whether or not the bootloader was built with app rollback support; when
+  it was, the image's PENDING_VERIFY state is honoured as well.
+
+  Time-to-healthy is logged and stored for every boot.
+*/
+#include <esp_ota_ops.h>
+#include <Preferences.h>
+
+const char *BOOT_HEALTH_NAMESPACE = "boot-health";
+
+// How long a new image has to pass its self-test
+#ifndef BOOT_HEALTH_DEADLINE_MS
+#define BOOT_HEALTH_DEADLINE_MS 60000UL
+#endif
+
+// Trial boots that may end in a crash or reset before rolling back
+#ifndef BOOT_HEALTH_MAX_ATTEMPTS
+#define BOOT_HEALTH_MAX_ATTEMPTS 3
+#endif
+
+// Self-test conditions
+enum BootHealthCheck {
+  BOOT_CHECK_LOOP       = 1 << 0, // handleOTA() is being called
+  BOOT_CHECK_WIFI       = 1 << 1, // Station has an IP
+  BOOT_CHECK_OTA_SERVER = 1 << 2  // Web server is listening
+};
+
+// Conditions a new image has to meet. Regular boots only check the loop,
+// since networking is started on demand.
+const uint8_t BOOT_HEALTH_TRIAL_CHECKS = BOOT_CHECK_LOOP | BOOT_CHECK_WIFI | BOOT_CHECK_OTA_SERVER;
+
+// True while the running image is on trial
+bool isBootOnTrial = false;
+
+// True once the self-test passed for this boot
+volatile bool isBootHealthy = false;
+
+// Time from boot to passing the self-test
+unsigned long bootHealthyMillis = 0;
+
+TaskHandle_t bootHealthTask = NULL;
+
+/**
+ * Keep the Arduino core from marking a pending image valid before setup()
+ */
+bool verifyRollbackLater() {
+  return true;
+}
+
+/**
+ * Remember that the image just committed to the boot partition is on trial
+ *
+ * Called after a successful update; does nothing if the boot partition did
+ * not change (e.g. a filesystem update).
+ */
+void markBootTrial() {
+  const esp_partition_t *boot = esp_ota_get_boot_partition();
+  if (boot == NULL || boot == esp_ota_get_running_partition()) {
+    return;
+  }
+
+  Preferences prefs;
+  if (prefs.begin(BOOT_HEALTH_NAMESPACE, false)) {
+    prefs.putUInt("trial", boot->address);
+    prefs.putUInt("attempts", 0);
+    prefs.end();
+  }
+}
+
+/**
+ * Boot back into the previous image; only returns if that isn't possible
+ */
+void rollBackFirmware(const char *reason) {
+  Serial.printf("BOOT: Self-test failed (%s), rolling back\n", reason);
+  Serial.flush();
+
+  Preferences prefs;
+  if (prefs.begin(BOOT_HEALTH_NAMESPACE, false)) {
+    prefs.remove("trial");
+    prefs.remove("attempts");
+    prefs.end();
+  }
+
+  // Marks this image invalid and reboots if the other slot holds a valid app
+  esp_ota_mark_app_invalid_rollback_and_reboot();
+
+  Serial.println(F("BOOT: No previous image to roll back to, keeping this one"));
+}
+
+/**
+ * Watchdog for the self-test deadline
+ *
+ * Runs on the other core at low priority and is woken early once the
+ * self-test passed, so it works even if the loop task is stuck.
+ */
+void bootHealthWatchdog(void * /* param */) {
+  if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(BOOT_HEALTH_DEADLINE_MS)) == 0 && !isBootHealthy) {
+    rollBackFirmware("deadline passed");
+  }
+  bootHealthTask = NULL;
+  vTaskDelete(NULL);
+}
+
+/**
+ * Find out whether the running image is on trial and start the deadline
+ *
+ * Call as early as possible in setup(), so a hang anywhere after it is
+ * still caught.
+ */
+void beginBootHealthCheck() {
+  const esp_partition_t *running = esp_ota_get_running_partition();
+
+  esp_ota_img_states_t state;
+  bool isPendingVerify = esp_ota_get_state_partition(running, &state) == ESP_OK &&
+                         state == ESP_OTA_IMG_PENDING_VERIFY;
+
+  uint32_t attempts = 0;
+  Preferences prefs;
+  if (prefs.begin(BOOT_HEALTH_NAMESPACE, false)) {
+    bool isTrialPartition = prefs.getUInt("trial", 0) == running->address;
+    isBootOnTrial = isPendingVerify || isTrialPartition;
+    if (isBootOnTrial) {
+      attempts = prefs.getUInt("attempts", 0) + 1;
+      prefs.putUInt("attempts", attempts);
+    }
+    prefs.end();
+  } else {
+    isBootOnTrial = isPendingVerify;
+  }
+
+  if (!isBootOnTrial) {
+    return;
+  }
+
+  Serial.printf("BOOT: New image on trial (boot %lu of %lu), self-test deadline %lu ms\n",
+                (unsigned long)attempts, (unsigned long)BOOT_HEALTH_MAX_ATTEMPTS, (unsigned long)BOOT_HEALTH_DEADLINE_MS);
+
+  // Earlier trial boots crashed or were reset before passing
+  if (attempts > BOOT_HEALTH_MAX_ATTEMPTS) {
+    rollBackFirmware("too many trial boots");
+    return;
+  }
+
+  xTaskCreatePinnedToCore(bootHealthWatchdog, "boot-health", 4096, NULL, 1, &bootHealthTask, 0);
+}
+
+/**
+ * Mark the running image as good and record how long that took
+ */
+void onBootHealthy() {
+  isBootHealthy = true;
+  bootHealthyMillis = millis();
+
+  if (isBootOnTrial) {
+    esp_ota_mark_app_valid_cancel_rollback();
+    if (bootHealthTask != NULL) {
+      xTaskNotifyGive(bootHealthTask);
+    }
+  }
+
+  Preferences prefs;
+  if (prefs.begin(BOOT_HEALTH_NAMESPACE, false)) {
+    if (isBootOnTrial) {
+      prefs.remove("trial");
+      prefs.remove("attempts");
+    }
+    prefs.putULong("healthy_ms", bootHealthyMillis);
+    prefs.end();
+  }
+
+  Serial.printf("BOOT: Healthy after %lu ms%s\n", bootHealthyMillis,
+                isBootOnTrial ? ", new image marked valid" : "");
+}
+
+/**
+ * Evaluate the self-test; called from handleOTA(), which proves the loop runs
+ */
+void handleBootHealth(bool isWiFiUp, bool isServerUp) {
+  if (isBootHealthy) {
+    return;
+  }
+
+  uint8_t passed = BOOT_CHECK_LOOP;
+  if (isWiFiUp) {
+    passed |= BOOT_CHECK_WIFI;
+  }
+  if (isServerUp) {
+    passed |= BOOT_CHECK_OTA_SERVER;
+  }
+
+  uint8_t required = isBootOnTrial ? BOOT_HEALTH_TRIAL_CHECKS : (uint8_t)BOOT_CHECK_LOOP;
+  if ((passed & required) == required) {
+    onBootHealthy();
+  }
+}
@@ -0,0 +1,142 @@
+/*
+  -----------------------
+  Build Identity
+  -----------------------
+
+  Identifies the running firmware so an update that would install the
+  same build again can be refused before any of it is transferred.
+
+  Version and git hash are fixed at compile time. tools/build_identity.py
+  passes them in as OTA_FIRMWARE_VERSION and OTA_GIT_HASH. The image hashes
+  can't be compiled in (they would change the image), so they are
+  computed once at startup from the running partition. The hashes cover
+  exactly the bytes of the .bin file that was flashed: sha256sum and md5sum
+  of firmware.bin give the same values, and so does the ElegantOTA page's
+  MD5.
+
+  GET /ota/identity returns all of it as JSON (see OTAUpload.h).
+*/
+#include <esp_image_format.h>
+#include <MD5Builder.h>
+
+// Set by tools/build_identity.py; may also be given in build_flags
+#ifndef OTA_FIRMWARE_VERSION
+#define OTA_FIRMWARE_VERSION NULL
+#endif
+#ifndef OTA_GIT_HASH
+#define OTA_GIT_HASH "unknown"
+#endif
+
+struct RunningImageDigest {
+  bool isValid;
+  size_t size;                     // Image length on flash (= .bin size)
+  uint8_t sha256[OTA_SHA256_SIZE];
+  String md5;
+};
+
+RunningImageDigest runningImage;
+
+// Updates refused because they matched the running image
+uint32_t identicalImageRejects = 0;
+uint64_t identicalImageBytesSaved = 0;
+
+/**
+ * Version of the running firmware
+ */
+const char *currentFirmwareVersion() {
+  const char *version = OTA_FIRMWARE_VERSION;
+  return version != NULL ? version : esp_ota_get_app_description()->version;
+}
+
+/**
+ * Hash the running image; call once at startup
+ */
+void computeRunningImageDigest() {
+  unsigned long t0 = millis();
+  runningImage.isValid = false;
+
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  esp_partition_pos_t position = { running->address, running->size };
+  esp_image_metadata_t metadata;
+  if (esp_image_verify(ESP_IMAGE_VERIFY_SILENT, &position, &metadata) != ESP_OK) {
+    Serial.println(F("BUILD: Running image could not be verified"));
+    return;
+  }
+
+  uint8_t *buffer = (uint8_t *)malloc(OTA_SECTOR_SIZE);
+  if (buffer == NULL) {
+    return;
+  }
+
+  OTAImageHash sha;
+  MD5Builder md5;
+  otaHashBegin(sha);
+  md5.begin();
+
+  bool ok = true;
+  for (size_t offset = 0; offset < metadata.image_len && ok; offset += OTA_SECTOR_SIZE) {
+    size_t n = min(OTA_SECTOR_SIZE, (size_t)metadata.image_len - offset);
+    ok = esp_partition_read(running, offset, buffer, n) == ESP_OK;
+    otaHashUpdate(sha, buffer, n);
+    md5.add(buffer, n);
+  }
+  free(buffer);
+
+  otaHashFinish(sha);
+  md5.calculate();
+  if (!ok) {
+    return;
+  }
+
+  memcpy(runningImage.sha256, sha.digest, OTA_SHA256_SIZE);
+  runningImage.md5 = md5.toString();
+  runningImage.size = metadata.image_len;
+  runningImage.isValid = true;
+
+  Serial.printf("BUILD: Version %s (%s), %u byte image hashed in %lu ms\n", currentFirmwareVersion(),
+                OTA_GIT_HASH, runningImage.size, millis() - t0);
+}
+
+/**
+ * Whether an update with these hashes would reinstall the running image
+ *
+ * Either hash may be missing (empty MD5, NULL SHA-256).
+ */
+bool isRunningImage(const String &md5, const uint8_t *sha256) {
+  if (!runningImage.isValid) {
+    return false;
+  }
+  return (md5.length() && md5.equalsIgnoreCase(runningImage.md5)) ||
+         (sha256 != NULL && memcmp(sha256, runningImage.sha256, OTA_SHA256_SIZE) == 0);
+}
+
+/**
+ * Count an update refused because it matched the running image
+ */
+void recordIdenticalImageReject() {
+  identicalImageRejects++;
+  identicalImageBytesSaved += runningImage.size;
+  Serial.printf("OTA: Refused to reinstall the running image, %lu bytes saved so far\n",
+                (unsigned long)identicalImageBytesSaved);
+}
+
+/**
+ * Build identity and skip counters as JSON
+ */
+String buildIdentityJSON() {
+  char sha256[OTA_SHA256_SIZE * 2 + 1] = "";
+  if (runningImage.isValid) {
+    for (size_t i = 0; i < OTA_SHA256_SIZE; i++) {
+      snprintf(sha256 + i * 2, 3, "%02x", runningImage.sha256[i]);
+    }
+  }
+
+  char json[384];
+  snprintf(json, sizeof(json),
+           "{\"version\":\"%s\",\"git\":\"%s\",\"built\":\"%s %s\",\"size\":%u,"
+           "\"sha256\":\"%s\",\"md5\":\"%s\",\"identical_rejected\":%lu,\"bytes_saved\":%llu}",
+           currentFirmwareVersion(), OTA_GIT_HASH, __DATE__, __TIME__, runningImage.size,
+           sha256, runningImage.md5.c_str(), (unsigned long)identicalImageRejects,
+           (unsigned long long)identicalImageBytesSaved);
+  return String(json);
+}
@@ -0,0 +1,144 @@
+/*
+  -----------------------
+  HTTP Chunked Body Decoder
+  -----------------------
+
+  Incremental decoder for Transfer-Encoding: chunked request bodies
+  (RFC 9112 section 7.1). The body can arrive split at any byte across TCP
+  segments. Payload is never copied: each call hands out a slice that
+  points into the caller's buffer.
+
+  Usage:
+    while (len > 0 && !chunkedDone(decoder)) {
+      const uint8_t *payload;
+      size_t payloadLen;
+      size_t used = chunkedDecode(decoder, data, len, payload, payloadLen);
+      // consume payload[0..payloadLen)
+      data += used;
+      len -= used;
+    }
+*/
+
+enum ChunkedState {
+  CHUNKED_SIZE,       // Hex chunk size
+  CHUNKED_EXTENSION,  // ";name=value" after the size, ignored
+  CHUNKED_DATA,       // Chunk payload
+  CHUNKED_DATA_END,   // CRLF after the payload
+  CHUNKED_TRAILER,    // Trailer fields after the last chunk, ignored
+  CHUNKED_DONE,
+  CHUNKED_ERROR
+};
+
+struct ChunkedDecoder {
+  ChunkedState state;
+  uint32_t remaining;   // Payload bytes left in the current chunk
+  uint8_t sizeDigits;
+  uint16_t lineLength;  // Length of the current trailer line
+};
+
+void chunkedBegin(ChunkedDecoder &d) {
+  d.state = CHUNKED_SIZE;
+  d.remaining = 0;
+  d.sizeDigits = 0;
+  d.lineLength = 0;
+}
+
+bool chunkedDone(const ChunkedDecoder &d) {
+  return d.state == CHUNKED_DONE || d.state == CHUNKED_ERROR;
+}
+
+/**
+ * End of a chunk size line: start the payload, or the trailer after the
+ * last (zero-size) chunk
+ */
+void chunkedSizeLineEnd(ChunkedDecoder &d) {
+  if (d.sizeDigits == 0) {
+    d.state = CHUNKED_ERROR;
+  } else if (d.remaining == 0) {
+    d.state = CHUNKED_TRAILER;
+    d.lineLength = 0;
+  } else {
+    d.state = CHUNKED_DATA;
+  }
+}
+
+/**
+ * Decode from data until a payload slice is found or data is used up
+ *
+ * Returns the number of input bytes consumed. payload/payloadLen are set
+ * to the slice found, if any (payloadLen is 0 otherwise).
+ */
+size_t chunkedDecode(ChunkedDecoder &d, const uint8_t *data, size_t len,
+                     const uint8_t *&payload, size_t &payloadLen) {
+  payload = NULL;
+  payloadLen = 0;
+
+  size_t i = 0;
+  while (i < len && !chunkedDone(d)) {
+    uint8_t c = data[i];
+    switch (d.state) {
+      case CHUNKED_SIZE:
+        if (isxdigit(c)) {
+          // Sizes above 4 GB are no firmware image
+          if (++d.sizeDigits > 8) {
+            d.state = CHUNKED_ERROR;
+            break;
+          }
+          d.remaining = (d.remaining << 4) | (isdigit(c) ? c - '0' : (tolower(c) - 'a' + 10));
+        } else if (c == ';' || c == ' ' || c == '\t') {
+          d.state = CHUNKED_EXTENSION;
+        } else if (c == '\n') {
+          chunkedSizeLineEnd(d);
+        } else if (c != '\r') {
+          d.state = CHUNKED_ERROR;
+        }
+        i++;
+        break;
+
+      case CHUNKED_EXTENSION:
+        if (c == '\n') {
+          chunkedSizeLineEnd(d);
+        }
+        i++;
+        break;
+
+      case CHUNKED_DATA: {
+        size_t n = min(len - i, (size_t)d.remaining);
+        payload = data + i;
+        payloadLen = n;
+        d.remaining -= n;
+        if (d.remaining == 0) {
+          d.state = CHUNKED_DATA_END;
+        }
+        return i + n;
+      }
+
+      case CHUNKED_DATA_END:
+        if (c == '\n') {
+          d.state = CHUNKED_SIZE;
+          d.sizeDigits = 0;
+        } else if (c != '\r') {
+          d.state = CHUNKED_ERROR;
+        }
+        i++;
+        break;
+
+      case CHUNKED_TRAILER:
+        if (c == '\n') {
+          if (d.lineLength == 0) {
+            d.state = CHUNKED_DONE;
+          }
+          d.lineLength = 0;
+        } else if (c != '\r') {
+          d.lineLength++;
+        }
+        i++;
+        break;
+
+      case CHUNKED_DONE:
+      case CHUNKED_ERROR:
+        break;
+    }
+  }
+  return i;
+}
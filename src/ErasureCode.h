@@ -0,0 +1,168 @@
+/*
+  -----------------------
+  Reed-Solomon Erasure Code
+  -----------------------
+
+  Systematic erasure code over GF(2^8) (polynomial 0x11D) used by the
+  multicast receiver (OTAMulticast.h). A group of k source symbols is
+  sent as is, followed by repair symbols. The repair symbol with index x
+  (k <= x < 256) is
+
+    repair[x] = sum over i < k of  source[i] * 1 / (x ^ i)
+
+  i.e. one row of a Cauchy matrix. Every square submatrix of a Cauchy
+  matrix is invertible, so any k distinct symbols of a group recover all
+  of its sources, whichever ones were lost. tools/ota_multicast.py
+  encodes with the same definition.
+
+  The decoder never needs a whole group in memory. The caller takes the
+  sources it has out of each repair symbol (fecMulAdd() with
+  fecCoefficient()), one source at a time, and fecSolve() turns what is
+  left into the missing sources, in place.
+*/
+
+// Largest group the decoder accepts (bounds its coefficient matrix)
+const uint8_t FEC_MAX_SYMBOLS = 64;
+
+uint8_t fecExp[512];
+uint8_t fecLog[256];
+bool isFECReady = false;
+
+// Coefficients of the system solved by fecDecode()
+uint8_t fecMatrix[FEC_MAX_SYMBOLS][FEC_MAX_SYMBOLS];
+
+/**
+ * Build the log/exp tables; cheap, and only done once
+ */
+void fecInit() {
+  if (isFECReady) {
+    return;
+  }
+  uint16_t x = 1;
+  for (int i = 0; i < 255; i++) {
+    fecExp[i] = x;
+    fecLog[x] = i;
+    x <<= 1;
+    if (x & 0x100) {
+      x ^= 0x11D;
+    }
+  }
+  // Doubled so a product needs no modulo
+  for (int i = 255; i < 512; i++) {
+    fecExp[i] = fecExp[i - 255];
+  }
+  fecLog[0] = 0;
+  isFECReady = true;
+}
+
+uint8_t fecMul(uint8_t a, uint8_t b) {
+  if (a == 0 || b == 0) {
+    return 0;
+  }
+  return fecExp[fecLog[a] + fecLog[b]];
+}
+
+uint8_t fecInverse(uint8_t a) {
+  return fecExp[255 - fecLog[a]];
+}
+
+/**
+ * Weight of source i in the repair symbol with index x (x >= k > i)
+ */
+uint8_t fecCoefficient(uint8_t x, uint8_t i) {
+  return fecInverse(x ^ i);
+}
+
+/**
+ * dst ^= c * src
+ */
+void fecMulAdd(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  if (c == 0) {
+    return;
+  }
+  if (c == 1) {
+    for (size_t i = 0; i < len; i++) {
+      dst[i] ^= src[i];
+    }
+    return;
+  }
+  uint8_t logC = fecLog[c];
+  for (size_t i = 0; i < len; i++) {
+    if (src[i]) {
+      dst[i] ^= fecExp[fecLog[src[i]] + logC];
+    }
+  }
+}
+
+/**
+ * row *= c
+ */
+void fecScale(uint8_t *row, uint8_t c, size_t len) {
+  if (c == 1) {
+    return;
+  }
+  uint8_t logC = fecLog[c];
+  for (size_t i = 0; i < len; i++) {
+    if (row[i]) {
+      row[i] = fecExp[fecLog[row[i]] + logC];
+    }
+  }
+}
+
+void fecSwap(uint8_t *a, uint8_t *b, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    uint8_t t = a[i];
+    a[i] = b[i];
+    b[i] = t;
+  }
+}
+
+/**
+ * Recover missing sources from as many repair symbols, in place
+ *
+ * rows[a] holds the repair symbol with index repair[a], with every source
+ * the receiver has already taken out, leaving
+ *   sum over b < m of  source[missing[b]] * fecCoefficient(repair[a], missing[b])
+ * On return rows[a] holds source missing[a]; the row pointers may have been
+ * swapped. Returns false if the repair indices aren't distinct.
+ */
+bool fecSolve(uint8_t **rows, const uint8_t *repair, const uint8_t *missing, uint8_t m, size_t size) {
+  if (m > FEC_MAX_SYMBOLS) {
+    return false;
+  }
+  for (uint8_t a = 0; a < m; a++) {
+    for (uint8_t b = 0; b < m; b++) {
+      fecMatrix[a][b] = fecCoefficient(repair[a], missing[b]);
+    }
+  }
+
+  // Gauss-Jordan: equation a ends up as source[missing[a]]
+  for (uint8_t col = 0; col < m; col++) {
+    uint8_t pivot = col;
+    while (pivot < m && fecMatrix[pivot][col] == 0) {
+      pivot++;
+    }
+    if (pivot == m) {
+      return false;
+    }
+    if (pivot != col) {
+      fecSwap(fecMatrix[pivot], fecMatrix[col], m);
+      uint8_t *row = rows[pivot];
+      rows[pivot] = rows[col];
+      rows[col] = row;
+    }
+
+    uint8_t inverse = fecInverse(fecMatrix[col][col]);
+    fecScale(fecMatrix[col], inverse, m);
+    fecScale(rows[col], inverse, size);
+
+    for (uint8_t a = 0; a < m; a++) {
+      uint8_t c = fecMatrix[a][col];
+      if (a != col && c != 0) {
+        fecMulAdd(fecMatrix[a], fecMatrix[col], c, m);
+        fecMulAdd(rows[a], rows[col], c, size);
+      }
+    }
+  }
+  return true;
+}
@@ -0,0 +1,115 @@
+/*
+  -----------------------
+  Lifecycle Heap Monitor
+  -----------------------
+
+  Samples the heap each time the WiFi/OTA lifecycle passes a fixed point
+  (link up, link down, portal ended, WiFi disabled) and compares it with a
+  baseline taken at the same point. The lifecycle should return the heap to
+  the same shape after every cycle, so any steady growth in allocated blocks
+  or shrinking of the free heap / largest free block points at a leak or
+  fragmentation in the connect/disconnect/portal paths.
+
+  Each lifecycle point has its own baseline because the heap legitimately
+  looks different with the station connected than with WiFi switched off.
+*/
+#include <esp_heap_caps.h>
+
+enum HeapLifecyclePoint {
+  HEAP_AT_LINK_UP,
+  HEAP_AT_LINK_DOWN,
+  HEAP_AT_PORTAL_END,
+  HEAP_AT_WIFI_OFF,
+  HEAP_LIFECYCLE_POINT_COUNT
+};
+
+// Cycles to skip before taking the baseline. The first connection allocates
+// long-lived driver and lwIP state, which is not a leak.
+const uint32_t HEAP_WARMUP_CYCLES = 2;
+
+// Drift allowed against the baseline before it is reported
+const uint32_t HEAP_DRIFT_TOLERANCE_BYTES = 2048;
+const uint32_t HEAP_DRIFT_TOLERANCE_BLOCKS = 16;
+
+struct HeapSample {
+  uint32_t freeBytes;
+  uint32_t largestFreeBlock;
+  uint32_t allocatedBlocks;
+};
+
+struct HeapLifecycleStats {
+  uint32_t cycles;
+  HeapSample baseline;
+  HeapSample last;
+  bool driftReported;
+};
+
+HeapLifecycleStats heapLifecycleStats[HEAP_LIFECYCLE_POINT_COUNT];
+
+const char *heapLifecyclePointName(HeapLifecyclePoint point) {
+  switch (point) {
+    case HEAP_AT_LINK_UP:    return "link up";
+    case HEAP_AT_LINK_DOWN:  return "link down";
+    case HEAP_AT_PORTAL_END: return "portal end";
+    case HEAP_AT_WIFI_OFF:   return "wifi off";
+    default:                 return "unknown";
+  }
+}
+
+HeapSample sampleHeap() {
+  multi_heap_info_t info;
+  heap_caps_get_info(&info, MALLOC_CAP_8BIT);
+
+  HeapSample sample;
+  sample.freeBytes = info.total_free_bytes;
+  sample.largestFreeBlock = info.largest_free_block;
+  sample.allocatedBlocks = info.allocated_blocks;
+  return sample;
+}
+
+/**
+ * Record the heap at a lifecycle point and report drift against its baseline
+ *
+ * Returns false if the heap has drifted beyond the configured tolerance.
+ */
+bool recordLifecycleHeap(HeapLifecyclePoint point) {
+  HeapLifecycleStats &stats = heapLifecycleStats[point];
+  HeapSample sample = sampleHeap();
+
+  stats.cycles++;
+  stats.last = sample;
+
+  #ifdef OTA_DEBUG_ENABLED
+  Serial.printf("HEAP: %s cycle %lu - free %lu, largest block %lu, blocks %lu\n",
+                heapLifecyclePointName(point), (unsigned long)stats.cycles,
+                (unsigned long)sample.freeBytes, (unsigned long)sample.largestFreeBlock,
+                (unsigned long)sample.allocatedBlocks);
+  #endif
+
+  if (stats.cycles <= HEAP_WARMUP_CYCLES) {
+    return true;
+  }
+  if (stats.cycles == HEAP_WARMUP_CYCLES + 1) {
+    stats.baseline = sample;
+    return true;
+  }
+
+  bool freeDrift = sample.freeBytes + HEAP_DRIFT_TOLERANCE_BYTES < stats.baseline.freeBytes;
+  bool fragmentDrift = sample.largestFreeBlock + HEAP_DRIFT_TOLERANCE_BYTES < stats.baseline.largestFreeBlock;
+  bool blockDrift = sample.allocatedBlocks > stats.baseline.allocatedBlocks + HEAP_DRIFT_TOLERANCE_BLOCKS;
+
+  if (!(freeDrift || fragmentDrift || blockDrift)) {
+    return true;
+  }
+
+  // Report once per lifecycle point to avoid flooding the log
+  if (!stats.driftReported) {
+    stats.driftReported = true;
+    Serial.printf("HEAP: Drift at %s after %lu cycles - free %+ld, largest block %+ld, blocks %+ld\n",
+                  heapLifecyclePointName(point), (unsigned long)stats.cycles,
+                  (long)sample.freeBytes - (long)stats.baseline.freeBytes,
+                  (long)sample.largestFreeBlock - (long)stats.baseline.largestFreeBlock,
+                  (long)sample.allocatedBlocks - (long)stats.baseline.allocatedBlocks);
+  }
+  return false;
+}
@@ -0,0 +1,143 @@
+/*
+  -----------------------
+  Multipart Boundary Scanner
+  -----------------------
+
+  Finds the delimiter ("\r\n--" + boundary) that ends a multipart/form-data
+  part in a stream of received buffers. It works a whole buffer at a time
+  instead of one byte at a time. A Horspool search skips up to the
+  delimiter length per step, so most payload bytes are never looked at.
+
+  A delimiter split across buffers is held back as a count of matched
+  bytes. The held bytes are always a prefix of the delimiter, so if it
+  doesn't complete they are handed out from the delimiter itself. Payload
+  is never copied: every slice points into the caller's buffer or into
+  the delimiter.
+
+  Usage:
+    while (len > 0 && scanner.state == MULTIPART_DATA) {
+      const uint8_t *payload;
+      size_t payloadLen;
+      size_t used = multipartScan(scanner, data, len, payload, payloadLen);
+      // consume payload[0..payloadLen)
+      data += used;
+      len -= used;
+    }
+*/
+
+const size_t MULTIPART_BOUNDARY_MAX = 70; // RFC 2046
+const size_t MULTIPART_DELIMITER_MAX = MULTIPART_BOUNDARY_MAX + 4;
+
+enum MultipartScanState {
+  MULTIPART_DATA,      // Inside the part's content
+  MULTIPART_DELIMITER  // Delimiter found, the part is complete
+};
+
+struct MultipartScanner {
+  MultipartScanState state;
+  uint8_t delimiter[MULTIPART_DELIMITER_MAX];
+  uint8_t length;
+  uint8_t skip[256];  // Horspool shift for each byte value
+  uint8_t carry;      // Delimiter bytes matched at the end of the last buffer
+};
+
+/**
+ * Start scanning part content for the given boundary
+ */
+bool multipartScanBegin(MultipartScanner &s, const char *boundary) {
+  size_t n = strlen(boundary);
+  if (n == 0 || n > MULTIPART_BOUNDARY_MAX) {
+    return false;
+  }
+  memcpy(s.delimiter, "\r\n--", 4);
+  memcpy(s.delimiter + 4, boundary, n);
+  s.length = n + 4;
+
+  memset(s.skip, s.length, sizeof(s.skip));
+  for (size_t i = 0; i + 1 < s.length; i++) {
+    s.skip[s.delimiter[i]] = s.length - 1 - i;
+  }
+
+  s.state = MULTIPART_DATA;
+  s.carry = 0;
+  return true;
+}
+
+/**
+ * Find the first complete delimiter in data (Horspool)
+ */
+const uint8_t *multipartFind(const MultipartScanner &s, const uint8_t *data, size_t len) {
+  size_t m = s.length;
+  uint8_t last = s.delimiter[m - 1];
+  for (size_t i = 0; i + m <= len; ) {
+    uint8_t c = data[i + m - 1];
+    if (c == last && memcmp(data + i, s.delimiter, m - 1) == 0) {
+      return data + i;
+    }
+    i += s.skip[c];
+  }
+  return NULL;
+}
+
+/**
+ * Length of the longest end of data that could start a delimiter
+ */
+size_t multipartTailMatch(const MultipartScanner &s, const uint8_t *data, size_t len) {
+  // Boundaries can't contain CR, so a delimiter can only start at one
+  size_t from = len > s.length - 1u ? len - (s.length - 1u) : 0;
+  const uint8_t *p = data + from;
+  const uint8_t *end = data + len;
+  while ((p = (const uint8_t *)memchr(p, '\r', end - p)) != NULL) {
+    if (memcmp(p, s.delimiter, end - p) == 0) {
+      return end - p;
+    }
+    p++;
+  }
+  return 0;
+}
+
+/**
+ * Scan from data until a payload slice is found or the delimiter is reached
+ *
+ * Returns the number of input bytes consumed (the delimiter included).
+ * payload/payloadLen are set to the content found, if any.
+ */
+size_t multipartScan(MultipartScanner &s, const uint8_t *data, size_t len,
+                     const uint8_t *&payload, size_t &payloadLen) {
+  payload = NULL;
+  payloadLen = 0;
+  if (s.state != MULTIPART_DATA || len == 0) {
+    return 0;
+  }
+
+  if (s.carry > 0) {
+    size_t n = min(len, (size_t)(s.length - s.carry));
+    if (memcmp(data, s.delimiter + s.carry, n) == 0) {
+      s.carry += n;
+      if (s.carry == s.length) {
+        s.state = MULTIPART_DELIMITER;
+        s.carry = 0;
+      }
+      return n;
+    }
+    // Not a delimiter after all: the held bytes were content. No delimiter
+    // can start inside them, so data is scanned afresh on the next call.
+    payload = s.delimiter;
+    payloadLen = s.carry;
+    s.carry = 0;
+    return 0;
+  }
+
+  const uint8_t *found = multipartFind(s, data, len);
+  if (found != NULL) {
+    payload = data;
+    payloadLen = found - data;
+    s.state = MULTIPART_DELIMITER;
+    return payloadLen + s.length;
+  }
+
+  s.carry = multipartTailMatch(s, data, len);
+  payload = data;
+  payloadLen = len - s.carry;
+  return len;
+}
@@ -24,6 +24,18 @@
 #include <AsyncTCP.h>
 #include <ESPAsyncWebServer.h>
 #include <ElegantOTA.h>
+#include "WiFiCache.h"
+#include "WiFiEvents.h"
+#include "HeapMonitor.h"
+#include "RebootScheduler.h"
+#include "OTAPerformanceMode.h"
+#include "BootHealth.h"
+#include "OTAEventStream.h"
+#include "OTAUpload.h"
+#include "OTAPull.h"
+#include "OTAMulticast.h"
+#include "OTAPeerRelay.h"
+#include "OTAUpdateCheck.h"
 
 // #define OTA_DEBUG_ENABLED
 
@@ -42,9 +54,56 @@ bool shouldStartConfigPortal = false;
 // Flag to track if portal is currently active
 bool isPortalActive = false;
 
-// Flag to track if OTA server has been set up
+// Flag to track if the web server listener is running
 bool isOTAServerRunning = false;
 
+// Flag to track if web routes and ElegantOTA handlers have been registered
+bool areWebRoutesRegistered = false;
+
+// Station link state as last reported by the WiFi event queue
+bool isWiFiLinkUp = false;
+
+// WiFi connection state machine, advanced from handleOTA() without blocking
+enum WiFiConnectState {
+  WIFI_CONN_IDLE,               // No connection attempt in progress
+  WIFI_CONN_CONNECTING,         // WiFi.begin() issued, waiting for an IP
+  WIFI_CONN_CONNECTED,          // Connected with saved credentials
+  WIFI_CONN_FALLBACK_TO_PORTAL  // Attempt failed, portal should be opened
+};
+
+// How long to wait for saved credentials before falling back to the portal
+const unsigned long WIFI_CONNECT_TIMEOUT_MS = 10000;
+
+// How long to wait for a cached BSSID/lease before falling back to a full scan.
+// Joining a known AP with a static lease normally takes well under a second.
+const unsigned long WIFI_FAST_CONNECT_TIMEOUT_MS = 3000;
+
+// How long the station runs on a cached lease before handing the address
+// back to DHCP. Well inside typical lease times (hours), and late enough
+// that a fast reconnect is never slowed down by a DHCP restart.
+const unsigned long WIFI_LEASE_RENEW_AFTER_MS = 30UL * 60 * 1000;
+
+// How long DHCP gets to confirm a cached lease once renewal has started
+// before the cache is dropped as describing a network that no longer exists
+const unsigned long WIFI_LEASE_CONFIRM_TIMEOUT_MS = 10000;
+
+WiFiConnectState wifiConnectState = WIFI_CONN_IDLE;
+unsigned long wifiConnectStartMillis = 0;
+
+// True while the current attempt uses the fast-reconnect cache
+bool isFastReconnectAttempt = false;
+
+// True after a fast reconnect until DHCP has handed out a fresh lease
+bool isLeaseConfirmPending = false;
+unsigned long leaseConfirmStartMillis = 0;
+
+// True once DHCP has been restarted to renew the cached lease
+bool isLeaseRenewing = false;
+unsigned long leaseRenewStartMillis = 0;
+
+// Time from WiFi.begin() to having an IP for the last successful connection
+unsigned long lastTimeToIPMillis = 0;
+
 // Forward declarations
 void setupWebServerAndOTA();
 void startWiFiConnection();
@@ -52,10 +111,15 @@ void startWiFiConnection();
 void onOTAStart() {
   // Log when OTA has started
   Serial.println(F("OTA update started!"));
+  enterOTAPerformanceMode();
+  postOTAStreamEvent(STREAM_OTA_STARTED);
   // <Add your own code -here>
 }
 
 void onOTAProgress(size_t current, size_t final) {
+  noteOTAPerformanceActivity();
+  noteOTAStreamProgress(current, final);
+
   // Log every 1 second
   if (millis() - ota_progress_millis > 1000) {
     ota_progress_millis = millis();
@@ -67,14 +131,20 @@ void onOTAProgress(size_t current, size_t final) {
 }
 
 void onOTAEnd(bool success) {
+  exitOTAPerformanceMode();
+  postOTAStreamEvent(success ? STREAM_OTA_FINISHED : STREAM_OTA_FAILED);
+
   // Log when OTA has finished
   if (success) {
     #ifdef OTA_DEBUG_ENABLED
     Serial.println(F("OTA update finished successfully!"));
-    Serial.println(F("Rebooting device in 3 seconds..."));
+    Serial.println(F("Rebooting device once the response is delivered..."));
     #endif
-    delay(3000); // Give time to see the message
-    ESP.restart(); // Automatically reboot the device
+    // The new image has to pass its self-test after the reboot
+    markBootTrial();
+
+    // Reboot from loop() after the client got its response, see handleScheduledReboot()
+    scheduleReboot();
   } else {
     #ifdef OTA_DEBUG_ENABLED
     Serial.println(F("There was an error during OTA update!"));
@@ -151,16 +221,23 @@ void configureWiFiManager() {
   
   // Add a callback for when WiFi connects during config portal
   wifiManager.setAPCallback([](WiFiManager *myWiFiManager) {
+    postOTAStreamEvent(STREAM_PORTAL_OPEN);
+
     #ifdef OTA_DEBUG_ENABLED
     Serial.println(F("CONFIG: Configuration portal started"));
     Serial.print(F("CONFIG: Connect to WiFi network: "));
     Serial.println(myWiFiManager->getConfigPortalSSID());
     Serial.println(F("CONFIG: Portal will timeout after 3 minutes"));
+    #else
+    (void)myWiFiManager;
     #endif
   });
   
   // Add callback for when WiFi connects successfully during portal
   wifiManager.setSaveConfigCallback([]() {
+    // New credentials invalidate the cached AP and lease
+    clearWiFiCache();
+
     #ifdef OTA_DEBUG_ENABLED
     Serial.println(F("CONFIG: WiFi credentials saved successfully!"));
     Serial.println(F("CONFIG: WiFi connection established during portal session"));
@@ -178,6 +255,20 @@ void setupOTA() {
   #endif
   configureWiFiManager();
 
+  // Progress and state pushed to /ota/events subscribers
+  beginOTAEventStream();
+
+  // Link changes are reported by the driver instead of polled
+  registerWiFiEvents();
+
+  // Lets updates identical to the running build be refused up front
+  computeRunningImageDigest();
+
+  // A new image has to show it can get back online, so connect right away
+  if (isBootOnTrial) {
+    startWiFiConnection();
+  }
+
   #ifdef OTA_DEBUG_ENABLED
   Serial.println(F("SETUP: WiFiManager configured and ready"));
   Serial.println(F("SETUP: Device started - Hold config button for 3 seconds to start WiFi configuration"));
@@ -185,12 +276,25 @@ void setupOTA() {
   #endif
 }
 
+/**
+ * Join the saved network by scanning for it, with an address from DHCP
+ * 
+ * The SSID and password are passed explicitly: WiFi.begin() without
+ * arguments reuses the driver's stored config, including the BSSID and
+ * channel of an earlier cached attempt.
+ */
+void startDHCPConnection() {
+  WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE); // Re-enable DHCP
+  WiFi.begin(wifiManager.getWiFiSSID().c_str(), wifiManager.getWiFiPass().c_str());
+}
+
 /**
  * Attempt WiFi connection with saved credentials or start configuration portal
  * 
  * This function is called when the user presses the configuration button.
- * It will try to connect with saved credentials first, and if that fails,
- * it will start the configuration portal.
+ * It only kicks off the connection attempt; the result is picked up by
+ * handleWiFiConnection() from the main loop, which starts the web server on
+ * success or falls back to the configuration portal on failure.
  */
 void startWiFiConnection() {
   #ifdef OTA_DEBUG_ENABLED
@@ -199,11 +303,11 @@ void startWiFiConnection() {
 
   // Ensure WiFi is properly disconnected and cleaned up first
   WiFi.disconnect(true);
-  delay(100);
   
   // Set WiFi mode to station
   WiFi.mode(WIFI_STA);
-  delay(100);
+  isLeaseConfirmPending = false;
+  isLeaseRenewing = false;
   
   // First, try to connect with saved credentials without starting a portal
   #ifdef OTA_DEBUG_ENABLED
@@ -215,67 +319,204 @@ void startWiFiConnection() {
     #ifdef OTA_DEBUG_ENABLED
     Serial.println(F("WIFI: Found saved credentials, attempting connection..."));
     #endif
-    WiFi.begin(); // Use saved credentials
-    
-    // Wait up to 10 seconds for connection
-    int attempts = 0;
-    while (WiFi.status() != WL_CONNECTED && attempts < 20) {
-      delay(500);
-      Serial.print(".");
-      attempts++;
-    }
-    
-    if (WiFi.status() == WL_CONNECTED) {
+    WiFiConnectionCache cache;
+    if (loadWiFiCache(cache)) {
       #ifdef OTA_DEBUG_ENABLED
-      Serial.println("");
-      Serial.println(F("WIFI: Connected successfully with saved credentials!"));
-      Serial.print(F("WIFI: Connected to: "));
-      Serial.println(WiFi.SSID());
-      Serial.print(F("WIFI: IP address: "));
-      Serial.println(WiFi.localIP());
+      Serial.println(F("WIFI: Using cached BSSID, channel and IP lease"));
       #endif
-      
-      // Start the web server and OTA
-      setupWebServerAndOTA();
-      return; // Successfully connected, exit function
+      // Reuse the last lease (no DHCP) and join the known AP directly (no scan)
+      WiFi.config(IPAddress(cache.ip), IPAddress(cache.gateway), IPAddress(cache.subnet), IPAddress(cache.dns));
+      WiFi.begin(wifiManager.getWiFiSSID().c_str(), wifiManager.getWiFiPass().c_str(), cache.channel, cache.bssid);
+      isFastReconnectAttempt = true;
     } else {
-      #ifdef OTA_DEBUG_ENABLED
-      Serial.println("");
-      Serial.println(F("WIFI: Failed to connect with saved credentials"));
-      #endif
+      startDHCPConnection();
+      isFastReconnectAttempt = false;
     }
+    
+    wifiConnectStartMillis = millis();
+    wifiConnectState = WIFI_CONN_CONNECTING;
+    postOTAStreamEvent(STREAM_WIFI_CONNECTING);
   } else {
     #ifdef OTA_DEBUG_ENABLED
     Serial.println(F("WIFI: No saved credentials found"));
     #endif
+    wifiConnectState = WIFI_CONN_FALLBACK_TO_PORTAL;
   }
-  
-  // Clean up WiFi before starting AP mode
+}
+
+/**
+ * Retry the current connection attempt without the fast-reconnect cache
+ * 
+ * Drops the cached AP and lease, switches back to DHCP and lets the driver
+ * scan for the saved network.
+ */
+void startFullScanConnection() {
   #ifdef OTA_DEBUG_ENABLED
-  Serial.println(F("WIFI: Cleaning up WiFi connection..."));
+  Serial.println(F("WIFI: Cached connection failed, falling back to full scan"));
   #endif
-  WiFi.disconnect(true);
-  delay(500); // Give more time for cleanup
-  
-  // If we get here, either no saved credentials or connection failed
+  clearWiFiCache();
+
+  WiFi.disconnect();
+  startDHCPConnection();
+
+  isFastReconnectAttempt = false;
+  wifiConnectStartMillis = millis();
+}
+
+/**
+ * Keep running on the cached lease after a fast reconnect
+ * 
+ * Re-enabling DHCP clears the address and restarts the client, which
+ * would undo the fast reconnect. The static lease is kept while the link
+ * comes up and is only handed back to DHCP later by renewCachedLease().
+ */
+void startLeaseConfirmation() {
+  isLeaseConfirmPending = true;
+  leaseConfirmStartMillis = millis();
+}
+
+/**
+ * Hand the cached lease back to DHCP in the background
+ * 
+ * Using the cached lease as a static address for good would keep an
+ * expired or reassigned lease forever. Once it has been in use for
+ * WIFI_LEASE_RENEW_AFTER_MS, and no update is being written, DHCP is
+ * re-enabled; the server normally hands back the same address and the
+ * next GOT_IP event refreshes the cache.
+ */
+void renewCachedLease() {
   #ifdef OTA_DEBUG_ENABLED
-  Serial.println(F("Set shouldStartConfigPortal = true"));
+  Serial.println(F("WIFI: Renewing cached lease with DHCP"));
   #endif
-  shouldStartConfigPortal = true; // Let the main loop handle the portal
+  WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE); // Re-enable DHCP
+  isLeaseRenewing = true;
+  leaseRenewStartMillis = millis();
 }
 
 /**
- * Setup web server and ElegantOTA functionality
+ * Store the lease DHCP handed out for a cached one
  * 
- * Called after successful WiFi connection to initialize the web server
- * and ElegantOTA components. Includes protection against multiple calls.
+ * A different address than the cached one means the old lease expired or
+ * collided with another host; either way the cache now holds the new one.
  */
-void setupWebServerAndOTA() {
-  // Prevent multiple server setups
-  if (isOTAServerRunning) {
-    #ifdef OTA_DEBUG_ENABLED
-    Serial.println(F("OTA: Server already running, skipping setup"));
-    #endif
+void onLeaseConfirmed() {
+  isLeaseConfirmPending = false;
+  isLeaseRenewing = false;
+  saveWiFiCache();
+
+  #ifdef OTA_DEBUG_ENABLED
+  Serial.print(F("WIFI: DHCP confirmed lease "));
+  Serial.println(WiFi.localIP());
+  #endif
+}
+
+/**
+ * Complete a pending connection attempt
+ * 
+ * Called by monitorWiFiConnection() when the station gets an IP while the
+ * state machine is in WIFI_CONN_CONNECTING.
+ */
+void onWiFiConnected() {
+  lastTimeToIPMillis = millis() - wifiConnectStartMillis;
+  #ifdef OTA_DEBUG_ENABLED
+  Serial.printf("WIFI: Time to IP %lu ms (%s)\n", lastTimeToIPMillis,
+                isFastReconnectAttempt ? "cached" : "full scan");
+  #endif
+
+  if (isFastReconnectAttempt) {
+    startLeaseConfirmation();
+  } else {
+    // Remember this AP and lease for the next connection
+    saveWiFiCache();
+  }
+
+  #ifdef OTA_DEBUG_ENABLED
+  Serial.println(F("WIFI: Connected successfully with saved credentials!"));
+  Serial.print(F("WIFI: Connected to: "));
+  Serial.println(WiFi.SSID());
+  Serial.print(F("WIFI: IP address: "));
+  Serial.println(WiFi.localIP());
+  #endif
+  wifiConnectState = WIFI_CONN_CONNECTED;
+
+  // Start the web server and OTA
+  setupWebServerAndOTA();
+}
+
+/**
+ * Advance the WiFi connection state machine
+ * 
+ * Called from handleOTA() on every loop iteration. Each call does a constant
+ * amount of work and never waits, so the main loop keeps running while the
+ * station is associating:
+ * - CONNECTING: wait for the GOT_IP event (handled by onWiFiConnected());
+ *   a cached attempt that times out retries with a full scan, a full scan
+ *   that times out falls back to the portal
+ * - CONNECTED: renew a cached lease with DHCP when it is due and drop
+ *   the cache if DHCP never confirms it, otherwise monitorWiFiConnection()
+ *   takes over
+ * - FALLBACK_TO_PORTAL: clean up the station and request the portal
+ */
+void handleWiFiConnection() {
+  switch (wifiConnectState) {
+    case WIFI_CONN_CONNECTING:
+      if (isFastReconnectAttempt && millis() - wifiConnectStartMillis >= WIFI_FAST_CONNECT_TIMEOUT_MS) {
+        startFullScanConnection();
+      } else if (millis() - wifiConnectStartMillis >= WIFI_CONNECT_TIMEOUT_MS) {
+        #ifdef OTA_DEBUG_ENABLED
+        Serial.println(F("WIFI: Failed to connect with saved credentials"));
+        #endif
+        wifiConnectState = WIFI_CONN_FALLBACK_TO_PORTAL;
+      }
+      break;
+
+    case WIFI_CONN_FALLBACK_TO_PORTAL:
+      // Clean up WiFi before starting AP mode
+      #ifdef OTA_DEBUG_ENABLED
+      Serial.println(F("WIFI: Cleaning up WiFi connection..."));
+      #endif
+      WiFi.disconnect(true);
+
+      // Either no saved credentials or connection failed
+      #ifdef OTA_DEBUG_ENABLED
+      Serial.println(F("Set shouldStartConfigPortal = true"));
+      #endif
+      shouldStartConfigPortal = true; // Let handlePortalStartup() open the portal
+      wifiConnectState = WIFI_CONN_IDLE;
+      postOTAStreamEvent(STREAM_WIFI_FAILED);
+      break;
+
+    case WIFI_CONN_CONNECTED:
+      if (isLeaseRenewing) {
+        if (isWiFiLinkUp && millis() - leaseRenewStartMillis >= WIFI_LEASE_CONFIRM_TIMEOUT_MS) {
+          // No DHCP answer: the cached address or its route is no longer valid
+          #ifdef OTA_DEBUG_ENABLED
+          Serial.println(F("WIFI: Cached lease not confirmed by DHCP, clearing cache"));
+          #endif
+          isLeaseConfirmPending = false;
+          isLeaseRenewing = false;
+          clearWiFiCache();
+        }
+      } else if (isLeaseConfirmPending && isWiFiLinkUp && !isOTAWriterActive &&
+                 millis() - leaseConfirmStartMillis >= WIFI_LEASE_RENEW_AFTER_MS) {
+        renewCachedLease();
+      }
+      break;
+
+    case WIFI_CONN_IDLE:
+      break;
+  }
+}
+
+/**
+ * Register web routes and ElegantOTA handlers
+ * 
+ * Handlers live on the global AsyncWebServer for the lifetime of the
+ * firmware, so they are registered exactly once. Registering them again
+ * would add duplicate handlers and leak their heap allocations.
+ */
+void registerWebRoutes() {
+  if (areWebRoutesRegistered) {
     return;
   }
 
@@ -284,14 +525,43 @@ void setupWebServerAndOTA() {
     request->redirect("/update");
   });
 
+  // Firmware uploads go through the double-buffered flash writer. Added
+  // before ElegantOTA so it gets first pick of the /ota/* requests.
+  server.addHandler(&firmwareUploadHandler);
+
   // Initialize ElegantOTA
   ElegantOTA.begin(&server);
+  #ifdef OTA_AUTH_USERNAME
+  ElegantOTA.setAuth(OTA_AUTH_USERNAME, OTA_AUTH_PASSWORD);
+  #endif
   
   // ElegantOTA callbacks
   ElegantOTA.onStart(onOTAStart);
   ElegantOTA.onProgress(onOTAProgress);
   ElegantOTA.onEnd(onOTAEnd);
 
+  areWebRoutesRegistered = true;
+}
+
+/**
+ * Setup web server and ElegantOTA functionality
+ * 
+ * Called after successful WiFi connection to make sure the routes are
+ * registered and the listener is running. Safe to call any number of times.
+ * The listener is bound to all interfaces, so it keeps running across link
+ * loss and only needs restarting after disableWiFi() stopped it.
+ */
+void setupWebServerAndOTA() {
+  registerWebRoutes();
+
+  // Prevent multiple listener starts
+  if (isOTAServerRunning) {
+    #ifdef OTA_DEBUG_ENABLED
+    Serial.println(F("OTA: Server already running, skipping setup"));
+    #endif
+    return;
+  }
+
   // Start the web server
   server.begin();
   isOTAServerRunning = true;
@@ -304,8 +574,9 @@ void setupWebServerAndOTA() {
  * when the shouldStartConfigPortal flag is set.
  */
 void handlePortalStartup() {
-  // Check if configuration portal should be started
-  if (shouldStartConfigPortal && !isPortalActive) {
+  // Check if configuration portal should be started. Wait for any pending
+  // connection attempt to finish so the portal doesn't tear it down.
+  if (shouldStartConfigPortal && !isPortalActive && wifiConnectState != WIFI_CONN_CONNECTING) {
     shouldStartConfigPortal = false;
     
     // Don't start portal if WiFi is already connected
@@ -358,104 +629,160 @@ void handlePortalStartup() {
 /**
  * Monitor active configuration portal status
  * 
- * Handles monitoring of an active portal, including WiFi connection detection
- * during portal session and portal timeout detection.
+ * Detects the end of a portal session (timeout or closed by the user).
+ * WiFiManager only exposes this as a flag, but reading it is cheap, so it
+ * is checked on every loop iteration instead of on a timer. Connections
+ * made during the portal session are picked up by monitorWiFiConnection().
  */
 void monitorActivePortal() {
-  // Check if portal is active and monitor its status
-  if (isPortalActive) {
-    // Check if WiFi connected while portal is running
-    if (WiFi.status() == WL_CONNECTED && !isOTAServerRunning) {
-      #ifdef OTA_DEBUG_ENABLED
-      Serial.println(F("CONFIG: WiFi connected during portal session!"));
-      Serial.print(F("CONFIG: Connected to: "));
-      Serial.println(WiFi.SSID());
-      Serial.print(F("CONFIG: IP address: "));
-      Serial.println(WiFi.localIP());
-      #endif
-
-      // Setup web server and OTA immediately when WiFi connects
+  // If WiFiManager is no longer in portal mode, the portal has ended
+  if (isPortalActive && !wifiManager.getConfigPortalActive()) {
+    #ifdef OTA_DEBUG_ENABLED
+    Serial.println(F("CONFIG: Configuration portal has ended"));
+    #endif
+    isPortalActive = false;
+    postOTAStreamEvent(STREAM_PORTAL_CLOSED);
+    
+    if (isWiFiLinkUp && !isOTAServerRunning) {
+      // WiFi connected but OTA server not started yet
       setupWebServerAndOTA();
-      
-      // Note: Portal may still be active, but OTA is now available
+    } else if (!isWiFiLinkUp) {
       #ifdef OTA_DEBUG_ENABLED
-      Serial.println(F("CONFIG: OTA server started while portal remains active"));
+      Serial.println(F("CONFIG: Portal ended without successful connection"));
       #endif
     }
-    
-    // Check if portal has timed out or been closed
-    static unsigned long portalCheckTime = 0;
-    if (millis() - portalCheckTime > 5000) { // Check every 5 seconds
-      portalCheckTime = millis();
-
-      #ifdef OTA_DEBUG_ENABLED
-      Serial.println(F("CONFIG: Checking if configuration portal is still active..."));
-      #endif
-
-      // If WiFiManager is no longer in portal mode, the portal has ended
-      if (!wifiManager.getConfigPortalActive()) {
-        #ifdef OTA_DEBUG_ENABLED
-        Serial.println(F("CONFIG: Configuration portal has ended"));
-        #endif
-        isPortalActive = false;
-        
-        if (WiFi.status() == WL_CONNECTED && !isOTAServerRunning) {
-          // WiFi connected but OTA server not started yet
-          setupWebServerAndOTA();
-        } else if (WiFi.status() != WL_CONNECTED) {
-          #ifdef OTA_DEBUG_ENABLED
-          Serial.println(F("CONFIG: Portal ended without successful connection"));
-          #endif
-        }
-      }
-    }
+    recordLifecycleHeap(HEAP_AT_PORTAL_END);
   }
 }
 
 /**
- * Monitor WiFi connection status when not in portal mode
+ * Handle a link event reported by the WiFi driver
  * 
- * Handles WiFi connection monitoring, reconnection detection, and 
- * OTA server restart when connection is restored.
+ * Routes GOT_IP to whichever component is waiting for it: a pending
+ * connection attempt, an active portal session, or plain reconnection.
  */
-void monitorWiFiConnection() {
-  // Monitor WiFi connection status (only when not in portal mode)
-  if (!isPortalActive) {
-    static unsigned long lastWiFiCheck = 0;
-    static bool wasConnected = false;
-    
-    if (millis() - lastWiFiCheck >= 5000) { // Check every 5 seconds
-      bool isConnected = (WiFi.status() == WL_CONNECTED);
-      
-      if (wasConnected && !isConnected) {
+void handleWiFiLinkEvent(WiFiLinkEvent event) {
+  switch (event) {
+    case LINK_GOT_IP:
+      isWiFiLinkUp = true;
+      postOTAStreamEvent(STREAM_WIFI_CONNECTED);
+
+      if (isLeaseRenewing) {
+        onLeaseConfirmed();
+      }
+
+      if (wifiConnectState == WIFI_CONN_CONNECTING) {
+        onWiFiConnected();
+      } else if (isPortalActive) {
         #ifdef OTA_DEBUG_ENABLED
-        Serial.println(F("WIFI: Connection lost - attempting reconnection..."));
+        Serial.println(F("CONFIG: WiFi connected during portal session!"));
+        Serial.print(F("CONFIG: Connected to: "));
+        Serial.println(WiFi.SSID());
+        Serial.print(F("CONFIG: IP address: "));
+        Serial.println(WiFi.localIP());
         #endif
-        isOTAServerRunning = false; // Will need to restart server when reconnected
-      } else if (!wasConnected && isConnected) {
+
+        // Setup web server and OTA immediately when WiFi connects
+        // Note: Portal may still be active, but OTA is now available
+        setupWebServerAndOTA();
+      } else {
         #ifdef OTA_DEBUG_ENABLED
         Serial.println(F("WIFI: Connection restored!"));
         Serial.print(F("WIFI: IP address: "));
         Serial.println(WiFi.localIP());
         #endif
-        // Restart OTA server if it was running before
-        if (!isOTAServerRunning) {
-          setupWebServerAndOTA();
-        }
+        // Make sure the OTA server is available on the new link
+        setupWebServerAndOTA();
+      }
+      // An open portal holds its own servers' heap; not the same state
+      if (!isPortalActive) {
+        recordLifecycleHeap(HEAP_AT_LINK_UP);
       }
-      
-      wasConnected = isConnected;
-      lastWiFiCheck = millis();
+
+      // Check for a newer release at a random time after coming online
+      onOTACheckLinkUp();
+      break;
+
+    case LINK_DISCONNECTED:
+      // The driver reports a disconnect for every failed association
+      // attempt, so only a transition from "up" counts as a lost link
+      if (isWiFiLinkUp) {
+        #ifdef OTA_DEBUG_ENABLED
+        Serial.println(F("WIFI: Connection lost - attempting reconnection..."));
+        #endif
+        isWiFiLinkUp = false;
+        // The driver rejoins with the same address config: a cached lease
+        // is still due for renewal, a renewal still waits for DHCP
+        postOTAStreamEvent(STREAM_WIFI_DISCONNECTED);
+        // The listener stays bound across link loss, nothing to tear down
+        recordLifecycleHeap(HEAP_AT_LINK_DOWN);
+      }
+      break;
+
+    case LINK_PORTAL_CLIENT_JOINED:
+      postOTAStreamEvent(STREAM_PORTAL_CLIENT);
+      #ifdef OTA_DEBUG_ENABLED
+      Serial.println(F("CONFIG: Client joined the configuration portal"));
+      #endif
+      break;
+  }
+}
+
+/**
+ * Monitor WiFi connection status
+ * 
+ * Drains the link events queued by the WiFi driver callback and applies
+ * them in loop context, so link loss and recovery are handled on the next
+ * loop iteration instead of on a polling timer.
+ */
+void monitorWiFiConnection() {
+  WiFiLinkEvent event;
+  while (popWiFiEvent(event)) {
+    handleWiFiLinkEvent(event);
+  }
+
+  // Events were dropped; resync the link state from the driver
+  if (wifiEventOverflow.exchange(false)) {
+    bool isConnected = (WiFi.status() == WL_CONNECTED);
+    if (isConnected != isWiFiLinkUp) {
+      handleWiFiLinkEvent(isConnected ? LINK_GOT_IP : LINK_DISCONNECTED);
     }
   }
 }
 
+/**
+ * Perform a reboot requested by onOTAEnd() once it is safe
+ * 
+ * Waits until the upload response has been delivered (or the deadline has
+ * passed), then flushes pending log output, closes the web server sockets
+ * and restarts.
+ */
+void handleScheduledReboot() {
+  if (!isRebootDue()) {
+    return;
+  }
+
+  #ifdef OTA_DEBUG_ENABLED
+  Serial.printf("REBOOT: Restarting %lu ms after update finished\n", millis() - rebootRequestMillis);
+  #endif
+  Serial.flush();
+
+  server.end();
+  ESP.restart();
+}
+
 /**
  * Handle WiFiManager operations and configuration portal
  * 
  * This function should be called from the main loop to handle:
+ * - WiFi link events (connect, disconnect, portal clients)
+ * - Pending connection attempts with saved credentials
+ * - Acks held back from an upload while the flash writer catches up
  * - Configuration portal requests
- * - WiFi connection monitoring
+ * - Scheduled update checks and pull updates running in the background
+ * - Progress and state messages for /ota/events subscribers
+ * - Reboots scheduled after a successful update
+ * - The boot self-test of a newly installed image
  * - Automatic reconnection attempts
  * 
  * Call this function regularly from loop() for proper operation.
@@ -465,9 +792,18 @@ void handleOTA() {
   wifiManager.process();
   
   // Handle each logical component
+  monitorWiFiConnection();
+  handleWiFiConnection();
   handlePortalStartup();
   monitorActivePortal();
-  monitorWiFiConnection();
+  handleOTAUpdateChecks(isWiFiLinkUp);
+  handleOTAMulticast(isWiFiLinkUp);
+  handleOTAPeerRelay(isWiFiLinkUp, OTA_SERVER_PORT);
+  handleOTAUploadAcks();
+  handleOTAEventStream();
+  handleScheduledReboot();
+  handleOTAPerformanceMode();
+  handleBootHealth(isWiFiLinkUp, isOTAServerRunning);
 }
 
 /**
@@ -483,24 +819,34 @@ void disableWiFi() {
   Serial.println(F("WIFI: Disabling WiFi and all related services..."));
   #endif
 
-  // Stop the web server
+  // Stop the web server listener (routes stay registered for next time)
   server.end();
   isOTAServerRunning = false;
   Serial.println(F("HTTP: Web server stopped"));
 
+  // Abandon any connection attempt still in progress
+  wifiConnectState = WIFI_CONN_IDLE;
+  isLeaseConfirmPending = false;
+  isLeaseRenewing = false;
+
   // Stop the configuration portal if it's active
   if (isPortalActive) {
     wifiManager.stopConfigPortal();
     isPortalActive = false;
+    postOTAStreamEvent(STREAM_PORTAL_CLOSED);
     Serial.println(F("CONFIG: Configuration portal stopped"));
   }
 
   // Disconnect and turn off WiFi hardware
   WiFi.disconnect(true);
   WiFi.mode(WIFI_OFF);
+  isWiFiLinkUp = false;
+  postOTAStreamEvent(STREAM_WIFI_OFF);
 
   #ifdef OTA_DEBUG_ENABLED
   Serial.println(F("WIFI: WiFi hardware disabled"));
   Serial.println(F("WIFI: All network services are now offline"));
   #endif
+
+  recordLifecycleHeap(HEAP_AT_WIFI_OFF);
 }
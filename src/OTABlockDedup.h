@@ -0,0 +1,134 @@
+/*
+  -----------------------
+  Block Dedup Updates
+  -----------------------
+
+  Much of a new build is usually byte-identical to the running one at the
+  same offsets (framework, libraries, fonts). A block-dedup update only
+  transfers the 4 KB blocks that differ:
+
+    POST /ota/blocks?size=<bytes>&sha256=<hex>[&force=1]
+         body: the SHA-256 of every 4 KB block of the new image
+         reply: hex bitmap, bit i (LSB first in each byte) set if block i
+                has to be sent
+    PUT  /ota/blocks/data
+         body: the blocks that have to be sent, in order
+
+  The running partition is read through a flash mapping
+  (esp_partition_mmap) and hashed by the SHA peripheral. While the data
+  streams in, blocks that matched are fed straight from the mapping into
+  the pipeline in image order. The image check, the writer and the final
+  SHA-256 comparison therefore see an ordinary full image. The HTTP side
+  lives in OTAUpload.h; tools/ota_blocks.py is the client.
+*/
+#include <esp_spi_flash.h>
+
+const size_t OTA_BLOCK_SIZE = OTA_SECTOR_SIZE;
+
+struct OTABlockPlan {
+  bool isPlanned;
+  size_t imageSize;
+  size_t blockCount;
+  uint8_t *needed;         // Bitmap of the blocks that are sent
+  size_t neededCount;
+  size_t neededBytes;      // Expected body length of /ota/blocks/data
+  const uint8_t *running;  // Running partition, mapped
+  size_t runningSize;
+  spi_flash_mmap_handle_t mapping;
+  size_t nextBlock;        // Next image block to produce
+  size_t blockFill;        // Bytes of a sent block received so far
+  size_t bytesCopied;      // Image bytes taken from the running partition
+};
+
+OTABlockPlan otaBlocks;
+
+size_t otaBlockCount(size_t imageSize) {
+  return (imageSize + OTA_BLOCK_SIZE - 1) / OTA_BLOCK_SIZE;
+}
+
+size_t otaBlockLength(size_t block) {
+  return min(OTA_BLOCK_SIZE, otaBlocks.imageSize - block * OTA_BLOCK_SIZE);
+}
+
+bool isOTABlockNeeded(size_t block) {
+  return otaBlocks.needed[block / 8] & (1 << (block % 8));
+}
+
+/**
+ * Drop the current plan and unmap the running partition
+ */
+void otaBlocksRelease() {
+  free(otaBlocks.needed);
+  otaBlocks.needed = NULL;
+  if (otaBlocks.running != NULL) {
+    spi_flash_munmap(otaBlocks.mapping);
+    otaBlocks.running = NULL;
+  }
+  otaBlocks.isPlanned = false;
+}
+
+/**
+ * Compare the block hashes of an imageSize-byte image with the running
+ * partition and decide which blocks have to be sent
+ */
+bool otaBlocksPlan(const uint8_t *hashes, size_t imageSize) {
+  otaBlocksRelease();
+  unsigned long t0 = millis();
+
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  const void *map;
+  if (esp_partition_mmap(running, 0, running->size, SPI_FLASH_MMAP_DATA, &map, &otaBlocks.mapping) != ESP_OK) {
+    return false;
+  }
+  otaBlocks.running = (const uint8_t *)map;
+  otaBlocks.runningSize = running->size;
+  otaBlocks.imageSize = imageSize;
+  otaBlocks.blockCount = otaBlockCount(imageSize);
+  otaBlocks.needed = (uint8_t *)calloc((otaBlocks.blockCount + 7) / 8, 1);
+  if (otaBlocks.needed == NULL) {
+    otaBlocksRelease();
+    return false;
+  }
+
+  otaBlocks.neededCount = 0;
+  otaBlocks.neededBytes = 0;
+  for (size_t i = 0; i < otaBlocks.blockCount; i++) {
+    size_t offset = i * OTA_BLOCK_SIZE;
+    size_t len = otaBlockLength(i);
+    bool isSame = false;
+    if (offset + len <= otaBlocks.runningSize) {
+      uint8_t digest[OTA_SHA256_SIZE];
+      mbedtls_sha256_ret(otaBlocks.running + offset, len, digest, 0);
+      isSame = memcmp(digest, hashes + i * OTA_SHA256_SIZE, OTA_SHA256_SIZE) == 0;
+    }
+    if (!isSame) {
+      otaBlocks.needed[i / 8] |= 1 << (i % 8);
+      otaBlocks.neededCount++;
+      otaBlocks.neededBytes += len;
+    }
+  }
+
+  otaBlocks.nextBlock = 0;
+  otaBlocks.blockFill = 0;
+  otaBlocks.bytesCopied = 0;
+  otaBlocks.isPlanned = true;
+  Serial.printf("OTA: Block plan needs %u of %u blocks (%u of %u bytes), compared in %lu ms\n",
+                otaBlocks.neededCount, otaBlocks.blockCount, otaBlocks.neededBytes, imageSize,
+                millis() - t0);
+  return true;
+}
+
+/**
+ * The needed-blocks bitmap as hex, for the /ota/blocks reply
+ */
+String otaBlocksBitmapHex() {
+  size_t len = (otaBlocks.blockCount + 7) / 8;
+  String hex;
+  hex.reserve(len * 2);
+  char byte[3];
+  for (size_t i = 0; i < len; i++) {
+    snprintf(byte, sizeof(byte), "%02x", otaBlocks.needed[i]);
+    hex += byte;
+  }
+  return hex;
+}
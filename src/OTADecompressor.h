@@ -0,0 +1,307 @@
+/*
+  -----------------------
+  Streaming Gzip Decompressor
+  -----------------------
+
+  Inflates gzip-compressed firmware images on the way to flash, using the
+  tinfl inflater built into the ESP32 ROM.
+
+  RAM use is fixed regardless of image size: one 32 KB window (the deflate
+  dictionary, which doubles as the output buffer) plus the inflater state.
+  Both are allocated only for compressed uploads and freed at the end of
+  the session, which matters on the no-PSRAM board.
+
+  Decompressed data is handed to an OTASink in window-sized pieces, so the
+  downstream writer still sees a plain image. The gzip trailer (CRC32 and
+  size) is checked when the stream ends.
+
+  Heatshrink is not supported: it would need a vendored library, while
+  tinfl is already in ROM and gzip is available on every build host.
+
+  Create a compressed image with:  gzip -9 -k firmware.bin
+*/
+#if CONFIG_IDF_TARGET_ESP32S3
+#include "esp32s3/rom/miniz.h"
+#else
+#include "rom/miniz.h"
+#endif
+#include <esp_rom_crc.h>
+
+const uint8_t GZIP_MAGIC_0 = 0x1f;
+const uint8_t GZIP_MAGIC_1 = 0x8b;
+const uint8_t GZIP_METHOD_DEFLATE = 8;
+
+// Gzip header flag bits (RFC 1952)
+const uint8_t GZIP_FHCRC = 0x02;
+const uint8_t GZIP_FEXTRA = 0x04;
+const uint8_t GZIP_FNAME = 0x08;
+const uint8_t GZIP_FCOMMENT = 0x10;
+
+enum GzipStage {
+  GZIP_STAGE_HEADER,      // Fixed 10-byte header
+  GZIP_STAGE_EXTRA_LEN,   // 2-byte FEXTRA length
+  GZIP_STAGE_EXTRA,       // FEXTRA payload
+  GZIP_STAGE_NAME,        // Zero-terminated FNAME
+  GZIP_STAGE_COMMENT,     // Zero-terminated FCOMMENT
+  GZIP_STAGE_HCRC,        // 2-byte header CRC
+  GZIP_STAGE_DEFLATE,     // Compressed data
+  GZIP_STAGE_TRAILER,     // CRC32 + ISIZE
+  GZIP_STAGE_DONE
+};
+
+struct OTAInflateStats {
+  size_t compressedBytes;
+  size_t outputBytes;
+  uint32_t inflateMicros;
+};
+
+OTAInflateStats otaInflateStats;
+
+struct OTAInflateState {
+  tinfl_decompressor *decompressor;
+  uint8_t *window;
+  size_t windowOffset;
+  OTASink sink;
+  GzipStage stage;
+  uint8_t flags;
+  uint8_t field[10];      // Scratch for fixed-size header/trailer fields
+  size_t fieldFill;
+  size_t extraRemaining;
+  uint32_t crc;
+  bool hasError;
+};
+
+OTAInflateState otaInflate;
+
+/**
+ * Check whether the first bytes of an upload are a gzip stream
+ */
+bool isGzipImage(const uint8_t *data, size_t len) {
+  return len >= 2 && data[0] == GZIP_MAGIC_0 && data[1] == GZIP_MAGIC_1;
+}
+
+/**
+ * Free the inflater buffers
+ */
+void otaInflateRelease() {
+  free(otaInflate.decompressor);
+  free(otaInflate.window);
+  otaInflate.decompressor = NULL;
+  otaInflate.window = NULL;
+}
+
+/**
+ * Start a decompression session that writes its output to sink
+ */
+bool otaInflateBegin(OTASink sink) {
+  otaInflateRelease();
+  memset(&otaInflateStats, 0, sizeof(otaInflateStats));
+
+  otaInflate.decompressor = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+  otaInflate.window = (uint8_t *)malloc(TINFL_LZ_DICT_SIZE);
+  if (otaInflate.decompressor == NULL || otaInflate.window == NULL) {
+    otaInflateRelease();
+    return false;
+  }
+
+  tinfl_init(otaInflate.decompressor);
+  otaInflate.windowOffset = 0;
+  otaInflate.sink = sink;
+  otaInflate.stage = GZIP_STAGE_HEADER;
+  otaInflate.flags = 0;
+  otaInflate.fieldFill = 0;
+  otaInflate.extraRemaining = 0;
+  otaInflate.crc = 0;
+  otaInflate.hasError = false;
+  return true;
+}
+
+/**
+ * Collect a fixed-size field that may be split across chunks
+ *
+ * Returns true once the field is complete.
+ */
+bool gzipCollectField(const uint8_t *&data, size_t &len, size_t size) {
+  while (len && otaInflate.fieldFill < size) {
+    otaInflate.field[otaInflate.fieldFill++] = *data++;
+    len--;
+  }
+  if (otaInflate.fieldFill < size) {
+    return false;
+  }
+  otaInflate.fieldFill = 0;
+  return true;
+}
+
+/**
+ * Skip a zero-terminated header string; returns true once its end is found
+ */
+bool gzipSkipString(const uint8_t *&data, size_t &len) {
+  const uint8_t *end = (const uint8_t *)memchr(data, 0, len);
+  if (end == NULL) {
+    data += len;
+    len = 0;
+    return false;
+  }
+  len -= end + 1 - data;
+  data = end + 1;
+  return true;
+}
+
+/**
+ * Move to the next optional header field that is present
+ */
+void gzipNextHeaderStage(GzipStage after) {
+  if (after < GZIP_STAGE_EXTRA_LEN && (otaInflate.flags & GZIP_FEXTRA)) {
+    otaInflate.stage = GZIP_STAGE_EXTRA_LEN;
+  } else if (after < GZIP_STAGE_NAME && (otaInflate.flags & GZIP_FNAME)) {
+    otaInflate.stage = GZIP_STAGE_NAME;
+  } else if (after < GZIP_STAGE_COMMENT && (otaInflate.flags & GZIP_FCOMMENT)) {
+    otaInflate.stage = GZIP_STAGE_COMMENT;
+  } else if (after < GZIP_STAGE_HCRC && (otaInflate.flags & GZIP_FHCRC)) {
+    otaInflate.stage = GZIP_STAGE_HCRC;
+  } else {
+    otaInflate.stage = GZIP_STAGE_DEFLATE;
+  }
+}
+
+/**
+ * Run compressed bytes through tinfl, flushing output to the sink
+ */
+void gzipInflate(const uint8_t *&data, size_t &len) {
+  while (otaInflate.stage == GZIP_STAGE_DEFLATE) {
+    size_t inBytes = len;
+    size_t outBytes = TINFL_LZ_DICT_SIZE - otaInflate.windowOffset;
+    uint8_t *out = otaInflate.window + otaInflate.windowOffset;
+
+    tinfl_status status = tinfl_decompress(otaInflate.decompressor, data, &inBytes,
+                                           otaInflate.window, out, &outBytes,
+                                           TINFL_FLAG_HAS_MORE_INPUT);
+    data += inBytes;
+    len -= inBytes;
+
+    if (outBytes) {
+      otaInflate.crc = esp_rom_crc32_le(otaInflate.crc, out, outBytes);
+      otaInflateStats.outputBytes += outBytes;
+      if (!otaInflate.sink(out, outBytes)) {
+        otaInflate.hasError = true;
+        return;
+      }
+      otaInflate.windowOffset = (otaInflate.windowOffset + outBytes) & (TINFL_LZ_DICT_SIZE - 1);
+    }
+
+    if (status == TINFL_STATUS_DONE) {
+      otaInflate.stage = GZIP_STAGE_TRAILER;
+    } else if (status < TINFL_STATUS_DONE) {
+      otaInflate.hasError = true;
+      return;
+    } else if (status == TINFL_STATUS_NEEDS_MORE_INPUT && len == 0) {
+      return;
+    }
+  }
+}
+
+/**
+ * Feed compressed upload data
+ *
+ * Returns false if the stream is malformed or the sink rejected data.
+ */
+bool otaInflateWrite(const uint8_t *data, size_t len) {
+  if (otaInflate.decompressor == NULL || otaInflate.hasError) {
+    return false;
+  }
+
+  uint32_t t0 = micros();
+  otaInflateStats.compressedBytes += len;
+
+  while (len && !otaInflate.hasError) {
+    switch (otaInflate.stage) {
+      case GZIP_STAGE_HEADER:
+        if (gzipCollectField(data, len, 10)) {
+          if (otaInflate.field[0] != GZIP_MAGIC_0 || otaInflate.field[1] != GZIP_MAGIC_1 ||
+              otaInflate.field[2] != GZIP_METHOD_DEFLATE) {
+            otaInflate.hasError = true;
+            break;
+          }
+          otaInflate.flags = otaInflate.field[3];
+          gzipNextHeaderStage(GZIP_STAGE_HEADER);
+        }
+        break;
+
+      case GZIP_STAGE_EXTRA_LEN:
+        if (gzipCollectField(data, len, 2)) {
+          otaInflate.extraRemaining = otaInflate.field[0] | (otaInflate.field[1] << 8);
+          otaInflate.stage = GZIP_STAGE_EXTRA;
+        }
+        break;
+
+      case GZIP_STAGE_EXTRA: {
+        size_t skip = min(len, otaInflate.extraRemaining);
+        data += skip;
+        len -= skip;
+        otaInflate.extraRemaining -= skip;
+        if (otaInflate.extraRemaining == 0) {
+          gzipNextHeaderStage(GZIP_STAGE_EXTRA);
+        }
+        break;
+      }
+
+      case GZIP_STAGE_NAME:
+      case GZIP_STAGE_COMMENT:
+        if (gzipSkipString(data, len)) {
+          gzipNextHeaderStage(otaInflate.stage);
+        }
+        break;
+
+      case GZIP_STAGE_HCRC:
+        if (gzipCollectField(data, len, 2)) {
+          gzipNextHeaderStage(GZIP_STAGE_HCRC);
+        }
+        break;
+
+      case GZIP_STAGE_DEFLATE:
+        gzipInflate(data, len);
+        break;
+
+      case GZIP_STAGE_TRAILER:
+        if (gzipCollectField(data, len, 8)) {
+          uint32_t crc = otaInflate.field[0] | (otaInflate.field[1] << 8) |
+                         (otaInflate.field[2] << 16) | ((uint32_t)otaInflate.field[3] << 24);
+          uint32_t size = otaInflate.field[4] | (otaInflate.field[5] << 8) |
+                          (otaInflate.field[6] << 16) | ((uint32_t)otaInflate.field[7] << 24);
+          if (crc != otaInflate.crc || size != (uint32_t)otaInflateStats.outputBytes) {
+            otaInflate.hasError = true;
+          }
+          otaInflate.stage = GZIP_STAGE_DONE;
+        }
+        break;
+
+      case GZIP_STAGE_DONE:
+        // Ignore trailing padding after the gzip member
+        len = 0;
+        break;
+    }
+  }
+
+  otaInflateStats.inflateMicros += micros() - t0;
+  return !otaInflate.hasError;
+}
+
+/**
+ * Finish the session; returns true if a complete, intact stream was seen
+ */
+bool otaInflateEnd() {
+  bool ok = !otaInflate.hasError && otaInflate.stage == GZIP_STAGE_DONE;
+  otaInflateRelease();
+  return ok;
+}
+
+/**
+ * Print compression ratio and decompression cost of the last session
+ */
+void printOTAInflateStats() {
+  float ratio = otaInflateStats.outputBytes ? (float)otaInflateStats.compressedBytes / otaInflateStats.outputBytes : 0;
+  Serial.printf("OTA: Inflated %u -> %u bytes (%.0f%%) in %lu ms of CPU\n",
+                otaInflateStats.compressedBytes, otaInflateStats.outputBytes, ratio * 100,
+                (unsigned long)(otaInflateStats.inflateMicros / 1000));
+}
@@ -0,0 +1,282 @@
+/*
+  -----------------------
+  Streaming Delta Patch Applier
+  -----------------------
+
+  Rebuilds a new firmware image from the running one plus a binary patch,
+  so small code changes don't resend the whole image.
+
+  The patch is bsdiff's algorithm in a streaming container: instead of
+  bsdiff's three separately compressed blocks, control records are
+  interleaved with their data, so the patch can be applied front to back as
+  it arrives. The running partition is read in small pieces as the records
+  reference it; nothing is buffered beyond one scratch block, which keeps
+  RAM use constant on the no-PSRAM board.
+
+  Patch layout (all integers little endian):
+    "ESPDLT01"         8-byte magic
+    newSize            uint32, size of the rebuilt image
+    newSha256          32 bytes, SHA-256 of the rebuilt image
+    then repeated until newSize bytes are produced:
+      diffLen          int64, bytes of old+delta to emit
+      extraLen         int64, literal bytes to emit
+      seek             int64, adjustment of the old read position
+      diff bytes       diffLen bytes, added bytewise to the old image
+      extra bytes      extraLen bytes, copied verbatim
+
+  The flash writer hashes the rebuilt image as it is written; the caller
+  compares that digest with newSha256 before committing.
+
+  Create patches with tools/make_delta.py; a patch may additionally be
+  gzip-compressed.
+*/
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+
+const uint8_t DELTA_MAGIC[8] = { 'E', 'S', 'P', 'D', 'L', 'T', '0', '1' };
+const size_t DELTA_HEADER_SIZE = 8 + 4 + 32;
+const size_t DELTA_CONTROL_SIZE = 3 * 8;
+
+// Scratch block for combining old image bytes with diff bytes
+const size_t DELTA_BLOCK_SIZE = 512;
+
+enum DeltaStage {
+  DELTA_STAGE_HEADER,
+  DELTA_STAGE_CONTROL,
+  DELTA_STAGE_DIFF,
+  DELTA_STAGE_EXTRA,
+  DELTA_STAGE_DONE
+};
+
+struct OTADeltaState {
+  const esp_partition_t *base; // Running partition the patch applies to
+  OTASink sink;
+  DeltaStage stage;
+  uint8_t field[DELTA_HEADER_SIZE];
+  size_t fieldFill;
+  uint32_t newSize;
+  uint8_t expectedSha256[32];
+  size_t written;
+  size_t oldPos;
+  size_t diffRemaining;
+  size_t extraRemaining;
+  int64_t seek;
+  bool hasError;
+};
+
+OTADeltaState otaDelta;
+uint8_t otaDeltaBlock[DELTA_BLOCK_SIZE];
+
+// True while a patch is being applied
+bool isOTADeltaActive = false;
+
+/**
+ * Check whether the first byte of an image stream starts a delta patch
+ *
+ * A plain ESP image always starts with 0xE9, so one byte is enough to
+ * tell them apart; the full magic is checked by the applier.
+ */
+bool isDeltaPatch(const uint8_t *data, size_t len) {
+  return len >= 1 && data[0] == DELTA_MAGIC[0];
+}
+
+/**
+ * Start applying a patch against the running partition, output to sink
+ */
+bool otaDeltaBegin(OTASink sink) {
+  otaDelta.base = esp_ota_get_running_partition();
+  if (otaDelta.base == NULL) {
+    return false;
+  }
+
+  otaDelta.sink = sink;
+  otaDelta.stage = DELTA_STAGE_HEADER;
+  otaDelta.fieldFill = 0;
+  otaDelta.newSize = 0;
+  otaDelta.written = 0;
+  otaDelta.oldPos = 0;
+  otaDelta.diffRemaining = 0;
+  otaDelta.extraRemaining = 0;
+  otaDelta.seek = 0;
+  otaDelta.hasError = false;
+  isOTADeltaActive = true;
+  return true;
+}
+
+/**
+ * Drop the patch state, e.g. when the upload is aborted
+ */
+void otaDeltaRelease() {
+  isOTADeltaActive = false;
+}
+
+int64_t readInt64LE(const uint8_t *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--) {
+    v = (v << 8) | p[i];
+  }
+  return (int64_t)v;
+}
+
+/**
+ * Collect a fixed-size field that may be split across chunks
+ */
+bool deltaCollectField(const uint8_t *&data, size_t &len, size_t size) {
+  size_t n = min(len, size - otaDelta.fieldFill);
+  memcpy(otaDelta.field + otaDelta.fieldFill, data, n);
+  otaDelta.fieldFill += n;
+  data += n;
+  len -= n;
+  if (otaDelta.fieldFill < size) {
+    return false;
+  }
+  otaDelta.fieldFill = 0;
+  return true;
+}
+
+/**
+ * Pass rebuilt image bytes to the sink
+ */
+bool deltaEmit(const uint8_t *data, size_t len) {
+  otaDelta.written += len;
+  return otaDelta.sink(data, len);
+}
+
+/**
+ * Validate a control record and set up the next diff/extra run
+ */
+void deltaStartRecord() {
+  int64_t diffLen = readInt64LE(otaDelta.field);
+  int64_t extraLen = readInt64LE(otaDelta.field + 8);
+  otaDelta.seek = readInt64LE(otaDelta.field + 16);
+
+  size_t remaining = otaDelta.newSize - otaDelta.written;
+  if (diffLen < 0 || extraLen < 0 || (uint64_t)diffLen + (uint64_t)extraLen > remaining ||
+      otaDelta.oldPos + (uint64_t)diffLen > otaDelta.base->size) {
+    otaDelta.hasError = true;
+    return;
+  }
+
+  otaDelta.diffRemaining = (size_t)diffLen;
+  otaDelta.extraRemaining = (size_t)extraLen;
+  otaDelta.stage = DELTA_STAGE_DIFF;
+}
+
+/**
+ * Finish a record: move the old read position and pick the next stage
+ */
+void deltaEndRecord() {
+  int64_t pos = (int64_t)otaDelta.oldPos + otaDelta.seek;
+  if (pos < 0 || pos > (int64_t)otaDelta.base->size) {
+    otaDelta.hasError = true;
+    return;
+  }
+  otaDelta.oldPos = (size_t)pos;
+  otaDelta.stage = otaDelta.written == otaDelta.newSize ? DELTA_STAGE_DONE : DELTA_STAGE_CONTROL;
+}
+
+/**
+ * Feed patch data
+ *
+ * Returns false if the patch is malformed or the sink rejected data.
+ */
+bool otaDeltaWrite(const uint8_t *data, size_t len) {
+  while (len && !otaDelta.hasError) {
+    switch (otaDelta.stage) {
+      case DELTA_STAGE_HEADER:
+        if (deltaCollectField(data, len, DELTA_HEADER_SIZE)) {
+          if (memcmp(otaDelta.field, DELTA_MAGIC, sizeof(DELTA_MAGIC)) != 0) {
+            otaDelta.hasError = true;
+            break;
+          }
+          otaDelta.newSize = otaDelta.field[8] | (otaDelta.field[9] << 8) |
+                             (otaDelta.field[10] << 16) | ((uint32_t)otaDelta.field[11] << 24);
+          memcpy(otaDelta.expectedSha256, otaDelta.field + 12, sizeof(otaDelta.expectedSha256));
+          // The writer may erase ahead up to the end of the rebuilt image
+          otaWriterSetImageSize(otaDelta.newSize);
+          otaDelta.stage = otaDelta.newSize ? DELTA_STAGE_CONTROL : DELTA_STAGE_DONE;
+        }
+        break;
+
+      case DELTA_STAGE_CONTROL:
+        if (deltaCollectField(data, len, DELTA_CONTROL_SIZE)) {
+          deltaStartRecord();
+        }
+        break;
+
+      case DELTA_STAGE_DIFF: {
+        size_t n = min(min(len, otaDelta.diffRemaining), DELTA_BLOCK_SIZE);
+        if (n) {
+          if (esp_partition_read(otaDelta.base, otaDelta.oldPos, otaDeltaBlock, n) != ESP_OK) {
+            otaDelta.hasError = true;
+            break;
+          }
+          for (size_t i = 0; i < n; i++) {
+            otaDeltaBlock[i] += data[i];
+          }
+          if (!deltaEmit(otaDeltaBlock, n)) {
+            otaDelta.hasError = true;
+            break;
+          }
+          data += n;
+          len -= n;
+          otaDelta.oldPos += n;
+          otaDelta.diffRemaining -= n;
+        }
+        if (otaDelta.diffRemaining == 0) {
+          otaDelta.stage = DELTA_STAGE_EXTRA;
+        }
+        break;
+      }
+
+      case DELTA_STAGE_EXTRA: {
+        size_t n = min(len, otaDelta.extraRemaining);
+        if (n) {
+          if (!deltaEmit(data, n)) {
+            otaDelta.hasError = true;
+            break;
+          }
+          data += n;
+          len -= n;
+          otaDelta.extraRemaining -= n;
+        }
+        if (otaDelta.extraRemaining == 0) {
+          deltaEndRecord();
+        }
+        break;
+      }
+
+      case DELTA_STAGE_DONE:
+        // Nothing may follow the last record
+        otaDelta.hasError = true;
+        break;
+    }
+  }
+
+  // Zero-length runs at the end of a chunk complete without further input
+  while (!otaDelta.hasError &&
+         ((otaDelta.stage == DELTA_STAGE_DIFF && otaDelta.diffRemaining == 0) ||
+          (otaDelta.stage == DELTA_STAGE_EXTRA && otaDelta.extraRemaining == 0))) {
+    if (otaDelta.stage == DELTA_STAGE_DIFF) {
+      otaDelta.stage = DELTA_STAGE_EXTRA;
+    } else {
+      deltaEndRecord();
+    }
+  }
+
+  return !otaDelta.hasError;
+}
+
+/**
+ * Finish the patch; returns true if the full image was rebuilt
+ *
+ * The caller must still check the written image against
+ * otaDelta.expectedSha256.
+ */
+bool otaDeltaEnd() {
+  if (!isOTADeltaActive) {
+    return false;
+  }
+  otaDeltaRelease();
+  return !otaDelta.hasError && otaDelta.stage == DELTA_STAGE_DONE;
+}
@@ -0,0 +1,391 @@
+/*
+  -----------------------
+  OTA Event Stream
+  -----------------------
+
+  GET /ota/events is a Server-Sent Events stream of update progress and
+  connectivity state on the OTA server, so dashboards don't have to poll:
+
+    event: progress  data: {"bytes":..,"total":..,"rate":..,"eta":..}
+    event: ota       data: {"state":"started"|"finished"|"failed"}
+    event: wifi      data: {"state":"connecting"|"connected"|"disconnected"|"failed"|"off"}
+    event: portal    data: {"state":"open"|"client"|"closed"}
+
+  rate is an exponentially weighted average of the throughput in bytes
+  per second, and eta the seconds left at that rate (-1 while unknown).
+
+  Producers run in the async_tcp task, the pull task and loop(), so they
+  only queue an event code or store the byte count. handleOTAEventStream()
+  formats the messages in loop context. Progress is coalesced to at most
+  one message per OTA_EVENTS_INTERVAL_MS. While a transfer stalls, one
+  message a second lets the rate decay to 0.
+
+  Messages go into one ring of OTA_EVENTS_RING_SIZE, shared by every
+  subscriber. A subscriber is a read cursor into the ring, and nothing is
+  queued per connection. The web server pulls new messages into the
+  socket when the TCP window has room: on an ACK, or on its poll every
+  half second. A subscriber that falls a whole ring behind skips to the
+  newest messages and gets the current state of every kind again, so a
+  slow client costs nothing beyond its connection. The same snapshot
+  starts every stream.
+
+  At most OTA_EVENTS_MAX_SUBSCRIBERS streams are open at once; lwIP has 16
+  TCP connections to share with uploads, pulls and the portal. More are
+  refused with 503. A scheduled reboot waits, up to its deadline, until
+  every subscriber has been sent the last messages. Build with
+  -DOTA_EVENT_STREAM=0 to leave it out.
+*/
+
+#ifndef OTA_EVENT_STREAM
+#define OTA_EVENT_STREAM 1
+#endif
+
+#ifndef OTA_EVENTS_MAX_SUBSCRIBERS
+#define OTA_EVENTS_MAX_SUBSCRIBERS 8
+#endif
+
+const unsigned long OTA_EVENTS_INTERVAL_MS = 500;
+const unsigned long OTA_EVENTS_STALL_MS = 1000;
+
+// Weight of the newest throughput sample
+const float OTA_EVENTS_RATE_WEIGHT = 0.3f;
+
+// Messages held for subscribers; a power of two so the cursor can wrap
+const uint32_t OTA_EVENTS_RING_SIZE = 16;
+const size_t OTA_EVENTS_MESSAGE_SIZE = 128;
+
+// Event codes queued by producers
+const uint8_t OTA_EVENTS_QUEUE_SIZE = 16;
+
+// Browsers reconnect this long after a stream drops
+const char *OTA_EVENTS_RETRY = "retry: 2000\n\n";
+
+enum OTAStreamEvent : uint8_t {
+  STREAM_OTA_STARTED,
+  STREAM_OTA_FINISHED,
+  STREAM_OTA_FAILED,
+  STREAM_WIFI_CONNECTING,
+  STREAM_WIFI_CONNECTED,
+  STREAM_WIFI_DISCONNECTED,
+  STREAM_WIFI_FAILED,
+  STREAM_WIFI_OFF,
+  STREAM_PORTAL_OPEN,
+  STREAM_PORTAL_CLIENT,
+  STREAM_PORTAL_CLOSED
+};
+
+// Kinds of message, each with its latest one kept for snapshots
+enum OTAStreamKind : uint8_t {
+  STREAM_KIND_OTA,
+  STREAM_KIND_PROGRESS,
+  STREAM_KIND_WIFI,
+  STREAM_KIND_PORTAL,
+  STREAM_KIND_COUNT
+};
+
+struct OTAStreamMessage {
+  uint16_t length;
+  char text[OTA_EVENTS_MESSAGE_SIZE];
+};
+
+struct OTAStreamSubscriber {
+  bool isOpen;
+  bool needsSnapshot;  // Send the latest message of every kind first
+  uint32_t cursor;     // Sequence number of the next ring message
+  uint32_t resyncs;    // Times it fell a ring behind
+};
+
+// Messages and cursors, only used under otaStreamLock
+OTAStreamMessage otaStreamRing[OTA_EVENTS_RING_SIZE];
+OTAStreamMessage otaStreamLatest[STREAM_KIND_COUNT];
+uint32_t otaStreamHead = 0;  // Sequence number of the next message
+OTAStreamSubscriber otaStreamSubscribers[OTA_EVENTS_MAX_SUBSCRIBERS];
+SemaphoreHandle_t otaStreamLock = NULL;
+
+QueueHandle_t otaStreamQueue = NULL;
+
+// Progress as reported by onOTAProgress(), from any task
+volatile size_t otaStreamBytes = 0;
+volatile size_t otaStreamTotal = 0;
+volatile bool isOTAStreamTransferring = false;
+
+// Last progress message sent, for the throughput average (loop only)
+size_t otaStreamLastBytes = 0;
+unsigned long otaStreamLastMillis = 0;
+float otaStreamRate = 0;
+
+// Reboot hold taken while subscribers haven't got every message yet
+bool isOTAStreamHoldingReboot = false;
+
+/**
+ * Create the queue and lock; called from setupOTA()
+ */
+void beginOTAEventStream() {
+  #if OTA_EVENT_STREAM
+  otaStreamLock = xSemaphoreCreateMutex();
+  otaStreamQueue = xQueueCreate(OTA_EVENTS_QUEUE_SIZE, sizeof(OTAStreamEvent));
+  #endif
+}
+
+/**
+ * Queue a state change for subscribers (any task, never blocks)
+ */
+void postOTAStreamEvent(OTAStreamEvent event) {
+  #if OTA_EVENT_STREAM
+  if (otaStreamQueue != NULL) {
+    xQueueSend(otaStreamQueue, &event, 0);
+  }
+  #endif
+}
+
+/**
+ * Record transfer progress; called from onOTAProgress() in any task
+ */
+void noteOTAStreamProgress(size_t current, size_t final) {
+  otaStreamBytes = current;
+  otaStreamTotal = final;
+}
+
+/**
+ * Format a message into the ring and keep it as the latest of its kind
+ */
+void publishOTAStreamMessage(OTAStreamKind kind, const char *event, const char *data) {
+  xSemaphoreTake(otaStreamLock, portMAX_DELAY);
+  OTAStreamMessage &message = otaStreamRing[otaStreamHead & (OTA_EVENTS_RING_SIZE - 1)];
+  int n = snprintf(message.text, sizeof(message.text), "event: %s\ndata: %s\n\n", event, data);
+  message.length = min((size_t)n, sizeof(message.text) - 1);
+  otaStreamLatest[kind] = message;
+  otaStreamHead++;
+  xSemaphoreGive(otaStreamLock);
+}
+
+void publishOTAStreamState(OTAStreamKind kind, const char *event, const char *state) {
+  char data[64];
+  snprintf(data, sizeof(data), "{\"state\":\"%s\"}", state);
+  publishOTAStreamMessage(kind, event, data);
+}
+
+/**
+ * Turn a queued event code into its message
+ */
+void publishOTAStreamEvent(OTAStreamEvent event) {
+  switch (event) {
+    case STREAM_OTA_STARTED:
+      isOTAStreamTransferring = true;
+      otaStreamBytes = 0;
+      otaStreamLastBytes = 0;
+      otaStreamLastMillis = millis();
+      otaStreamRate = 0;
+      // New streams shouldn't see the last transfer's progress
+      xSemaphoreTake(otaStreamLock, portMAX_DELAY);
+      otaStreamLatest[STREAM_KIND_PROGRESS].length = 0;
+      xSemaphoreGive(otaStreamLock);
+      publishOTAStreamState(STREAM_KIND_OTA, "ota", "started");
+      break;
+    case STREAM_OTA_FINISHED:
+    case STREAM_OTA_FAILED:
+      isOTAStreamTransferring = false;
+      publishOTAStreamState(STREAM_KIND_OTA, "ota", event == STREAM_OTA_FINISHED ? "finished" : "failed");
+      break;
+    case STREAM_WIFI_CONNECTING:
+      publishOTAStreamState(STREAM_KIND_WIFI, "wifi", "connecting");
+      break;
+    case STREAM_WIFI_CONNECTED: {
+      char data[64];
+      snprintf(data, sizeof(data), "{\"state\":\"connected\",\"ip\":\"%s\"}", WiFi.localIP().toString().c_str());
+      publishOTAStreamMessage(STREAM_KIND_WIFI, "wifi", data);
+      break;
+    }
+    case STREAM_WIFI_DISCONNECTED:
+      publishOTAStreamState(STREAM_KIND_WIFI, "wifi", "disconnected");
+      break;
+    case STREAM_WIFI_FAILED:
+      publishOTAStreamState(STREAM_KIND_WIFI, "wifi", "failed");
+      break;
+    case STREAM_WIFI_OFF:
+      publishOTAStreamState(STREAM_KIND_WIFI, "wifi", "off");
+      break;
+    case STREAM_PORTAL_OPEN:
+      publishOTAStreamState(STREAM_KIND_PORTAL, "portal", "open");
+      break;
+    case STREAM_PORTAL_CLIENT:
+      publishOTAStreamState(STREAM_KIND_PORTAL, "portal", "client");
+      break;
+    case STREAM_PORTAL_CLOSED:
+      publishOTAStreamState(STREAM_KIND_PORTAL, "portal", "closed");
+      break;
+  }
+}
+
+/**
+ * Publish coalesced progress with the average throughput and ETA
+ *
+ * Skipped until OTA_EVENTS_INTERVAL_MS has passed, unless isFinal. While
+ * no bytes arrive, one message a second lets the average decay to 0.
+ */
+void publishOTAStreamProgress(bool isFinal) {
+  unsigned long now = millis();
+  unsigned long elapsed = now - otaStreamLastMillis;
+  size_t bytes = otaStreamBytes;
+  size_t total = otaStreamTotal;
+  bool isStalled = bytes == otaStreamLastBytes;
+  if (isStalled && (otaStreamRate == 0 || (!isFinal && elapsed < OTA_EVENTS_STALL_MS))) {
+    return;
+  }
+  if (!isFinal && elapsed < OTA_EVENTS_INTERVAL_MS) {
+    return;
+  }
+
+  if (elapsed > 0) {
+    // A resumed transfer may start past the last count
+    float sample = bytes >= otaStreamLastBytes ? (bytes - otaStreamLastBytes) * 1000.0f / elapsed : 0;
+    otaStreamRate = otaStreamRate == 0 ? sample
+                                       : OTA_EVENTS_RATE_WEIGHT * sample + (1 - OTA_EVENTS_RATE_WEIGHT) * otaStreamRate;
+    if (otaStreamRate < 1) {
+      otaStreamRate = 0;
+    }
+  }
+  otaStreamLastBytes = bytes;
+  otaStreamLastMillis = now;
+
+  long eta = -1;
+  if (otaStreamRate > 0 && total >= bytes) {
+    eta = lroundf((total - bytes) / otaStreamRate);
+  }
+  char data[96];
+  snprintf(data, sizeof(data), "{\"bytes\":%u,\"total\":%u,\"rate\":%lu,\"eta\":%ld}", bytes, total,
+           (unsigned long)otaStreamRate, eta);
+  publishOTAStreamMessage(STREAM_KIND_PROGRESS, "progress", data);
+}
+
+/**
+ * Whether any subscriber has messages it hasn't been sent yet
+ */
+bool hasOTAStreamBacklog() {
+  bool hasBacklog = false;
+  xSemaphoreTake(otaStreamLock, portMAX_DELAY);
+  for (int i = 0; i < OTA_EVENTS_MAX_SUBSCRIBERS; i++) {
+    const OTAStreamSubscriber &subscriber = otaStreamSubscribers[i];
+    if (subscriber.isOpen && (subscriber.needsSnapshot || subscriber.cursor != otaStreamHead)) {
+      hasBacklog = true;
+    }
+  }
+  xSemaphoreGive(otaStreamLock);
+  return hasBacklog;
+}
+
+/**
+ * Publish queued state changes and due progress; called from handleOTA()
+ */
+void handleOTAEventStream() {
+  #if OTA_EVENT_STREAM
+  if (otaStreamQueue == NULL || otaStreamLock == NULL) {
+    return;
+  }
+  OTAStreamEvent event;
+  while (xQueueReceive(otaStreamQueue, &event, 0) == pdTRUE) {
+    // The last progress before the end, so subscribers see 100%
+    if (isOTAStreamTransferring && (event == STREAM_OTA_FINISHED || event == STREAM_OTA_FAILED)) {
+      publishOTAStreamProgress(true);
+    }
+    publishOTAStreamEvent(event);
+  }
+  if (isOTAStreamTransferring) {
+    publishOTAStreamProgress(false);
+  }
+
+  // Let subscribers see how the update ended before the reboot
+  bool hasBacklog = isRebootScheduled && hasOTAStreamBacklog();
+  if (hasBacklog != isOTAStreamHoldingReboot) {
+    if (hasBacklog) {
+      holdReboot();
+    } else {
+      releaseReboot();
+    }
+    isOTAStreamHoldingReboot = hasBacklog;
+  }
+  #endif
+}
+
+/**
+ * Copy what fits of a subscriber's pending messages into the socket
+ * buffer; runs in the async_tcp task
+ */
+size_t fillOTAStream(OTAStreamSubscriber &subscriber, uint8_t *buffer, size_t maxLen) {
+  size_t len = 0;
+  xSemaphoreTake(otaStreamLock, portMAX_DELAY);
+  if (!subscriber.needsSnapshot && otaStreamHead - subscriber.cursor > OTA_EVENTS_RING_SIZE) {
+    subscriber.needsSnapshot = true;
+    subscriber.resyncs++;
+  }
+  if (subscriber.needsSnapshot) {
+    // All or nothing, so the snapshot never interleaves with older messages
+    size_t needed = strlen(OTA_EVENTS_RETRY);
+    for (int kind = 0; kind < STREAM_KIND_COUNT; kind++) {
+      needed += otaStreamLatest[kind].length;
+    }
+    if (needed <= maxLen) {
+      memcpy(buffer, OTA_EVENTS_RETRY, strlen(OTA_EVENTS_RETRY));
+      len = strlen(OTA_EVENTS_RETRY);
+      for (int kind = 0; kind < STREAM_KIND_COUNT; kind++) {
+        memcpy(buffer + len, otaStreamLatest[kind].text, otaStreamLatest[kind].length);
+        len += otaStreamLatest[kind].length;
+      }
+      subscriber.needsSnapshot = false;
+      subscriber.cursor = otaStreamHead;
+    }
+  }
+  while (!subscriber.needsSnapshot && subscriber.cursor != otaStreamHead) {
+    const OTAStreamMessage &message = otaStreamRing[subscriber.cursor & (OTA_EVENTS_RING_SIZE - 1)];
+    if (len + message.length > maxLen) {
+      break;
+    }
+    memcpy(buffer + len, message.text, message.length);
+    len += message.length;
+    subscriber.cursor++;
+  }
+  xSemaphoreGive(otaStreamLock);
+
+  // Nothing new: the server asks again on the next ACK or poll
+  return len > 0 ? len : RESPONSE_TRY_AGAIN;
+}
+
+/**
+ * GET /ota/events: open a stream if a subscriber slot is free
+ */
+void handleOTAEventsRequest(AsyncWebServerRequest *request) {
+  #if OTA_EVENT_STREAM
+  OTAStreamSubscriber *subscriber = NULL;
+  if (otaStreamLock != NULL) {
+    xSemaphoreTake(otaStreamLock, portMAX_DELAY);
+    for (int i = 0; i < OTA_EVENTS_MAX_SUBSCRIBERS && subscriber == NULL; i++) {
+      if (!otaStreamSubscribers[i].isOpen) {
+        subscriber = &otaStreamSubscribers[i];
+        subscriber->isOpen = true;
+        subscriber->needsSnapshot = true;
+        subscriber->resyncs = 0;
+      }
+    }
+    xSemaphoreGive(otaStreamLock);
+  }
+  if (subscriber == NULL) {
+    request->send(503, "text/plain", "Too many subscribers");
+    return;
+  }
+
+  AsyncWebServerResponse *response = request->beginChunkedResponse(
+      "text/event-stream", [subscriber](uint8_t *buffer, size_t maxLen, size_t /* index */) -> size_t {
+        return fillOTAStream(*subscriber, buffer, maxLen);
+      });
+  response->addHeader("Cache-Control", "no-cache");
+  request->onDisconnect([subscriber]() {
+    #ifdef OTA_DEBUG_ENABLED
+    Serial.printf("HTTP: Event stream closed after %u resyncs\n", subscriber->resyncs);
+    #endif
+    subscriber->isOpen = false;
+  });
+  request->send(response);
+  #else
+  request->send(404);
+  #endif
+}
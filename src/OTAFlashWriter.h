@@ -0,0 +1,514 @@
+/*
+  -----------------------
+  Double-Buffered OTA Flash Writer
+  -----------------------
+
+  Decouples the network receive path from flash erase/write.
+
+  Upload data arrives in the async_tcp task in TCP-segment-sized chunks.
+  Writing each chunk to flash from that task stalls TCP receive for the
+  whole sector erase. Instead, chunks are copied into a FreeRTOS stream
+  buffer (the ring) and a dedicated writer task pinned to its own core
+  drains it, coalescing the data into whole 4 KB sectors before erasing and
+  writing them to the inactive OTA partition.
+
+  The receive side only waits when the ring is full, which is counted as a
+  stall in the session statistics. Sessions fed from the async_tcp task
+  wait briefly at most; the upload handler holds back TCP acks while the
+  ring is nearly full (otaWriterSpace()) so the sender slows down instead.
+
+  Sector erase (tens of ms per 4 KB) costs far more than the write. While
+  less than a sector of data is waiting, the writer erases ahead of the
+  write cursor, up to OTA_PREERASE_SECTORS and never past the end of the
+  image (otaWriterSetImageSize()). While the size is unknown, it erases
+  only as far as the sector buffer and the ring can hold. Nothing is
+  erased before the first data arrives, so an image refused from its
+  header costs no erase. When the network is the bottleneck, every
+  sector is already erased by the time its data arrives. The stats split
+  erase time into inline (on the critical path) and ahead.
+
+  The writer also feeds each sector into a streaming SHA-256
+  (OTAImageHash.h), so otaWriterDigest() is available as soon as
+  otaWriterEnd() returns.
+
+  Usage (single producer):
+    otaWriterBegin(owner, imageSize); // imageSize may be 0 if unknown
+    otaWriterSetImageSize(size);     // optional, once the size is known
+    otaWriterWrite(data, len);       // repeatedly
+    otaWriterEnd();                  // flush and wait for the writer
+    otaWriterCommit();               // validate image and set boot partition
+  or otaWriterAbort() at any point. otaWriterSuspend() keeps every whole
+  sector already written, so an interrupted upload can later continue
+  with otaWriterBegin(owner, imageSize, offset).
+*/
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/stream_buffer.h>
+#include <freertos/semphr.h>
+#include <atomic>
+#include "OTAImageHash.h"
+
+// Flash sector size; erase granularity and the unit the writer coalesces to
+const size_t OTA_SECTOR_SIZE = 4096;
+
+// Ring between the receive path and the writer task. Large enough to absorb
+// several TCP windows while a sector erase is in progress.
+const size_t OTA_WRITER_RING_SIZE = 16 * 1024;
+
+// Writer task placement. WiFi and lwIP run on core 0, so the writer is
+// pinned to core 1 and runs above the Arduino loop task priority.
+const BaseType_t OTA_WRITER_CORE = 1;
+const UBaseType_t OTA_WRITER_PRIORITY = 5;
+const uint32_t OTA_WRITER_STACK_SIZE = 4096;
+
+// How long the receive path waits for ring space before failing the upload.
+// Sessions fed from the async_tcp task use the short wait, which still
+// covers a worst-case sector erase (~400 ms): every connection is held up
+// while that task waits.
+const TickType_t OTA_WRITER_SEND_TIMEOUT = pdMS_TO_TICKS(5000);
+const TickType_t OTA_WRITER_ASYNC_SEND_TIMEOUT = pdMS_TO_TICKS(500);
+
+// How long the writer waits for data before re-checking for end of input
+const TickType_t OTA_WRITER_RECEIVE_TIMEOUT = pdMS_TO_TICKS(20);
+
+// How far the writer erases ahead of the write cursor while idle
+const size_t OTA_PREERASE_SECTORS = 16;
+
+// Receives image data for the next pipeline stage; returns false to abort
+typedef bool (*OTASink)(const uint8_t *data, size_t len);
+
+struct OTAWriterStats {
+  size_t bytesWritten;      // Bytes written to the partition
+  uint32_t sectorsWritten;  // Sectors erased and written
+  uint32_t eraseMicros;     // Time spent erasing sectors right before writing
+  uint32_t preEraseMicros;  // Time spent erasing ahead while waiting for data
+  uint32_t sectorsPreErased;
+  uint32_t writeMicros;     // Time spent writing sectors
+  uint32_t stallCount;      // Receive calls that found the ring full
+  uint32_t stallMicros;     // Time the receive path spent waiting for space
+  unsigned long startMillis;
+  unsigned long endMillis;
+};
+
+OTAWriterStats otaWriterStats;
+
+const esp_partition_t *otaTargetPartition = NULL;
+StreamBufferHandle_t otaWriterRing = NULL;
+TaskHandle_t otaWriterTaskHandle = NULL;
+SemaphoreHandle_t otaWriterDone = NULL;
+
+// Shared between the receive path and the writer task
+volatile bool otaWriterInputDone = false;
+volatile bool otaWriterCancelled = false;
+volatile bool otaWriterSuspending = false;
+volatile esp_err_t otaWriterError = ESP_OK;
+
+// Partition offset up to which data is on flash (always sector aligned
+// while the session is running)
+volatile size_t otaWriteOffset = 0;
+
+// Partition offset up to which data has been queued by the receive path
+volatile size_t otaQueuedOffset = 0;
+
+// Ring wait of the current session, see OTA_WRITER_ASYNC_SEND_TIMEOUT
+TickType_t otaWriterSendTimeout = OTA_WRITER_SEND_TIMEOUT;
+
+// Partition offset up to which sectors are erased, and how far erasing
+// ahead may go (end of the image, or 0 if unknown)
+size_t otaEraseOffset = 0;
+volatile size_t otaEraseLimit = 0;
+
+// Writer task state
+uint8_t otaSectorBuffer[OTA_SECTOR_SIZE];
+size_t otaSectorFill = 0;
+
+// SHA-256 of everything written in the current session
+OTAImageHash otaWriterHash;
+
+// Kind of session holding the writer, so one kind never tears down
+// another's session (e.g. a new upload request aborting a running pull)
+enum OTAWriterOwner {
+  OTA_WRITER_IDLE,
+  OTA_WRITER_UPLOAD,   // HTTP uploads, block dedup and delta patches
+  OTA_WRITER_PULL      // Manifest pulls, including the peer relay fetch
+};
+
+// Claimed by compare-and-swap in otaWriterBegin(), since uploads
+// (async_tcp), pulls and multicast sessions (their own tasks) may try to
+// begin at the same time
+std::atomic<OTAWriterOwner> otaWriterOwner(OTA_WRITER_IDLE);
+
+// True between otaWriterBegin() and otaWriterEnd()/otaWriterAbort()
+std::atomic<bool> isOTAWriterActive(false);
+
+/**
+ * Erase and write one (possibly partial, final) sector at the write offset
+ */
+void otaWriterFlushSector() {
+  if (otaSectorFill == 0 || otaWriterError != ESP_OK) {
+    return;
+  }
+
+  if (otaWriteOffset + otaSectorFill > otaTargetPartition->size) {
+    otaWriterError = ESP_ERR_INVALID_SIZE;
+    return;
+  }
+
+  // Erase only if the idle time before didn't already
+  uint32_t t0 = micros();
+  esp_err_t err = ESP_OK;
+  if (otaWriteOffset >= otaEraseOffset) {
+    err = esp_partition_erase_range(otaTargetPartition, otaWriteOffset, OTA_SECTOR_SIZE);
+    otaEraseOffset = otaWriteOffset + OTA_SECTOR_SIZE;
+  }
+  uint32_t t1 = micros();
+  if (err == ESP_OK) {
+    err = esp_partition_write(otaTargetPartition, otaWriteOffset, otaSectorBuffer, otaSectorFill);
+  }
+  uint32_t t2 = micros();
+
+  otaWriterStats.eraseMicros += t1 - t0;
+  otaWriterStats.writeMicros += t2 - t1;
+
+  if (err != ESP_OK) {
+    otaWriterError = err;
+    return;
+  }
+
+  otaHashUpdate(otaWriterHash, otaSectorBuffer, otaSectorFill);
+  otaWriteOffset += otaSectorFill;
+  otaWriterStats.bytesWritten += otaSectorFill;
+  otaWriterStats.sectorsWritten++;
+  otaSectorFill = 0;
+}
+
+/**
+ * Erase the next sector ahead of the write cursor, if the window allows
+ *
+ * Returns false when there is nothing left to erase ahead.
+ */
+bool otaWriterPreErase() {
+  // With the size unknown, only as far as the sector buffer and the ring
+  // can hold, so a small image isn't followed by sectors it never uses
+  size_t limit = otaEraseLimit != 0 ? (size_t)otaEraseLimit : otaTargetPartition->size;
+  size_t reach = otaEraseLimit != 0 ? OTA_PREERASE_SECTORS * OTA_SECTOR_SIZE : OTA_SECTOR_SIZE + OTA_WRITER_RING_SIZE;
+  size_t window = min(limit, otaWriteOffset + reach);
+  if (otaEraseOffset >= window || otaWriterInputDone || otaWriterError != ESP_OK) {
+    return false;
+  }
+  // Not before the first data: the image check may still refuse the header
+  if (otaWriterStats.bytesWritten == 0 && otaSectorFill == 0 && xStreamBufferIsEmpty(otaWriterRing)) {
+    return false;
+  }
+
+  uint32_t t0 = micros();
+  esp_err_t err = esp_partition_erase_range(otaTargetPartition, otaEraseOffset, OTA_SECTOR_SIZE);
+  otaWriterStats.preEraseMicros += micros() - t0;
+  if (err != ESP_OK) {
+    otaWriterError = err;
+    return false;
+  }
+  otaEraseOffset += OTA_SECTOR_SIZE;
+  otaWriterStats.sectorsPreErased++;
+  return true;
+}
+
+/**
+ * Writer task: drain the ring into sector-sized flash writes
+ */
+void otaWriterTask(void * /* param */) {
+  for (;;) {
+    // Use the time until the next sector is complete to erase ahead; poll
+    // the ring instead of waiting while there is erasing left to do
+    TickType_t wait = OTA_WRITER_RECEIVE_TIMEOUT;
+    if (otaSectorFill + xStreamBufferBytesAvailable(otaWriterRing) < OTA_SECTOR_SIZE &&
+        !otaWriterCancelled && otaWriterPreErase()) {
+      wait = 0;
+    }
+
+    size_t n = xStreamBufferReceive(otaWriterRing, otaSectorBuffer + otaSectorFill,
+                                    OTA_SECTOR_SIZE - otaSectorFill, wait);
+    otaSectorFill += n;
+
+    // Stop on cancel or on a flash error; the receive path sees the error
+    if (otaWriterCancelled || otaWriterError != ESP_OK) {
+      break;
+    }
+    if (otaSectorFill == OTA_SECTOR_SIZE) {
+      otaWriterFlushSector();
+    } else if (n == 0 && otaWriterInputDone && xStreamBufferIsEmpty(otaWriterRing)) {
+      // Input finished and ring drained: write the final partial sector,
+      // unless suspending, where only whole sectors are kept
+      if (!otaWriterSuspending) {
+        otaWriterFlushSector();
+      }
+      break;
+    }
+  }
+
+  xSemaphoreGive(otaWriterDone);
+  vTaskDelete(NULL);
+}
+
+/**
+ * Release the ring, task and semaphore of the current session
+ */
+void otaWriterRelease() {
+  if (otaWriterRing != NULL) {
+    vStreamBufferDelete(otaWriterRing);
+    otaWriterRing = NULL;
+  }
+  if (otaWriterDone != NULL) {
+    vSemaphoreDelete(otaWriterDone);
+    otaWriterDone = NULL;
+  }
+  otaWriterTaskHandle = NULL;
+  otaHashRelease(otaWriterHash);
+  otaQueuedOffset = otaWriteOffset;
+  isOTAWriterActive = false;
+  otaWriterOwner = OTA_WRITER_IDLE;
+}
+
+/**
+ * Feed the part of the image already on flash into the hash (resume)
+ */
+bool otaWriterRehash(size_t length) {
+  for (size_t offset = 0; offset < length; offset += OTA_SECTOR_SIZE) {
+    size_t n = min(OTA_SECTOR_SIZE, length - offset);
+    if (esp_partition_read(otaTargetPartition, offset, otaSectorBuffer, n) != ESP_OK) {
+      return false;
+    }
+    otaHashUpdate(otaWriterHash, otaSectorBuffer, n);
+  }
+  return true;
+}
+
+/**
+ * Bound erasing ahead to an image of size bytes (0: unknown)
+ *
+ * May be called during the session, e.g. once the upload's length is in.
+ */
+void otaWriterSetImageSize(size_t size) {
+  if (otaTargetPartition == NULL) {
+    return;
+  }
+  size_t end = (size + OTA_SECTOR_SIZE - 1) / OTA_SECTOR_SIZE * OTA_SECTOR_SIZE;
+  otaEraseLimit = end > otaTargetPartition->size ? otaTargetPartition->size : end;
+}
+
+/**
+ * Start a write session to the inactive OTA partition
+ *
+ * owner says which kind of session holds the writer until it is released.
+ * imageSize is used to reject images that cannot fit; pass 0 if unknown.
+ * startOffset continues a suspended session; it must be sector aligned and
+ * everything before it must already be on flash. sendTimeout bounds how
+ * long otaWriterWrite() waits for ring space.
+ *
+ * Returns false if another session holds the writer; of several callers
+ * racing for it, exactly one wins.
+ */
+bool otaWriterBegin(OTAWriterOwner owner, size_t imageSize, size_t startOffset = 0,
+                    TickType_t sendTimeout = OTA_WRITER_SEND_TIMEOUT) {
+  OTAWriterOwner idle = OTA_WRITER_IDLE;
+  if (!otaWriterOwner.compare_exchange_strong(idle, owner)) {
+    return false;
+  }
+  isOTAWriterActive = true;
+
+  otaTargetPartition = esp_ota_get_next_update_partition(NULL);
+  if (otaTargetPartition == NULL || imageSize > otaTargetPartition->size ||
+      startOffset % OTA_SECTOR_SIZE != 0 || startOffset > otaTargetPartition->size) {
+    otaWriterRelease();
+    return false;
+  }
+
+  otaWriterRing = xStreamBufferCreate(OTA_WRITER_RING_SIZE, 1);
+  otaWriterDone = xSemaphoreCreateBinary();
+  if (otaWriterRing == NULL || otaWriterDone == NULL) {
+    otaWriterRelease();
+    return false;
+  }
+
+  memset(&otaWriterStats, 0, sizeof(otaWriterStats));
+  otaWriterStats.startMillis = millis();
+  otaSectorFill = 0;
+  otaWriteOffset = startOffset;
+  otaQueuedOffset = startOffset;
+  otaEraseOffset = startOffset;
+  otaWriterSendTimeout = sendTimeout;
+  otaWriterSetImageSize(imageSize);
+  otaWriterInputDone = false;
+  otaWriterCancelled = false;
+  otaWriterSuspending = false;
+  otaWriterError = ESP_OK;
+
+  otaHashBegin(otaWriterHash);
+  if (!otaWriterRehash(startOffset)) {
+    otaWriterRelease();
+    return false;
+  }
+
+  if (xTaskCreatePinnedToCore(otaWriterTask, "ota_writer", OTA_WRITER_STACK_SIZE, NULL,
+                              OTA_WRITER_PRIORITY, &otaWriterTaskHandle, OTA_WRITER_CORE) != pdPASS) {
+    otaWriterRelease();
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Queue upload data for the writer (receive path)
+ *
+ * Blocks only while the ring is full. Returns the number of bytes queued,
+ * which is less than len if the writer failed or made no room within the
+ * session's send timeout.
+ */
+size_t otaWriterWrite(const uint8_t *data, size_t len) {
+  if (!isOTAWriterActive || otaWriterError != ESP_OK) {
+    return 0;
+  }
+
+  bool stalled = xStreamBufferSpacesAvailable(otaWriterRing) < len;
+  uint32_t t0 = micros();
+
+  size_t queued = 0;
+  while (queued < len && otaWriterError == ESP_OK) {
+    size_t n = xStreamBufferSend(otaWriterRing, data + queued, len - queued, otaWriterSendTimeout);
+    if (n == 0) {
+      break; // Writer stuck for the whole timeout
+    }
+    queued += n;
+  }
+  otaQueuedOffset += queued;
+
+  if (stalled) {
+    otaWriterStats.stallCount++;
+    otaWriterStats.stallMicros += micros() - t0;
+  }
+  return queued;
+}
+
+/**
+ * Room left for queuing without waiting, counting the sector the writer is
+ * assembling as used
+ *
+ * Only reads counters, so it may be called from any task, also while a
+ * session ends; without a session the whole ring is free.
+ */
+size_t otaWriterSpace() {
+  size_t backlog = otaQueuedOffset - otaWriteOffset;
+  return backlog < OTA_WRITER_RING_SIZE ? OTA_WRITER_RING_SIZE - backlog : 0;
+}
+
+/**
+ * OTASink adapter for pipeline stages that feed the writer
+ */
+bool otaWriterSink(const uint8_t *data, size_t len) {
+  return otaWriterWrite(data, len) == len;
+}
+
+/**
+ * Finish the session: flush remaining data and wait for the writer task
+ *
+ * Returns true if every queued byte reached flash.
+ */
+bool otaWriterEnd() {
+  if (!isOTAWriterActive) {
+    return false;
+  }
+
+  otaWriterInputDone = true;
+  xSemaphoreTake(otaWriterDone, portMAX_DELAY);
+  otaWriterStats.endMillis = millis();
+  otaHashFinish(otaWriterHash);
+
+  bool ok = (otaWriterError == ESP_OK);
+  otaWriterRelease();
+  return ok;
+}
+
+/**
+ * Stop the session but keep the whole sectors written so far
+ *
+ * Data that doesn't fill a sector is dropped. Returns the offset from which
+ * the upload has to continue, or 0 if nothing usable was written.
+ */
+size_t otaWriterSuspend() {
+  if (!isOTAWriterActive) {
+    return 0;
+  }
+
+  otaWriterSuspending = true;
+  otaWriterInputDone = true;
+  xSemaphoreTake(otaWriterDone, portMAX_DELAY);
+  otaWriterStats.endMillis = millis();
+
+  size_t offset = (otaWriterError == ESP_OK) ? otaWriteOffset : 0;
+  otaWriterRelease();
+  return offset;
+}
+
+/**
+ * Cancel the session and discard anything not yet written
+ */
+void otaWriterAbort() {
+  if (!isOTAWriterActive) {
+    return;
+  }
+
+  otaWriterCancelled = true;
+  xSemaphoreTake(otaWriterDone, portMAX_DELAY);
+  otaWriterStats.endMillis = millis();
+  otaWriterRelease();
+}
+
+/**
+ * Validate the written image and make it the boot partition
+ *
+ * esp_ota_set_boot_partition() verifies the image header, segments and
+ * checksum before switching, so a corrupt image is never booted.
+ */
+bool otaWriterCommit() {
+  if (otaTargetPartition == NULL) {
+    return false;
+  }
+  otaWriterError = esp_ota_set_boot_partition(otaTargetPartition);
+  return otaWriterError == ESP_OK;
+}
+
+/**
+ * SHA-256 of the image written in the last completed session
+ */
+const uint8_t *otaWriterDigest() {
+  return otaWriterHash.digest;
+}
+
+/**
+ * Print throughput and stall statistics of the last session
+ */
+void printOTAWriterStats() {
+  unsigned long elapsed = otaWriterStats.endMillis - otaWriterStats.startMillis;
+  float seconds = elapsed / 1000.0f;
+  float mbps = seconds > 0 ? (otaWriterStats.bytesWritten / 1048576.0f) / seconds : 0;
+
+  Serial.printf("OTA: Wrote %u bytes (%lu sectors) in %lu ms, %.2f MB/s\n",
+                otaWriterStats.bytesWritten, (unsigned long)otaWriterStats.sectorsWritten,
+                elapsed, mbps);
+  Serial.printf("OTA: Erase %lu ms inline + %lu ms ahead (%lu of %lu sectors), write %lu ms, "
+                "%lu receive stalls (%lu ms)\n",
+                (unsigned long)(otaWriterStats.eraseMicros / 1000),
+                (unsigned long)(otaWriterStats.preEraseMicros / 1000),
+                (unsigned long)otaWriterStats.sectorsPreErased,
+                (unsigned long)otaWriterStats.sectorsWritten,
+                (unsigned long)(otaWriterStats.writeMicros / 1000),
+                (unsigned long)otaWriterStats.stallCount,
+                (unsigned long)(otaWriterStats.stallMicros / 1000));
+
+  float hashMB = otaWriterHash.bytes / 1048576.0f;
+  Serial.printf("OTA: SHA-256 over %u bytes took %lu ms (%.1f ms/MB)\n",
+                otaWriterHash.bytes, (unsigned long)(otaWriterHash.micros / 1000),
+                hashMB > 0 ? otaWriterHash.micros / 1000.0f / hashMB : 0);
+}
@@ -0,0 +1,259 @@
+/*
+  -----------------------
+  Early Image Validation
+  -----------------------
+
+  Checks the firmware image as it streams in, so that a wrong file is
+  refused after its first bytes instead of after a full transfer and a
+  failed esp_ota_set_boot_partition().
+
+  From the first 36 bytes (image header, first segment header and the
+  start of the app description) it checks:
+  - the image magic and segment count
+  - that the image was built for this chip (and chip revision)
+  - that it is an application, not e.g. a bootloader or a merged
+    factory image
+  The remaining segment headers are checked as they pass by. Once the
+  last one has been seen, the exact image length is known: a longer
+  image is refused right away, a stream that ends early is reported as
+  truncated, and the writer stops erasing ahead at the image's end, also
+  for uploads whose size wasn't known (chunked or gzip).
+
+  The writer starts erasing ahead once the first data reaches it, which
+  the check has passed by then. A header error found in the first
+  segment therefore costs no erase, and a later refusal at most the
+  sectors up to where erasing ahead had got.
+*/
+
+// Sizes of the on-flash structures (esp_image_format.h, esp_app_format.h)
+const size_t ESP_IMAGE_HEADER_SIZE = 24;
+const size_t ESP_SEGMENT_HEADER_SIZE = 8;
+const uint8_t ESP_IMAGE_MAGIC = 0xE9;
+const uint32_t ESP_APP_DESC_MAGIC = 0xABCD5432;
+const uint8_t ESP_IMAGE_SEGMENTS_MAX = 16;
+
+// Bytes needed before the header can be checked
+const size_t OTA_IMAGE_CHECK_PREFIX = ESP_IMAGE_HEADER_SIZE + ESP_SEGMENT_HEADER_SIZE + 4;
+
+enum OTAImageError {
+  OTA_IMAGE_OK,
+  OTA_IMAGE_BAD_MAGIC,
+  OTA_IMAGE_BAD_SEGMENT_COUNT,
+  OTA_IMAGE_WRONG_CHIP,
+  OTA_IMAGE_CHIP_REVISION,
+  OTA_IMAGE_NOT_APP,
+  OTA_IMAGE_BAD_SEGMENT,
+  OTA_IMAGE_TOO_LARGE,
+  OTA_IMAGE_TRAILING_DATA,
+  OTA_IMAGE_TRUNCATED
+};
+
+enum OTAImageCheckStage {
+  IMAGE_CHECK_PREFIX,    // Collecting the first OTA_IMAGE_CHECK_PREFIX bytes
+  IMAGE_CHECK_SEGMENTS,  // Skipping segment data, checking segment headers
+  IMAGE_CHECK_TRAILER    // Past the last segment, image length known
+};
+
+struct OTAImageCheck {
+  bool isEnabled;
+  OTAImageError error;
+  OTAImageCheckStage stage;
+  size_t position;          // Image bytes seen so far
+  size_t limit;             // Space available in the target partition
+  uint8_t prefix[OTA_IMAGE_CHECK_PREFIX];
+  uint8_t segmentHeader[ESP_SEGMENT_HEADER_SIZE];
+  size_t fill;              // Bytes collected into prefix/segmentHeader
+  uint8_t segmentCount;
+  uint8_t segmentsSeen;
+  size_t nextSegment;       // Offset of the next segment header
+  bool hasAppendedHash;
+  size_t imageLength;       // Valid in IMAGE_CHECK_TRAILER
+};
+
+OTAImageCheck otaImageCheck;
+
+/**
+ * Describe a validation error for the client
+ */
+const char *otaImageErrorString(OTAImageError error) {
+  switch (error) {
+    case OTA_IMAGE_OK:                return "OK";
+    case OTA_IMAGE_BAD_MAGIC:         return "Not an ESP firmware image";
+    case OTA_IMAGE_BAD_SEGMENT_COUNT: return "Image header corrupt (segment count)";
+    case OTA_IMAGE_WRONG_CHIP:        return "Image built for a different chip";
+    case OTA_IMAGE_CHIP_REVISION:     return "Image requires a newer chip revision";
+    case OTA_IMAGE_NOT_APP:           return "Image is not an application (bootloader or merged image?)";
+    case OTA_IMAGE_BAD_SEGMENT:       return "Image segment table corrupt";
+    case OTA_IMAGE_TOO_LARGE:         return "Image larger than the OTA partition";
+    case OTA_IMAGE_TRAILING_DATA:     return "Data after the end of the image";
+    case OTA_IMAGE_TRUNCATED:         return "Image truncated";
+  }
+  return "Image invalid";
+}
+
+uint32_t readLE32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * Start checking a new image for a partition of partitionSize bytes
+ */
+void otaImageCheckBegin(size_t partitionSize) {
+  memset(&otaImageCheck, 0, sizeof(otaImageCheck));
+  otaImageCheck.isEnabled = true;
+  otaImageCheck.limit = partitionSize;
+}
+
+/**
+ * Skip checking, e.g. when a resumed upload starts past the header
+ */
+void otaImageCheckDisable() {
+  otaImageCheck.isEnabled = false;
+  otaImageCheck.error = OTA_IMAGE_OK;
+}
+
+/**
+ * Check image header, chip and app description once the prefix is in
+ */
+OTAImageError otaImageCheckPrefix() {
+  const uint8_t *h = otaImageCheck.prefix;
+  if (h[0] != ESP_IMAGE_MAGIC) {
+    return OTA_IMAGE_BAD_MAGIC;
+  }
+  otaImageCheck.segmentCount = h[1];
+  if (otaImageCheck.segmentCount == 0 || otaImageCheck.segmentCount > ESP_IMAGE_SEGMENTS_MAX) {
+    return OTA_IMAGE_BAD_SEGMENT_COUNT;
+  }
+  uint16_t chipId = h[12] | (h[13] << 8);
+  if (chipId != CONFIG_IDF_FIRMWARE_CHIP_ID) {
+    return OTA_IMAGE_WRONG_CHIP;
+  }
+  if (h[14] > ESP.getChipRevision()) {
+    return OTA_IMAGE_CHIP_REVISION;
+  }
+  otaImageCheck.hasAppendedHash = h[23] == 1;
+
+  // Applications start their first segment with the app description
+  if (readLE32(h + ESP_IMAGE_HEADER_SIZE + ESP_SEGMENT_HEADER_SIZE) != ESP_APP_DESC_MAGIC) {
+    return OTA_IMAGE_NOT_APP;
+  }
+
+  // The first segment header is part of the prefix
+  memcpy(otaImageCheck.segmentHeader, h + ESP_IMAGE_HEADER_SIZE, ESP_SEGMENT_HEADER_SIZE);
+  otaImageCheck.nextSegment = ESP_IMAGE_HEADER_SIZE;
+  return OTA_IMAGE_OK;
+}
+
+/**
+ * Account for the segment header in otaImageCheck.segmentHeader
+ */
+OTAImageError otaImageCheckSegment() {
+  uint32_t length = readLE32(otaImageCheck.segmentHeader + 4);
+  if (length % 4 != 0) {
+    return OTA_IMAGE_BAD_SEGMENT;
+  }
+  if (length > otaImageCheck.limit) {
+    return OTA_IMAGE_TOO_LARGE;
+  }
+  otaImageCheck.nextSegment += ESP_SEGMENT_HEADER_SIZE + length;
+  otaImageCheck.segmentsSeen++;
+  if (otaImageCheck.nextSegment > otaImageCheck.limit) {
+    return OTA_IMAGE_TOO_LARGE;
+  }
+
+  if (otaImageCheck.segmentsSeen == otaImageCheck.segmentCount) {
+    // Checksum byte padded to 16 bytes, then the optional SHA-256
+    otaImageCheck.imageLength = (otaImageCheck.nextSegment + 16) & ~(size_t)15;
+    if (otaImageCheck.hasAppendedHash) {
+      otaImageCheck.imageLength += 32;
+    }
+    if (otaImageCheck.imageLength > otaImageCheck.limit) {
+      return OTA_IMAGE_TOO_LARGE;
+    }
+    otaWriterSetImageSize(otaImageCheck.imageLength);
+  }
+  return OTA_IMAGE_OK;
+}
+
+/**
+ * Check the next piece of the image stream
+ *
+ * Returns false as soon as the image is known to be invalid; the reason
+ * is left in otaImageCheck.error.
+ */
+bool otaImageCheckWrite(const uint8_t *data, size_t len) {
+  if (!otaImageCheck.isEnabled) {
+    return true;
+  }
+
+  while (len > 0 && otaImageCheck.error == OTA_IMAGE_OK) {
+    // Bytes taken by this stage; the trailer takes the rest
+    size_t n = len;
+    switch (otaImageCheck.stage) {
+      case IMAGE_CHECK_PREFIX:
+        n = min(len, OTA_IMAGE_CHECK_PREFIX - otaImageCheck.fill);
+        memcpy(otaImageCheck.prefix + otaImageCheck.fill, data, n);
+        otaImageCheck.fill += n;
+        if (otaImageCheck.fill == OTA_IMAGE_CHECK_PREFIX) {
+          otaImageCheck.error = otaImageCheckPrefix();
+          if (otaImageCheck.error == OTA_IMAGE_OK) {
+            otaImageCheck.error = otaImageCheckSegment();
+          }
+          otaImageCheck.fill = 0;
+          otaImageCheck.stage = otaImageCheck.segmentsSeen == otaImageCheck.segmentCount ?
+                                IMAGE_CHECK_TRAILER : IMAGE_CHECK_SEGMENTS;
+        }
+        break;
+
+      case IMAGE_CHECK_SEGMENTS:
+        if (otaImageCheck.position < otaImageCheck.nextSegment) {
+          // Segment data
+          n = min(len, otaImageCheck.nextSegment - otaImageCheck.position);
+        } else {
+          n = min(len, ESP_SEGMENT_HEADER_SIZE - otaImageCheck.fill);
+          memcpy(otaImageCheck.segmentHeader + otaImageCheck.fill, data, n);
+          otaImageCheck.fill += n;
+          if (otaImageCheck.fill == ESP_SEGMENT_HEADER_SIZE) {
+            otaImageCheck.error = otaImageCheckSegment();
+            otaImageCheck.fill = 0;
+            if (otaImageCheck.segmentsSeen == otaImageCheck.segmentCount) {
+              otaImageCheck.stage = IMAGE_CHECK_TRAILER;
+            }
+          }
+        }
+        break;
+
+      case IMAGE_CHECK_TRAILER:
+        if (otaImageCheck.position + n > otaImageCheck.imageLength) {
+          otaImageCheck.error = OTA_IMAGE_TRAILING_DATA;
+        }
+        break;
+    }
+
+    otaImageCheck.position += n;
+    data += n;
+    len -= n;
+  }
+
+  return otaImageCheck.error == OTA_IMAGE_OK;
+}
+
+/**
+ * Check that the stream contained the whole image
+ */
+bool otaImageCheckEnd() {
+  if (!otaImageCheck.isEnabled || otaImageCheck.error != OTA_IMAGE_OK) {
+    return otaImageCheck.error == OTA_IMAGE_OK;
+  }
+  if (otaImageCheck.stage != IMAGE_CHECK_TRAILER || otaImageCheck.position < otaImageCheck.imageLength) {
+    otaImageCheck.error = OTA_IMAGE_TRUNCATED;
+  }
+  return otaImageCheck.error == OTA_IMAGE_OK;
+}
+
+/**
+ * OTASink that checks the image before passing it to the flash writer
+ */
+bool otaCheckedWriterSink(const uint8_t *data, size_t len) {
+  return otaImageCheckWrite(data, len) && otaWriterSink(data, len);
+}
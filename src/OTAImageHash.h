@@ -0,0 +1,83 @@
+/*
+  -----------------------
+  Streaming Image Hash
+  -----------------------
+
+  SHA-256 of the firmware image, computed incrementally by the flash writer
+  as each sector is written. The digest is ready the moment the last sector
+  lands, so verifying an upload needs no separate read-back pass.
+
+  On the ESP32-S3, mbedTLS routes SHA-256 to the SHA peripheral. If the
+  peripheral is already busy (e.g. a TLS session is hashing at the same
+  time), IDF transparently falls back to its software implementation for
+  this context. The time spent hashing is tracked so both cases show up in
+  the per-session statistics.
+*/
+#include <mbedtls/sha256.h>
+
+const size_t OTA_SHA256_SIZE = 32;
+
+struct OTAImageHash {
+  mbedtls_sha256_context ctx;
+  uint8_t digest[OTA_SHA256_SIZE];
+  uint32_t micros;   // Time spent hashing
+  size_t bytes;      // Bytes hashed
+  bool isActive;
+};
+
+void otaHashBegin(OTAImageHash &hash) {
+  mbedtls_sha256_init(&hash.ctx);
+  mbedtls_sha256_starts_ret(&hash.ctx, 0);
+  hash.micros = 0;
+  hash.bytes = 0;
+  hash.isActive = true;
+}
+
+void otaHashUpdate(OTAImageHash &hash, const uint8_t *data, size_t len) {
+  uint32_t t0 = micros();
+  mbedtls_sha256_update_ret(&hash.ctx, data, len);
+  hash.micros += micros() - t0;
+  hash.bytes += len;
+}
+
+/**
+ * Finalize the digest into hash.digest and release the context
+ */
+void otaHashFinish(OTAImageHash &hash) {
+  if (!hash.isActive) {
+    return;
+  }
+  uint32_t t0 = micros();
+  mbedtls_sha256_finish_ret(&hash.ctx, hash.digest);
+  hash.micros += micros() - t0;
+  mbedtls_sha256_free(&hash.ctx);
+  hash.isActive = false;
+}
+
+/**
+ * Release the context without producing a digest (aborted sessions)
+ */
+void otaHashRelease(OTAImageHash &hash) {
+  if (hash.isActive) {
+    mbedtls_sha256_free(&hash.ctx);
+    hash.isActive = false;
+  }
+}
+
+/**
+ * Parse a 64-character hex SHA-256 digest
+ */
+bool parseSHA256Hex(const String &hex, uint8_t *out) {
+  if (hex.length() != OTA_SHA256_SIZE * 2) {
+    return false;
+  }
+  for (size_t i = 0; i < OTA_SHA256_SIZE; i++) {
+    char byte[3] = { hex[i * 2], hex[i * 2 + 1], 0 };
+    char *end;
+    out[i] = (uint8_t)strtoul(byte, &end, 16);
+    if (*end != 0) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,790 @@
+/*
+  -----------------------
+  Multicast Fleet Updates
+  -----------------------
+
+  Uploading one image to many devices over HTTP sends it once per device,
+  and the AP saturates long before the fleet is done. In multicast mode
+  every device listens on one UDP group and the sender
+  (tools/ota_multicast.py) sends the image once for all of them.
+
+  The image is cut into groups of k symbols. Each group is sent as its k
+  source symbols plus a few repair symbols of a Reed-Solomon erasure code
+  (ErasureCode.h), and any k symbols of a group rebuild it. A device that
+  lost no more packets of a group than there were repair symbols never
+  talks back. At the end of each round the sender asks who is still short
+  (ROUND_END). Only devices with a group they can't decode answer, with a
+  unicast NACK saying how many symbols each such group lacks. The next
+  round sends that many fresh repair symbols for the group, which serve
+  every device missing any of that group's packets at once.
+
+  Packets (little endian, 20-byte header):
+    magic "OTM1", type u8, groupSymbols u8, symbolSize u16, session u32,
+    imageSize u32, group u16, index u8, k u8, payload
+  ANNOUNCE carries the image SHA-256, SYMBOL carries one symbol (index < k
+  is a source, index >= k a repair symbol), ROUND_END carries the round
+  number in group, and NACK carries (group u16, missing u8) entries.
+
+  Groups are sector aligned. A source symbol is written straight to its
+  place in the inactive partition as soon as it arrives, so any number of
+  groups can be incomplete at once and nothing but a bitmap per group is
+  kept for them. Only repair symbols are held in RAM, in a pool of two
+  groups' worth of symbols (at least OTA_MULTICAST_SPARE_BUFFERS more than
+  one group) shared with sources waiting for flash. Once a group has k
+  symbols, the flash task reads its sources back, takes them out of the
+  repair symbols and solves for the missing ones.
+  A NACK only names the groups whose repair symbols fit in the pool
+  together, those already holding some first; the rest are asked for
+  once those are done. When the pool is full anyway, a repair symbol of
+  a group that wasn't asked for, or else of the one missing the most, is
+  given up, and that group's NACK counts it as missing again.
+  Writes don't go through the streaming flash writer, and the flash task
+  erases ahead while idle. Once every group is written, the partition is
+  read back and hashed, and the image is only booted if the SHA-256
+  matches the announcement.
+
+  Enable with -DOTA_MULTICAST_GROUP=\"239.255.0.1\" (and optionally
+  -DOTA_MULTICAST_PORT=5007) in build_flags. The device listens whenever
+  the station link is up; uploads and pulls are refused while a multicast
+  session is running and vice versa.
+*/
+#include <AsyncUDP.h>
+#include "ErasureCode.h"
+
+#ifndef OTA_MULTICAST_GROUP
+#define OTA_MULTICAST_GROUP ""
+#endif
+
+#ifndef OTA_MULTICAST_PORT
+#define OTA_MULTICAST_PORT 5007
+#endif
+
+const uint32_t OTA_MULTICAST_MAGIC = 0x314D544F;  // "OTM1"
+
+// Largest symbol accepted; a symbol plus headers must fit one frame
+const uint16_t OTA_MULTICAST_SYMBOL_MAX = 1440;
+
+// Fewest symbol buffers beyond one group's worth, for sources waiting
+// to be written and repair symbols of other groups
+const uint8_t OTA_MULTICAST_SPARE_BUFFERS = 32;
+const uint8_t OTA_MULTICAST_BUFFERS_MAX = 2 * FEC_MAX_SYMBOLS;
+
+// A session that goes quiet this long is abandoned
+const unsigned long OTA_MULTICAST_IDLE_MS = 60000;
+
+// NACK entries per packet (3 bytes each)
+const size_t OTA_MULTICAST_NACK_ENTRIES = 400;
+
+// Flash task placement, next to the flash writer's
+const BaseType_t OTA_MULTICAST_CORE = 1;
+const UBaseType_t OTA_MULTICAST_PRIORITY = 5;
+const uint32_t OTA_MULTICAST_STACK_SIZE = 4096;
+
+// How long the flash task waits for a symbol before erasing ahead
+const TickType_t OTA_MULTICAST_WAIT = pdMS_TO_TICKS(20);
+
+
+enum OTAMulticastPacketType {
+  MCAST_ANNOUNCE = 1,   // Session parameters and image SHA-256
+  MCAST_SYMBOL = 2,     // One symbol of a group
+  MCAST_ROUND_END = 3,  // Sender collects NACKs now
+  MCAST_DONE = 4,       // Sender stopped
+  MCAST_NACK = 16       // Device to sender: groups it can't decode
+};
+
+struct __attribute__((packed)) OTAMulticastHeader {
+  uint32_t magic;
+  uint8_t type;
+  uint8_t groupSymbols;  // Symbols per group (the last one may have fewer)
+  uint16_t symbolSize;
+  uint32_t session;
+  uint32_t imageSize;
+  uint16_t group;
+  uint8_t index;
+  uint8_t k;             // Source symbols in this group
+};
+
+enum OTAMulticastBufferState {
+  MCAST_BUFFER_FREE,
+  MCAST_BUFFER_SOURCE,  // Queued for writing, owned by the flash task
+  MCAST_BUFFER_REPAIR   // Held until its group can be decoded
+};
+
+// One symbol buffered between the receive path and the flash task
+struct OTAMulticastBuffer {
+  volatile OTAMulticastBufferState state;
+  uint16_t group;
+  uint8_t index;
+};
+
+enum OTAMulticastJobType {
+  MCAST_JOB_WRITE,   // Write the source symbol in a buffer
+  MCAST_JOB_DECODE,  // Rebuild the missing sources of a group
+  MCAST_JOB_CANCEL   // Stop the flash task
+};
+
+struct OTAMulticastJob {
+  uint8_t type;
+  uint8_t buffer;
+  uint16_t group;
+};
+
+// Every buffer can be queued for writing, and every group holding a
+// repair symbol for decoding, plus a cancel
+const UBaseType_t OTA_MULTICAST_QUEUE_LENGTH = 2 * OTA_MULTICAST_BUFFERS_MAX + 1;
+
+enum OTAMulticastResult {
+  MCAST_RESULT_NONE,
+  MCAST_RESULT_DONE,    // Image written and committed
+  MCAST_RESULT_FAILED
+};
+
+struct OTAMulticastSession {
+  volatile bool isActive;
+  bool isCancelled;
+  uint32_t id;
+  size_t imageSize;
+  uint16_t symbolSize;
+  uint8_t groupSymbols;
+  size_t groupBytes;
+  uint16_t groupCount;
+  uint8_t sha256[OTA_SHA256_SIZE];
+  const esp_partition_t *partition;
+  uint8_t bufferCount;
+  uint8_t *symbols;       // bufferCount symbols, then the flash task's scratch
+  uint64_t *sourceSeen;   // Per group, bitmap of the sources received
+  uint8_t *groupHave;     // Per group, sources received plus repair symbols held
+  uint8_t *groupWritten;  // Per group, sources on flash (flash task only)
+  uint8_t *groupErased;   // Bitmap of groups erased (flash task only)
+  uint8_t *groupAsked;    // Bitmap of groups named in the last NACK
+  volatile uint16_t groupsDone;
+  volatile unsigned long lastPacketMillis;
+  unsigned long startMillis;
+  int32_t nackRound;     // Round last answered; ROUND_END is repeated
+  String error;
+
+  // Statistics
+  uint32_t packets;
+  uint32_t duplicates;
+  uint32_t dropped;      // No free buffer
+  uint32_t evicted;      // Repair symbols given up for another group
+  uint32_t repairsUsed;
+  uint32_t nacksSent;
+};
+
+AsyncUDP otaMulticastUdp;
+bool isOTAMulticastListening = false;
+
+OTAMulticastSession otaMulticast;
+OTAMulticastBuffer otaMulticastBuffers[OTA_MULTICAST_BUFFERS_MAX];
+volatile OTAMulticastResult otaMulticastResult = MCAST_RESULT_NONE;
+
+// Session last joined or refused, so its announcements are ignored
+uint32_t otaMulticastSeenSession = 0;
+bool hasSeenMulticastSession = false;
+
+// Held while a packet is handled and while the flash task releases
+// buffers or the session
+SemaphoreHandle_t otaMulticastLock = NULL;
+QueueHandle_t otaMulticastQueue = NULL;
+
+// Reply buffer for NACKs, only used under otaMulticastLock
+uint8_t otaMulticastNack[sizeof(OTAMulticastHeader) + OTA_MULTICAST_NACK_ENTRIES * 3];
+
+/**
+ * Whether a multicast session owns the inactive partition
+ */
+bool isOTAMulticastReceiving() {
+  return otaMulticast.isActive;
+}
+
+bool isOTAMulticastBitSet(const uint8_t *bitmap, size_t i) {
+  return bitmap[i / 8] & (1 << (i % 8));
+}
+
+void setOTAMulticastBit(uint8_t *bitmap, size_t i) {
+  bitmap[i / 8] |= 1 << (i % 8);
+}
+
+/**
+ * Source symbols in a group; only the last group can be short
+ */
+uint8_t otaMulticastGroupK(uint16_t group) {
+  size_t left = otaMulticast.imageSize - group * otaMulticast.groupBytes;
+  size_t symbols = (left + otaMulticast.symbolSize - 1) / otaMulticast.symbolSize;
+  return min(symbols, (size_t)otaMulticast.groupSymbols);
+}
+
+size_t otaMulticastGroupLength(uint16_t group) {
+  return min(otaMulticast.groupBytes, otaMulticast.imageSize - group * otaMulticast.groupBytes);
+}
+
+/**
+ * Free the session's buffers; the flash task has stopped
+ */
+void releaseOTAMulticast() {
+  for (uint8_t i = 0; i < OTA_MULTICAST_BUFFERS_MAX; i++) {
+    otaMulticastBuffers[i].state = MCAST_BUFFER_FREE;
+  }
+  free(otaMulticast.symbols);
+  free(otaMulticast.sourceSeen);
+  free(otaMulticast.groupHave);
+  free(otaMulticast.groupWritten);
+  free(otaMulticast.groupErased);
+  free(otaMulticast.groupAsked);
+  otaMulticast.symbols = NULL;
+  otaMulticast.sourceSeen = NULL;
+  otaMulticast.groupHave = NULL;
+  otaMulticast.groupWritten = NULL;
+  otaMulticast.groupErased = NULL;
+  otaMulticast.groupAsked = NULL;
+}
+
+uint8_t *otaMulticastSymbol(uint8_t buffer) {
+  return otaMulticast.symbols + buffer * otaMulticast.symbolSize;
+}
+
+/**
+ * Image bytes in a symbol; only the last symbol of the image is short
+ */
+size_t otaMulticastSymbolLength(uint16_t group, uint8_t index) {
+  return min((size_t)otaMulticast.symbolSize, otaMulticastGroupLength(group) - index * otaMulticast.symbolSize);
+}
+
+bool eraseOTAMulticastGroup(uint16_t group) {
+  size_t offset = group * otaMulticast.groupBytes;
+  size_t len = (otaMulticastGroupLength(group) + OTA_SECTOR_SIZE - 1) / OTA_SECTOR_SIZE * OTA_SECTOR_SIZE;
+  if (esp_partition_erase_range(otaMulticast.partition, offset, len) != ESP_OK) {
+    otaMulticast.error = "Flash erase failed";
+    return false;
+  }
+  setOTAMulticastBit(otaMulticast.groupErased, group);
+  return true;
+}
+
+/**
+ * Erase the first group that still has to be written, while idle
+ */
+bool preEraseOTAMulticast() {
+  for (uint16_t g = 0; g < otaMulticast.groupCount; g++) {
+    if (otaMulticast.groupWritten[g] < otaMulticastGroupK(g) && !isOTAMulticastBitSet(otaMulticast.groupErased, g)) {
+      return eraseOTAMulticastGroup(g);
+    }
+  }
+  return true;
+}
+
+/**
+ * Write one source symbol to its place in the partition
+ */
+bool writeOTAMulticastSymbol(uint16_t group, uint8_t index, const uint8_t *symbol) {
+  if (!isOTAMulticastBitSet(otaMulticast.groupErased, group) && !eraseOTAMulticastGroup(group)) {
+    return false;
+  }
+  size_t offset = group * otaMulticast.groupBytes + index * otaMulticast.symbolSize;
+  if (esp_partition_write(otaMulticast.partition, offset, symbol, otaMulticastSymbolLength(group, index)) != ESP_OK) {
+    otaMulticast.error = "Flash write failed";
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Read a written source symbol back, zero padded like the sender's
+ */
+bool readOTAMulticastSymbol(uint16_t group, uint8_t index, uint8_t *symbol) {
+  size_t offset = group * otaMulticast.groupBytes + index * otaMulticast.symbolSize;
+  size_t len = otaMulticastSymbolLength(group, index);
+  memset(symbol + len, 0, otaMulticast.symbolSize - len);
+  if (esp_partition_read(otaMulticast.partition, offset, symbol, len) != ESP_OK) {
+    otaMulticast.error = "Flash read failed";
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Count sources written to a group, and the group once all of them are
+ */
+void completeOTAMulticastSymbols(uint16_t group, uint8_t written) {
+  otaMulticast.groupWritten[group] += written;
+  if (otaMulticast.groupWritten[group] < otaMulticastGroupK(group)) {
+    return;
+  }
+  xSemaphoreTake(otaMulticastLock, portMAX_DELAY);
+  otaMulticast.groupsDone++;
+  xSemaphoreGive(otaMulticastLock);
+  onOTAProgress(min(otaMulticast.groupsDone * otaMulticast.groupBytes, otaMulticast.imageSize),
+                otaMulticast.imageSize);
+}
+
+bool writeOTAMulticastSource(uint8_t buffer) {
+  OTAMulticastBuffer &b = otaMulticastBuffers[buffer];
+  if (!writeOTAMulticastSymbol(b.group, b.index, otaMulticastSymbol(buffer))) {
+    return false;
+  }
+  uint16_t group = b.group;
+  xSemaphoreTake(otaMulticastLock, portMAX_DELAY);
+  b.state = MCAST_BUFFER_FREE;
+  xSemaphoreGive(otaMulticastLock);
+  completeOTAMulticastSymbols(group, 1);
+  return true;
+}
+
+/**
+ * Rebuild the sources a group lacks from the repair symbols held for it.
+ * Its received sources are already on flash (queued first).
+ */
+bool decodeOTAMulticastGroup(uint16_t group) {
+  uint8_t k = otaMulticastGroupK(group);
+  size_t size = otaMulticast.symbolSize;
+  uint8_t *rows[FEC_MAX_SYMBOLS];
+  uint8_t buffers[FEC_MAX_SYMBOLS];
+  // Only the first r and m entries are filled; r != m is refused below
+  uint8_t repair[FEC_MAX_SYMBOLS] = {};
+  uint8_t missing[FEC_MAX_SYMBOLS] = {};
+  uint8_t m = 0;
+  uint8_t r = 0;
+
+  xSemaphoreTake(otaMulticastLock, portMAX_DELAY);
+  uint64_t seen = otaMulticast.sourceSeen[group];
+  for (uint8_t i = 0; i < otaMulticast.bufferCount && r < FEC_MAX_SYMBOLS; i++) {
+    if (otaMulticastBuffers[i].state == MCAST_BUFFER_REPAIR && otaMulticastBuffers[i].group == group) {
+      buffers[r] = i;
+      repair[r] = otaMulticastBuffers[i].index;
+      rows[r++] = otaMulticastSymbol(i);
+    }
+  }
+  xSemaphoreGive(otaMulticastLock);
+  for (uint8_t i = 0; i < k; i++) {
+    if (!(seen & (1ULL << i))) {
+      missing[m++] = i;
+    }
+  }
+  if (r != m) {
+    otaMulticast.error = "Repair symbols lost";
+    return false;
+  }
+
+  // Take the known sources out of each repair symbol, one at a time
+  uint8_t *scratch = otaMulticastSymbol(otaMulticast.bufferCount);
+  for (uint8_t i = 0; i < k; i++) {
+    if (!(seen & (1ULL << i))) {
+      continue;
+    }
+    if (!readOTAMulticastSymbol(group, i, scratch)) {
+      return false;
+    }
+    for (uint8_t a = 0; a < m; a++) {
+      fecMulAdd(rows[a], scratch, fecCoefficient(repair[a], i), size);
+    }
+  }
+  if (!fecSolve(rows, repair, missing, m, size)) {
+    otaMulticast.error = "Repair symbols inconsistent";
+    return false;
+  }
+  for (uint8_t a = 0; a < m; a++) {
+    if (!writeOTAMulticastSymbol(group, missing[a], rows[a])) {
+      return false;
+    }
+  }
+
+  xSemaphoreTake(otaMulticastLock, portMAX_DELAY);
+  for (uint8_t a = 0; a < m; a++) {
+    otaMulticastBuffers[buffers[a]].state = MCAST_BUFFER_FREE;
+  }
+  otaMulticast.repairsUsed += m;
+  xSemaphoreGive(otaMulticastLock);
+  completeOTAMulticastSymbols(group, m);
+  return true;
+}
+
+/**
+ * Hash the written image back from flash and boot it if it matches
+ */
+bool commitOTAMulticast() {
+  uint8_t *buffer = (uint8_t *)malloc(OTA_SECTOR_SIZE);
+  if (buffer == NULL) {
+    otaMulticast.error = "Out of memory";
+    return false;
+  }
+  OTAImageHash hash;
+  otaHashBegin(hash);
+  bool isRead = true;
+  for (size_t offset = 0; offset < otaMulticast.imageSize && isRead; offset += OTA_SECTOR_SIZE) {
+    size_t n = min(OTA_SECTOR_SIZE, otaMulticast.imageSize - offset);
+    isRead = esp_partition_read(otaMulticast.partition, offset, buffer, n) == ESP_OK;
+    if (isRead) {
+      otaHashUpdate(hash, buffer, n);
+    }
+  }
+  free(buffer);
+  if (!isRead) {
+    otaHashRelease(hash);
+    otaMulticast.error = "Flash read failed";
+    return false;
+  }
+  otaHashFinish(hash);
+
+  if (memcmp(hash.digest, otaMulticast.sha256, OTA_SHA256_SIZE) != 0) {
+    otaMulticast.error = "SHA-256 mismatch";
+    return false;
+  }
+  if (esp_ota_set_boot_partition(otaMulticast.partition) != ESP_OK) {
+    otaMulticast.error = "Image validation failed";
+    return false;
+  }
+  return true;
+}
+
+void printOTAMulticastStats() {
+  Serial.printf("OTA: Multicast session %08lx: %lu packets, %lu duplicates, %lu dropped, %lu evicted, "
+                "%lu repair symbols used, %lu NACKs, %u of %u groups in %lu ms\n",
+                (unsigned long)otaMulticast.id, (unsigned long)otaMulticast.packets,
+                (unsigned long)otaMulticast.duplicates, (unsigned long)otaMulticast.dropped,
+                (unsigned long)otaMulticast.evicted, (unsigned long)otaMulticast.repairsUsed, (unsigned long)otaMulticast.nacksSent,
+                otaMulticast.groupsDone, otaMulticast.groupCount, millis() - otaMulticast.startMillis);
+}
+
+/**
+ * Flash task: write sources as they arrive and decode groups as they
+ * complete, then verify and commit
+ */
+void otaMulticastTask(void * /* param */) {
+  bool isOK = true;
+  while (isOK && otaMulticast.groupsDone < otaMulticast.groupCount) {
+    OTAMulticastJob job;
+    if (xQueueReceive(otaMulticastQueue, &job, OTA_MULTICAST_WAIT) != pdTRUE) {
+      isOK = preEraseOTAMulticast();
+    } else if (job.type == MCAST_JOB_CANCEL) {
+      otaMulticast.error = "Session timed out";
+      isOK = false;
+    } else if (job.type == MCAST_JOB_WRITE) {
+      isOK = writeOTAMulticastSource(job.buffer);
+    } else {
+      isOK = decodeOTAMulticastGroup(job.group);
+    }
+  }
+  isOK = isOK && commitOTAMulticast();
+  printOTAMulticastStats();
+
+  xSemaphoreTake(otaMulticastLock, portMAX_DELAY);
+  releaseOTAMulticast();
+  xQueueReset(otaMulticastQueue);
+  otaMulticast.isActive = false;
+  xSemaphoreGive(otaMulticastLock);
+
+  otaMulticastResult = isOK ? MCAST_RESULT_DONE : MCAST_RESULT_FAILED;
+  vTaskDelete(NULL);
+}
+
+/**
+ * Join the session an announcement describes, if it is worth joining
+ */
+void beginOTAMulticast(const OTAMulticastHeader &h, const uint8_t *payload, size_t len) {
+  if (hasSeenMulticastSession && h.session == otaMulticastSeenSession) {
+    return;
+  }
+  size_t groupBytes = (size_t)h.groupSymbols * h.symbolSize;
+  const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+  if (len < OTA_SHA256_SIZE || h.symbolSize == 0 || h.symbolSize > OTA_MULTICAST_SYMBOL_MAX ||
+      h.groupSymbols == 0 || h.groupSymbols > FEC_MAX_SYMBOLS || groupBytes % OTA_SECTOR_SIZE != 0 ||
+      h.imageSize == 0 || (h.imageSize + groupBytes - 1) / groupBytes > 0xFFFF ||
+      partition == NULL || h.imageSize > partition->size) {
+    Serial.printf("OTA: Multicast session %08lx not supported\n", (unsigned long)h.session);
+    otaMulticastSeenSession = h.session;
+    hasSeenMulticastSession = true;
+    return;
+  }
+  if (isRunningImage("", payload)) {
+    recordIdenticalImageReject();
+    otaMulticastSeenSession = h.session;
+    hasSeenMulticastSession = true;
+    return;
+  }
+  // Try again at the next announcement
+  if (isOTAWriterActive || otaPullState == OTA_PULL_RUNNING || otaMulticastResult != MCAST_RESULT_NONE) {
+    return;
+  }
+
+  otaMulticast.id = h.session;
+  otaMulticast.imageSize = h.imageSize;
+  otaMulticast.symbolSize = h.symbolSize;
+  otaMulticast.groupSymbols = h.groupSymbols;
+  otaMulticast.groupBytes = groupBytes;
+  otaMulticast.groupCount = (h.imageSize + groupBytes - 1) / groupBytes;
+  otaMulticast.partition = partition;
+  memcpy(otaMulticast.sha256, payload, OTA_SHA256_SIZE);
+
+  // One more symbol than buffers: the flash task's scratch for decoding
+  otaMulticast.bufferCount = h.groupSymbols + max(h.groupSymbols, OTA_MULTICAST_SPARE_BUFFERS);
+  otaMulticast.symbols = (uint8_t *)malloc((otaMulticast.bufferCount + 1) * h.symbolSize);
+  otaMulticast.sourceSeen = (uint64_t *)calloc(otaMulticast.groupCount, sizeof(uint64_t));
+  otaMulticast.groupHave = (uint8_t *)calloc(otaMulticast.groupCount, 1);
+  otaMulticast.groupWritten = (uint8_t *)calloc(otaMulticast.groupCount, 1);
+  otaMulticast.groupErased = (uint8_t *)calloc((otaMulticast.groupCount + 7) / 8, 1);
+  otaMulticast.groupAsked = (uint8_t *)calloc((otaMulticast.groupCount + 7) / 8, 1);
+  if (otaMulticast.symbols == NULL || otaMulticast.sourceSeen == NULL || otaMulticast.groupHave == NULL ||
+      otaMulticast.groupWritten == NULL || otaMulticast.groupErased == NULL || otaMulticast.groupAsked == NULL) {
+    Serial.printf("OTA: Not enough memory for multicast session %08lx\n", (unsigned long)h.session);
+    releaseOTAMulticast();
+    return;
+  }
+
+  otaMulticast.groupsDone = 0;
+  otaMulticast.isCancelled = false;
+  otaMulticast.error = "";
+  otaMulticast.packets = 0;
+  otaMulticast.duplicates = 0;
+  otaMulticast.dropped = 0;
+  otaMulticast.evicted = 0;
+  otaMulticast.repairsUsed = 0;
+  otaMulticast.nacksSent = 0;
+  otaMulticast.nackRound = -1;
+  otaMulticast.startMillis = millis();
+  otaMulticast.lastPacketMillis = millis();
+  otaMulticast.isActive = true;
+  otaMulticastSeenSession = h.session;
+  hasSeenMulticastSession = true;
+
+  if (xTaskCreatePinnedToCore(otaMulticastTask, "ota_mcast", OTA_MULTICAST_STACK_SIZE, NULL,
+                              OTA_MULTICAST_PRIORITY, NULL, OTA_MULTICAST_CORE) != pdPASS) {
+    otaMulticast.isActive = false;
+    releaseOTAMulticast();
+    return;
+  }
+
+  Serial.printf("OTA: Joined multicast session %08lx: %lu bytes, %u groups of %u x %u bytes\n",
+                (unsigned long)h.session, (unsigned long)h.imageSize, otaMulticast.groupCount,
+                h.groupSymbols, h.symbolSize);
+  onOTAStart();
+}
+
+uint8_t otaMulticastGroupMissing(uint16_t group) {
+  return otaMulticastGroupK(group) - otaMulticast.groupHave[group];
+}
+
+/**
+ * A free symbol buffer, or one taken from a repair symbol of another
+ * group: one not asked for first, then the one missing the most. A repair
+ * symbol never displaces one of a group closer to done, or asked for when
+ * its own group wasn't; a source always does, it is never sent again.
+ */
+int claimOTAMulticastBuffer(uint16_t group, bool isSource) {
+  int victim = -1;
+  bool isVictimAsked = true;
+  uint8_t victimMissing = 0;
+  for (uint8_t i = 0; i < otaMulticast.bufferCount; i++) {
+    OTAMulticastBuffer &b = otaMulticastBuffers[i];
+    if (b.state == MCAST_BUFFER_FREE) {
+      return i;
+    }
+    // Groups with k symbols are waiting to be decoded
+    if (b.state != MCAST_BUFFER_REPAIR || b.group == group || otaMulticastGroupMissing(b.group) == 0) {
+      continue;
+    }
+    bool isAsked = isOTAMulticastBitSet(otaMulticast.groupAsked, b.group);
+    uint8_t missing = otaMulticastGroupMissing(b.group);
+    if (victim < 0 || (isVictimAsked && !isAsked) || (isVictimAsked == isAsked && missing > victimMissing)) {
+      victim = i;
+      isVictimAsked = isAsked;
+      victimMissing = missing;
+    }
+  }
+  if (victim < 0) {
+    return -1;
+  }
+  if (!isSource) {
+    bool isAsked = isOTAMulticastBitSet(otaMulticast.groupAsked, group);
+    if ((isVictimAsked && !isAsked) ||
+        (isVictimAsked == isAsked && victimMissing < otaMulticastGroupMissing(group))) {
+      return -1;
+    }
+  }
+  otaMulticast.groupHave[otaMulticastBuffers[victim].group]--;
+  otaMulticast.evicted++;
+  return victim;
+}
+
+bool isOTAMulticastRepairHeld(uint16_t group, uint8_t index) {
+  for (uint8_t i = 0; i < otaMulticast.bufferCount; i++) {
+    const OTAMulticastBuffer &b = otaMulticastBuffers[i];
+    if (b.state == MCAST_BUFFER_REPAIR && b.group == group && b.index == index) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Take one symbol of a group: sources go to the flash task to be written,
+ * repair symbols are held until the group has k symbols
+ */
+void storeOTAMulticastSymbol(const OTAMulticastHeader &h, const uint8_t *payload, size_t len) {
+  otaMulticast.packets++;
+  if (h.group >= otaMulticast.groupCount || len < otaMulticast.symbolSize ||
+      h.k != otaMulticastGroupK(h.group)) {
+    return;
+  }
+  bool isSource = h.index < h.k;
+  if (otaMulticast.groupHave[h.group] == h.k ||
+      (isSource && (otaMulticast.sourceSeen[h.group] & (1ULL << h.index))) ||
+      (!isSource && isOTAMulticastRepairHeld(h.group, h.index))) {
+    otaMulticast.duplicates++;
+    return;
+  }
+  int buffer = claimOTAMulticastBuffer(h.group, isSource);
+  if (buffer < 0) {
+    otaMulticast.dropped++;
+    return;
+  }
+
+  OTAMulticastBuffer &b = otaMulticastBuffers[buffer];
+  memcpy(otaMulticastSymbol(buffer), payload, otaMulticast.symbolSize);
+  b.group = h.group;
+  b.index = h.index;
+  b.state = isSource ? MCAST_BUFFER_SOURCE : MCAST_BUFFER_REPAIR;
+  if (isSource) {
+    otaMulticast.sourceSeen[h.group] |= 1ULL << h.index;
+    OTAMulticastJob job = {MCAST_JOB_WRITE, (uint8_t)buffer, h.group};
+    xQueueSend(otaMulticastQueue, &job, 0);
+  }
+
+  // Decoded after the writes queued for its sources
+  if (++otaMulticast.groupHave[h.group] == h.k &&
+      otaMulticast.sourceSeen[h.group] != (h.k == 64 ? ~0ULL : (1ULL << h.k) - 1)) {
+    OTAMulticastJob job = {MCAST_JOB_DECODE, 0, h.group};
+    xQueueSend(otaMulticastQueue, &job, 0);
+  }
+}
+
+void addOTAMulticastNackEntry(AsyncUDPPacket &packet, size_t &entries, uint16_t group) {
+  uint8_t *entry = otaMulticastNack + sizeof(OTAMulticastHeader) + entries * 3;
+  entry[0] = group & 0xFF;
+  entry[1] = group >> 8;
+  entry[2] = otaMulticastGroupMissing(group);
+  if (++entries == OTA_MULTICAST_NACK_ENTRIES) {
+    otaMulticastUdp.writeTo(otaMulticastNack, sizeof(otaMulticastNack), packet.remoteIP(), packet.remotePort());
+    otaMulticast.nacksSent++;
+    entries = 0;
+  }
+}
+
+/**
+ * Answer a ROUND_END with the groups that can't be decoded yet, as many
+ * as the buffers can hold the repair symbols of; those already holding
+ * some come first
+ */
+void sendOTAMulticastNack(AsyncUDPPacket &packet) {
+  OTAMulticastHeader *h = (OTAMulticastHeader *)otaMulticastNack;
+  memset(h, 0, sizeof(*h));
+  h->magic = OTA_MULTICAST_MAGIC;
+  h->type = MCAST_NACK;
+  h->session = otaMulticast.id;
+
+  memset(otaMulticast.groupAsked, 0, (otaMulticast.groupCount + 7) / 8);
+  size_t entries = 0;
+  size_t budget = otaMulticast.bufferCount;
+  for (uint8_t pass = 0; pass < 2; pass++) {
+    for (uint16_t g = 0; g < otaMulticast.groupCount; g++) {
+      uint8_t sources = __builtin_popcountll(otaMulticast.sourceSeen[g]);
+      bool isHolding = otaMulticast.groupHave[g] > sources;
+      if (otaMulticastGroupMissing(g) == 0 || isHolding != (pass == 0)) {
+        continue;
+      }
+      // Buffers the group needs to be decoded, repair symbols held included
+      size_t need = otaMulticastGroupK(g) - sources;
+      if (need <= budget) {
+        budget -= need;
+        setOTAMulticastBit(otaMulticast.groupAsked, g);
+        addOTAMulticastNackEntry(packet, entries, g);
+      }
+    }
+  }
+  if (entries > 0) {
+    otaMulticastUdp.writeTo(otaMulticastNack, sizeof(OTAMulticastHeader) + entries * 3,
+                            packet.remoteIP(), packet.remotePort());
+    otaMulticast.nacksSent++;
+  }
+}
+
+/**
+ * Packet handler; runs in the async_udp task
+ */
+void onOTAMulticastPacket(AsyncUDPPacket &packet) {
+  if (packet.length() < sizeof(OTAMulticastHeader)) {
+    return;
+  }
+  OTAMulticastHeader h;
+  memcpy(&h, packet.data(), sizeof(h));
+  if (h.magic != OTA_MULTICAST_MAGIC) {
+    return;
+  }
+  const uint8_t *payload = packet.data() + sizeof(h);
+  size_t len = packet.length() - sizeof(h);
+
+  xSemaphoreTake(otaMulticastLock, portMAX_DELAY);
+  if (!otaMulticast.isActive || h.session != otaMulticast.id) {
+    // One session at a time; others are considered once it is over
+    if (!otaMulticast.isActive && h.type == MCAST_ANNOUNCE) {
+      beginOTAMulticast(h, payload, len);
+    }
+  } else {
+    otaMulticast.lastPacketMillis = millis();
+    if (h.type == MCAST_SYMBOL) {
+      storeOTAMulticastSymbol(h, payload, len);
+    } else if (h.type == MCAST_ROUND_END && h.group != otaMulticast.nackRound) {
+      otaMulticast.nackRound = h.group;
+      sendOTAMulticastNack(packet);
+    }
+  }
+  xSemaphoreGive(otaMulticastLock);
+}
+
+/**
+ * Listen while the link is up, time out stalled sessions and report the
+ * outcome; called from handleOTA()
+ */
+void handleOTAMulticast(bool isOnline) {
+  if (strlen(OTA_MULTICAST_GROUP) == 0) {
+    return;
+  }
+
+  if (isOnline && !isOTAMulticastListening) {
+    if (otaMulticastLock == NULL) {
+      fecInit();
+      otaMulticastLock = xSemaphoreCreateMutex();
+      otaMulticastQueue = xQueueCreate(OTA_MULTICAST_QUEUE_LENGTH, sizeof(OTAMulticastJob));
+      otaMulticastUdp.onPacket(onOTAMulticastPacket);
+    }
+    IPAddress group;
+    if (group.fromString(OTA_MULTICAST_GROUP) && otaMulticastUdp.listenMulticast(group, OTA_MULTICAST_PORT)) {
+      Serial.printf("OTA: Listening for multicast updates on %s:%u\n", OTA_MULTICAST_GROUP, OTA_MULTICAST_PORT);
+    } else {
+      Serial.printf("OTA: Could not join multicast group %s\n", OTA_MULTICAST_GROUP);
+    }
+    // Not retried until the link comes back
+    isOTAMulticastListening = true;
+  } else if (!isOnline && isOTAMulticastListening) {
+    otaMulticastUdp.close();
+    isOTAMulticastListening = false;
+  }
+
+  // Read before millis(): the async_udp task may update it meanwhile
+  unsigned long lastPacket = otaMulticast.lastPacketMillis;
+  if (otaMulticast.isActive && !otaMulticast.isCancelled && millis() - lastPacket > OTA_MULTICAST_IDLE_MS) {
+    otaMulticast.isCancelled = true;
+    OTAMulticastJob job = {MCAST_JOB_CANCEL, 0, 0};
+    xQueueSend(otaMulticastQueue, &job, 0);
+  }
+
+  OTAMulticastResult result = otaMulticastResult;
+  if (result == MCAST_RESULT_DONE) {
+    otaMulticastResult = MCAST_RESULT_NONE;
+    onOTAEnd(true);
+  } else if (result == MCAST_RESULT_FAILED) {
+    Serial.printf("OTA: Multicast update failed - %s\n", otaMulticast.error.c_str());
+    otaMulticastResult = MCAST_RESULT_NONE;
+    onOTAEnd(false);
+  }
+}
@@ -0,0 +1,500 @@
+/*
+  -----------------------
+  Peer Relay
+  -----------------------
+
+  Once one device runs a new image, its neighbours can fetch the image
+  from it instead of from the central server. With -DOTA_PEER_RELAY=1 in
+  build_flags:
+
+  - A device whose running image passed its boot self-test seeds it:
+      GET /ota/image    the running image, with Range support
+    The partition is mapped once (spi_flash_mmap through
+    esp_partition_mmap) and responses are sent straight out of the
+    mapping. There is no flash read into a RAM buffer, only the server's
+    copy into the TCP segment. Seeders advertise themselves over mDNS as
+    _ota-seed._tcp, with the image's sha256, size and version in TXT
+    records.
+
+  - A pull update (OTAPull.h) first looks for seeders of the SHA-256 in
+    the manifest. The image is cut into OTA_PEER_CHUNK_SIZE chunks, and
+    one task per seeder (up to OTA_PEER_MAX_SEEDERS) fetches chunks with
+    Range requests. Chunks are handed to the flash writer in image order,
+    so each task holds at most one finished chunk. A seeder that fails
+    gives its chunk back to the others; if they are all holding later
+    chunks, the furthest one is dropped to make room. If every seeder
+    fails, or progress
+    stalls, the pull continues from the server, keeping the whole sectors
+    already written.
+
+  Every seeder's response must name the expected SHA-256
+  (X-Image-SHA256), and the whole image is checked against the manifest
+  before it is booted, whoever sent it. With OTA_AUTH_USERNAME set,
+  /ota/image needs the same credentials, and peers send them.
+
+  tools/simulate_peer_relay.py runs a fleet of simulated devices on the
+  host with the same chunk scheduling.
+*/
+#include <ESPmDNS.h>
+#include <HTTPClient.h>
+
+#ifndef OTA_PEER_RELAY
+#define OTA_PEER_RELAY 0
+#endif
+
+// Range fetched per request; one buffer of this size per seeder task
+const size_t OTA_PEER_CHUNK_SIZE = 16 * 1024;
+const int OTA_PEER_MAX_SEEDERS = 3;
+
+// Give up on the peers after this long without a chunk written
+const unsigned long OTA_PEER_STALL_MS = 10000;
+
+// Fetch task placement; network I/O belongs next to lwIP on core 0
+const BaseType_t OTA_PEER_CORE = 0;
+const UBaseType_t OTA_PEER_PRIORITY = 1;
+const uint32_t OTA_PEER_STACK_SIZE = 6144;
+
+const char *OTA_PEER_SERVICE = "ota-seed";
+
+// Seeder side
+bool isOTAMDNSStarted = false;
+bool isOTASeeding = false;
+bool hasTriedOTASeeding = false;
+const uint8_t *otaSeedImage = NULL;
+spi_flash_mmap_handle_t otaSeedMapping;
+char otaSeedSHA256[OTA_SHA256_SIZE * 2 + 1];
+uint32_t otaSeedRequests = 0;
+uint64_t otaSeedBytes = 0;
+
+enum OTAPeerWorkerState {
+  PEER_FETCHING,  // Fetching w.chunk, or waiting to be given one
+  PEER_READY,     // w.chunk is in the buffer, waiting to be written
+  PEER_STOPPED
+};
+
+// One seeder and the task fetching from it
+struct OTAPeerWorker {
+  IPAddress ip;
+  uint16_t port;
+  uint8_t *buffer;
+  volatile OTAPeerWorkerState state;
+  size_t chunk;
+  size_t length;
+  size_t bytes;  // Fetched in total
+};
+
+struct OTAPeerFetch {
+  char sha256[OTA_SHA256_SIZE * 2 + 1];
+  size_t imageSize;
+  size_t chunkCount;
+  size_t nextChunk;                     // First chunk no task has taken
+  size_t retry[OTA_PEER_MAX_SEEDERS];   // Chunks given back by failed tasks
+  int retryCount;
+  volatile bool isCancelled;
+  volatile int running;                 // Tasks not stopped yet
+  SemaphoreHandle_t lock;
+  OTAPeerWorker workers[OTA_PEER_MAX_SEEDERS];
+  int workerCount;
+};
+
+OTAPeerFetch otaPeerFetch;
+
+void formatSHA256Hex(const uint8_t *sha256, char *hex) {
+  for (size_t i = 0; i < OTA_SHA256_SIZE; i++) {
+    snprintf(hex + i * 2, 3, "%02x", sha256[i]);
+  }
+}
+
+/**
+ * Parse a single "bytes=" range against an image of size bytes
+ *
+ * Handles "a-b", "a-" and "-n". Returns false if the range is invalid or
+ * unsatisfiable.
+ */
+bool parseByteRange(const String &header, size_t size, size_t &start, size_t &end) {
+  if (!header.startsWith("bytes=") || header.indexOf(',') >= 0) {
+    return false;
+  }
+  int dash = header.indexOf('-');
+  if (dash < 0) {
+    return false;
+  }
+  String first = header.substring(6, dash);
+  String last = header.substring(dash + 1);
+  first.trim();
+  last.trim();
+  if (first.length() == 0 && last.length() == 0) {
+    return false;
+  }
+
+  if (first.length() == 0) {
+    size_t suffix = strtoul(last.c_str(), NULL, 10);
+    if (suffix == 0) {
+      return false;
+    }
+    start = suffix >= size ? 0 : size - suffix;
+    end = size - 1;
+  } else {
+    start = strtoul(first.c_str(), NULL, 10);
+    end = last.length() ? strtoul(last.c_str(), NULL, 10) : size - 1;
+    if (end >= size) {
+      end = size - 1;
+    }
+  }
+  return start < size && start <= end;
+}
+
+/**
+ * GET /ota/image: the running image, or the requested range of it
+ */
+void handleOTAImageRequest(AsyncWebServerRequest *request) {
+  if (!isOTASeeding) {
+    request->send(503, "text/plain", "Not seeding");
+    return;
+  }
+
+  size_t size = runningImage.size;
+  size_t start = 0;
+  size_t end = size - 1;
+  bool isRange = request->hasHeader("Range");
+  if (isRange && !parseByteRange(request->header("Range"), size, start, end)) {
+    AsyncWebServerResponse *response = request->beginResponse(416, "text/plain", "Range not satisfiable");
+    response->addHeader("Content-Range", "bytes */" + String(size));
+    request->send(response);
+    return;
+  }
+
+  size_t len = end - start + 1;
+  AsyncWebServerResponse *response =
+      request->beginResponse_P(isRange ? 206 : 200, "application/octet-stream", otaSeedImage + start, len);
+  if (isRange) {
+    response->addHeader("Content-Range", "bytes " + String(start) + "-" + String(end) + "/" + String(size));
+  }
+  response->addHeader("Accept-Ranges", "bytes");
+  response->addHeader(OTA_SHA256_HEADER, otaSeedSHA256);
+  response->addHeader(OTA_VERSION_HEADER, currentFirmwareVersion());
+  request->send(response);
+
+  otaSeedRequests++;
+  otaSeedBytes += len;
+  #ifdef OTA_DEBUG_ENABLED
+  Serial.printf("OTA: Seeding bytes %u-%u to %s\n", start, end, request->client()->remoteIP().toString().c_str());
+  #endif
+}
+
+/**
+ * Map the running image and advertise it
+ */
+bool beginOTASeeding(uint16_t port) {
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  const void *map;
+  if (esp_partition_mmap(running, 0, runningImage.size, SPI_FLASH_MMAP_DATA, &map, &otaSeedMapping) != ESP_OK) {
+    Serial.println(F("OTA: Could not map the running image for seeding"));
+    return false;
+  }
+  otaSeedImage = (const uint8_t *)map;
+  formatSHA256Hex(runningImage.sha256, otaSeedSHA256);
+
+  MDNS.addService(OTA_PEER_SERVICE, "tcp", port);
+  MDNS.addServiceTxt(OTA_PEER_SERVICE, "tcp", "sha256", otaSeedSHA256);
+  MDNS.addServiceTxt(OTA_PEER_SERVICE, "tcp", "size", String(runningImage.size));
+  MDNS.addServiceTxt(OTA_PEER_SERVICE, "tcp", "version", currentFirmwareVersion());
+  Serial.printf("OTA: Seeding version %s (%u bytes) to peers\n", currentFirmwareVersion(), runningImage.size);
+  return true;
+}
+
+/**
+ * Start mDNS once online, and seed once the running image is known to be
+ * good; called from handleOTA()
+ */
+void handleOTAPeerRelay(bool isOnline, uint16_t port) {
+  #if OTA_PEER_RELAY
+  if (!isOnline) {
+    return;
+  }
+  if (!isOTAMDNSStarted) {
+    isOTAMDNSStarted = MDNS.begin(WiFi.getHostname());
+    if (!isOTAMDNSStarted) {
+      return;
+    }
+  }
+  // Don't pass on an image that may still be rolled back
+  if (!hasTriedOTASeeding && isBootHealthy && runningImage.isValid) {
+    hasTriedOTASeeding = true;
+    isOTASeeding = beginOTASeeding(port);
+  }
+  #else
+  (void)isOnline;
+  (void)port;
+  #endif
+}
+
+/**
+ * Next chunk for a fetch task, lowest retry first; false once none are left
+ */
+bool takeOTAPeerChunk(size_t &chunk) {
+  bool isTaken = true;
+  xSemaphoreTake(otaPeerFetch.lock, portMAX_DELAY);
+  if (otaPeerFetch.retryCount > 0) {
+    int lowest = 0;
+    for (int i = 1; i < otaPeerFetch.retryCount; i++) {
+      if (otaPeerFetch.retry[i] < otaPeerFetch.retry[lowest]) {
+        lowest = i;
+      }
+    }
+    chunk = otaPeerFetch.retry[lowest];
+    otaPeerFetch.retry[lowest] = otaPeerFetch.retry[--otaPeerFetch.retryCount];
+  } else if (otaPeerFetch.nextChunk < otaPeerFetch.chunkCount) {
+    chunk = otaPeerFetch.nextChunk++;
+  } else {
+    isTaken = false;
+  }
+  xSemaphoreGive(otaPeerFetch.lock);
+  return isTaken;
+}
+
+/**
+ * Fetch one chunk into the task's buffer with a Range request
+ */
+bool fetchOTAPeerChunk(HTTPClient &http, const String &url, OTAPeerWorker &w) {
+  size_t start = w.chunk * OTA_PEER_CHUNK_SIZE;
+  size_t len = min(OTA_PEER_CHUNK_SIZE, otaPeerFetch.imageSize - start);
+  if (!http.begin(url)) {
+    return false;
+  }
+  #ifdef OTA_AUTH_USERNAME
+  http.setAuthorization(OTA_AUTH_USERNAME, OTA_AUTH_PASSWORD);
+  #endif
+  const char *headers[] = { OTA_SHA256_HEADER };
+  http.collectHeaders(headers, 1);
+  http.addHeader("Range", "bytes=" + String(start) + "-" + String(start + len - 1));
+
+  int status = http.GET();
+  if (status != HTTP_CODE_PARTIAL_CONTENT || http.getSize() != (int)len ||
+      !http.header(OTA_SHA256_HEADER).equalsIgnoreCase(otaPeerFetch.sha256)) {
+    http.end();
+    return false;
+  }
+
+  WiFiClient *stream = http.getStreamPtr();
+  size_t received = 0;
+  unsigned long lastDataMillis = millis();
+  while (received < len && !otaPeerFetch.isCancelled) {
+    size_t available = stream->available();
+    if (available == 0) {
+      if (!stream->connected() || millis() - lastDataMillis >= OTA_PULL_READ_TIMEOUT_MS) {
+        break;
+      }
+      delay(1);
+      continue;
+    }
+    int n = stream->read(w.buffer + received, min(available, len - received));
+    if (n > 0) {
+      received += n;
+      lastDataMillis = millis();
+    }
+  }
+  // Keeps the connection for the next range if the body was read in full
+  http.end();
+
+  w.length = received;
+  w.bytes += received;
+  return received == len;
+}
+
+/**
+ * Fetch task: take chunks from one seeder until none are left
+ */
+void otaPeerWorkerTask(void *param) {
+  OTAPeerWorker &w = *(OTAPeerWorker *)param;
+  String url = "http://" + w.ip.toString() + ":" + String(w.port) + "/ota/image";
+  HTTPClient http;
+  http.setReuse(true);
+  http.setConnectTimeout(OTA_PULL_CONNECT_TIMEOUT_MS);
+  http.setTimeout(OTA_PULL_READ_TIMEOUT_MS);
+
+  size_t chunk;
+  while (!otaPeerFetch.isCancelled && takeOTAPeerChunk(chunk)) {
+    w.chunk = chunk;
+    if (!fetchOTAPeerChunk(http, url, w)) {
+      xSemaphoreTake(otaPeerFetch.lock, portMAX_DELAY);
+      otaPeerFetch.retry[otaPeerFetch.retryCount++] = chunk;
+      xSemaphoreGive(otaPeerFetch.lock);
+      Serial.printf("OTA: Peer %s failed, leaving it\n", w.ip.toString().c_str());
+      break;
+    }
+    w.state = PEER_READY;
+    // Wait for the chunk to be written; the buffer is reused afterwards
+    while (w.state == PEER_READY && !otaPeerFetch.isCancelled) {
+      delay(1);
+    }
+  }
+  http.end();
+
+  xSemaphoreTake(otaPeerFetch.lock, portMAX_DELAY);
+  w.state = PEER_STOPPED;
+  otaPeerFetch.running--;
+  xSemaphoreGive(otaPeerFetch.lock);
+  vTaskDelete(NULL);
+}
+
+/**
+ * Seeders on the LAN advertising this image, other than this device
+ */
+int findOTASeeders(const char *sha256) {
+  otaPeerFetch.workerCount = 0;
+  if (!isOTAMDNSStarted) {
+    return 0;
+  }
+  int found = MDNS.queryService(OTA_PEER_SERVICE, "tcp");
+  for (int i = 0; i < found && otaPeerFetch.workerCount < OTA_PEER_MAX_SEEDERS; i++) {
+    if (MDNS.IP(i) == WiFi.localIP() || !MDNS.txt(i, "sha256").equalsIgnoreCase(sha256)) {
+      continue;
+    }
+    OTAPeerWorker &w = otaPeerFetch.workers[otaPeerFetch.workerCount++];
+    w.ip = MDNS.IP(i);
+    w.port = MDNS.port(i);
+  }
+  return otaPeerFetch.workerCount;
+}
+
+/**
+ * Stop the fetch tasks and free their buffers
+ */
+void endOTAPeerFetch() {
+  otaPeerFetch.isCancelled = true;
+  while (otaPeerFetch.running > 0) {
+    delay(10);
+  }
+  for (int i = 0; i < otaPeerFetch.workerCount; i++) {
+    free(otaPeerFetch.workers[i].buffer);
+    otaPeerFetch.workers[i].buffer = NULL;
+  }
+  vSemaphoreDelete(otaPeerFetch.lock);
+  otaPeerFetch.lock = NULL;
+}
+
+/**
+ * When every live task holds a chunk past next, next was dropped by a
+ * failed peer and nobody is free to fetch it: send the furthest chunk back
+ */
+void releaseOTAPeerWorker(size_t next) {
+  OTAPeerWorker *furthest = NULL;
+  for (int i = 0; i < otaPeerFetch.workerCount; i++) {
+    OTAPeerWorker &w = otaPeerFetch.workers[i];
+    if (w.state == PEER_FETCHING || (w.state == PEER_READY && w.chunk == next)) {
+      return;
+    }
+    if (w.state == PEER_READY && (furthest == NULL || w.chunk > furthest->chunk)) {
+      furthest = &w;
+    }
+  }
+  if (furthest != NULL) {
+    xSemaphoreTake(otaPeerFetch.lock, portMAX_DELAY);
+    otaPeerFetch.retry[otaPeerFetch.retryCount++] = furthest->chunk;
+    xSemaphoreGive(otaPeerFetch.lock);
+    furthest->state = PEER_FETCHING;
+  }
+}
+
+/**
+ * Hand a fetched chunk to the pipeline
+ */
+bool writeOTAPeerChunk(const OTAPeerWorker &w, String &error) {
+  for (size_t offset = 0; offset < w.length; offset += OTA_SECTOR_SIZE) {
+    size_t n = min(OTA_SECTOR_SIZE, w.length - offset);
+    if (!otaImageCheckWrite(w.buffer + offset, n)) {
+      error = otaImageErrorString(otaImageCheck.error);
+      otaWriterAbort();
+      return false;
+    }
+    if (otaWriterWrite(w.buffer + offset, n) != n) {
+      error = "Flash write failed";
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Fetch the image from seeders in parallel into the running writer session
+ *
+ * The writer must be at offset 0. Returns true once every byte is queued;
+ * otherwise error says why, and whatever was written stays for a resume.
+ */
+bool fetchOTAFromPeers(const uint8_t *sha256, size_t imageSize, String &error) {
+  formatSHA256Hex(sha256, otaPeerFetch.sha256);
+  if (findOTASeeders(otaPeerFetch.sha256) == 0) {
+    error = "No seeders found";
+    return false;
+  }
+
+  otaPeerFetch.imageSize = imageSize;
+  otaPeerFetch.chunkCount = (imageSize + OTA_PEER_CHUNK_SIZE - 1) / OTA_PEER_CHUNK_SIZE;
+  otaPeerFetch.nextChunk = 0;
+  otaPeerFetch.retryCount = 0;
+  otaPeerFetch.isCancelled = false;
+  otaPeerFetch.running = 0;
+  otaPeerFetch.lock = xSemaphoreCreateMutex();
+  unsigned long t0 = millis();
+
+  for (int i = 0; i < otaPeerFetch.workerCount; i++) {
+    OTAPeerWorker &w = otaPeerFetch.workers[i];
+    w.buffer = (uint8_t *)malloc(OTA_PEER_CHUNK_SIZE);
+    w.state = PEER_FETCHING;
+    w.bytes = 0;
+    w.chunk = SIZE_MAX;
+    if (w.buffer == NULL) {
+      w.state = PEER_STOPPED;
+      continue;
+    }
+    otaPeerFetch.running++;
+    if (xTaskCreatePinnedToCore(otaPeerWorkerTask, "ota_peer", OTA_PEER_STACK_SIZE, &w,
+                                OTA_PEER_PRIORITY, NULL, OTA_PEER_CORE) != pdPASS) {
+      w.state = PEER_STOPPED;
+      otaPeerFetch.running--;
+    }
+  }
+  Serial.printf("OTA: Fetching %u bytes from %d peers\n", imageSize, otaPeerFetch.running);
+
+  size_t next = 0;
+  unsigned long lastProgressMillis = millis();
+  bool isOK = true;
+  while (isOK && next < otaPeerFetch.chunkCount) {
+    OTAPeerWorker *ready = NULL;
+    for (int i = 0; i < otaPeerFetch.workerCount; i++) {
+      OTAPeerWorker &w = otaPeerFetch.workers[i];
+      if (w.state == PEER_READY && w.chunk == next) {
+        ready = &w;
+      }
+    }
+    if (ready != NULL) {
+      isOK = writeOTAPeerChunk(*ready, error);
+      ready->state = PEER_FETCHING;
+      if (isOK) {
+        next++;
+        lastProgressMillis = millis();
+        onOTAProgress(min(next * OTA_PEER_CHUNK_SIZE, imageSize), imageSize);
+      }
+    } else if (otaPeerFetch.running == 0) {
+      error = "All peers failed";
+      isOK = false;
+    } else if (millis() - lastProgressMillis > OTA_PEER_STALL_MS) {
+      error = "Peers stalled";
+      isOK = false;
+    } else {
+      releaseOTAPeerWorker(next);
+      delay(1);
+    }
+  }
+  endOTAPeerFetch();
+
+  unsigned long elapsed = millis() - t0;
+  Serial.printf("OTA: Fetched %u of %u bytes from peers in %lu ms:", min(next * OTA_PEER_CHUNK_SIZE, imageSize),
+                imageSize, elapsed);
+  for (int i = 0; i < otaPeerFetch.workerCount; i++) {
+    Serial.printf(" %s %u", otaPeerFetch.workers[i].ip.toString().c_str(), otaPeerFetch.workers[i].bytes);
+  }
+  Serial.println();
+  return isOK;
+}
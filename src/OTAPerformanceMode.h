@@ -0,0 +1,110 @@
+/*
+  -----------------------
+  OTA Performance Mode
+  -----------------------
+
+  Switches the device into an upload profile while an update runs and
+  restores the previous profile when it ends:
+  - WiFi modem sleep off. With power save on, the station only listens
+    at DTIM beacons between bursts, which stretches every ACK round trip
+    and keeps the sender's window small.
+  - CPU at 240 MHz for hashing, inflating and the TCP stack.
+  - The main loop's periodic status output is paused
+    (isOTAPerformanceModeActive).
+
+  The lwIP TCP window and mailbox sizes and the WiFi driver's receive
+  buffer count are compile-time options of the Arduino core's prebuilt
+  ESP-IDF (CONFIG_LWIP_TCP_WND_DEFAULT, CONFIG_LWIP_TCP_RECVMBOX_SIZE,
+  CONFIG_ESP32_WIFI_DYNAMIC_RX_BUFFER_NUM). They can't be raised at
+  runtime and need a custom sdkconfig.
+
+  Build with -DOTA_PERFORMANCE_MODE=0 to leave the profile alone, e.g. to
+  compare the receive rate logged after each upload with and without it.
+
+  A session that is prepared but never uploaded would keep the profile
+  forever, so it is dropped after OTA_PERFORMANCE_IDLE_MS without progress.
+*/
+#include <esp_wifi.h>
+
+#ifndef OTA_PERFORMANCE_MODE
+#define OTA_PERFORMANCE_MODE 1
+#endif
+
+const uint32_t OTA_PERFORMANCE_CPU_MHZ = 240;
+const unsigned long OTA_PERFORMANCE_IDLE_MS = 60000;
+
+// Settings in effect before the upload profile
+struct OTAPerformanceProfile {
+  bool hasPowerSave;
+  wifi_ps_type_t powerSave;
+  uint32_t cpuMhz;
+};
+
+volatile bool isOTAPerformanceModeActive = false;
+OTAPerformanceProfile otaSavedProfile;
+unsigned long otaPerformanceStartMillis = 0;
+volatile unsigned long otaPerformanceActivityMillis = 0;
+
+/**
+ * Switch to the upload profile; called from onOTAStart()
+ */
+void enterOTAPerformanceMode() {
+  #if OTA_PERFORMANCE_MODE
+  otaPerformanceActivityMillis = millis();
+  if (isOTAPerformanceModeActive) {
+    return;
+  }
+
+  otaSavedProfile.hasPowerSave = esp_wifi_get_ps(&otaSavedProfile.powerSave) == ESP_OK;
+  otaSavedProfile.cpuMhz = getCpuFrequencyMhz();
+
+  if (otaSavedProfile.hasPowerSave) {
+    esp_wifi_set_ps(WIFI_PS_NONE);
+  }
+  if (otaSavedProfile.cpuMhz < OTA_PERFORMANCE_CPU_MHZ) {
+    setCpuFrequencyMhz(OTA_PERFORMANCE_CPU_MHZ);
+  }
+
+  otaPerformanceStartMillis = millis();
+  isOTAPerformanceModeActive = true;
+  Serial.printf("OTA: Upload profile on (CPU %lu -> %lu MHz, WiFi power save off)\n",
+                (unsigned long)otaSavedProfile.cpuMhz, (unsigned long)getCpuFrequencyMhz());
+  #endif
+}
+
+/**
+ * Note that the update is still making progress
+ */
+void noteOTAPerformanceActivity() {
+  otaPerformanceActivityMillis = millis();
+}
+
+/**
+ * Restore the profile saved by enterOTAPerformanceMode()
+ */
+void exitOTAPerformanceMode() {
+  if (!isOTAPerformanceModeActive) {
+    return;
+  }
+  isOTAPerformanceModeActive = false;
+
+  if (otaSavedProfile.hasPowerSave) {
+    esp_wifi_set_ps(otaSavedProfile.powerSave);
+  }
+  if (getCpuFrequencyMhz() != otaSavedProfile.cpuMhz) {
+    setCpuFrequencyMhz(otaSavedProfile.cpuMhz);
+  }
+  Serial.printf("OTA: Upload profile off after %lu ms\n", millis() - otaPerformanceStartMillis);
+}
+
+/**
+ * Drop the upload profile once the update has stalled; call from loop()
+ */
+void handleOTAPerformanceMode() {
+  // Read before millis(): the upload task may update it meanwhile
+  unsigned long lastActivity = otaPerformanceActivityMillis;
+  if (isOTAPerformanceModeActive && millis() - lastActivity > OTA_PERFORMANCE_IDLE_MS) {
+    Serial.println(F("OTA: No update progress, leaving the upload profile"));
+    exitOTAPerformanceMode();
+  }
+}
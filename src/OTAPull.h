@@ -0,0 +1,433 @@
+/*
+  -----------------------
+  Pull-Mode OTA Client
+  -----------------------
+
+  Lets the device fetch its own updates instead of waiting for an upload,
+  which works behind NAT. The device reads a small JSON manifest:
+
+    {"version": "1.4.2", "size": 1234567,
+     "sha256": "<64 hex chars>", "url": "http://host/firmware.bin"}
+
+  If the version or the image hash matches the running firmware
+  (BuildIdentity.h), nothing is downloaded. The
+  manifest is requested conditionally (If-None-Match/If-Modified-Since), so
+  as long as it hasn't changed since the last check that found nothing to
+  do, a check costs the server a bodiless 304.
+  Otherwise the image is streamed into the inactive partition through the
+  same flash writer as browser uploads (OTAFlashWriter.h). The writer
+  hashes it on the way, and the image is only committed if size and
+  SHA-256 match the manifest.
+
+  The download runs in its own task, so loop() keeps running. Connect and
+  read timeouts bound each attempt. A failed attempt is retried, and keeps
+  the whole sectors it already wrote if the server honours a Range request.
+  The result is picked up by handleOTAPull() in loop context, which calls
+  onOTAEnd() exactly like an upload does.
+
+  Generate a manifest for a build with tools/make_manifest.py and serve
+  both files from any HTTP server.
+*/
+#include <HTTPClient.h>
+
+// Implemented in OTAMulticast.h and OTAPeerRelay.h
+bool isOTAMulticastReceiving();
+bool fetchOTAFromPeers(const uint8_t *sha256, size_t imageSize, String &error);
+
+// Manifest location; set with -DOTA_PULL_MANIFEST_URL=\"http://...\" in
+// build_flags. Pull updates are disabled while it is empty.
+#ifndef OTA_PULL_MANIFEST_URL
+#define OTA_PULL_MANIFEST_URL ""
+#endif
+
+const uint16_t OTA_PULL_CONNECT_TIMEOUT_MS = 5000;
+const uint16_t OTA_PULL_READ_TIMEOUT_MS = 10000;
+
+// Attempts per download and the delay between them (multiplied by attempt)
+const int OTA_PULL_ATTEMPTS = 3;
+const unsigned long OTA_PULL_RETRY_DELAY_MS = 2000;
+
+// Largest manifest accepted
+const size_t OTA_PULL_MANIFEST_MAX_SIZE = 1024;
+
+// Download task placement; network I/O belongs next to lwIP on core 0
+const BaseType_t OTA_PULL_CORE = 0;
+const UBaseType_t OTA_PULL_PRIORITY = 1;
+const uint32_t OTA_PULL_STACK_SIZE = 8192;
+
+enum OTAPullState {
+  OTA_PULL_IDLE,
+  OTA_PULL_RUNNING,     // Task is fetching the manifest or image
+  OTA_PULL_UP_TO_DATE,  // Manifest names the running version
+  OTA_PULL_DOWNLOADED,  // New image written and committed
+  OTA_PULL_FAILED
+};
+
+struct OTAManifest {
+  String version;
+  size_t size;
+  uint8_t sha256[OTA_SHA256_SIZE];
+  String url;
+};
+
+volatile OTAPullState otaPullState = OTA_PULL_IDLE;
+String otaPullError;
+
+// Validators of the last manifest that needed no update
+String otaManifestETag;
+String otaManifestLastModified;
+
+// True once the image download started, i.e. onOTAStart() was called
+bool isOTAPullDownloading = false;
+
+/**
+ * Extract a top-level string or number field from a flat JSON object
+ *
+ * Good enough for the manifest, which has no nesting or escapes.
+ */
+bool getJSONField(const String &json, const char *key, String &value) {
+  int pos = json.indexOf(String("\"") + key + "\"");
+  if (pos < 0) {
+    return false;
+  }
+  pos = json.indexOf(':', pos);
+  if (pos < 0) {
+    return false;
+  }
+  pos++;
+  while (pos < (int)json.length() && isspace(json[pos])) {
+    pos++;
+  }
+
+  int end;
+  if (json[pos] == '"') {
+    pos++;
+    end = json.indexOf('"', pos);
+  } else {
+    end = pos;
+    while (end < (int)json.length() && (isdigit(json[end]) || json[end] == '.')) {
+      end++;
+    }
+  }
+  if (end <= pos) {
+    return false;
+  }
+  value = json.substring(pos, end);
+  return true;
+}
+
+/**
+ * Parse the manifest body; sets otaPullError on failure
+ */
+bool parseOTAManifest(const String &json, OTAManifest &manifest) {
+  String size, sha256;
+  if (!getJSONField(json, "version", manifest.version) || !getJSONField(json, "size", size) ||
+      !getJSONField(json, "sha256", sha256) || !getJSONField(json, "url", manifest.url)) {
+    otaPullError = "Manifest incomplete";
+    return false;
+  }
+  manifest.size = size.toInt();
+  if (manifest.size == 0 || !parseSHA256Hex(sha256, manifest.sha256)) {
+    otaPullError = "Manifest invalid";
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Download and parse the manifest
+ *
+ * Sets isNotModified (and returns false) if the server answered 304.
+ */
+bool fetchOTAManifest(OTAManifest &manifest, String &etag, String &lastModified, bool &isNotModified) {
+  isNotModified = false;
+
+  HTTPClient http;
+  http.setConnectTimeout(OTA_PULL_CONNECT_TIMEOUT_MS);
+  http.setTimeout(OTA_PULL_READ_TIMEOUT_MS);
+  if (!http.begin(OTA_PULL_MANIFEST_URL)) {
+    otaPullError = "Manifest URL invalid";
+    return false;
+  }
+
+  const char *validators[] = { "ETag", "Last-Modified" };
+  http.collectHeaders(validators, 2);
+  if (otaManifestETag.length()) {
+    http.addHeader("If-None-Match", otaManifestETag);
+  }
+  if (otaManifestLastModified.length()) {
+    http.addHeader("If-Modified-Since", otaManifestLastModified);
+  }
+
+  int status = http.GET();
+  if (status == HTTP_CODE_NOT_MODIFIED) {
+    isNotModified = true;
+    http.end();
+    return false;
+  }
+  if (status != HTTP_CODE_OK) {
+    otaPullError = "Manifest request failed: " + (status < 0 ? http.errorToString(status) : String(status));
+    http.end();
+    return false;
+  }
+  if (http.getSize() > (int)OTA_PULL_MANIFEST_MAX_SIZE) {
+    otaPullError = "Manifest too large";
+    http.end();
+    return false;
+  }
+
+  etag = http.header("ETag");
+  lastModified = http.header("Last-Modified");
+  String body = http.getString();
+  http.end();
+  return parseOTAManifest(body, manifest);
+}
+
+/**
+ * One download attempt, continuing from the writer's current offset
+ *
+ * The writer session must be running. Returns true once manifest.size
+ * bytes have been queued.
+ */
+bool downloadOTAImage(const OTAManifest &manifest) {
+  HTTPClient http;
+  http.setConnectTimeout(OTA_PULL_CONNECT_TIMEOUT_MS);
+  http.setTimeout(OTA_PULL_READ_TIMEOUT_MS);
+  if (!http.begin(manifest.url)) {
+    otaPullError = "Image URL invalid";
+    return false;
+  }
+
+  size_t offset = otaWriteOffset;
+  if (offset > 0) {
+    http.addHeader("Range", "bytes=" + String(offset) + "-");
+  }
+
+  int status = http.GET();
+  if (status == HTTP_CODE_OK && offset > 0) {
+    // Server ignored the range; start over
+    otaWriterAbort();
+    if (!otaWriterBegin(OTA_WRITER_PULL, manifest.size)) {
+      otaPullError = "OTA could not begin";
+      http.end();
+      return false;
+    }
+    otaImageCheckBegin(otaTargetPartition->size);
+    offset = 0;
+  } else if (status != HTTP_CODE_OK && status != HTTP_CODE_PARTIAL_CONTENT) {
+    otaPullError = "Image request failed: " + (status < 0 ? http.errorToString(status) : String(status));
+    http.end();
+    return false;
+  }
+
+  WiFiClient *stream = http.getStreamPtr();
+  uint8_t buffer[1024];
+  size_t received = offset;
+  unsigned long lastDataMillis = millis();
+
+  while (received < manifest.size) {
+    size_t available = stream->available();
+    if (available == 0) {
+      if (!stream->connected() || millis() - lastDataMillis >= OTA_PULL_READ_TIMEOUT_MS) {
+        otaPullError = "Image download interrupted";
+        http.end();
+        return false;
+      }
+      delay(1);
+      continue;
+    }
+
+    int n = stream->read(buffer, min(available, min(sizeof(buffer), manifest.size - received)));
+    if (n <= 0) {
+      continue;
+    }
+    if (!otaImageCheckWrite(buffer, n)) {
+      // Retrying won't fix the image
+      otaPullError = otaImageErrorString(otaImageCheck.error);
+      otaWriterAbort();
+      http.end();
+      return false;
+    }
+    if (otaWriterWrite(buffer, n) != (size_t)n) {
+      otaPullError = "Flash write failed";
+      http.end();
+      return false;
+    }
+    received += n;
+    lastDataMillis = millis();
+    onOTAProgress(received, manifest.size);
+  }
+
+  http.end();
+  return true;
+}
+
+/**
+ * Restart the writer after a failed attempt, keeping the whole sectors
+ * already written (none if the writer was aborted)
+ */
+bool resumeOTAPull(const OTAManifest &manifest) {
+  size_t offset = otaWriterSuspend();
+  if (!otaWriterBegin(OTA_WRITER_PULL, manifest.size, offset)) {
+    otaPullError = "OTA could not resume";
+    return false;
+  }
+  // The header was already checked unless starting over
+  if (offset > 0) {
+    otaImageCheckDisable();
+  } else {
+    otaImageCheckBegin(otaTargetPartition->size);
+  }
+  return true;
+}
+
+/**
+ * Download the image with retries, then verify and commit it
+ */
+bool pullOTAImage(const OTAManifest &manifest) {
+  if (!otaWriterBegin(OTA_WRITER_PULL, manifest.size)) {
+    otaPullError = "OTA could not begin";
+    return false;
+  }
+  otaImageCheckBegin(otaTargetPartition->size);
+
+  bool downloaded = false;
+  #if OTA_PEER_RELAY
+  // Neighbours that already run the image spare the server
+  downloaded = fetchOTAFromPeers(manifest.sha256, manifest.size, otaPullError);
+  if (!downloaded) {
+    Serial.printf("OTA: Not fetched from peers (%s), using the server\n", otaPullError.c_str());
+    if (!resumeOTAPull(manifest)) {
+      return false;
+    }
+  }
+  #endif
+
+  for (int attempt = 1; attempt <= OTA_PULL_ATTEMPTS && !downloaded; attempt++) {
+    downloaded = downloadOTAImage(manifest);
+    if (!downloaded && attempt < OTA_PULL_ATTEMPTS && isOTAWriterActive) {
+      Serial.printf("OTA: Pull attempt %d failed (%s), retrying\n", attempt, otaPullError.c_str());
+      delay(OTA_PULL_RETRY_DELAY_MS * attempt);
+
+      // Keep whole sectors and ask for the rest
+      if (!resumeOTAPull(manifest)) {
+        return false;
+      }
+    }
+  }
+
+  if (!downloaded) {
+    otaWriterAbort();
+    return false;
+  }
+
+  if (!otaImageCheckEnd()) {
+    otaWriterAbort();
+    otaPullError = otaImageErrorString(otaImageCheck.error);
+  } else if (!otaWriterEnd()) {
+    otaPullError = "Flash write failed";
+  } else if (memcmp(otaWriterDigest(), manifest.sha256, OTA_SHA256_SIZE) != 0) {
+    otaPullError = "SHA-256 mismatch";
+  } else if (!otaWriterCommit()) {
+    otaPullError = "Image validation failed";
+  } else {
+    printOTAWriterStats();
+    return true;
+  }
+  printOTAWriterStats();
+  return false;
+}
+
+/**
+ * Pull task: check the manifest and download the image if it is newer
+ */
+void otaPullTask(void * /* param */) {
+  OTAManifest manifest;
+  OTAPullState result = OTA_PULL_FAILED;
+  String etag, lastModified;
+  bool isNotModified;
+
+  if (fetchOTAManifest(manifest, etag, lastModified, isNotModified)) {
+    bool isSameImage = isRunningImage("", manifest.sha256);
+    if (manifest.version == currentFirmwareVersion() || isSameImage) {
+      // Republished build under a new version
+      if (isSameImage && manifest.version != currentFirmwareVersion()) {
+        recordIdenticalImageReject();
+      }
+      // Nothing to do until the manifest changes
+      otaManifestETag = etag;
+      otaManifestLastModified = lastModified;
+      result = OTA_PULL_UP_TO_DATE;
+    } else {
+      Serial.printf("OTA: Pulling version %s (%u bytes), running %s\n",
+                    manifest.version.c_str(), manifest.size, currentFirmwareVersion());
+      isOTAPullDownloading = true;
+      onOTAStart();
+      result = pullOTAImage(manifest) ? OTA_PULL_DOWNLOADED : OTA_PULL_FAILED;
+    }
+  } else if (isNotModified) {
+    result = OTA_PULL_UP_TO_DATE;
+  }
+
+  otaPullState = result;
+  vTaskDelete(NULL);
+}
+
+/**
+ * Check the manifest and update if needed, in the background
+ *
+ * Returns false if pull updates are not configured or a check or upload is
+ * already running. The outcome is handled by handleOTAPull().
+ */
+bool startOTAPull() {
+  if (strlen(OTA_PULL_MANIFEST_URL) == 0 || otaPullState == OTA_PULL_RUNNING || isOTAWriterActive ||
+      isOTAMulticastReceiving()) {
+    return false;
+  }
+
+  otaPullError = "";
+  isOTAPullDownloading = false;
+  otaPullState = OTA_PULL_RUNNING;
+  if (xTaskCreatePinnedToCore(otaPullTask, "ota_pull", OTA_PULL_STACK_SIZE, NULL,
+                              OTA_PULL_PRIORITY, NULL, OTA_PULL_CORE) != pdPASS) {
+    otaPullState = OTA_PULL_IDLE;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Finish a completed pull from loop context
+ *
+ * Returns the outcome of a pull that just completed, or OTA_PULL_IDLE /
+ * OTA_PULL_RUNNING if there is none.
+ */
+OTAPullState handleOTAPull() {
+  OTAPullState result = otaPullState;
+  switch (result) {
+    case OTA_PULL_UP_TO_DATE:
+      #ifdef OTA_DEBUG_ENABLED
+      Serial.printf("OTA: Firmware %s is up to date\n", currentFirmwareVersion());
+      #endif
+      otaPullState = OTA_PULL_IDLE;
+      break;
+
+    case OTA_PULL_DOWNLOADED:
+      otaPullState = OTA_PULL_IDLE;
+      onOTAEnd(true);
+      break;
+
+    case OTA_PULL_FAILED:
+      Serial.printf("OTA: Pull update failed - %s\n", otaPullError.c_str());
+      otaPullState = OTA_PULL_IDLE;
+      if (isOTAPullDownloading) {
+        onOTAEnd(false);
+      }
+      break;
+
+    case OTA_PULL_IDLE:
+    case OTA_PULL_RUNNING:
+      break;
+  }
+  return result;
+}
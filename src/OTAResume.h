@@ -0,0 +1,90 @@
+/*
+  -----------------------
+  Resumable Upload State
+  -----------------------
+
+  Persists enough about an interrupted firmware upload to continue it
+  after the connection drops: a session ID, the MD5 of the image being
+  uploaded and the partition offset up to which whole sectors are safely
+  on flash. The state lives in NVS so it also survives a reboot into the
+  same firmware.
+
+  The offset is checkpointed every OTA_RESUME_CHECKPOINT_BYTES rather than
+  after every sector to keep NVS wear low; on disconnect the exact flushed
+  offset is stored.
+*/
+#include <Preferences.h>
+
+const char *OTA_RESUME_NAMESPACE = "ota-resume";
+
+// How much new data must be on flash before the offset is saved again
+const size_t OTA_RESUME_CHECKPOINT_BYTES = 64 * 1024;
+
+struct OTAResumeState {
+  String session;     // Random ID of the upload session
+  String hash;        // MD5 of the complete image, as sent by the client
+  uint32_t offset;    // Bytes of the image already on flash
+  uint32_t partition; // Flash address of the partition being written
+};
+
+/**
+ * Create a new random session ID
+ */
+String newOTASessionId() {
+  char id[9];
+  snprintf(id, sizeof(id), "%08lx", (unsigned long)esp_random());
+  return String(id);
+}
+
+/**
+ * Load the state of an interrupted upload; returns false if there is none
+ */
+bool loadOTAResume(OTAResumeState &state) {
+  Preferences prefs;
+  if (!prefs.begin(OTA_RESUME_NAMESPACE, true)) {
+    return false;
+  }
+  state.session = prefs.getString("session", "");
+  state.hash = prefs.getString("hash", "");
+  state.offset = prefs.getUInt("offset", 0);
+  state.partition = prefs.getUInt("partition", 0);
+  prefs.end();
+
+  return state.session.length() > 0 && state.hash.length() > 0;
+}
+
+/**
+ * Persist the state of a new upload session
+ */
+void saveOTAResume(const OTAResumeState &state) {
+  Preferences prefs;
+  if (prefs.begin(OTA_RESUME_NAMESPACE, false)) {
+    prefs.putString("session", state.session);
+    prefs.putString("hash", state.hash);
+    prefs.putUInt("offset", state.offset);
+    prefs.putUInt("partition", state.partition);
+    prefs.end();
+  }
+}
+
+/**
+ * Update the committed offset of the current session
+ */
+void saveOTAResumeOffset(uint32_t offset) {
+  Preferences prefs;
+  if (prefs.begin(OTA_RESUME_NAMESPACE, false)) {
+    prefs.putUInt("offset", offset);
+    prefs.end();
+  }
+}
+
+/**
+ * Forget the current session, e.g. after it completed or was replaced
+ */
+void clearOTAResume() {
+  Preferences prefs;
+  if (prefs.begin(OTA_RESUME_NAMESPACE, false)) {
+    prefs.clear();
+    prefs.end();
+  }
+}
@@ -0,0 +1,104 @@
+/*
+  -----------------------
+  Update Check Scheduler
+  -----------------------
+
+  Decides when the pull client (OTAPull.h) checks the manifest.
+
+  A fleet that checks on a fixed schedule hits the server in lockstep,
+  especially after a power cut brings every device online at once. So each
+  device waits a random time after coming online before the first check,
+  and every following interval is drawn at random from
+  [interval/2, 3*interval/2].
+
+  Failed checks back off exponentially, again with jitter, so an outage of
+  the update server doesn't turn into a retry storm when it comes back.
+
+  Checks are only made while the station link is up.
+*/
+
+// Average time between checks
+const unsigned long OTA_CHECK_INTERVAL_MS = 6UL * 60 * 60 * 1000;
+
+// First check happens within this time after coming online
+const unsigned long OTA_CHECK_STARTUP_WINDOW_MS = 5UL * 60 * 1000;
+
+// Backoff after a failed check: doubles per failure, up to the maximum
+const unsigned long OTA_CHECK_BACKOFF_BASE_MS = 60UL * 1000;
+const unsigned long OTA_CHECK_BACKOFF_MAX_MS = OTA_CHECK_INTERVAL_MS;
+
+bool isOTACheckScheduled = false;
+unsigned long otaCheckScheduledMillis = 0;
+unsigned long otaCheckDelayMillis = 0;
+
+// Failed checks in a row
+uint8_t otaCheckFailures = 0;
+
+/**
+ * Schedule the next check delayMs from now
+ */
+void scheduleOTACheck(unsigned long delayMs) {
+  isOTACheckScheduled = true;
+  otaCheckScheduledMillis = millis();
+  otaCheckDelayMillis = delayMs;
+
+  #ifdef OTA_DEBUG_ENABLED
+  Serial.printf("OTA: Next update check in %lu s\n", delayMs / 1000);
+  #endif
+}
+
+/**
+ * Random delay uniformly distributed in [base/2, 3*base/2)
+ */
+unsigned long jitteredOTACheckDelay(unsigned long base) {
+  return base / 2 + esp_random() % max(base, 1UL);
+}
+
+/**
+ * Schedule the first check after the link came up
+ *
+ * Keeps an already scheduled check, so a flapping link doesn't reset the
+ * interval or the backoff.
+ */
+void onOTACheckLinkUp() {
+  if (!isOTACheckScheduled && strlen(OTA_PULL_MANIFEST_URL) > 0) {
+    scheduleOTACheck(esp_random() % OTA_CHECK_STARTUP_WINDOW_MS);
+  }
+}
+
+/**
+ * Schedule the next check from the outcome of the last one
+ */
+void onOTACheckDone(OTAPullState result) {
+  if (result == OTA_PULL_FAILED) {
+    unsigned long backoff = OTA_CHECK_BACKOFF_BASE_MS << min((int)otaCheckFailures, 16);
+    if (otaCheckFailures < 255) {
+      otaCheckFailures++;
+    }
+    scheduleOTACheck(jitteredOTACheckDelay(min(backoff, OTA_CHECK_BACKOFF_MAX_MS)));
+  } else {
+    otaCheckFailures = 0;
+    scheduleOTACheck(jitteredOTACheckDelay(OTA_CHECK_INTERVAL_MS));
+  }
+}
+
+/**
+ * Start a scheduled check when it is due; called from handleOTA()
+ */
+void handleOTAUpdateChecks(bool isOnline) {
+  OTAPullState result = handleOTAPull();
+  if (result == OTA_PULL_UP_TO_DATE || result == OTA_PULL_DOWNLOADED || result == OTA_PULL_FAILED) {
+    onOTACheckDone(result);
+  }
+
+  if (!isOTACheckScheduled || !isOnline || millis() - otaCheckScheduledMillis < otaCheckDelayMillis) {
+    return;
+  }
+
+  if (startOTAPull()) {
+    isOTACheckScheduled = false;
+  } else {
+    // An upload is using the writer; try again later
+    scheduleOTACheck(jitteredOTACheckDelay(OTA_CHECK_BACKOFF_BASE_MS));
+  }
+}
@@ -0,0 +1,1387 @@
+/*
+  -----------------------
+  Firmware Upload Handler
+  -----------------------
+
+  Takes over the firmware half of ElegantOTA's upload protocol so that
+  uploads go through the double-buffered writer in OTAFlashWriter.h
+  instead of being written to flash synchronously in the async_tcp task.
+
+  Images uploaded gzip-compressed (detected from the gzip magic) are
+  inflated on the fly by OTADecompressor.h before reaching the writer.
+  Delta patches (OTADeltaPatch.h) are recognized from their magic and
+  rebuilt against the running partition. The resulting pipeline is:
+
+    upload -> [gzip inflate] -> [delta apply] -> image check -> flash writer
+
+  The image check (OTAImageCheck.h) refuses a wrong or broken image from
+  its first bytes. The 400 response is sent right away and the rest of
+  the body is ignored.
+
+  Before that, every upload is admitted from its headers alone (see
+  admitOTAUpload()): credentials, Content-Length against the partition,
+  X-Firmware-Version / X-Image-SHA256 against the running build, and
+  whether another upload is already running. A refusal is sent as soon as
+  the headers are in. A client that sent "Expect: 100-continue" gets it
+  before any body bytes and never transmits the image. The library can't
+  be kept from writing its interim "100 Continue" after that final
+  response, so a refused connection is closed a second after the client
+  stops sending, instead of waiting for a next request.
+
+  canHandle() only checks the headers and marks the request; the session
+  itself is taken when the first body byte arrives, since another request
+  may have started receiving in between. Whether a request was refused is
+  kept with the request (OTARequestState), so several refused or competing
+  requests never touch each other's session.
+
+  With -DOTA_AUTH_USERNAME=\"...\" -DOTA_AUTH_PASSWORD=\"...\" in
+  build_flags, the update endpoints and the ElegantOTA page require HTTP
+  authentication.
+
+  Plain (uncompressed, non-delta) uploads started with a hash can be
+  resumed after a dropped connection (state kept by OTAResume.h):
+    GET  /ota/resume                          report session, hash, offset
+    GET  /ota/start?mode=fr&hash=<md5>&resume=1   reopen it, replies offset
+    POST /ota/upload?offset=<offset>          send the image from offset on
+  tools/ota_upload.py drives this automatically.
+
+  Besides the page's MD5 of the uploaded file, the SHA-256 of the final
+  image can be supplied as /ota/start?sha256=<hex> or as an
+  X-Image-SHA256 header on /ota/upload (delta patches carry it in their
+  header). The writer hashes sectors as they are written, so the check
+  costs nothing extra once the last byte arrives.
+
+  Reinstalling the running build is refused with 409 before any image
+  data is sent: /ota/start compares the page's MD5 (or sha256 parameter)
+  with the running image, and /ota/upload checks X-Image-SHA256. Add
+  force=1 to /ota/start to reinstall anyway. GET /ota/identity reports
+  the running build (BuildIdentity.h).
+
+  The ElegantOTA page talks to two endpoints:
+    GET  /ota/start?mode=fr&hash=<md5>   prepare an update
+    POST /ota/upload                     multipart upload of the .bin
+
+  The library parses multipart bodies one byte at a time and copies the
+  file into its own 1460-byte buffer. Only the start of the body is left
+  to it. At the first flush that ends a TCP buffer, the connection's data
+  callback is taken over and MultipartScanner.h finds the closing boundary
+  a whole buffer at a time. It can't be taken over earlier: body bytes
+  that arrived with the headers are parsed before any handler sees them.
+
+  Scripts can skip the multipart framing, which the library parses one
+  byte at a time, and send the image as the request body instead:
+    PUT|POST /ota/firmware[?md5=<md5>&sha256=<hex>&force=1]
+  This prepares the session itself (no /ota/start), so it takes the same
+  parameters. A body with Content-Length reaches handleBody() as the
+  buffers the TCP stack received. A chunked body of unknown length
+  (curl -T -) isn't read by the library at all: the connection's data
+  callback is taken over and ChunkedDecoder.h strips the framing in
+  place. Either way the payload goes to the pipeline without a copy.
+  Body bytes sent along with the headers would miss that callback, so a
+  chunked upload needs "Expect: 100-continue" (curl sends it) and is
+  refused with 411 without it.
+
+  Block-dedup updates (OTABlockDedup.h) send only the 4 KB blocks that
+  differ from the running image:
+    POST /ota/blocks?size=<bytes>&sha256=<hex>   block hashes in, bitmap out
+    PUT  /ota/blocks/data                        the needed blocks
+
+  With peer relay on (OTAPeerRelay.h), GET /ota/image serves the running
+  image to other devices. GET /ota/events streams progress and state
+  (OTAEventStream.h).
+
+  This handler is added to the server before ElegantOTA.begin(), so it sees
+  those requests first. It only claims firmware updates; filesystem updates
+  (mode=fs) fall through to ElegantOTA's own handlers unchanged. The same
+  onOTAStart/onOTAProgress/onOTAEnd callbacks are invoked as before.
+
+  All body data is handled in the async_tcp task, which must not wait for
+  flash. While the writer's ring is nearly full, the segment being handled
+  is not acked, so the sender's TCP window closes; handleOTAUploadAcks()
+  acks it from loop() once the writer has caught up.
+*/
+#include "OTAFlashWriter.h"
+#include "OTADecompressor.h"
+#include "OTADeltaPatch.h"
+#include "OTAResume.h"
+#include "OTAImageCheck.h"
+#include "BuildIdentity.h"
+#include "ChunkedDecoder.h"
+#include "MultipartScanner.h"
+#include "OTABlockDedup.h"
+#include <MD5Builder.h>
+
+// Upload headers checked by admitOTAUpload()
+const char *OTA_SHA256_HEADER = "X-Image-SHA256";
+const char *OTA_VERSION_HEADER = "X-Firmware-Version";
+
+// Callbacks implemented in OTA.h
+void onOTAStart();
+void onOTAProgress(size_t current, size_t final);
+void onOTAEnd(bool success);
+
+// Implemented in OTAMulticast.h and OTAPeerRelay.h
+bool isOTAMulticastReceiving();
+void handleOTAImageRequest(AsyncWebServerRequest *request);
+
+struct OTAUploadSession {
+  bool isPrepared;   // /ota/start accepted, waiting for /ota/upload
+  bool isFinished;   // Final chunk processed (successfully or not)
+  bool hasError;
+  bool isCompressed; // Upload is gzip, inflated before the writer
+  bool isFormatKnown; // First image byte seen, isDelta is valid
+  bool isDelta;      // Image stream is a delta patch
+  bool isForced;     // Reinstalling the running image was requested
+  String error;
+  String expectedMD5;
+  bool hasExpectedSHA256;
+  uint8_t expectedSHA256[OTA_SHA256_SIZE];
+  String sessionId;    // Set when the upload can be resumed
+  size_t resumeOffset; // Image offset this upload continues from
+  size_t lastCheckpoint;
+  size_t received;
+  unsigned long startMillis; // First upload byte received
+  bool isResponseSent;       // Refused early, response already sent
+  bool isReceiving;          // An upload request is streaming its body
+  bool isHoldingReboot; // Success response not yet delivered
+  bool isScanPending;   // Multipart body to be taken over from the library
+  const char *transport;   // How the body arrives, for the receive stats
+  uint64_t receiveCycles;  // CPU cycles spent handling body data
+};
+
+OTAUploadSession otaSession;
+
+// MD5 of the uploaded file as sent, which is what the ElegantOTA page hashes
+MD5Builder otaUploadMD5;
+
+// Multipart framing around the file, at most (boundaries and part headers)
+const size_t OTA_MULTIPART_OVERHEAD_MAX = 1024;
+
+// Seconds without data after which the library closes a refused connection
+const uint32_t OTA_REFUSED_CLOSE_SECONDS = 1;
+
+// State of a request with a body (/ota/upload, /ota/firmware, /ota/blocks,
+// /ota/blocks/data), kept in request->_tempObject and freed with it. A
+// /ota/blocks request keeps its block hashes right behind it, so requests
+// racing each other each fill their own copy.
+struct OTARequestState {
+  bool isAnswered; // Refused or responded to; the rest of the body is ignored
+  bool isStarted; // The upload session is receiving this request's body
+  bool isChunked; // Raw body with chunked transfer encoding
+  ChunkedDecoder chunked; // Framing state of a chunked /ota/firmware body
+};
+
+// Boundary search in a multipart /ota/upload body
+MultipartScanner otaMultipart;
+
+// Size of ESPAsyncWebServer's upload buffer; shorter pieces end a TCP buffer
+const size_t OTA_MULTIPART_ITEM_BUFFER = 1460;
+
+// Ring space below which upload data is left unacked. Covers a full TCP
+// receive window (CONFIG_LWIP_TCP_WND_DEFAULT, 5744 bytes) still in flight
+// when the acks stop, so those segments are queued without waiting.
+const size_t OTA_UPLOAD_ACK_RESERVE = 8 * 1024;
+
+// Upload connection with data left unacked, and the lock that keeps it from
+// being freed while loop() acks it
+AsyncClient *otaAckHeldClient = NULL;
+SemaphoreHandle_t otaAckLock = NULL;
+
+/**
+ * Check the request's credentials, if any are configured
+ */
+bool isOTARequestAuthorized(AsyncWebServerRequest *request) {
+  #ifdef OTA_AUTH_USERNAME
+  return request->authenticate(OTA_AUTH_USERNAME, OTA_AUTH_PASSWORD);
+  #else
+  (void)request;
+  return true;
+  #endif
+}
+
+/**
+ * Per-request state of request, or NULL if it has none
+ */
+OTARequestState *otaRequestState(AsyncWebServerRequest *request) {
+  return (OTARequestState *)request->_tempObject;
+}
+
+/**
+ * Attach fresh per-request state to request
+ *
+ * extra bytes are allocated behind the state. Returns NULL when out of
+ * memory; a request without state counts as refused.
+ */
+OTARequestState *newOTARequestState(AsyncWebServerRequest *request, size_t extra = 0) {
+  free(request->_tempObject);
+  request->_tempObject = calloc(1, sizeof(OTARequestState) + extra);
+  return otaRequestState(request);
+}
+
+/**
+ * The extra bytes allocated behind the state of request
+ */
+uint8_t *otaRequestBuffer(AsyncWebServerRequest *request) {
+  return (uint8_t *)(otaRequestState(request) + 1);
+}
+
+/**
+ * Whether a request with a body has been answered and is to be ignored
+ */
+bool isOTARequestAnswered(AsyncWebServerRequest *request) {
+  OTARequestState *state = otaRequestState(request);
+  return state == NULL || state->isAnswered;
+}
+
+/**
+ * Mark request as answered, so nothing more of it is processed
+ */
+void markOTARequestAnswered(AsyncWebServerRequest *request) {
+  OTARequestState *state = otaRequestState(request);
+  if (state == NULL) {
+    state = newOTARequestState(request);
+  }
+  if (state != NULL) {
+    state->isAnswered = true;
+  }
+}
+
+/**
+ * Decide from the headers alone whether an upload may proceed
+ *
+ * resumeOffset and isForced are those of the session the upload is for.
+ * Returns 0 to accept, otherwise the HTTP status to refuse with; error is
+ * set to the reason.
+ */
+int admitOTAUpload(AsyncWebServerRequest *request, size_t resumeOffset, bool isForced, const char *&error) {
+  if (!isOTARequestAuthorized(request)) {
+    error = "Authentication required";
+    return 401;
+  }
+  if (otaSession.isReceiving) {
+    error = "Another upload is in progress";
+    return 409;
+  }
+
+  // Even a compressed image or patch can't usefully exceed the partition.
+  // Before the first session of this boot no writer has picked it yet.
+  const esp_partition_t *target = otaTargetPartition != NULL ? otaTargetPartition :
+                                  esp_ota_get_next_update_partition(NULL);
+  if (target != NULL && request->contentLength() > target->size - resumeOffset + OTA_MULTIPART_OVERHEAD_MAX) {
+    error = otaImageErrorString(OTA_IMAGE_TOO_LARGE);
+    return 413;
+  }
+
+  bool isSameBuild = false;
+  if (request->hasHeader(OTA_SHA256_HEADER)) {
+    uint8_t sha256[OTA_SHA256_SIZE];
+    if (!parseSHA256Hex(request->header(OTA_SHA256_HEADER), sha256)) {
+      error = "X-Image-SHA256 header invalid";
+      return 400;
+    }
+    isSameBuild = isRunningImage("", sha256);
+  }
+  if (request->hasHeader(OTA_VERSION_HEADER) &&
+      request->header(OTA_VERSION_HEADER) == currentFirmwareVersion()) {
+    isSameBuild = true;
+  }
+  if (isSameBuild && !isForced) {
+    recordIdenticalImageReject();
+    error = "Firmware already running";
+    return 409;
+  }
+
+  return 0;
+}
+
+/**
+ * Answer a request with a body that won't be processed
+ *
+ * Called from its headers or, if the session was taken meanwhile, on its
+ * first body byte. The request is marked so the rest of its body and the
+ * final handleRequest() are ignored.
+ */
+void refuseOTAUpload(AsyncWebServerRequest *request, int status, const char *error) {
+  Serial.printf("OTA: Upload refused: %d %s\n", status, error);
+
+  markOTARequestAnswered(request);
+
+  if (status == 401) {
+    request->requestAuthentication();
+  } else {
+    AsyncWebServerResponse *response = request->beginResponse(status, "text/plain", error);
+    response->addHeader("Connection", "close");
+    response->addHeader("Access-Control-Allow-Origin", "*");
+    request->send(response);
+  }
+
+  // Refused from its headers, the request still gets the library's
+  // "100 Continue" after this reply. Don't leave the connection open for a
+  // client to read that as the start of another response: the library
+  // closes it once the client has nothing more to send (send() clears the
+  // timeout, so it is set after).
+  request->client()->setRxTimeout(OTA_REFUSED_CLOSE_SECONDS);
+}
+
+/**
+ * Leave the segment being handled unacked if the writer is falling behind
+ * (async_tcp task)
+ */
+void throttleOTAUpload(AsyncWebServerRequest *request) {
+  if (otaWriterSpace() >= OTA_UPLOAD_ACK_RESERVE) {
+    return;
+  }
+  if (otaAckLock == NULL && (otaAckLock = xSemaphoreCreateMutex()) == NULL) {
+    return;
+  }
+  request->client()->ackLater();
+  xSemaphoreTake(otaAckLock, portMAX_DELAY);
+  otaAckHeldClient = request->client();
+  xSemaphoreGive(otaAckLock);
+}
+
+/**
+ * Forget the upload connection before it is freed (async_tcp task)
+ */
+void releaseOTAUploadAcks() {
+  if (otaAckLock == NULL) {
+    return;
+  }
+  xSemaphoreTake(otaAckLock, portMAX_DELAY);
+  otaAckHeldClient = NULL;
+  xSemaphoreGive(otaAckLock);
+}
+
+/**
+ * Ack held-back upload data once the writer has made room; called from
+ * handleOTA()
+ */
+void handleOTAUploadAcks() {
+  if (otaAckHeldClient == NULL || otaWriterSpace() < OTA_UPLOAD_ACK_RESERVE) {
+    return;
+  }
+  xSemaphoreTake(otaAckLock, portMAX_DELAY);
+  if (otaAckHeldClient != NULL) {
+    otaAckHeldClient->ack(SIZE_MAX);
+    otaAckHeldClient = NULL;
+  }
+  xSemaphoreGive(otaAckLock);
+}
+
+/**
+ * Abort the writer session if an upload holds it
+ *
+ * A pull claims the writer from its own task; an upload request must
+ * never tear that session down. An upload-owned session only changes
+ * hands in async_tcp, so the owner can't change between check and abort.
+ */
+void abortOTAUploadWriter() {
+  if (otaWriterOwner == OTA_WRITER_UPLOAD) {
+    otaWriterAbort();
+  }
+}
+
+/**
+ * Fail the current upload and discard anything written so far
+ */
+void failOTAUpload(const char *error) {
+  if (!otaSession.hasError) {
+    otaSession.hasError = true;
+    otaSession.error = error;
+    #ifdef OTA_DEBUG_ENABLED
+    Serial.printf("OTA: Upload failed - %s\n", error);
+    #endif
+  }
+  otaInflateRelease();
+  otaDeltaRelease();
+  abortOTAUploadWriter();
+}
+
+/**
+ * Refuse the upload right away instead of at the end of the body
+ *
+ * Sends the error response immediately; the rest of the body is ignored.
+ */
+void rejectOTAUpload(AsyncWebServerRequest *request, const char *error) {
+  failOTAUpload(error);
+  Serial.printf("OTA: Image refused after %u bytes, %lu ms: %s\n",
+                otaSession.received, millis() - otaSession.startMillis, error);
+
+  otaSession.isFinished = true;
+  otaSession.isPrepared = false;
+  otaSession.isResponseSent = true;
+  otaSession.isReceiving = false;
+  markOTARequestAnswered(request);
+  clearOTAResume();
+
+  AsyncWebServerResponse *response = request->beginResponse(400, "text/plain", error);
+  response->addHeader("Connection", "close");
+  response->addHeader("Access-Control-Allow-Origin", "*");
+  request->send(response);
+
+  onOTAEnd(false);
+}
+
+/**
+ * Whether an interrupted upload can be continued later
+ *
+ * Only plain images qualify: the inflater and patch state can't be
+ * restored, but a plain image continues from any sector boundary.
+ */
+bool isOTAUploadResumable() {
+  return otaSession.sessionId.length() && !otaSession.isCompressed &&
+         otaSession.isFormatKnown && !otaSession.isDelta;
+}
+
+/**
+ * Keep the sectors written so far and record where to continue
+ */
+void suspendOTAUpload() {
+  size_t offset = otaWriterSuspend();
+  saveOTAResumeOffset(offset);
+  Serial.printf("OTA: Upload interrupted, session %s can resume from %u bytes\n",
+                otaSession.sessionId.c_str(), offset);
+}
+
+/**
+ * Re-hash the part of the image already on flash before a resumed upload
+ */
+bool rehashWrittenImage(const esp_partition_t *partition, size_t length) {
+  uint8_t *buffer = (uint8_t *)malloc(OTA_SECTOR_SIZE);
+  if (buffer == NULL) {
+    return false;
+  }
+
+  bool ok = true;
+  for (size_t offset = 0; offset < length && ok; offset += OTA_SECTOR_SIZE) {
+    size_t n = min(OTA_SECTOR_SIZE, length - offset);
+    ok = esp_partition_read(partition, offset, buffer, n) == ESP_OK;
+    otaUploadMD5.add(buffer, n);
+  }
+
+  free(buffer);
+  return ok;
+}
+
+/**
+ * OTASink for the (decompressed) image stream
+ *
+ * Decides from the first byte whether the stream is a full image or a
+ * delta patch and routes it accordingly.
+ */
+bool otaImageSink(const uint8_t *data, size_t len) {
+  if (!otaSession.isFormatKnown) {
+    otaSession.isFormatKnown = true;
+    otaSession.isDelta = isDeltaPatch(data, len);
+    if (otaSession.isDelta && !otaDeltaBegin(otaCheckedWriterSink)) {
+      return false;
+    }
+  }
+  return otaSession.isDelta ? otaDeltaWrite(data, len) : otaCheckedWriterSink(data, len);
+}
+
+/**
+ * Pass upload data to the first pipeline stage
+ */
+bool writeOTAUploadData(const uint8_t *data, size_t len) {
+  return otaSession.isCompressed ? otaInflateWrite(data, len) : otaImageSink(data, len);
+}
+
+/**
+ * Check the parameters of request for a new update session without
+ * touching the current one
+ *
+ * Returns the HTTP status (200 if a session can be prepared) and sets
+ * reply to the reason for a refusal.
+ */
+int checkOTASession(AsyncWebServerRequest *request, String &reply) {
+  // The writer is held by a pull (or its peer relay), an upload is
+  // streaming into the current session, or a multicast session owns the
+  // inactive partition
+  OTAWriterOwner owner = otaWriterOwner;
+  if ((owner != OTA_WRITER_IDLE && owner != OTA_WRITER_UPLOAD) || otaSession.isReceiving ||
+      isOTAMulticastReceiving()) {
+    reply = "Another update is in progress";
+    return 409;
+  }
+
+  // The page sends "hash", /ota/firmware callers may say "md5"
+  const char *md5Param = request->hasParam("md5") ? "md5" : "hash";
+  String md5 = request->hasParam(md5Param) ? request->getParam(md5Param)->value() : "";
+  if (md5.length() && md5.length() != 32) {
+    reply = "MD5 parameter invalid";
+    return 400;
+  }
+
+  uint8_t sha256[OTA_SHA256_SIZE];
+  bool hasSHA256 = request->hasParam("sha256");
+  if (hasSHA256 && !parseSHA256Hex(request->getParam("sha256")->value(), sha256)) {
+    reply = "SHA-256 parameter invalid";
+    return 400;
+  }
+
+  if (!request->hasParam("force") && isRunningImage(md5, hasSHA256 ? sha256 : NULL)) {
+    recordIdenticalImageReject();
+    reply = "Firmware already running";
+    return 409;
+  }
+  return 200;
+}
+
+/**
+ * Prepare a new update session for the parameters of request
+ *
+ * Shared by /ota/start, /ota/firmware and /ota/blocks. Returns the HTTP
+ * status (200 on success) and sets reply to the response text.
+ */
+int prepareOTASession(AsyncWebServerRequest *request, String &reply) {
+  int status = checkOTASession(request, reply);
+  if (status != 200) {
+    return status;
+  }
+
+  // A new start replaces any upload session that never completed
+  abortOTAUploadWriter();
+  otaBlocksRelease();
+
+  otaSession.isPrepared = false;
+  otaSession.isFinished = false;
+  otaSession.hasError = false;
+  otaSession.isCompressed = false;
+  otaSession.isFormatKnown = false;
+  otaSession.isDelta = false;
+  otaSession.isForced = request->hasParam("force");
+  otaSession.error = "";
+  otaSession.sessionId = "";
+  otaSession.resumeOffset = 0;
+  otaSession.lastCheckpoint = 0;
+  otaSession.received = 0;
+  otaSession.isResponseSent = false;
+  otaSession.isScanPending = false;
+  // Validated by checkOTASession()
+  const char *md5Param = request->hasParam("md5") ? "md5" : "hash";
+  otaSession.expectedMD5 = request->hasParam(md5Param) ? request->getParam(md5Param)->value() : "";
+  otaSession.hasExpectedSHA256 = request->hasParam("sha256") &&
+                                 parseSHA256Hex(request->getParam("sha256")->value(), otaSession.expectedSHA256);
+  otaUploadMD5.begin();
+
+  onOTAStart();
+
+  const esp_partition_t *target = esp_ota_get_next_update_partition(NULL);
+  OTAResumeState resume;
+  bool canResume = request->hasParam("resume") && target != NULL &&
+                   loadOTAResume(resume) && resume.offset > 0 &&
+                   resume.hash.equalsIgnoreCase(otaSession.expectedMD5) &&
+                   resume.partition == target->address;
+
+  if (canResume) {
+    // Continue the interrupted session: the image up to resume.offset is
+    // already on flash, only the MD5 state has to be rebuilt
+    if (!rehashWrittenImage(target, resume.offset) ||
+        !otaWriterBegin(OTA_WRITER_UPLOAD, 0, resume.offset, OTA_WRITER_ASYNC_SEND_TIMEOUT)) {
+      reply = "OTA could not resume";
+      onOTAEnd(false);
+      return 400;
+    }
+    otaSession.sessionId = resume.session;
+    otaSession.resumeOffset = resume.offset;
+    otaSession.lastCheckpoint = resume.offset;
+    otaSession.isFormatKnown = true; // A resumable session is always a plain image
+    otaImageCheckDisable();          // Its header was checked before the drop
+    Serial.printf("OTA: Resuming session %s at %u bytes\n", resume.session.c_str(), resume.offset);
+  } else {
+    clearOTAResume();
+    if (!otaWriterBegin(OTA_WRITER_UPLOAD, 0, 0, OTA_WRITER_ASYNC_SEND_TIMEOUT)) {
+      reply = "OTA could not begin";
+      onOTAEnd(false);
+      return 400;
+    }
+    otaImageCheckBegin(target->size);
+    // Uploads with a known hash can be matched up again after a drop
+    if (otaSession.expectedMD5.length() && target != NULL) {
+      otaSession.sessionId = newOTASessionId();
+      saveOTAResume({ otaSession.sessionId, otaSession.expectedMD5, 0, target->address });
+    }
+  }
+
+  otaSession.isPrepared = true;
+  reply = canResume ? String(otaSession.resumeOffset) : String("OK");
+  return 200;
+}
+
+/**
+ * Drop a session prepared for a request that was then refused
+ */
+void abandonOTASession(const char *error) {
+  failOTAUpload(error);
+  clearOTAResume();
+  otaSession.isPrepared = false;
+  onOTAEnd(false);
+}
+
+/**
+ * Clean up after the connection of an upload closed
+ *
+ * A dropped connection never reaches the final response. Keep what was
+ * written if the upload can be resumed, otherwise discard it so the next
+ * session begins cleanly.
+ */
+void onOTAUploadDisconnect() {
+  otaSession.isReceiving = false;
+  releaseOTAUploadAcks();
+
+  // The success response has reached the client
+  if (otaSession.isHoldingReboot) {
+    otaSession.isHoldingReboot = false;
+    releaseReboot();
+  }
+
+  if (otaSession.isPrepared && !otaSession.isFinished) {
+    if (isOTAUploadResumable() && !otaSession.hasError) {
+      suspendOTAUpload();
+    } else {
+      failOTAUpload("Connection lost");
+      clearOTAResume();
+    }
+    otaSession.isPrepared = false;
+    onOTAEnd(false);
+  }
+}
+
+/**
+ * Set up for the body of an upload request; data is its first piece
+ */
+void beginOTAUploadStream(AsyncWebServerRequest *request, const uint8_t *data, size_t len,
+                          const char *transport) {
+  otaRequestState(request)->isStarted = true;
+  otaSession.isReceiving = true;
+  otaSession.received = 0;
+  otaSession.receiveCycles = 0;
+  otaSession.transport = transport;
+  otaSession.startMillis = millis();
+  size_t offset = request->hasParam("offset") ? request->getParam("offset")->value().toInt() : 0;
+  // Validated by admitOTAUpload()
+  if (request->hasHeader(OTA_SHA256_HEADER)) {
+    otaSession.hasExpectedSHA256 = parseSHA256Hex(request->header(OTA_SHA256_HEADER), otaSession.expectedSHA256);
+  }
+
+  if (offset != otaSession.resumeOffset) {
+    failOTAUpload("Resume offset mismatch");
+  } else if (otaSession.resumeOffset == 0) {
+    // Only the start of an upload tells us what kind of image it is
+    otaSession.isCompressed = isGzipImage(data, len);
+    if (otaSession.isCompressed) {
+      // The inflated image is larger than the upload
+      otaWriterSetImageSize(0);
+      if (!otaInflateBegin(otaImageSink)) {
+        failOTAUpload("Not enough memory to decompress");
+      }
+    }
+  }
+  request->onDisconnect(onOTAUploadDisconnect);
+}
+
+/**
+ * Feed a piece of the uploaded file into the pipeline
+ *
+ * total is the expected file size for progress reports, 0 if unknown.
+ * Returns false once the upload has failed or was refused.
+ */
+bool receiveOTAUploadData(AsyncWebServerRequest *request, const uint8_t *data, size_t len, size_t total) {
+  if (otaSession.hasError || otaSession.isFinished) {
+    return false;
+  }
+  if (len == 0) {
+    return true;
+  }
+
+  otaUploadMD5.add((uint8_t *)data, len);
+  if (!writeOTAUploadData(data, len)) {
+    if (otaImageCheck.error != OTA_IMAGE_OK) {
+      rejectOTAUpload(request, otaImageErrorString(otaImageCheck.error));
+      return false;
+    }
+    failOTAUpload(otaSession.isCompressed ? "Decompression failed" :
+                  otaSession.isDelta ? "Delta patch invalid" : "Flash write failed");
+    return false;
+  }
+  otaSession.received += len;
+  throttleOTAUpload(request);
+  onOTAProgress(otaSession.resumeOffset + otaSession.received,
+                total ? otaSession.resumeOffset + total : 0);
+
+  if (isOTAUploadResumable() && otaWriteOffset - otaSession.lastCheckpoint >= OTA_RESUME_CHECKPOINT_BYTES) {
+    otaSession.lastCheckpoint = otaWriteOffset;
+    saveOTAResumeOffset(otaSession.lastCheckpoint);
+  }
+  return true;
+}
+
+/**
+ * Report how fast the body arrived and what handling it cost
+ *
+ * The cycle count covers everything from the handler on (framing, MD5,
+ * inflate, queuing for the writer), not the library's own request parsing.
+ */
+void printOTAReceiveStats() {
+  unsigned long elapsed = millis() - otaSession.startMillis;
+  float mb = otaSession.received / 1048576.0f;
+  Serial.printf("OTA: Received %u bytes (%s) in %lu ms, %.2f MB/s, %lu handler cycles/MB\n",
+                otaSession.received, otaSession.transport, elapsed,
+                elapsed > 0 ? mb * 1000.0f / elapsed : 0,
+                (unsigned long)(mb > 0 ? otaSession.receiveCycles / mb : 0));
+}
+
+/**
+ * Complete the image after the last byte of the upload has arrived
+ */
+void finishOTAUpload() {
+  otaSession.isFinished = true;
+  printOTAReceiveStats();
+  if (otaSession.isCompressed) {
+    printOTAInflateStats();
+    if (!otaInflateEnd()) {
+      failOTAUpload("Compressed image incomplete or corrupt");
+      return;
+    }
+  }
+  if (otaSession.isDelta) {
+    if (!otaDeltaEnd()) {
+      failOTAUpload("Delta patch incomplete");
+      return;
+    }
+    // The patch names the image it must produce
+    if (otaSession.hasExpectedSHA256 &&
+        memcmp(otaSession.expectedSHA256, otaDelta.expectedSha256, OTA_SHA256_SIZE) != 0) {
+      failOTAUpload("Delta patch is for a different image");
+      return;
+    }
+    memcpy(otaSession.expectedSHA256, otaDelta.expectedSha256, OTA_SHA256_SIZE);
+    otaSession.hasExpectedSHA256 = true;
+  }
+  otaUploadMD5.calculate();
+  if (!otaImageCheckEnd()) {
+    failOTAUpload(otaImageErrorString(otaImageCheck.error));
+  } else if (!otaWriterEnd()) {
+    failOTAUpload("Flash write failed");
+  } else if (otaSession.expectedMD5.length() && !otaSession.expectedMD5.equalsIgnoreCase(otaUploadMD5.toString())) {
+    failOTAUpload("MD5 mismatch");
+  } else if (otaSession.hasExpectedSHA256 &&
+             memcmp(otaWriterDigest(), otaSession.expectedSHA256, OTA_SHA256_SIZE) != 0) {
+    failOTAUpload(otaSession.isDelta ? "Delta patch built for different firmware" : "SHA-256 mismatch");
+  } else if (!otaWriterCommit()) {
+    failOTAUpload("Image validation failed");
+  }
+  clearOTAResume();
+  printOTAWriterStats();
+}
+
+/**
+ * Send the final response to an upload and end the session
+ */
+void respondOTAUpload(AsyncWebServerRequest *request) {
+  otaSession.isReceiving = false;
+  markOTARequestAnswered(request);
+
+  // Already answered by rejectOTAUpload()
+  if (otaSession.isResponseSent) {
+    return;
+  }
+  otaSession.isResponseSent = true;
+
+  // Request ended without a complete file
+  if (!otaSession.isFinished) {
+    failOTAUpload("No firmware received");
+  }
+  otaSession.isPrepared = false;
+
+  bool success = !otaSession.hasError;
+
+  // Don't let the reboot scheduled by onOTAEnd() cut off this response;
+  // released when the connection closes after it has been sent
+  if (success) {
+    otaSession.isHoldingReboot = true;
+    holdReboot();
+  }
+
+  AsyncWebServerResponse *response = request->beginResponse(success ? 200 : 400, "text/plain",
+                                                            success ? "OK" : otaSession.error);
+  response->addHeader("Connection", "close");
+  response->addHeader("Access-Control-Allow-Origin", "*");
+  request->send(response);
+
+  onOTAEnd(success);
+}
+
+/**
+ * Prepare the session for a /ota/firmware request once its body starts
+ *
+ * Returns false after refusing the request.
+ */
+bool startRawUpload(AsyncWebServerRequest *request) {
+  String reply;
+  int status = prepareOTASession(request, reply);
+  if (status != 200) {
+    refuseOTAUpload(request, status, reply.c_str());
+    return false;
+  }
+  if (!otaRequestState(request)->isChunked) {
+    otaWriterSetImageSize(request->contentLength());
+  }
+  return true;
+}
+
+/**
+ * Data callback of a connection sending a chunked /ota/firmware body
+ *
+ * Replaces the library's own parser for this connection, which would
+ * otherwise drop a body without Content-Length.
+ */
+void onOTAChunkedData(void *arg, AsyncClient * /* client */, void *buffer, size_t len) {
+  AsyncWebServerRequest *request = (AsyncWebServerRequest *)arg;
+  OTARequestState *state = otaRequestState(request);
+  if (state->isAnswered) {
+    return;
+  }
+
+  uint32_t cycles = ESP.getCycleCount();
+  const uint8_t *data = (const uint8_t *)buffer;
+  while (len > 0 && !chunkedDone(state->chunked)) {
+    const uint8_t *payload;
+    size_t payloadLen;
+    size_t used = chunkedDecode(state->chunked, data, len, payload, payloadLen);
+    data += used;
+    len -= used;
+
+    if (payloadLen > 0) {
+      if (!state->isStarted) {
+        if (!startRawUpload(request)) {
+          return;
+        }
+        beginOTAUploadStream(request, payload, payloadLen, "raw chunked");
+      }
+      if (!receiveOTAUploadData(request, payload, payloadLen, 0) && otaSession.isResponseSent) {
+        return;
+      }
+    }
+  }
+  if (state->isStarted) {
+    otaSession.receiveCycles += ESP.getCycleCount() - cycles;
+  }
+
+  if (!chunkedDone(state->chunked)) {
+    return;
+  }
+  if (!state->isStarted) {
+    // No payload at all; there is no session to end
+    refuseOTAUpload(request, 400, state->chunked.state == CHUNKED_ERROR ? "Chunked encoding invalid" :
+                                                                          "No firmware received");
+  } else if (state->chunked.state == CHUNKED_ERROR) {
+    failOTAUpload("Chunked encoding invalid");
+    respondOTAUpload(request);
+  } else {
+    if (!otaSession.hasError) {
+      finishOTAUpload();
+    }
+    respondOTAUpload(request);
+  }
+}
+
+/**
+ * Set up the boundary search for a multipart upload from its Content-Type
+ *
+ * Extracts the boundary the way the library does, so both parsers agree.
+ */
+bool beginOTAMultipartScan(AsyncWebServerRequest *request) {
+  String type = request->header("Content-Type");
+  int at = type.indexOf("boundary=");
+  if (!type.startsWith("multipart/") || at < 0) {
+    return false;
+  }
+  String boundary = type.substring(at + 9);
+  boundary.replace("\"", "");
+  return multipartScanBegin(otaMultipart, boundary.c_str());
+}
+
+/**
+ * Data callback of a multipart upload once the library has parsed the
+ * part headers and the start of the file
+ */
+void onOTAMultipartData(void *arg, AsyncClient * /* client */, void *buffer, size_t len) {
+  AsyncWebServerRequest *request = (AsyncWebServerRequest *)arg;
+  if (isOTARequestAnswered(request)) {
+    return;
+  }
+  // The library found the end of the file before letting go
+  if (otaSession.isFinished) {
+    respondOTAUpload(request);
+    return;
+  }
+
+  uint32_t cycles = ESP.getCycleCount();
+  const uint8_t *data = (const uint8_t *)buffer;
+  while (len > 0 && otaMultipart.state == MULTIPART_DATA) {
+    const uint8_t *payload;
+    size_t payloadLen;
+    size_t used = multipartScan(otaMultipart, data, len, payload, payloadLen);
+    data += used;
+    len -= used;
+
+    if (payloadLen > 0 && !receiveOTAUploadData(request, payload, payloadLen, request->contentLength()) &&
+        otaSession.isResponseSent) {
+      return;
+    }
+  }
+  otaSession.receiveCycles += ESP.getCycleCount() - cycles;
+
+  // Whatever follows the file part (closing boundary, epilogue) is ignored
+  if (otaMultipart.state == MULTIPART_DELIMITER) {
+    if (!otaSession.hasError) {
+      finishOTAUpload();
+    }
+    respondOTAUpload(request);
+  }
+}
+
+/**
+ * Feed the blocks that matched the running image into the pipeline, up to
+ * the next block that is sent
+ */
+bool copyMatchedOTABlocks(AsyncWebServerRequest *request) {
+  while (otaBlocks.nextBlock < otaBlocks.blockCount && !isOTABlockNeeded(otaBlocks.nextBlock)) {
+    size_t len = otaBlockLength(otaBlocks.nextBlock);
+    if (!receiveOTAUploadData(request, otaBlocks.running + otaBlocks.nextBlock * OTA_BLOCK_SIZE, len,
+                              otaBlocks.imageSize)) {
+      return false;
+    }
+    otaBlocks.bytesCopied += len;
+    otaBlocks.nextBlock++;
+  }
+  return true;
+}
+
+/**
+ * Put /ota/blocks/data body bytes in place between the copied blocks
+ */
+void receiveOTABlockData(AsyncWebServerRequest *request, const uint8_t *data, size_t len) {
+  while (len > 0) {
+    if (!copyMatchedOTABlocks(request)) {
+      return;
+    }
+    if (otaBlocks.nextBlock == otaBlocks.blockCount) {
+      failOTAUpload("More block data than requested");
+      return;
+    }
+    size_t blockLen = otaBlockLength(otaBlocks.nextBlock);
+    size_t n = min(len, blockLen - otaBlocks.blockFill);
+    if (!receiveOTAUploadData(request, data, n, otaBlocks.imageSize)) {
+      return;
+    }
+    data += n;
+    len -= n;
+    otaBlocks.blockFill += n;
+    if (otaBlocks.blockFill == blockLen) {
+      otaBlocks.nextBlock++;
+      otaBlocks.blockFill = 0;
+    }
+  }
+}
+
+/**
+ * Whether the request body would be parsed as form fields by the library
+ * instead of reaching handleBody()
+ */
+bool isOTAFormBody(AsyncWebServerRequest *request) {
+  const String &type = request->contentType();
+  return type.startsWith("application/x-www-form-urlencoded") || type.startsWith("multipart/") ||
+         type.startsWith("text/");
+}
+
+class FirmwareUploadHandler : public AsyncWebHandler {
+public:
+  // Called once the headers are parsed, before any body byte is read and
+  // before the library answers "Expect: 100-continue". Requests with a body
+  // are checked and marked here; sessions are only taken once it arrives.
+  bool canHandle(AsyncWebServerRequest *request) override {
+    if (request->method() == HTTP_GET && request->url() == "/ota/start") {
+      // Leave filesystem updates to ElegantOTA
+      return !request->hasParam("mode") || request->getParam("mode")->value() != "fs";
+    }
+    if (request->method() == HTTP_POST && request->url() == "/ota/upload") {
+      if (!otaSession.isPrepared) {
+        return false;
+      }
+      request->addInterestingHeader(OTA_SHA256_HEADER);
+      request->addInterestingHeader("Content-Type");
+      admitMultipartUpload(request);
+      return true;
+    }
+    if ((request->method() == HTTP_PUT || request->method() == HTTP_POST) && request->url() == "/ota/firmware") {
+      request->addInterestingHeader(OTA_SHA256_HEADER);
+      admitRawUpload(request);
+      return true;
+    }
+    if (request->method() == HTTP_POST && request->url() == "/ota/blocks") {
+      admitBlockPlan(request);
+      return true;
+    }
+    if ((request->method() == HTTP_PUT || request->method() == HTTP_POST) && request->url() == "/ota/blocks/data") {
+      admitBlockData(request);
+      return true;
+    }
+    if (request->method() == HTTP_GET &&
+        (request->url() == "/ota/resume" || request->url() == "/ota/identity" || request->url() == "/ota/events")) {
+      return true;
+    }
+    if (request->method() == HTTP_GET && request->url() == "/ota/image") {
+      request->addInterestingHeader("Range");
+      return true;
+    }
+    return false;
+  }
+
+  void handleRequest(AsyncWebServerRequest *request) override {
+    if (request->method() != HTTP_GET && isOTARequestAnswered(request)) {
+      return;
+    }
+    if (request->url() == "/ota/firmware") {
+      OTARequestState *state = otaRequestState(request);
+      if (state->isChunked) {
+        // The body is still to come; onOTAChunkedData() answers it
+      } else if (state->isStarted) {
+        respondOTAUpload(request);
+      } else {
+        refuseOTAUpload(request, 400, "No firmware received");
+      }
+      return;
+    }
+    if (request->url() != "/ota/identity" && !isOTARequestAuthorized(request)) {
+      request->requestAuthentication();
+      return;
+    }
+
+    if (request->url() == "/ota/start") {
+      handleStart(request);
+    } else if (request->url() == "/ota/resume") {
+      handleResumeQuery(request);
+    } else if (request->url() == "/ota/identity") {
+      request->send(200, "application/json", buildIdentityJSON());
+    } else if (request->url() == "/ota/image") {
+      handleOTAImageRequest(request);
+    } else if (request->url() == "/ota/events") {
+      handleOTAEventsRequest(request);
+    } else if (request->url() == "/ota/blocks") {
+      handleBlockPlan(request);
+    } else if (request->url() == "/ota/blocks/data") {
+      if (otaRequestState(request)->isStarted || startBlockData(request)) {
+        handleBlockDataDone(request);
+      }
+    } else if (otaRequestState(request)->isStarted || !otaSession.isReceiving) {
+      // A request without a file part ends the session it was sent for
+      respondOTAUpload(request);
+    } else {
+      refuseOTAUpload(request, 409, "Another upload is in progress");
+    }
+  }
+
+  void handleUpload(AsyncWebServerRequest *request, const String & /* filename */, size_t index,
+                    uint8_t *data, size_t len, bool final) override {
+    if (isOTARequestAnswered(request)) {
+      return;
+    }
+
+    uint32_t cycles = ESP.getCycleCount();
+    if (index == 0) {
+      if (!startMultipartUpload(request)) {
+        return;
+      }
+      beginOTAUploadStream(request, data, len, "multipart");
+    }
+    bool ok = receiveOTAUploadData(request, data, len, request->contentLength());
+    otaSession.receiveCycles += ESP.getCycleCount() - cycles;
+    if (ok && final) {
+      finishOTAUpload();
+    } else if (ok && otaSession.isScanPending && len < OTA_MULTIPART_ITEM_BUFFER) {
+      // The library flushed the end of a TCP buffer and holds nothing back,
+      // so the rest of the body can be scanned without it
+      otaSession.isScanPending = false;
+      otaSession.transport = "multipart, block scan";
+      request->client()->onData(onOTAMultipartData, request);
+    }
+  }
+
+  void handleBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index,
+                  size_t total) override {
+    if (isOTARequestAnswered(request)) {
+      return;
+    }
+    if (request->url() == "/ota/blocks") {
+      // Length checked against the block count in admitBlockPlan()
+      memcpy(otaRequestBuffer(request) + index, data, len);
+      return;
+    }
+    if (request->url() == "/ota/blocks/data") {
+      if (index == 0 && !startBlockData(request)) {
+        return;
+      }
+      uint32_t cycles = ESP.getCycleCount();
+      receiveOTABlockData(request, data, len);
+      otaSession.receiveCycles += ESP.getCycleCount() - cycles;
+      return;
+    }
+    if (request->url() != "/ota/firmware") {
+      return;
+    }
+
+    // data points into the segment the TCP stack received
+    uint32_t cycles = ESP.getCycleCount();
+    if (index == 0) {
+      if (!startRawUpload(request)) {
+        return;
+      }
+      beginOTAUploadStream(request, data, len, "raw");
+    }
+    bool ok = receiveOTAUploadData(request, data, len, total);
+    otaSession.receiveCycles += ESP.getCycleCount() - cycles;
+    if (ok && index + len == total) {
+      finishOTAUpload();
+    }
+  }
+
+  bool isRequestHandlerTrivial() override { return false; }
+
+private:
+  /**
+   * Check a /ota/upload request for the prepared session from its headers
+   */
+  void admitMultipartUpload(AsyncWebServerRequest *request) {
+    const char *error;
+    int status = admitOTAUpload(request, otaSession.resumeOffset, otaSession.isForced, error);
+    if (status != 0) {
+      refuseOTAUpload(request, status, error);
+    } else if (newOTARequestState(request) == NULL) {
+      refuseOTAUpload(request, 503, "Out of memory");
+    }
+  }
+
+  /**
+   * Take the prepared session for a /ota/upload request once its file starts
+   *
+   * Returns false after refusing the request.
+   */
+  bool startMultipartUpload(AsyncWebServerRequest *request) {
+    if (!otaSession.isPrepared || otaSession.isReceiving) {
+      refuseOTAUpload(request, 409, "Another upload is in progress");
+      return false;
+    }
+    otaSession.isScanPending = beginOTAMultipartScan(request);
+    // Framing makes this a slight overestimate, which only bounds erasing ahead
+    otaWriterSetImageSize(otaSession.resumeOffset + request->contentLength());
+    return true;
+  }
+
+  /**
+   * Check a /ota/firmware request from its headers
+   */
+  void admitRawUpload(AsyncWebServerRequest *request) {
+    if (!isOTARequestAuthorized(request)) {
+      refuseOTAUpload(request, 401, "Authentication required");
+      return;
+    }
+    if (isOTAFormBody(request)) {
+      refuseOTAUpload(request, 415, "Send the image as application/octet-stream");
+      return;
+    }
+
+    String reply;
+    int status = checkOTASession(request, reply);
+    if (status != 200) {
+      refuseOTAUpload(request, status, reply.c_str());
+      return;
+    }
+
+    const char *error;
+    status = admitOTAUpload(request, 0, request->hasParam("force"), error);
+    if (status != 0) {
+      refuseOTAUpload(request, status, error);
+      return;
+    }
+
+    // The library only reads bodies with a Content-Length, so a chunked
+    // body is taken from the connection's data callback instead. Body bytes
+    // that came with the headers are already past that callback; only a
+    // client that waits for "100 Continue" is sure not to have sent any.
+    bool isChunked = request->hasHeader("Transfer-Encoding") &&
+                     request->header("Transfer-Encoding").equalsIgnoreCase("chunked");
+    if (isChunked && !request->header("Expect").equalsIgnoreCase("100-continue")) {
+      refuseOTAUpload(request, 411, "Chunked uploads need Expect: 100-continue (or send Content-Length)");
+      return;
+    }
+
+    OTARequestState *state = newOTARequestState(request);
+    if (state == NULL) {
+      refuseOTAUpload(request, 503, "Out of memory");
+      return;
+    }
+
+    // Take the data over before the library sends "100 Continue"
+    if (isChunked) {
+      state->isChunked = true;
+      chunkedBegin(state->chunked);
+      request->client()->onData(onOTAChunkedData, request);
+    }
+  }
+
+  /**
+   * Check a /ota/blocks request from its headers and make room for the hashes
+   */
+  void admitBlockPlan(AsyncWebServerRequest *request) {
+    if (!isOTARequestAuthorized(request)) {
+      refuseOTAUpload(request, 401, "Authentication required");
+      return;
+    }
+    if (otaSession.isReceiving) {
+      refuseOTAUpload(request, 409, "Another upload is in progress");
+      return;
+    }
+    if (isOTAFormBody(request)) {
+      refuseOTAUpload(request, 415, "Send the block hashes as application/octet-stream");
+      return;
+    }
+    if (!request->hasParam("size") || !request->hasParam("sha256")) {
+      refuseOTAUpload(request, 400, "size and sha256 parameters required");
+      return;
+    }
+    const esp_partition_t *target = esp_ota_get_next_update_partition(NULL);
+    size_t size = request->getParam("size")->value().toInt();
+    if (size == 0 || target == NULL || size > target->size) {
+      refuseOTAUpload(request, 413, otaImageErrorString(OTA_IMAGE_TOO_LARGE));
+      return;
+    }
+    if (request->contentLength() != otaBlockCount(size) * OTA_SHA256_SIZE) {
+      refuseOTAUpload(request, 400, "Body must hold one SHA-256 per 4 KB block");
+      return;
+    }
+    if (newOTARequestState(request, request->contentLength()) == NULL) {
+      refuseOTAUpload(request, 503, "Not enough memory for the block hashes");
+    }
+  }
+
+  /**
+   * Prepare a session for the block hashes received and reply which
+   * blocks to send
+   */
+  void handleBlockPlan(AsyncWebServerRequest *request) {
+    size_t size = request->getParam("size")->value().toInt();
+
+    String reply;
+    int status = prepareOTASession(request, reply);
+    if (status != 200) {
+      request->send(status, "text/plain", reply);
+      return;
+    }
+
+    if (!otaBlocksPlan(otaRequestBuffer(request), size)) {
+      abandonOTASession("Running image could not be mapped");
+      request->send(503, "text/plain", otaSession.error);
+      return;
+    }
+    otaSession.isFormatKnown = true; // Blocks always rebuild a plain image
+    otaWriterSetImageSize(size);
+
+    AsyncWebServerResponse *response = request->beginResponse(200, "text/plain", otaBlocksBitmapHex());
+    response->addHeader("X-Blocks-Needed", String(otaBlocks.neededCount));
+    response->addHeader("X-Bytes-Needed", String(otaBlocks.neededBytes));
+    request->send(response);
+  }
+
+  /**
+   * Check a /ota/blocks/data request against the current plan from its
+   * headers
+   */
+  void admitBlockData(AsyncWebServerRequest *request) {
+    if (!isOTARequestAuthorized(request)) {
+      refuseOTAUpload(request, 401, "Authentication required");
+      return;
+    }
+    if (!otaBlocks.isPlanned || !otaSession.isPrepared) {
+      refuseOTAUpload(request, 409, "No block plan, POST /ota/blocks first");
+      return;
+    }
+    if (otaSession.isReceiving) {
+      refuseOTAUpload(request, 409, "Another upload is in progress");
+      return;
+    }
+    if (isOTAFormBody(request)) {
+      refuseOTAUpload(request, 415, "Send the blocks as application/octet-stream");
+      return;
+    }
+    if (request->contentLength() != otaBlocks.neededBytes) {
+      refuseOTAUpload(request, 400, "Body must be exactly the blocks the plan asked for");
+      return;
+    }
+    if (newOTARequestState(request) == NULL) {
+      refuseOTAUpload(request, 503, "Out of memory");
+    }
+  }
+
+  /**
+   * Take the planned session for a /ota/blocks/data request once its body
+   * starts, or when it ends if all blocks matched
+   *
+   * Returns false after refusing the request.
+   */
+  bool startBlockData(AsyncWebServerRequest *request) {
+    if (!otaBlocks.isPlanned || !otaSession.isPrepared || otaSession.isReceiving) {
+      refuseOTAUpload(request, 409, "Another upload is in progress");
+      return false;
+    }
+
+    otaRequestState(request)->isStarted = true;
+    otaSession.isReceiving = true;
+    otaSession.received = 0;
+    otaSession.receiveCycles = 0;
+    otaSession.transport = "block dedup";
+    otaSession.startMillis = millis();
+    request->onDisconnect(onOTAUploadDisconnect);
+    return true;
+  }
+
+  /**
+   * Copy the trailing matched blocks and complete the image
+   */
+  void handleBlockDataDone(AsyncWebServerRequest *request) {
+    if (!otaSession.hasError && copyMatchedOTABlocks(request)) {
+      if (otaBlocks.nextBlock < otaBlocks.blockCount) {
+        failOTAUpload("Block data incomplete");
+      } else {
+        Serial.printf("OTA: %u of %u blocks sent, %u bytes copied from the running image\n",
+                      otaBlocks.neededCount, otaBlocks.blockCount, otaBlocks.bytesCopied);
+        finishOTAUpload();
+      }
+    }
+    otaBlocksRelease();
+    respondOTAUpload(request);
+  }
+
+  void handleStart(AsyncWebServerRequest *request) {
+    String reply;
+    int status = prepareOTASession(request, reply);
+    request->send(status, "text/plain", reply);
+  }
+
+  void handleResumeQuery(AsyncWebServerRequest *request) {
+    OTAResumeState resume;
+    if (otaSession.isPrepared || !loadOTAResume(resume)) {
+      request->send(404, "application/json", "{\"error\":\"no interrupted upload\"}");
+      return;
+    }
+
+    char json[128];
+    snprintf(json, sizeof(json), "{\"session\":\"%s\",\"hash\":\"%s\",\"offset\":%lu}",
+             resume.session.c_str(), resume.hash.c_str(), (unsigned long)resume.offset);
+    request->send(200, "application/json", json);
+  }
+};
+
+FirmwareUploadHandler firmwareUploadHandler;
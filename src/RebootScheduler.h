@@ -0,0 +1,62 @@
+/*
+  -----------------------
+  Deferred Reboot Scheduler
+  -----------------------
+
+  Restarting straight from an ElegantOTA callback blocks the async_tcp task,
+  so the HTTP response announcing success may never reach the client and
+  every other connection freezes until the restart.
+
+  Instead, a reboot is only requested from the callback. The loop performs
+  it once nothing is holding it back: responses that must reach their
+  client take a hold and release it when their connection closes. The
+  reboot also happens when the deadline passes (REBOOT_DEADLINE_MS, which
+  can be overridden with a -D build flag), so a client that never closes
+  its connection cannot postpone it forever.
+*/
+#include <atomic>
+
+// Upper bound between the reboot request and the restart
+#ifndef REBOOT_DEADLINE_MS
+#define REBOOT_DEADLINE_MS 3000UL
+#endif
+
+std::atomic<bool> isRebootScheduled(false);
+unsigned long rebootRequestMillis = 0;
+
+// Responses that must be delivered before rebooting
+std::atomic<int> rebootHolds(0);
+
+/**
+ * Request a reboot from any context; performed later from loop()
+ */
+void scheduleReboot() {
+  if (!isRebootScheduled) {
+    rebootRequestMillis = millis();
+    isRebootScheduled = true;
+  }
+}
+
+/**
+ * Keep a pending reboot waiting, e.g. until a response is delivered
+ */
+void holdReboot() {
+  rebootHolds++;
+}
+
+/**
+ * Release a hold taken with holdReboot()
+ */
+void releaseReboot() {
+  rebootHolds--;
+}
+
+/**
+ * Whether a scheduled reboot may happen now
+ */
+bool isRebootDue() {
+  if (!isRebootScheduled) {
+    return false;
+  }
+  return rebootHolds.load() <= 0 || millis() - rebootRequestMillis >= REBOOT_DEADLINE_MS;
+}
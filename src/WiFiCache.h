@@ -0,0 +1,100 @@
+/*
+  -----------------------
+  WiFi Fast-Reconnect Cache
+  -----------------------
+
+  Remembers the access point (BSSID + channel) and IP lease of the last
+  successful connection in NVS. The next connection attempt can then join
+  that AP directly and reuse the lease, skipping both the channel scan and
+  the DHCP exchange.
+
+  The cache is only a hint: if the cached attempt fails, the caller clears
+  it and falls back to a normal scan + DHCP connection. Once the cached
+  attempt is up, DHCP is re-enabled to confirm the lease; a new address
+  replaces the cached one and no answer at all clears the cache.
+*/
+#include <Preferences.h>
+
+// NVS namespace and key used for the cached connection parameters
+const char *WIFI_CACHE_NAMESPACE = "wifi-cache";
+const char *WIFI_CACHE_KEY = "lease";
+
+// Bump when the layout of WiFiConnectionCache changes
+const uint8_t WIFI_CACHE_VERSION = 1;
+
+struct WiFiConnectionCache {
+  uint8_t version;
+  uint8_t bssid[6];
+  int32_t channel;
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+};
+
+/**
+ * Load the cached connection parameters from NVS
+ *
+ * Returns false if nothing is cached or the stored entry is from an
+ * incompatible firmware version.
+ */
+bool loadWiFiCache(WiFiConnectionCache &cache) {
+  Preferences prefs;
+  if (!prefs.begin(WIFI_CACHE_NAMESPACE, true)) {
+    return false;
+  }
+  size_t len = prefs.getBytes(WIFI_CACHE_KEY, &cache, sizeof(cache));
+  prefs.end();
+
+  return len == sizeof(cache) && cache.version == WIFI_CACHE_VERSION && cache.ip != 0;
+}
+
+/**
+ * Store the parameters of the current station connection in NVS
+ *
+ * Must be called while WiFi.status() == WL_CONNECTED. Skips the write when
+ * the stored entry is already identical, since every fast reconnect saves
+ * the lease DHCP confirmed.
+ */
+void saveWiFiCache() {
+  WiFiConnectionCache cache;
+  memset(&cache, 0, sizeof(cache));
+  cache.version = WIFI_CACHE_VERSION;
+  memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+  cache.channel = WiFi.channel();
+  cache.ip = (uint32_t)WiFi.localIP();
+  cache.gateway = (uint32_t)WiFi.gatewayIP();
+  cache.subnet = (uint32_t)WiFi.subnetMask();
+  cache.dns = (uint32_t)WiFi.dnsIP();
+
+  WiFiConnectionCache stored;
+  if (loadWiFiCache(stored) && memcmp(&stored, &cache, sizeof(cache)) == 0) {
+    return;
+  }
+
+  Preferences prefs;
+  if (prefs.begin(WIFI_CACHE_NAMESPACE, false)) {
+    prefs.putBytes(WIFI_CACHE_KEY, &cache, sizeof(cache));
+    prefs.end();
+  }
+
+  #ifdef OTA_DEBUG_ENABLED
+  Serial.printf("WIFI: Cached BSSID %02X:%02X:%02X:%02X:%02X:%02X on channel %d\n",
+                cache.bssid[0], cache.bssid[1], cache.bssid[2],
+                cache.bssid[3], cache.bssid[4], cache.bssid[5], cache.channel);
+  #endif
+}
+
+/**
+ * Forget the cached connection parameters
+ *
+ * Called when a cached attempt fails or the credentials change, so the
+ * next connection does a full scan and DHCP exchange.
+ */
+void clearWiFiCache() {
+  Preferences prefs;
+  if (prefs.begin(WIFI_CACHE_NAMESPACE, false)) {
+    prefs.remove(WIFI_CACHE_KEY);
+    prefs.end();
+  }
+}
@@ -0,0 +1,91 @@
+/*
+  -----------------------
+  WiFi Link Event Queue
+  -----------------------
+
+  Hands WiFi driver events from the Arduino event task to the main loop.
+
+  The WiFi.onEvent() callback runs in its own FreeRTOS task, so it must not
+  touch the web server or WiFiManager directly. Instead it pushes a compact
+  event code into a single-producer/single-consumer ring buffer, which
+  monitorWiFiConnection() drains from loop(). Neither side ever blocks or
+  takes a lock.
+*/
+#include <atomic>
+
+enum WiFiLinkEvent : uint8_t {
+  LINK_GOT_IP,              // Station has an IP address
+  LINK_DISCONNECTED,        // Station lost its association
+  LINK_PORTAL_CLIENT_JOINED // A client joined the configuration portal AP
+};
+
+// Must be a power of two so the indices can wrap with a mask
+const uint8_t WIFI_EVENT_QUEUE_SIZE = 16;
+
+WiFiLinkEvent wifiEventQueue[WIFI_EVENT_QUEUE_SIZE];
+std::atomic<uint8_t> wifiEventHead(0); // Next slot to write (event task)
+std::atomic<uint8_t> wifiEventTail(0); // Next slot to read (main loop)
+
+// Set when an event had to be dropped; the loop then resyncs from WiFi.status()
+std::atomic<bool> wifiEventOverflow(false);
+
+/**
+ * Push an event into the queue (event task side)
+ */
+void pushWiFiEvent(WiFiLinkEvent event) {
+  uint8_t head = wifiEventHead.load(std::memory_order_relaxed);
+  uint8_t next = (head + 1) & (WIFI_EVENT_QUEUE_SIZE - 1);
+
+  if (next == wifiEventTail.load(std::memory_order_acquire)) {
+    wifiEventOverflow.store(true, std::memory_order_release);
+    return;
+  }
+
+  wifiEventQueue[head] = event;
+  wifiEventHead.store(next, std::memory_order_release);
+}
+
+/**
+ * Pop the oldest event from the queue (main loop side)
+ *
+ * Returns false if the queue is empty.
+ */
+bool popWiFiEvent(WiFiLinkEvent &event) {
+  uint8_t tail = wifiEventTail.load(std::memory_order_relaxed);
+
+  if (tail == wifiEventHead.load(std::memory_order_acquire)) {
+    return false;
+  }
+
+  event = wifiEventQueue[tail];
+  wifiEventTail.store((tail + 1) & (WIFI_EVENT_QUEUE_SIZE - 1), std::memory_order_release);
+  return true;
+}
+
+/**
+ * Translate driver events into link events (runs in the Arduino event task)
+ */
+void onWiFiEvent(WiFiEvent_t event) {
+  switch (event) {
+    case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+      pushWiFiEvent(LINK_GOT_IP);
+      break;
+    case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+      pushWiFiEvent(LINK_DISCONNECTED);
+      break;
+    case ARDUINO_EVENT_WIFI_AP_STACONNECTED:
+      pushWiFiEvent(LINK_PORTAL_CLIENT_JOINED);
+      break;
+    default:
+      break;
+  }
+}
+
+/**
+ * Register the driver event handler
+ *
+ * Call once from setup; the handler stays registered across WiFi mode changes.
+ */
+void registerWiFiEvents() {
+  WiFi.onEvent(onWiFiEvent);
+}
@@ -65,7 +65,8 @@ void checkButton() {
  * This function provides visual confirmation that the main loop is running
  * and displays system status information periodically:
  * - LED blinks every second (1 second on, 1 second off)
- * - Status display every 2 seconds showing counter and WiFi connectivity
+ * - Status display every 2 seconds showing counter and WiFi connectivity,
+ *   except during an OTA update
  * Uses static variables to maintain state between function calls.
  */
 void heartbeat() {
@@ -84,7 +85,8 @@ void heartbeat() {
   static unsigned long lastCounterTime = 0; // Timestamp for periodic counter display
   
   // Display system status every 2 seconds including WiFi connectivity
-  if (millis() - lastCounterTime >= 2000) {
+  // (paused while an update runs, see OTAPerformanceMode.h)
+  if (millis() - lastCounterTime >= 2000 && !isOTAPerformanceModeActive) {
     String wifiStatus;
     if (WiFi.status() == WL_CONNECTED) {
       wifiStatus = "Connected (" + WiFi.SSID() + " - " + WiFi.localIP().toString() + ")";
@@ -110,6 +112,10 @@ void heartbeat() {
  */
 void setup(void) {
   Serial.begin(115200);           // Initialize serial communication at 115200 baud
+
+  // Start the self-test deadline first, so a new image that hangs in setup() is rolled back
+  beginBootHealthCheck();
+
   pinMode(LED_BUILTIN, OUTPUT);   // Configure built-in LED as output for status indication
 
   delay(1000); // Give time for serial monitor to initialize and connect
@@ -0,0 +1,302 @@
+/*
+  -----------------------
+  Native Arduino Core Fake
+  -----------------------
+
+  Just enough of the Arduino-ESP32 core for the headers in src/ to compile
+  and run on the build host ([env:native] in platformio.ini).
+
+  Time is simulated: millis()/micros() only move when a test calls
+  fakeAdvanceMillis() or the code under test calls delay(), so timeouts
+  are reached instantly and deterministically. Benchmarks switch to the
+  host's clock with fakeUseWallClock(), so the statistics the code keeps
+  measure real time. Serial output is dropped unless FAKE_SERIAL_ECHO is
+  set in the environment.
+
+  ESP.getFreeHeap() reports the host allocator's free space, so heap
+  drift across repeated cycles shows up the same way it does on target.
+*/
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <malloc.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "esp_idf_fake.h"
+#include "freertos/FreeRTOS.h"
+
+using std::max;
+using std::min;
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+// -----------------------------------------------------------------------
+// Simulated time
+// -----------------------------------------------------------------------
+
+std::atomic<uint64_t> fakeMicros(0);
+
+// Wall-clock mode: time runs from this point of the host's steady clock
+std::atomic<bool> isFakeWallClock(false);
+std::chrono::steady_clock::time_point fakeWallClockStart;
+
+uint64_t fakeNowMicros() {
+  if (isFakeWallClock) {
+    auto elapsed = std::chrono::steady_clock::now() - fakeWallClockStart;
+    return fakeMicros.load() + std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+  }
+  return fakeMicros.load();
+}
+
+unsigned long millis() {
+  return (unsigned long)(fakeNowMicros() / 1000);
+}
+
+unsigned long micros() {
+  return (unsigned long)fakeNowMicros();
+}
+
+void fakeAdvanceMillis(unsigned long ms) {
+  fakeMicros += (uint64_t)ms * 1000;
+}
+
+/**
+ * Let time pass with the host's clock (on) or only when advanced (off)
+ */
+void fakeUseWallClock(bool on) {
+  fakeMicros = fakeNowMicros();
+  fakeWallClockStart = std::chrono::steady_clock::now();
+  isFakeWallClock = on;
+}
+
+void delay(unsigned long ms) {
+  if (isFakeWallClock) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+  } else {
+    fakeAdvanceMillis(ms);
+  }
+}
+
+void yield() {}
+
+// -----------------------------------------------------------------------
+// String
+// -----------------------------------------------------------------------
+
+class __FlashStringHelper;
+#define F(text) (reinterpret_cast<const __FlashStringHelper *>(text))
+#define PROGMEM
+
+class String {
+public:
+  String() {}
+  String(const char *text) : s(text ? text : "") {}
+  String(const char *text, size_t len) : s(text, len) {}
+  String(const __FlashStringHelper *text) : s((const char *)text) {}
+  String(const std::string &text) : s(text) {}
+  String(char c) : s(1, c) {}
+  String(int value) : s(std::to_string(value)) {}
+  String(unsigned int value) : s(std::to_string(value)) {}
+  String(long value) : s(std::to_string(value)) {}
+  String(unsigned long value) : s(std::to_string(value)) {}
+  String(long long value) : s(std::to_string(value)) {}
+  String(unsigned long long value) : s(std::to_string(value)) {}
+  String(float value, unsigned int decimals = 2) : s(formatFloat(value, decimals)) {}
+  String(double value, unsigned int decimals = 2) : s(formatFloat(value, decimals)) {}
+
+  const char *c_str() const { return s.c_str(); }
+  unsigned int length() const { return s.length(); }
+  bool isEmpty() const { return s.empty(); }
+  bool reserve(unsigned int size) { s.reserve(size); return true; }
+  char charAt(unsigned int i) const { return i < s.size() ? s[i] : 0; }
+  char operator[](unsigned int i) const { return charAt(i); }
+
+  int indexOf(char c, unsigned int from = 0) const { return find(s.find(c, from)); }
+  int indexOf(const String &text, unsigned int from = 0) const { return find(s.find(text.s, from)); }
+  int lastIndexOf(char c) const { return find(s.rfind(c)); }
+  String substring(unsigned int from) const { return from < s.size() ? String(s.substr(from)) : String(); }
+  String substring(unsigned int from, unsigned int to) const {
+    if (from > to) std::swap(from, to);
+    return from < s.size() ? String(s.substr(from, to - from)) : String();
+  }
+  bool startsWith(const String &prefix) const { return s.compare(0, prefix.s.size(), prefix.s) == 0; }
+  bool endsWith(const String &suffix) const {
+    return s.size() >= suffix.s.size() && s.compare(s.size() - suffix.s.size(), suffix.s.size(), suffix.s) == 0;
+  }
+  bool equals(const String &other) const { return s == other.s; }
+  bool equalsIgnoreCase(const String &other) const {
+    if (s.size() != other.s.size()) return false;
+    for (size_t i = 0; i < s.size(); i++) {
+      if (tolower((unsigned char)s[i]) != tolower((unsigned char)other.s[i])) return false;
+    }
+    return true;
+  }
+  void replace(const String &from, const String &to) {
+    if (from.s.empty()) return;
+    for (size_t at = s.find(from.s); at != std::string::npos; at = s.find(from.s, at + to.s.size())) {
+      s.replace(at, from.s.size(), to.s);
+    }
+  }
+  void trim() {
+    size_t begin = s.find_first_not_of(" \t\r\n");
+    size_t end = s.find_last_not_of(" \t\r\n");
+    s = begin == std::string::npos ? "" : s.substr(begin, end - begin + 1);
+  }
+  void toLowerCase() { for (char &c : s) c = tolower((unsigned char)c); }
+  void toUpperCase() { for (char &c : s) c = toupper((unsigned char)c); }
+  long toInt() const { return strtol(s.c_str(), NULL, 10); }
+  bool concat(const String &text) { s += text.s; return true; }
+
+  String &operator+=(const String &text) { s += text.s; return *this; }
+  String &operator+=(const char *text) { s += text; return *this; }
+  String &operator+=(char c) { s += c; return *this; }
+  friend String operator+(const String &a, const String &b) { return String(a.s + b.s); }
+  friend String operator+(const String &a, const char *b) { return String(a.s + b); }
+  friend String operator+(const char *a, const String &b) { return String(a + b.s); }
+  friend String operator+(const String &a, char b) { return String(a.s + b); }
+  bool operator==(const String &other) const { return s == other.s; }
+  bool operator==(const char *other) const { return s == other; }
+  bool operator!=(const String &other) const { return s != other.s; }
+  bool operator!=(const char *other) const { return s != other; }
+  bool operator<(const String &other) const { return s < other.s; }
+
+private:
+  std::string s;
+
+  static int find(size_t at) { return at == std::string::npos ? -1 : (int)at; }
+  static std::string formatFloat(double value, unsigned int decimals) {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%.*f", decimals, value);
+    return buffer;
+  }
+};
+
+// -----------------------------------------------------------------------
+// IPAddress
+// -----------------------------------------------------------------------
+
+class IPAddress {
+public:
+  IPAddress() : address(0) {}
+  IPAddress(uint32_t value) : address(value) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+      : address((uint32_t)a | ((uint32_t)b << 8) | ((uint32_t)c << 16) | ((uint32_t)d << 24)) {}
+  operator uint32_t() const { return address; }
+  bool fromString(const char *text) {
+    unsigned a, b, c, d;
+    char tail;
+    if (sscanf(text, "%u.%u.%u.%u%c", &a, &b, &c, &d, &tail) != 4 || a > 255 || b > 255 || c > 255 || d > 255) {
+      return false;
+    }
+    *this = IPAddress(a, b, c, d);
+    return true;
+  }
+  bool fromString(const String &text) { return fromString(text.c_str()); }
+  bool operator==(const IPAddress &other) const { return address == other.address; }
+  String toString() const {
+    char text[16];
+    snprintf(text, sizeof(text), "%u.%u.%u.%u", address & 0xff, (address >> 8) & 0xff,
+             (address >> 16) & 0xff, address >> 24);
+    return text;
+  }
+
+private:
+  uint32_t address;
+};
+
+const IPAddress INADDR_NONE(0);
+
+// -----------------------------------------------------------------------
+// Serial
+// -----------------------------------------------------------------------
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(const uint8_t *data, size_t len) {
+    if (getenv("FAKE_SERIAL_ECHO")) {
+      fwrite(data, 1, len, stdout);
+    }
+    return len;
+  }
+  size_t write(uint8_t c) { return write(&c, 1); }
+  size_t print(const char *text) { return write((const uint8_t *)text, strlen(text)); }
+  size_t print(const String &text) { return print(text.c_str()); }
+  size_t print(const __FlashStringHelper *text) { return print((const char *)text); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(long value) { return print(String(value)); }
+  size_t print(unsigned long value) { return print(String(value)); }
+  size_t print(int value) { return print(String(value)); }
+  size_t print(unsigned int value) { return print(String(value)); }
+  size_t print(double value) { return print(String(value)); }
+  size_t print(const IPAddress &ip) { return print(ip.toString()); }
+  template <typename T>
+  size_t println(const T &value) { return print(value) + print("\n"); }
+  size_t println() { return print("\n"); }
+  size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3))) {
+    char buffer[512];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    return write((const uint8_t *)buffer, min((size_t)n, sizeof(buffer) - 1));
+  }
+};
+
+class HardwareSerial : public Print {
+public:
+  void begin(unsigned long baud) {}
+  void flush() { fflush(stdout); }
+};
+
+HardwareSerial Serial;
+
+// -----------------------------------------------------------------------
+// ESP
+// -----------------------------------------------------------------------
+
+class EspClass {
+public:
+  // Free heap as seen by the host allocator: bytes handed out by malloc()
+  // and not yet freed count against the simulated heap
+  uint32_t getFreeHeap() {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks < FAKE_HEAP_SIZE ? FAKE_HEAP_SIZE - info.uordblks : 0;
+  }
+  uint32_t getMinFreeHeap() { return getFreeHeap(); }
+  uint32_t getMaxAllocHeap() { return getFreeHeap(); }
+  uint32_t getCycleCount() { return (uint32_t)(fakeNowMicros() * 240); }
+  uint8_t getChipRevision() { return 0; }
+  void restart() { restarts++; }
+
+  int restarts = 0;
+};
+
+EspClass ESP;
+
+uint32_t fakeCpuMhz = 240;
+
+uint32_t getCpuFrequencyMhz() {
+  return fakeCpuMhz;
+}
+
+bool setCpuFrequencyMhz(uint32_t mhz) {
+  fakeCpuMhz = mhz;
+  return true;
+}
+
+uint32_t esp_random() {
+  return (uint32_t)rand();
+}
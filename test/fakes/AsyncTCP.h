@@ -0,0 +1,70 @@
+/*
+  -----------------------
+  Native AsyncTCP Fake
+  -----------------------
+
+  An AsyncClient that only tracks what the code under test can observe:
+  who receives the connection's data, how much of it was acked, and when
+  an idle connection is closed.
+  The web server fake feeds segments through fakeReceive(), which acks
+  them afterwards unless the data callback called ackLater(), as the
+  library does per pbuf.
+*/
+#pragma once
+
+#include <Arduino.h>
+
+class AsyncClient;
+
+typedef std::function<void(void *, AsyncClient *, void *data, size_t len)> AcDataHandler;
+
+class AsyncClient {
+public:
+  AcDataHandler dataHandler;
+  void *dataArg = NULL;
+  size_t receivedBytes = 0;
+  size_t ackedBytes = 0;
+  IPAddress peer = IPAddress(192, 168, 1, 10);
+
+  void onData(AcDataHandler handler, void *arg = NULL) {
+    dataHandler = handler;
+    dataArg = arg;
+  }
+
+  void ackLater() { isAckHeld = true; }
+
+  // Seconds without data before the library closes the connection, 0 for never
+  void setRxTimeout(uint32_t timeout) { rxTimeout = timeout; }
+  uint32_t getRxTimeout() { return rxTimeout; }
+
+  size_t ack(size_t len) {
+    size_t n = min(len, receivedBytes - ackedBytes);
+    ackedBytes += n;
+    return n;
+  }
+
+  IPAddress remoteIP() { return peer; }
+
+  /**
+   * Deliver one segment to the data callback; false if there is none
+   */
+  bool fakeReceive(void *data, size_t len) {
+    if (!dataHandler) {
+      return false;
+    }
+    isAckHeld = false;
+    receivedBytes += len;
+    dataHandler(dataArg, this, data, len);
+    if (!isAckHeld) {
+      ack(len);
+    }
+    return true;
+  }
+
+  // Bytes received but not acked, which closes the sender's window
+  size_t fakeUnacked() { return receivedBytes - ackedBytes; }
+
+private:
+  bool isAckHeld = false;
+  uint32_t rxTimeout = 0;
+};
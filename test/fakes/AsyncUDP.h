@@ -0,0 +1,58 @@
+/*
+  -----------------------
+  Native AsyncUDP Fake
+  -----------------------
+
+  Packets are injected by a test with fakeDeliver(); anything the code
+  under test sends is kept in sent for inspection.
+*/
+#pragma once
+
+#include <Arduino.h>
+
+class AsyncUDPPacket {
+public:
+  AsyncUDPPacket(const uint8_t *data, size_t len, IPAddress from = IPAddress(192, 168, 1, 20),
+                 uint16_t port = 3232)
+      : bytes(data), size(len), from(from), port(port) {}
+
+  uint8_t *data() { return (uint8_t *)bytes; }
+  size_t length() { return size; }
+  IPAddress remoteIP() { return from; }
+  uint16_t remotePort() { return port; }
+
+private:
+  const uint8_t *bytes;
+  size_t size;
+  IPAddress from;
+  uint16_t port;
+};
+
+typedef std::function<void(AsyncUDPPacket &packet)> AuPacketHandlerFunction;
+
+class AsyncUDP {
+public:
+  bool isListening = false;
+  std::vector<std::vector<uint8_t>> sent;
+
+  void onPacket(AuPacketHandlerFunction handler) { packetHandler = handler; }
+  bool listenMulticast(const IPAddress &group, uint16_t port) {
+    isListening = true;
+    return true;
+  }
+  void close() { isListening = false; }
+  size_t writeTo(const uint8_t *data, size_t len, const IPAddress &ip, uint16_t port) {
+    sent.emplace_back(data, data + len);
+    return len;
+  }
+
+  void fakeDeliver(const uint8_t *data, size_t len) {
+    if (isListening && packetHandler) {
+      AsyncUDPPacket packet(data, len);
+      packetHandler(packet);
+    }
+  }
+
+private:
+  AuPacketHandlerFunction packetHandler;
+};
@@ -0,0 +1,480 @@
+/*
+  -----------------------
+  Native ESPAsyncWebServer Fake
+  -----------------------
+
+  The request/handler side of ESPAsyncWebServer 3.x, driven by a test
+  through FakeConnection instead of a socket:
+
+    FakeConnection c(server, HTTP_POST, "/ota/firmware?md5=...");
+    c.header("Content-Length", "4096");
+    c.open();              // headers in: canHandle(), maybe handleRequest()
+    c.receive(data, len);  // one TCP segment of the body
+    c.idle(seconds);       // no data for a while: closed on RX timeout
+    c.close();             // connection gone: onDisconnect, request freed
+
+  Segments are dispatched the way the library does it: to the data
+  callback if a handler took the connection over, through a byte-level
+  multipart parser that flushes its 1460-byte item buffer when full or at
+  the end of a segment, or to handleBody() as received. handleRequest()
+  runs when the Content-Length has been read, or right after the headers
+  for a request without one.
+
+  Several connections can be open at once, so tests can interleave
+  competing requests segment by segment.
+*/
+#pragma once
+
+#include <Arduino.h>
+#include <AsyncTCP.h>
+#include <map>
+
+typedef enum {
+  HTTP_GET = 0b00000001,
+  HTTP_POST = 0b00000010,
+  HTTP_DELETE = 0b00000100,
+  HTTP_PUT = 0b00001000,
+  HTTP_PATCH = 0b00010000,
+  HTTP_HEAD = 0b00100000,
+  HTTP_OPTIONS = 0b01000000,
+  HTTP_ANY = 0b01111111
+} WebRequestMethod;
+
+typedef uint8_t WebRequestMethodComposite;
+
+#define RESPONSE_TRY_AGAIN 0xFFFFFFFF
+
+typedef std::function<size_t(uint8_t *buffer, size_t maxLen, size_t index)> AwsResponseFiller;
+typedef std::function<void(void)> ArDisconnectHandler;
+
+class AsyncWebServerRequest;
+
+class AsyncWebParameter {
+public:
+  AsyncWebParameter(const String &name, const String &value) : paramName(name), paramValue(value) {}
+  const String &name() const { return paramName; }
+  const String &value() const { return paramValue; }
+
+private:
+  String paramName;
+  String paramValue;
+};
+
+class AsyncWebServerResponse {
+public:
+  int code;
+  String contentType;
+  String content;
+  AwsResponseFiller filler;
+  std::vector<std::pair<String, String>> headers;
+
+  AsyncWebServerResponse(int code, const String &contentType, const String &content)
+      : code(code), contentType(contentType), content(content) {}
+  virtual ~AsyncWebServerResponse() {}
+
+  void addHeader(const String &name, const String &value) { headers.push_back({ name, value }); }
+
+  String header(const String &name) const {
+    for (const auto &h : headers) {
+      if (h.first.equalsIgnoreCase(name)) {
+        return h.second;
+      }
+    }
+    return String();
+  }
+};
+
+class AsyncWebHandler {
+public:
+  virtual ~AsyncWebHandler() {}
+  virtual bool canHandle(AsyncWebServerRequest *request) { return false; }
+  virtual void handleRequest(AsyncWebServerRequest *request) {}
+  virtual void handleUpload(AsyncWebServerRequest *request, const String &filename, size_t index,
+                            uint8_t *data, size_t len, bool final) {}
+  virtual void handleBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index,
+                          size_t total) {}
+  virtual bool isRequestHandlerTrivial() { return true; }
+};
+
+// Credentials authenticate() accepts
+String fakeAuthUser = "admin";
+String fakeAuthPass = "admin";
+
+class AsyncWebServerRequest {
+public:
+  void *_tempObject = NULL;
+
+  AsyncWebServerRequest(WebRequestMethodComposite method, const String &path) : requestMethod(method) {
+    int query = path.indexOf('?');
+    requestUrl = query < 0 ? path : path.substring(0, query);
+    String rest = query < 0 ? String() : path.substring(query + 1);
+    while (rest.length()) {
+      int amp = rest.indexOf('&');
+      String pair = amp < 0 ? rest : rest.substring(0, amp);
+      rest = amp < 0 ? String() : rest.substring(amp + 1);
+      int eq = pair.indexOf('=');
+      params.push_back(eq < 0 ? AsyncWebParameter(pair, "") :
+                                AsyncWebParameter(pair.substring(0, eq), pair.substring(eq + 1)));
+    }
+  }
+
+  ~AsyncWebServerRequest() {
+    free(_tempObject);
+    delete response;
+  }
+
+  WebRequestMethodComposite method() const { return requestMethod; }
+  const String &url() const { return requestUrl; }
+  AsyncClient *client() { return &tcp; }
+  size_t contentLength() const { return length; }
+  const String &contentType() const { return type; }
+
+  bool hasParam(const String &name, bool post = false, bool file = false) const {
+    return getParam(name) != NULL;
+  }
+  const AsyncWebParameter *getParam(const String &name, bool post = false, bool file = false) const {
+    for (const AsyncWebParameter &p : params) {
+      if (p.name() == name) {
+        return &p;
+      }
+    }
+    return NULL;
+  }
+
+  bool hasHeader(const String &name) const { return findHeader(name) != NULL; }
+  String header(const String &name) const {
+    const String *value = findHeader(name);
+    return value ? *value : String();
+  }
+  void addInterestingHeader(const String &name) {}
+
+  bool authenticate(const char *user, const char *pass) {
+    String expected = String(user) + ":" + pass;
+    return header("Authorization") == expected;
+  }
+  void requestAuthentication() { send(401); }
+
+  void onDisconnect(ArDisconnectHandler handler) { disconnectHandler = handler; }
+
+  AsyncWebServerResponse *beginResponse(int code, const String &contentType = String(),
+                                        const String &content = String()) {
+    return new AsyncWebServerResponse(code, contentType, content);
+  }
+  AsyncWebServerResponse *beginResponse_P(int code, const String &contentType, const uint8_t *content,
+                                          size_t len) {
+    return new AsyncWebServerResponse(code, contentType, String((const char *)content, len));
+  }
+  AsyncWebServerResponse *beginChunkedResponse(const String &contentType, AwsResponseFiller filler) {
+    AsyncWebServerResponse *r = new AsyncWebServerResponse(200, contentType, String());
+    r->filler = filler;
+    return r;
+  }
+
+  void send(AsyncWebServerResponse *r) {
+    if (response != NULL) {
+      // The library keeps the first response and drops later ones
+      sendsDropped++;
+      delete r;
+      return;
+    }
+    response = r;
+    tcp.setRxTimeout(0);
+  }
+  void send(int code, const String &contentType = String(), const String &content = String()) {
+    send(beginResponse(code, contentType, content));
+  }
+  void redirect(const String &url) {
+    AsyncWebServerResponse *r = beginResponse(302);
+    r->addHeader("Location", url);
+    send(r);
+  }
+
+  // Set up by FakeConnection
+  std::vector<std::pair<String, String>> headers;
+  size_t length = 0;
+  String type;
+  AsyncWebServerResponse *response = NULL;
+  int sendsDropped = 0;
+  ArDisconnectHandler disconnectHandler;
+  AsyncClient tcp;
+
+private:
+  WebRequestMethodComposite requestMethod;
+  String requestUrl;
+  std::vector<AsyncWebParameter> params;
+
+  const String *findHeader(const String &name) const {
+    for (const auto &h : headers) {
+      if (h.first.equalsIgnoreCase(name)) {
+        return &h.second;
+      }
+    }
+    return NULL;
+  }
+};
+
+typedef std::function<void(AsyncWebServerRequest *request)> ArRequestHandlerFunction;
+
+class AsyncWebServer {
+public:
+  struct Route {
+    String url;
+    WebRequestMethodComposite method;
+    ArRequestHandlerFunction handler;
+  };
+
+  std::vector<AsyncWebHandler *> handlers;
+  std::vector<Route> routes;
+  bool isListening = false;
+  int begins = 0;
+
+  AsyncWebServer(uint16_t port) {}
+
+  void on(const char *url, WebRequestMethodComposite method, ArRequestHandlerFunction handler) {
+    routes.push_back({ url, method, handler });
+  }
+  AsyncWebHandler &addHandler(AsyncWebHandler *handler) {
+    handlers.push_back(handler);
+    return *handler;
+  }
+  void begin() {
+    isListening = true;
+    begins++;
+  }
+  void end() { isListening = false; }
+};
+
+/**
+ * One client connection carrying one request
+ */
+class FakeConnection {
+public:
+  FakeConnection(AsyncWebServer &server, WebRequestMethodComposite method, const String &path)
+      : request(new AsyncWebServerRequest(method, path)), server(server) {}
+
+  ~FakeConnection() { close(); }
+
+  FakeConnection &header(const String &name, const String &value) {
+    request->headers.push_back({ name, value });
+    if (name.equalsIgnoreCase("Content-Length")) {
+      request->length = value.toInt();
+    } else if (name.equalsIgnoreCase("Content-Type")) {
+      request->type = value;
+      int at = value.indexOf("boundary=");
+      if (value.startsWith("multipart/") && at >= 0) {
+        boundary = value.substring(at + 9);
+        boundary.replace("\"", "");
+      }
+    }
+    return *this;
+  }
+
+  /**
+   * The headers have arrived: pick the handler as the library does
+   */
+  void open() {
+    for (AsyncWebHandler *h : server.handlers) {
+      if (h->canHandle(request)) {
+        handler = h;
+        break;
+      }
+    }
+    if (handler == NULL) {
+      for (AsyncWebServer::Route &route : server.routes) {
+        if (route.url == request->url() && (route.method & request->method())) {
+          routeHandler = route.handler;
+          break;
+        }
+      }
+    }
+    // Written once a handler is attached, even if it already responded
+    if (request->header("Expect").equalsIgnoreCase("100-continue")) {
+      isContinueSent = true;
+    }
+    if (request->length == 0) {
+      finishRequest();
+    }
+  }
+
+  /**
+   * One TCP segment of the body arrives
+   */
+  void receive(const uint8_t *data, size_t len) {
+    if (request == NULL) {
+      return;
+    }
+    // Taken over by a handler: the library no longer sees the data
+    if (request->tcp.fakeReceive((void *)data, len)) {
+      return;
+    }
+    request->tcp.receivedBytes += len;
+    request->tcp.ack(len);
+    if (isDone) {
+      return;
+    }
+
+    size_t n = min(len, request->length - parsed);
+    if (boundary.length()) {
+      for (size_t i = 0; i < n && request->tcp.dataHandler == NULL; i++) {
+        parseMultipartByte(data[i], i == n - 1);
+      }
+    } else if (handler != NULL) {
+      handler->handleBody(request, (uint8_t *)data, n, parsed, request->length);
+    }
+    parsed += n;
+    if (parsed == request->length && request->tcp.dataHandler == NULL) {
+      finishRequest();
+    }
+  }
+
+  void receive(const String &text) { receive((const uint8_t *)text.c_str(), text.length()); }
+
+  /**
+   * Send data as segments of at most segment bytes
+   */
+  void receiveAll(const uint8_t *data, size_t len, size_t segment = 1436) {
+    for (size_t at = 0; at < len; at += segment) {
+      receive(data + at, min(segment, len - at));
+    }
+  }
+
+  /**
+   * The connection closed; the library frees the request right away
+   */
+  void close() {
+    if (request == NULL) {
+      return;
+    }
+    if (request->response != NULL) {
+      status = request->response->code;
+      body = request->response->content;
+    }
+    if (request->disconnectHandler) {
+      request->disconnectHandler();
+    }
+    delete request;
+    request = NULL;
+  }
+
+  /**
+   * Nothing arrives for seconds; the library closes the connection once its
+   * RX timeout has run out
+   */
+  void idle(uint32_t seconds) {
+    if (request != NULL && request->tcp.getRxTimeout() != 0 && seconds >= request->tcp.getRxTimeout()) {
+      close();
+    }
+  }
+
+  bool isOpen() { return request != NULL; }
+
+  // Response code so far, 0 if none was sent yet
+  int responseCode() {
+    return request && request->response ? request->response->code : status;
+  }
+  String responseBody() {
+    return request && request->response ? request->response->content : body;
+  }
+
+  AsyncWebServerRequest *request;
+  // The library wrote "HTTP/1.1 100 Continue" for "Expect: 100-continue"
+  bool isContinueSent = false;
+
+private:
+  AsyncWebServer &server;
+  AsyncWebHandler *handler = NULL;
+  ArRequestHandlerFunction routeHandler;
+  size_t parsed = 0;
+  bool isDone = false;
+  int status = 0;
+  String body;
+
+  // Multipart parser state, following WebRequest.cpp
+  String boundary;
+  enum { EXPECT_BOUNDARY, PART_HEADERS, PART_DATA, PART_DONE } stage = EXPECT_BOUNDARY;
+  String line;
+  String filename;
+  bool isFilePart = false;
+  size_t itemSize = 0;
+  uint8_t itemBuffer[1460];
+  size_t itemBufferIndex = 0;
+  String delimiter;
+  size_t matched = 0;
+
+  void finishRequest() {
+    isDone = true;
+    if (handler != NULL) {
+      handler->handleRequest(request);
+    } else if (routeHandler) {
+      routeHandler(request);
+    } else {
+      request->send(404);
+    }
+  }
+
+  void flushItem(bool final) {
+    if (handler != NULL && isFilePart) {
+      handler->handleUpload(request, filename, itemSize - itemBufferIndex, itemBuffer, itemBufferIndex, final);
+    }
+    itemBufferIndex = 0;
+  }
+
+  void uploadByte(uint8_t b, bool last) {
+    itemBuffer[itemBufferIndex++] = b;
+    itemSize++;
+    if (last || itemBufferIndex == sizeof(itemBuffer)) {
+      flushItem(false);
+    }
+  }
+
+  void parseMultipartByte(uint8_t b, bool last) {
+    switch (stage) {
+      case EXPECT_BOUNDARY:
+      case PART_HEADERS:
+        line += (char)b;
+        if (!line.endsWith("\r\n")) {
+          return;
+        }
+        line = line.substring(0, line.length() - 2);
+        if (stage == EXPECT_BOUNDARY) {
+          stage = line == "--" + boundary ? PART_HEADERS : PART_DONE;
+        } else if (line.length() == 0) {
+          stage = PART_DATA;
+          delimiter = "\r\n--" + boundary;
+          matched = 0;
+          itemSize = 0;
+          itemBufferIndex = 0;
+        } else if (line.indexOf("filename=\"") >= 0) {
+          int at = line.indexOf("filename=\"") + 10;
+          filename = line.substring(at, line.indexOf('"', at));
+          isFilePart = true;
+        }
+        line = String();
+        return;
+
+      case PART_DATA:
+        if ((char)b == delimiter[matched]) {
+          if (++matched == delimiter.length()) {
+            flushItem(true);
+            isFilePart = false;
+            stage = PART_DONE;
+          }
+          return;
+        }
+        // Not the delimiter after all: the held bytes were data
+        for (size_t i = 0; i < matched; i++) {
+          uploadByte(delimiter[i], false);
+        }
+        matched = 0;
+        if ((char)b == delimiter[0]) {
+          matched = 1;
+          return;
+        }
+        uploadByte(b, last);
+        return;
+
+      case PART_DONE:
+        return;
+    }
+  }
+};
@@ -0,0 +1,46 @@
+/*
+  -----------------------
+  Native ESPmDNS Fake
+  -----------------------
+
+  Advertising succeeds and is recorded. Queries find the services a test
+  puts in fakeMDNSServices, with their sha256 TXT record.
+*/
+#pragma once
+
+#include <Arduino.h>
+
+struct FakeMDNSService {
+  IPAddress ip;
+  uint16_t port;
+  String sha256;
+};
+
+std::vector<FakeMDNSService> fakeMDNSServices;
+
+class MDNSResponder {
+public:
+  bool isStarted = false;
+  int services = 0;
+
+  bool begin(const char *hostname) {
+    isStarted = true;
+    return true;
+  }
+  void end() { isStarted = false; }
+  bool addService(const char *service, const char *proto, uint16_t port) {
+    services++;
+    return true;
+  }
+  bool addServiceTxt(const char *service, const char *proto, const char *key, const String &value) {
+    return true;
+  }
+  int queryService(const char *service, const char *proto) { return fakeMDNSServices.size(); }
+  IPAddress IP(int index) { return fakeMDNSServices[index].ip; }
+  uint16_t port(int index) { return fakeMDNSServices[index].port; }
+  String txt(int index, const char *key) {
+    return strcmp(key, "sha256") == 0 ? fakeMDNSServices[index].sha256 : String();
+  }
+};
+
+MDNSResponder MDNS;
@@ -0,0 +1,31 @@
+/*
+  -----------------------
+  Native ElegantOTA Fake
+  -----------------------
+
+  Records registration and callbacks; the page and its routes are not
+  served natively.
+*/
+#pragma once
+
+#include <ESPAsyncWebServer.h>
+
+class ElegantOTAClass {
+public:
+  AsyncWebServer *server = NULL;
+  int begins = 0;
+  void (*startCallback)() = NULL;
+  void (*progressCallback)(size_t, size_t) = NULL;
+  void (*endCallback)(bool) = NULL;
+
+  void begin(AsyncWebServer *s, const char *username = "", const char *password = "") {
+    server = s;
+    begins++;
+  }
+  void setAuth(const char *username, const char *password) {}
+  void onStart(void (*callback)()) { startCallback = callback; }
+  void onProgress(void (*callback)(size_t, size_t)) { progressCallback = callback; }
+  void onEnd(void (*callback)(bool)) { endCallback = callback; }
+};
+
+ElegantOTAClass ElegantOTA;
@@ -0,0 +1,73 @@
+/*
+  -----------------------
+  Native Test Images
+  -----------------------
+
+  Builds firmware images that pass the same checks as a real ESP32-S3
+  application (OTAImageCheck.h, esp_image_verify()), with pseudo-random
+  segment data so every image built from a different seed differs.
+*/
+#pragma once
+
+#include <Arduino.h>
+#include <mbedtls/sha256.h>
+
+/**
+ * An application image with segmentCount segments of segmentSize bytes
+ * (a multiple of 4), optionally followed by its appended SHA-256
+ */
+std::vector<uint8_t> fakeAppImage(uint32_t seed, size_t segmentSize = 16 * 1024, uint8_t segmentCount = 2,
+                                  bool hasHash = true) {
+  std::vector<uint8_t> image(24, 0);
+  image[0] = 0xE9;
+  image[1] = segmentCount;
+  image[12] = CONFIG_IDF_FIRMWARE_CHIP_ID & 0xff;
+  image[13] = CONFIG_IDF_FIRMWARE_CHIP_ID >> 8;
+  image[23] = hasHash ? 1 : 0;
+
+  uint32_t x = seed * 2654435761u + 1;
+  for (uint8_t s = 0; s < segmentCount; s++) {
+    uint32_t header[2] = { 0x3c000000u + s * 0x100000u, (uint32_t)segmentSize };
+    image.insert(image.end(), (uint8_t *)header, (uint8_t *)header + sizeof(header));
+    size_t start = image.size();
+    for (size_t i = 0; i < segmentSize; i++) {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      image.push_back((uint8_t)x);
+    }
+    if (s == 0) {
+      // Applications start with the app description
+      const uint32_t magic = 0xABCD5432;
+      memcpy(image.data() + start, &magic, sizeof(magic));
+    }
+  }
+
+  // Checksum byte, padded to 16
+  image.resize((image.size() + 16) & ~(size_t)15, 0);
+  if (hasHash) {
+    uint8_t digest[32];
+    mbedtls_sha256_ret(image.data(), image.size(), digest, 0);
+    image.insert(image.end(), digest, digest + sizeof(digest));
+  }
+  return image;
+}
+
+/**
+ * Lower-case hex of bytes
+ */
+String fakeHex(const uint8_t *bytes, size_t len) {
+  String hex;
+  char two[3];
+  for (size_t i = 0; i < len; i++) {
+    snprintf(two, sizeof(two), "%02x", bytes[i]);
+    hex += two;
+  }
+  return hex;
+}
+
+String fakeSHA256Hex(const std::vector<uint8_t> &data) {
+  uint8_t digest[32];
+  mbedtls_sha256_ret(data.data(), data.size(), digest, 0);
+  return fakeHex(digest, sizeof(digest));
+}
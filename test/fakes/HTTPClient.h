@@ -0,0 +1,174 @@
+/*
+  -----------------------
+  Native HTTPClient Fake
+  -----------------------
+
+  Requests go to the resources a test registers in fakeHTTPResources by
+  URL; any other URL fails to connect, so pull updates, update checks
+  and peer fetches take their error paths unless a test serves them.
+
+  A resource answers Range requests with 206 (unless acceptsRanges is
+  off) and If-None-Match with 304 when it matches its ETag header.
+  dropAt makes the first response that reaches that offset of the body
+  end there, as if the connection was lost. Every request is logged in
+  fakeHTTPRequests.
+*/
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <map>
+#include <mutex>
+
+#define HTTPC_ERROR_CONNECTION_REFUSED (-1)
+
+typedef enum {
+  HTTP_CODE_OK = 200,
+  HTTP_CODE_PARTIAL_CONTENT = 206,
+  HTTP_CODE_NOT_MODIFIED = 304,
+  HTTP_CODE_NOT_FOUND = 404
+} t_http_codes;
+
+struct FakeHTTPResource {
+  int status = HTTP_CODE_OK;
+  std::vector<uint8_t> body;
+  std::map<String, String> headers;
+  bool acceptsRanges = true;
+  size_t dropAt = SIZE_MAX;  // Once: the response reaching this offset ends there
+};
+
+struct FakeHTTPRequest {
+  String url;
+  String range;
+  String ifNoneMatch;
+  String user;
+};
+
+std::map<String, FakeHTTPResource> fakeHTTPResources;
+std::vector<FakeHTTPRequest> fakeHTTPRequests;
+std::mutex fakeHTTPLock;
+
+void fakeHTTPReset() {
+  std::lock_guard<std::mutex> guard(fakeHTTPLock);
+  fakeHTTPResources.clear();
+  fakeHTTPRequests.clear();
+}
+
+/**
+ * Serve body at url with the given headers
+ */
+FakeHTTPResource &fakeHTTPServe(const String &url, const std::vector<uint8_t> &body,
+                                std::map<String, String> headers = {}) {
+  std::lock_guard<std::mutex> guard(fakeHTTPLock);
+  FakeHTTPResource &resource = fakeHTTPResources[url];
+  resource = FakeHTTPResource();
+  resource.body = body;
+  resource.headers = headers;
+  return resource;
+}
+
+FakeHTTPResource &fakeHTTPServe(const String &url, const String &body, std::map<String, String> headers = {}) {
+  return fakeHTTPServe(url, std::vector<uint8_t>(body.c_str(), body.c_str() + body.length()), headers);
+}
+
+class WiFiClient {
+public:
+  int available() { return (int)(data.size() - position); }
+  bool connected() { return position < data.size(); }
+  int read(uint8_t *buffer, size_t len) {
+    size_t n = min(len, data.size() - position);
+    if (n == 0) {
+      return -1;
+    }
+    memcpy(buffer, data.data() + position, n);
+    position += n;
+    return (int)n;
+  }
+
+  std::vector<uint8_t> data;  // What arrives before the connection ends
+  size_t position = 0;
+};
+
+class HTTPClient {
+public:
+  bool begin(const String &url) {
+    this->url = url;
+    request = FakeHTTPRequest();
+    request.url = url;
+    return url.length() > 0;
+  }
+  void end() {}
+  void setReuse(bool reuse) {}
+  void setTimeout(uint16_t timeout) {}
+  void setConnectTimeout(int32_t timeout) {}
+  void setAuthorization(const char *user, const char *password) { request.user = user; }
+  void addHeader(const String &name, const String &value) {
+    if (name.equalsIgnoreCase("Range")) {
+      request.range = value;
+    } else if (name.equalsIgnoreCase("If-None-Match")) {
+      request.ifNoneMatch = value;
+    }
+  }
+  void collectHeaders(const char *headerKeys[], const size_t headerKeysCount) {}
+
+  int GET() {
+    std::lock_guard<std::mutex> guard(fakeHTTPLock);
+    fakeHTTPRequests.push_back(request);
+    responseHeaders.clear();
+    stream = WiFiClient();
+    size = -1;
+
+    auto found = fakeHTTPResources.find(url);
+    if (found == fakeHTTPResources.end()) {
+      return HTTPC_ERROR_CONNECTION_REFUSED;
+    }
+    FakeHTTPResource &resource = found->second;
+    responseHeaders = resource.headers;
+    if (resource.status != HTTP_CODE_OK) {
+      return resource.status;
+    }
+    if (request.ifNoneMatch.length() && request.ifNoneMatch == resource.headers["ETag"]) {
+      return HTTP_CODE_NOT_MODIFIED;
+    }
+
+    // "bytes=<first>-[<last>]"
+    size_t first = 0;
+    size_t last = resource.body.size() - 1;
+    int status = HTTP_CODE_OK;
+    if (request.range.startsWith("bytes=") && resource.acceptsRanges) {
+      int dash = request.range.indexOf('-');
+      first = request.range.substring(6, dash).toInt();
+      if (dash + 1 < (int)request.range.length()) {
+        last = min(last, (size_t)request.range.substring(dash + 1).toInt());
+      }
+      if (first > last) {
+        return 416;
+      }
+      status = HTTP_CODE_PARTIAL_CONTENT;
+    }
+
+    size_t end = last + 1;
+    if (resource.dropAt < end) {
+      end = max(resource.dropAt, first);
+      resource.dropAt = SIZE_MAX;
+    }
+    stream.data.assign(resource.body.begin() + first, resource.body.begin() + end);
+    size = (int)(last + 1 - first);
+    return status;
+  }
+  int getSize() { return size; }
+  String header(const char *name) {
+    auto found = responseHeaders.find(name);
+    return found == responseHeaders.end() ? String() : found->second;
+  }
+  String getString() { return String((const char *)stream.data.data(), stream.data.size()); }
+  WiFiClient *getStreamPtr() { return &stream; }
+  static String errorToString(int error) { return "connection refused"; }
+
+private:
+  String url;
+  FakeHTTPRequest request;
+  std::map<String, String> responseHeaders;
+  WiFiClient stream;
+  int size = -1;
+};
@@ -0,0 +1,83 @@
+/*
+  -----------------------
+  Native Preferences Fake
+  -----------------------
+
+  NVS held in host memory and shared by every Preferences instance, so
+  state written by one module (or one simulated boot) is visible to the
+  next. fakeNVSWrites counts put/remove/clear calls, for tests that care
+  about flash wear. Clear fakeNVS between tests for a factory-fresh device.
+*/
+#pragma once
+
+#include <Arduino.h>
+#include <map>
+
+std::map<std::string, std::map<std::string, std::vector<uint8_t>>> fakeNVS;
+uint32_t fakeNVSWrites = 0;
+
+class Preferences {
+public:
+  bool begin(const char *name, bool readOnly = false) {
+    // Like NVS, opening a namespace that was never written fails read-only
+    if (readOnly && fakeNVS.find(name) == fakeNVS.end()) {
+      return false;
+    }
+    space = &fakeNVS[name];
+    isReadOnly = readOnly;
+    return true;
+  }
+
+  void end() { space = NULL; }
+
+  bool clear() { return write([&] { space->clear(); }); }
+  bool remove(const char *key) { return write([&] { space->erase(key); }); }
+
+  size_t putBytes(const char *key, const void *value, size_t len) {
+    const uint8_t *bytes = (const uint8_t *)value;
+    return write([&] { (*space)[key].assign(bytes, bytes + len); }) ? len : 0;
+  }
+  size_t putUInt(const char *key, uint32_t value) { return putBytes(key, &value, sizeof(value)); }
+  size_t putULong(const char *key, uint32_t value) { return putBytes(key, &value, sizeof(value)); }
+  size_t putString(const char *key, const String &value) { return putBytes(key, value.c_str(), value.length()); }
+
+  size_t getBytes(const char *key, void *buf, size_t maxLen) {
+    const std::vector<uint8_t> *value = find(key);
+    if (value == NULL || value->size() > maxLen) {
+      return 0;
+    }
+    memcpy(buf, value->data(), value->size());
+    return value->size();
+  }
+  uint32_t getUInt(const char *key, uint32_t defaultValue = 0) {
+    uint32_t value;
+    return getBytes(key, &value, sizeof(value)) == sizeof(value) ? value : defaultValue;
+  }
+  uint32_t getULong(const char *key, uint32_t defaultValue = 0) { return getUInt(key, defaultValue); }
+  String getString(const char *key, const String &defaultValue = String()) {
+    const std::vector<uint8_t> *value = find(key);
+    return value ? String((const char *)value->data(), value->size()) : defaultValue;
+  }
+
+private:
+  std::map<std::string, std::vector<uint8_t>> *space = NULL;
+  bool isReadOnly = false;
+
+  const std::vector<uint8_t> *find(const char *key) {
+    if (space == NULL) {
+      return NULL;
+    }
+    auto it = space->find(key);
+    return it == space->end() ? NULL : &it->second;
+  }
+
+  template <typename F>
+  bool write(F apply) {
+    if (space == NULL || isReadOnly) {
+      return false;
+    }
+    apply();
+    fakeNVSWrites++;
+    return true;
+  }
+};
@@ -0,0 +1,157 @@
+/*
+  -----------------------
+  Native WiFi Fake
+  -----------------------
+
+  The station side of the Arduino-ESP32 WiFi class. Nothing connects on
+  its own: a test plays the driver by calling fakeWiFiGotIP() or
+  fakeWiFiDisconnected(), which update the status and deliver the event
+  to the registered handlers just like the Arduino event task would.
+
+  Every begin()/config() call is recorded so tests can check whether a
+  connection used the fast-reconnect cache or DHCP. As on the device,
+  begin() without arguments reconnects with the stored driver config
+  (including a BSSID and channel from an earlier begin()), and
+  config(INADDR_NONE, ...) drops the current address and restarts DHCP.
+*/
+#pragma once
+
+#include <Arduino.h>
+
+typedef enum {
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_DISCONNECTED = 6
+} wl_status_t;
+
+typedef enum { WIFI_OFF = 0, WIFI_STA = 1, WIFI_AP = 2, WIFI_AP_STA = 3 } wifi_mode_t;
+
+typedef enum {
+  ARDUINO_EVENT_WIFI_STA_CONNECTED = 4,
+  ARDUINO_EVENT_WIFI_STA_DISCONNECTED = 5,
+  ARDUINO_EVENT_WIFI_STA_GOT_IP = 7,
+  ARDUINO_EVENT_WIFI_AP_STACONNECTED = 12
+} arduino_event_id_t;
+
+typedef arduino_event_id_t WiFiEvent_t;
+typedef void (*WiFiEventCb)(WiFiEvent_t event);
+
+class WiFiClass {
+public:
+  // How the last begin() was called
+  bool lastBeginUsedCache = false;
+  int32_t lastBeginChannel = 0;
+  uint8_t lastBeginBSSID[6] = {};
+  int beginCalls = 0;
+
+  // Driver config stored by the last begin() with arguments
+  int32_t storedChannel = 0;
+  uint8_t storedBSSID[6] = {};
+  bool isStoredBSSIDSet = false;
+
+  // DHCP is off while config() holds a static address
+  bool isStaticIP = false;
+  IPAddress staticIP;
+  int dhcpStarts = 0;
+
+  // The station has an address (cleared when DHCP restarts)
+  bool hasIP = false;
+
+  wifi_mode_t currentMode = WIFI_OFF;
+  wl_status_t currentStatus = WL_DISCONNECTED;
+  IPAddress leaseIP = IPAddress(192, 168, 1, 50);
+  IPAddress leaseGateway = IPAddress(192, 168, 1, 1);
+  IPAddress leaseSubnet = IPAddress(255, 255, 255, 0);
+  IPAddress leaseDNS = IPAddress(192, 168, 1, 1);
+  uint8_t apBSSID[6] = { 0x02, 0x11, 0x22, 0x33, 0x44, 0x55 };
+  int32_t apChannel = 6;
+  String ssid = "native-ap";
+
+  std::vector<WiFiEventCb> handlers;
+
+  bool mode(wifi_mode_t m) {
+    currentMode = m;
+    return true;
+  }
+
+  bool disconnect(bool wifiOff = false, bool eraseAP = false) {
+    currentStatus = WL_DISCONNECTED;
+    hasIP = false;
+    return true;
+  }
+
+  // Reconnect with the stored config, BSSID and channel included
+  wl_status_t begin() {
+    beginCalls++;
+    lastBeginUsedCache = isStoredBSSIDSet && storedChannel != 0;
+    lastBeginChannel = storedChannel;
+    memcpy(lastBeginBSSID, storedBSSID, sizeof(lastBeginBSSID));
+    return currentStatus;
+  }
+
+  wl_status_t begin(const char *ssid, const char *pass, int32_t channel = 0, const uint8_t *bssid = NULL) {
+    storedChannel = channel;
+    isStoredBSSIDSet = bssid != NULL;
+    memset(storedBSSID, 0, sizeof(storedBSSID));
+    if (bssid) {
+      memcpy(storedBSSID, bssid, sizeof(storedBSSID));
+    }
+    return begin();
+  }
+
+  bool config(IPAddress local, IPAddress gateway, IPAddress subnet, IPAddress dns1 = INADDR_NONE) {
+    isStaticIP = local != INADDR_NONE;
+    staticIP = local;
+    if (!isStaticIP) {
+      // The address is gone until the DHCP server answers again
+      hasIP = false;
+      dhcpStarts++;
+    }
+    return true;
+  }
+
+  wl_status_t status() { return currentStatus; }
+  String SSID() { return ssid; }
+  IPAddress localIP() {
+    if (currentStatus != WL_CONNECTED || (!isStaticIP && !hasIP)) {
+      return INADDR_NONE;
+    }
+    return isStaticIP ? staticIP : leaseIP;
+  }
+  IPAddress gatewayIP() { return leaseGateway; }
+  IPAddress subnetMask() { return leaseSubnet; }
+  IPAddress dnsIP(uint8_t index = 0) { return leaseDNS; }
+  uint8_t *BSSID() { return apBSSID; }
+  int32_t channel() { return apChannel; }
+  const char *getHostname() { return "esp32-native"; }
+
+  void onEvent(WiFiEventCb handler) { handlers.push_back(handler); }
+};
+
+WiFiClass WiFi;
+
+void fakeWiFiEvent(WiFiEvent_t event) {
+  for (WiFiEventCb handler : WiFi.handlers) {
+    handler(event);
+  }
+}
+
+/**
+ * The station associated and has an address (static or from DHCP)
+ */
+void fakeWiFiGotIP() {
+  WiFi.currentStatus = WL_CONNECTED;
+  WiFi.hasIP = true;
+  fakeWiFiEvent(ARDUINO_EVENT_WIFI_STA_GOT_IP);
+}
+
+/**
+ * The station lost its AP, or an association attempt failed
+ */
+void fakeWiFiDisconnected() {
+  WiFi.currentStatus = WL_DISCONNECTED;
+  WiFi.hasIP = false;
+  fakeWiFiEvent(ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
+}
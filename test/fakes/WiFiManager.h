@@ -0,0 +1,96 @@
+/*
+  -----------------------
+  Native WiFiManager Fake
+  -----------------------
+
+  Records the configuration calls and models the non-blocking portal:
+  startConfigPortal() opens it, process() closes it once the configured
+  timeout has passed in simulated time, and a test can close it early or
+  simulate a user saving credentials with fakePortalSave().
+
+  Like the real library, an open portal holds some heap (the DNS and web
+  servers), so leaking a portal shows up as heap drift.
+*/
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+class WiFiManager {
+public:
+  bool hasSavedCredentials = true;
+  bool portalStartFails = false;
+  int portalStarts = 0;
+
+  ~WiFiManager() { free(portalHeap); }
+
+  void setConfigPortalTimeout(unsigned long seconds) { portalTimeoutMillis = seconds * 1000; }
+  void setConnectTimeout(unsigned long seconds) {}
+  void setMinimumSignalQuality(int quality) {}
+  void setShowPassword(bool show) {}
+  void setDebugOutput(bool debug) {}
+  void setAPStaticIPConfig(IPAddress ip, IPAddress gateway, IPAddress subnet) {}
+  void setWiFiAutoReconnect(bool enable) {}
+  void setCleanConnect(bool enable) {}
+  void setBreakAfterConfig(bool enable) {}
+  void setConfigPortalBlocking(bool blocking) {}
+  void setMenu(std::vector<const char *> &menu) {}
+  void setCustomHeadElement(const char *html) { headElement = html; }
+  void setAPCallback(std::function<void(WiFiManager *)> callback) { apCallback = callback; }
+  void setSaveConfigCallback(std::function<void()> callback) { saveCallback = callback; }
+
+  bool getWiFiIsSaved() { return hasSavedCredentials; }
+  String getWiFiSSID() { return WiFi.ssid; }
+  String getWiFiPass() { return "native-pass"; }
+  String getConfigPortalSSID() { return portalSSID; }
+  bool getConfigPortalActive() { return portalHeap != NULL; }
+
+  bool startConfigPortal(const char *apName) {
+    if (portalStartFails || portalHeap != NULL) {
+      return false;
+    }
+    portalStarts++;
+    portalSSID = apName;
+    portalHeap = malloc(PORTAL_HEAP);
+    portalOpenedMillis = millis();
+    if (apCallback) {
+      apCallback(this);
+    }
+    return true;
+  }
+
+  bool process() {
+    if (portalHeap != NULL && millis() - portalOpenedMillis >= portalTimeoutMillis) {
+      stopConfigPortal();
+    }
+    return WiFi.status() == WL_CONNECTED;
+  }
+
+  bool stopConfigPortal() {
+    free(portalHeap);
+    portalHeap = NULL;
+    return true;
+  }
+
+  /**
+   * A user entered credentials in the portal and the station joined
+   */
+  void fakePortalSave() {
+    hasSavedCredentials = true;
+    if (saveCallback) {
+      saveCallback();
+    }
+    fakeWiFiGotIP();
+  }
+
+private:
+  static const size_t PORTAL_HEAP = 4096;
+
+  void *portalHeap = NULL;
+  unsigned long portalOpenedMillis = 0;
+  unsigned long portalTimeoutMillis = 180000;
+  String portalSSID;
+  String headElement;
+  std::function<void(WiFiManager *)> apCallback;
+  std::function<void()> saveCallback;
+};
@@ -0,0 +1,5 @@
+/*
+  Native fake: see rom/miniz.h
+*/
+#pragma once
+#include "../../rom/miniz.h"
@@ -0,0 +1,436 @@
+/*
+  -----------------------
+  Native ESP-IDF Fake
+  -----------------------
+
+  The ESP-IDF calls used by src/: partitions backed by host memory, OTA
+  slot bookkeeping, image verification, flash mapping, heap info, ROM CRC
+  and WiFi power save.
+
+  Flash behaves like NOR flash: erase sets a sector to 0xFF and a write
+  can only clear bits, so writing a sector that was not erased first
+  corrupts it just as it would on the device. fakeFlashFailFrom makes
+  every erase or write at or beyond that partition offset fail, for
+  exercising error paths. fakeFlashEraseMicros and fakeFlashWriteMicros
+  make each sector erase and each write take that long on the host's
+  clock, for benchmarks; by default flash costs no time.
+*/
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <malloc.h>
+#include <thread>
+#include <zlib.h>
+#include <vector>
+
+#include "mbedtls/sha256.h"
+
+// sdkconfig of the ESP32-S3 target
+#define CONFIG_IDF_TARGET_ESP32S3 1
+#define CONFIG_IDF_FIRMWARE_CHIP_ID 0x0009
+
+typedef int esp_err_t;
+
+const esp_err_t ESP_OK = 0;
+const esp_err_t ESP_FAIL = -1;
+const esp_err_t ESP_ERR_NO_MEM = 0x101;
+const esp_err_t ESP_ERR_INVALID_ARG = 0x102;
+const esp_err_t ESP_ERR_INVALID_STATE = 0x103;
+const esp_err_t ESP_ERR_INVALID_SIZE = 0x104;
+const esp_err_t ESP_ERR_NOT_FOUND = 0x105;
+const esp_err_t ESP_ERR_IMAGE_INVALID = 0x2002;
+const esp_err_t ESP_ERR_OTA_VALIDATE_FAILED = 0x1503;
+const esp_err_t ESP_ERR_FLASH_OP_FAIL = 0x6001;
+
+// -----------------------------------------------------------------------
+// Partitions
+// -----------------------------------------------------------------------
+
+struct esp_partition_t {
+  uint32_t address;
+  uint32_t size;
+  char label[17];
+};
+
+const size_t FAKE_PARTITION_SIZE = 1024 * 1024;
+const size_t FAKE_FLASH_SECTOR = 4096;
+
+struct FakeFlashPartition {
+  esp_partition_t partition;
+  std::vector<uint8_t> data;
+};
+
+FakeFlashPartition fakeOTASlots[2] = {
+  { { 0x10000, FAKE_PARTITION_SIZE, "app0" }, std::vector<uint8_t>(FAKE_PARTITION_SIZE, 0xff) },
+  { { 0x110000, FAKE_PARTITION_SIZE, "app1" }, std::vector<uint8_t>(FAKE_PARTITION_SIZE, 0xff) },
+};
+
+// Slot the fake device runs from and will boot next
+int fakeRunningSlot = 0;
+int fakeBootSlot = 0;
+
+// Erases and writes at or beyond this offset fail
+size_t fakeFlashFailFrom = SIZE_MAX;
+
+// Operation counters, for tests that check what reached the flash
+uint32_t fakeFlashErases = 0;
+uint32_t fakeFlashWrites = 0;
+
+// Host time each erased sector and each write takes
+uint32_t fakeFlashEraseMicros = 0;
+uint32_t fakeFlashWriteMicros = 0;
+
+void fakeFlashBusy(uint32_t us) {
+  if (us > 0) {
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+  }
+}
+
+FakeFlashPartition *fakeSlotOf(const esp_partition_t *partition) {
+  for (FakeFlashPartition &slot : fakeOTASlots) {
+    if (&slot.partition == partition) {
+      return &slot;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Put the fake flash back into its power-on state
+ */
+void fakeFlashReset() {
+  for (FakeFlashPartition &slot : fakeOTASlots) {
+    std::fill(slot.data.begin(), slot.data.end(), 0xff);
+  }
+  fakeRunningSlot = 0;
+  fakeBootSlot = 0;
+  fakeFlashFailFrom = SIZE_MAX;
+  fakeFlashErases = 0;
+  fakeFlashWrites = 0;
+  fakeFlashEraseMicros = 0;
+  fakeFlashWriteMicros = 0;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t offset, void *dst, size_t size) {
+  FakeFlashPartition *slot = fakeSlotOf(partition);
+  if (slot == NULL || offset + size > partition->size) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  memcpy(dst, slot->data.data() + offset, size);
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t offset, const void *src, size_t size) {
+  FakeFlashPartition *slot = fakeSlotOf(partition);
+  if (slot == NULL || offset + size > partition->size) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (offset + size > fakeFlashFailFrom) {
+    return ESP_ERR_FLASH_OP_FAIL;
+  }
+  const uint8_t *bytes = (const uint8_t *)src;
+  for (size_t i = 0; i < size; i++) {
+    slot->data[offset + i] &= bytes[i];
+  }
+  fakeFlashWrites++;
+  fakeFlashBusy(fakeFlashWriteMicros);
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size) {
+  FakeFlashPartition *slot = fakeSlotOf(partition);
+  if (slot == NULL || offset % FAKE_FLASH_SECTOR != 0 || size % FAKE_FLASH_SECTOR != 0 ||
+      offset + size > partition->size) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (offset + size > fakeFlashFailFrom) {
+    return ESP_ERR_FLASH_OP_FAIL;
+  }
+  std::fill(slot->data.begin() + offset, slot->data.begin() + offset + size, 0xff);
+  fakeFlashErases++;
+  fakeFlashBusy(fakeFlashEraseMicros * (size / FAKE_FLASH_SECTOR));
+  return ESP_OK;
+}
+
+// -----------------------------------------------------------------------
+// Flash mapping
+// -----------------------------------------------------------------------
+
+typedef uint32_t spi_flash_mmap_handle_t;
+enum spi_flash_mmap_memory_t { SPI_FLASH_MMAP_DATA, SPI_FLASH_MMAP_INST };
+
+esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size,
+                             spi_flash_mmap_memory_t memory, const void **out,
+                             spi_flash_mmap_handle_t *handle) {
+  FakeFlashPartition *slot = fakeSlotOf(partition);
+  if (slot == NULL || offset + size > partition->size) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  *out = slot->data.data() + offset;
+  *handle = 1;
+  return ESP_OK;
+}
+
+void spi_flash_munmap(spi_flash_mmap_handle_t handle) {}
+
+// -----------------------------------------------------------------------
+// Images
+// -----------------------------------------------------------------------
+
+struct esp_partition_pos_t {
+  uint32_t offset;
+  uint32_t size;
+};
+
+struct esp_image_metadata_t {
+  uint32_t start_addr;
+  uint32_t image_len;
+};
+
+enum esp_image_load_mode_t { ESP_IMAGE_VERIFY, ESP_IMAGE_VERIFY_SILENT };
+
+struct esp_app_desc_t {
+  uint32_t magic_word;
+  uint32_t secure_version;
+  uint32_t reserv1[2];
+  char version[32];
+  char project_name[32];
+  char time[16];
+  char date[16];
+  char idf_ver[32];
+  uint8_t app_elf_sha256[32];
+};
+
+const esp_app_desc_t fakeAppDescription = { 0xABCD5432, 0, { 0, 0 }, "1.0.0-native", "ota-native" };
+
+const esp_app_desc_t *esp_ota_get_app_description() {
+  return &fakeAppDescription;
+}
+
+/**
+ * Length of the image at the start of data, walking its segment headers
+ * the way the bootloader does, checking the appended SHA-256 when the
+ * header asks for one; 0 if there is no valid image
+ */
+size_t fakeImageLength(const uint8_t *data, size_t size) {
+  if (size < 24 || data[0] != 0xE9 || data[1] == 0 || data[1] > 16) {
+    return 0;
+  }
+  size_t offset = 24;
+  for (uint8_t i = 0; i < data[1]; i++) {
+    if (offset + 8 > size) {
+      return 0;
+    }
+    uint32_t length;
+    memcpy(&length, data + offset + 4, 4);
+    offset += 8 + length;
+  }
+  // Checksum byte, padded to 16, then the SHA-256 if appended
+  offset = (offset + 16) & ~(size_t)15;
+  if (data[23] == 1) {
+    uint8_t digest[32];
+    if (offset + 32 > size || mbedtls_sha256_ret(data, offset, digest, 0) != 0 ||
+        memcmp(digest, data + offset, 32) != 0) {
+      return 0;
+    }
+    offset += 32;
+  }
+  return offset <= size ? offset : 0;
+}
+
+esp_err_t esp_image_verify(esp_image_load_mode_t mode, const esp_partition_pos_t *position,
+                           esp_image_metadata_t *metadata) {
+  for (FakeFlashPartition &slot : fakeOTASlots) {
+    if (slot.partition.address == position->offset) {
+      metadata->start_addr = position->offset;
+      metadata->image_len = fakeImageLength(slot.data.data(), slot.data.size());
+      return metadata->image_len > 0 ? ESP_OK : ESP_ERR_IMAGE_INVALID;
+    }
+  }
+  return ESP_ERR_NOT_FOUND;
+}
+
+// -----------------------------------------------------------------------
+// OTA slots
+// -----------------------------------------------------------------------
+
+enum esp_ota_img_states_t {
+  ESP_OTA_IMG_NEW,
+  ESP_OTA_IMG_PENDING_VERIFY,
+  ESP_OTA_IMG_VALID,
+  ESP_OTA_IMG_INVALID,
+  ESP_OTA_IMG_ABORTED,
+  ESP_OTA_IMG_UNDEFINED = -1
+};
+
+esp_ota_img_states_t fakeRunningState = ESP_OTA_IMG_UNDEFINED;
+int fakeRollbacks = 0;
+
+const esp_partition_t *esp_ota_get_running_partition() {
+  return &fakeOTASlots[fakeRunningSlot].partition;
+}
+
+const esp_partition_t *esp_ota_get_boot_partition() {
+  return &fakeOTASlots[fakeBootSlot].partition;
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start) {
+  return &fakeOTASlots[1 - fakeRunningSlot].partition;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition) {
+  FakeFlashPartition *slot = fakeSlotOf(partition);
+  if (slot == NULL) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (fakeImageLength(slot->data.data(), slot->data.size()) == 0) {
+    return ESP_ERR_OTA_VALIDATE_FAILED;
+  }
+  fakeBootSlot = slot - fakeOTASlots;
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_get_state_partition(const esp_partition_t *partition, esp_ota_img_states_t *state) {
+  if (fakeRunningState == ESP_OTA_IMG_UNDEFINED) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  *state = fakeRunningState;
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_valid_cancel_rollback() {
+  fakeRunningState = ESP_OTA_IMG_VALID;
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_invalid_rollback_and_reboot() {
+  fakeRollbacks++;
+  return ESP_OK;
+}
+
+// -----------------------------------------------------------------------
+// Heap
+// -----------------------------------------------------------------------
+
+// Pretend the device has this much heap in total
+const size_t FAKE_HEAP_SIZE = 320 * 1024;
+
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_DEFAULT (1 << 12)
+
+struct multi_heap_info_t {
+  size_t total_free_bytes;
+  size_t total_allocated_bytes;
+  size_t largest_free_block;
+  size_t minimum_free_bytes;
+  size_t allocated_blocks;
+  size_t free_blocks;
+  size_t total_blocks;
+};
+
+// Live host allocations, for multi_heap_info_t::allocated_blocks.
+// AddressSanitizer brings its own allocator, so blocks are not counted
+// (and mallinfo2() reads zero) in sanitizer builds.
+std::atomic<long> fakeHeapBlocks(0);
+
+#ifndef __SANITIZE_ADDRESS__
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+
+void *malloc(size_t size) noexcept {
+  void *ptr = __libc_malloc(size);
+  if (ptr) fakeHeapBlocks++;
+  return ptr;
+}
+
+void *calloc(size_t count, size_t size) noexcept {
+  void *ptr = __libc_calloc(count, size);
+  if (ptr) fakeHeapBlocks++;
+  return ptr;
+}
+
+void *realloc(void *ptr, size_t size) noexcept {
+  void *moved = __libc_realloc(ptr, size);
+  if (ptr == NULL && moved) fakeHeapBlocks++;
+  if (ptr && size == 0 && moved == NULL) fakeHeapBlocks--;
+  return moved;
+}
+
+void *memalign(size_t alignment, size_t size) noexcept {
+  void *ptr = __libc_memalign(alignment, size);
+  if (ptr) fakeHeapBlocks++;
+  return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) noexcept {
+  return memalign(alignment, size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) noexcept {
+  void *ptr = memalign(alignment, size);
+  if (ptr == NULL) return ENOMEM;
+  *out = ptr;
+  return 0;
+}
+
+void free(void *ptr) noexcept {
+  if (ptr) fakeHeapBlocks--;
+  __libc_free(ptr);
+}
+}
+#endif
+
+/**
+ * Heap info from the host allocator, scaled to the simulated heap size
+ * used by ESP.getFreeHeap()
+ *
+ * The largest free block is the free heap less the holes glibc keeps
+ * between live chunks (free bytes not in the top chunk), so fragmentation
+ * left behind by a cycle shows up the way it does on the device.
+ */
+void heap_caps_get_info(multi_heap_info_t *info, uint32_t caps) {
+  struct mallinfo2 host = mallinfo2();
+  memset(info, 0, sizeof(*info));
+  info->total_allocated_bytes = host.uordblks;
+  info->total_free_bytes = host.uordblks < FAKE_HEAP_SIZE ? FAKE_HEAP_SIZE - host.uordblks : 0;
+  size_t holes = host.fordblks - host.keepcost;
+  info->largest_free_block = holes < info->total_free_bytes ? info->total_free_bytes - holes : 0;
+  info->minimum_free_bytes = info->total_free_bytes;
+  info->allocated_blocks = fakeHeapBlocks > 0 ? fakeHeapBlocks.load() : 0;
+}
+
+// -----------------------------------------------------------------------
+// ROM CRC
+// -----------------------------------------------------------------------
+
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len) {
+  // Same polynomial and inversion as the ROM
+  return crc32(crc, buf, len);
+}
+
+// -----------------------------------------------------------------------
+// WiFi power save
+// -----------------------------------------------------------------------
+
+enum wifi_ps_type_t { WIFI_PS_NONE, WIFI_PS_MIN_MODEM, WIFI_PS_MAX_MODEM };
+
+wifi_ps_type_t fakePowerSave = WIFI_PS_MIN_MODEM;
+
+esp_err_t esp_wifi_get_ps(wifi_ps_type_t *type) {
+  *type = fakePowerSave;
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_ps(wifi_ps_type_t type) {
+  fakePowerSave = type;
+  return ESP_OK;
+}
@@ -0,0 +1,5 @@
+/*
+  Native fake: see esp_idf_fake.h
+*/
+#pragma once
+#include "esp_idf_fake.h"
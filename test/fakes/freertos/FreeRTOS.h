@@ -0,0 +1,299 @@
+/*
+  -----------------------
+  Native FreeRTOS Fake
+  -----------------------
+
+  Tasks, semaphores, queues and stream buffers on top of std::thread, with
+  the blocking and timeout semantics the code in src/ relies on. One tick
+  is one real millisecond; simulated Arduino time (millis()) is separate.
+
+  Tasks run as detached threads. vTaskDelete(NULL) ends the calling task
+  by unwinding its thread.
+*/
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+const BaseType_t pdFALSE = 0;
+const BaseType_t pdTRUE = 1;
+const BaseType_t pdPASS = 1;
+const BaseType_t pdFAIL = 0;
+const TickType_t portMAX_DELAY = 0xffffffff;
+
+#define configTICK_RATE_HZ 1000
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define portTICK_PERIOD_MS 1
+
+/**
+ * Wait on cv until ready() holds or ticks pass; returns ready()
+ */
+template <typename Predicate>
+bool fakeWait(std::unique_lock<std::mutex> &lock, std::condition_variable &cv, TickType_t ticks,
+              Predicate ready) {
+  if (ticks == portMAX_DELAY) {
+    cv.wait(lock, ready);
+    return true;
+  }
+  return cv.wait_for(lock, std::chrono::milliseconds(ticks), ready);
+}
+
+// -----------------------------------------------------------------------
+// Tasks
+// -----------------------------------------------------------------------
+
+struct FakeTask {
+  std::mutex lock;
+  std::condition_variable changed;
+  uint32_t notifications = 0;
+};
+typedef FakeTask *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+// Thrown by vTaskDelete(NULL) to unwind the task's thread
+struct FakeTaskExit {};
+
+// Tasks are never freed, so handles stay valid after the task ended
+std::deque<FakeTask> fakeTasks;
+std::mutex fakeTasksLock;
+thread_local FakeTask *fakeCurrentTask = NULL;
+
+FakeTask *fakeNewTask() {
+  std::lock_guard<std::mutex> guard(fakeTasksLock);
+  fakeTasks.emplace_back();
+  return &fakeTasks.back();
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+  if (fakeCurrentTask == NULL) {
+    fakeCurrentTask = fakeNewTask();
+  }
+  return fakeCurrentTask;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stackSize,
+                                   void *param, UBaseType_t priority, TaskHandle_t *handle,
+                                   BaseType_t core) {
+  FakeTask *task = fakeNewTask();
+  if (handle != NULL) {
+    *handle = task;
+  }
+  std::thread([function, param, task]() {
+    fakeCurrentTask = task;
+    try {
+      function(param);
+    } catch (const FakeTaskExit &) {
+    }
+  }).detach();
+  return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stackSize, void *param,
+                       UBaseType_t priority, TaskHandle_t *handle) {
+  return xTaskCreatePinnedToCore(function, name, stackSize, param, priority, handle, 0);
+}
+
+void vTaskDelete(TaskHandle_t task) {
+  if (task == NULL || task == fakeCurrentTask) {
+    throw FakeTaskExit();
+  }
+}
+
+void vTaskDelay(TickType_t ticks) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  std::lock_guard<std::mutex> guard(task->lock);
+  task->notifications++;
+  task->changed.notify_all();
+  return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks) {
+  FakeTask *task = xTaskGetCurrentTaskHandle();
+  std::unique_lock<std::mutex> lock(task->lock);
+  fakeWait(lock, task->changed, ticks, [task]() { return task->notifications > 0; });
+  uint32_t value = task->notifications;
+  if (value > 0) {
+    task->notifications = clearOnExit ? 0 : value - 1;
+  }
+  return value;
+}
+
+// -----------------------------------------------------------------------
+// Semaphores
+// -----------------------------------------------------------------------
+
+struct FakeSemaphore {
+  std::mutex lock;
+  std::condition_variable changed;
+  UBaseType_t count;
+  UBaseType_t maxCount;
+};
+typedef FakeSemaphore *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t maxCount, UBaseType_t initialCount) {
+  FakeSemaphore *semaphore = new FakeSemaphore();
+  semaphore->count = initialCount;
+  semaphore->maxCount = maxCount;
+  return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary() {
+  return xSemaphoreCreateCounting(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+  return xSemaphoreCreateCounting(1, 1);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+  std::unique_lock<std::mutex> lock(semaphore->lock);
+  if (!fakeWait(lock, semaphore->changed, ticks, [semaphore]() { return semaphore->count > 0; })) {
+    return pdFALSE;
+  }
+  semaphore->count--;
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+  std::lock_guard<std::mutex> guard(semaphore->lock);
+  if (semaphore->count >= semaphore->maxCount) {
+    return pdFALSE;
+  }
+  semaphore->count++;
+  semaphore->changed.notify_all();
+  return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+  delete semaphore;
+}
+
+// -----------------------------------------------------------------------
+// Queues
+// -----------------------------------------------------------------------
+
+struct FakeQueue {
+  std::mutex lock;
+  std::condition_variable changed;
+  std::deque<std::vector<uint8_t>> items;
+  UBaseType_t length;
+  UBaseType_t itemSize;
+};
+typedef FakeQueue *QueueHandle_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) {
+  FakeQueue *queue = new FakeQueue();
+  queue->length = length;
+  queue->itemSize = itemSize;
+  return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks) {
+  std::unique_lock<std::mutex> lock(queue->lock);
+  if (!fakeWait(lock, queue->changed, ticks, [queue]() { return queue->items.size() < queue->length; })) {
+    return pdFALSE;
+  }
+  const uint8_t *bytes = (const uint8_t *)item;
+  queue->items.emplace_back(bytes, bytes + queue->itemSize);
+  queue->changed.notify_all();
+  return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks) {
+  std::unique_lock<std::mutex> lock(queue->lock);
+  if (!fakeWait(lock, queue->changed, ticks, [queue]() { return !queue->items.empty(); })) {
+    return pdFALSE;
+  }
+  memcpy(item, queue->items.front().data(), queue->itemSize);
+  queue->items.pop_front();
+  queue->changed.notify_all();
+  return pdTRUE;
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue) {
+  std::lock_guard<std::mutex> guard(queue->lock);
+  queue->items.clear();
+  queue->changed.notify_all();
+  return pdPASS;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+  delete queue;
+}
+
+// -----------------------------------------------------------------------
+// Stream buffers
+// -----------------------------------------------------------------------
+
+struct FakeStreamBuffer {
+  std::mutex lock;
+  std::condition_variable changed;
+  std::deque<uint8_t> bytes;
+  size_t capacity;
+  size_t triggerLevel;
+};
+typedef FakeStreamBuffer *StreamBufferHandle_t;
+
+StreamBufferHandle_t xStreamBufferCreate(size_t capacity, size_t triggerLevel) {
+  FakeStreamBuffer *buffer = new FakeStreamBuffer();
+  buffer->capacity = capacity;
+  buffer->triggerLevel = triggerLevel > 0 ? triggerLevel : 1;
+  return buffer;
+}
+
+void vStreamBufferDelete(StreamBufferHandle_t buffer) {
+  delete buffer;
+}
+
+// Waits for room for all of data (up to the capacity), then writes as
+// much as fits, like the real xStreamBufferSend()
+size_t xStreamBufferSend(StreamBufferHandle_t buffer, const void *data, size_t len, TickType_t ticks) {
+  std::unique_lock<std::mutex> lock(buffer->lock);
+  size_t required = len < buffer->capacity ? len : buffer->capacity;
+  fakeWait(lock, buffer->changed, ticks,
+           [buffer, required]() { return buffer->capacity - buffer->bytes.size() >= required; });
+  size_t n = buffer->capacity - buffer->bytes.size();
+  n = n < len ? n : len;
+  const uint8_t *bytes = (const uint8_t *)data;
+  buffer->bytes.insert(buffer->bytes.end(), bytes, bytes + n);
+  buffer->changed.notify_all();
+  return n;
+}
+
+size_t xStreamBufferReceive(StreamBufferHandle_t buffer, void *data, size_t len, TickType_t ticks) {
+  std::unique_lock<std::mutex> lock(buffer->lock);
+  fakeWait(lock, buffer->changed, ticks, [buffer]() { return buffer->bytes.size() >= buffer->triggerLevel; });
+  size_t n = buffer->bytes.size() < len ? buffer->bytes.size() : len;
+  std::copy(buffer->bytes.begin(), buffer->bytes.begin() + n, (uint8_t *)data);
+  buffer->bytes.erase(buffer->bytes.begin(), buffer->bytes.begin() + n);
+  buffer->changed.notify_all();
+  return n;
+}
+
+size_t xStreamBufferBytesAvailable(StreamBufferHandle_t buffer) {
+  std::lock_guard<std::mutex> guard(buffer->lock);
+  return buffer->bytes.size();
+}
+
+size_t xStreamBufferSpacesAvailable(StreamBufferHandle_t buffer) {
+  std::lock_guard<std::mutex> guard(buffer->lock);
+  return buffer->capacity - buffer->bytes.size();
+}
+
+BaseType_t xStreamBufferIsEmpty(StreamBufferHandle_t buffer) {
+  std::lock_guard<std::mutex> guard(buffer->lock);
+  return buffer->bytes.empty() ? pdTRUE : pdFALSE;
+}
@@ -0,0 +1,5 @@
+/*
+  Native fake: see FreeRTOS.h
+*/
+#pragma once
+#include "FreeRTOS.h"
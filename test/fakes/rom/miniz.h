@@ -0,0 +1,117 @@
+/*
+  -----------------------
+  Native ROM Inflater Fake
+  -----------------------
+
+  The ROM tinfl API on top of the host's zlib, so gzip uploads run
+  natively. The ROM inflater can't run on the host; zlib's raw inflate
+  streams the same way, so the contract OTADecompressor.h relies on holds:
+
+  - with TINFL_FLAG_HAS_MORE_INPUT, input may end anywhere and the call
+    returns TINFL_STATUS_NEEDS_MORE_INPUT
+  - output goes to outNext, at most *outBytes of it, and a full output
+    buffer returns TINFL_STATUS_HAS_MORE_OUTPUT
+  - at the end of the deflate stream it returns TINFL_STATUS_DONE having
+    consumed no input past it, so the gzip trailer follows in the input
+
+  The ROM inflater reads back-references from the caller's 32 KB output
+  buffer, so the caller must pass the same buffer every time, continue at
+  the position where the last call stopped (wrapping at the end), and
+  leave the bytes in it alone. zlib keeps its own window, so the fake
+  keeps a copy of what it wrote and fails the call if any of that is
+  broken, as the ROM would by producing garbage.
+
+  The zlib state lives in an arena inside the decompressor, so freeing
+  the decompressor frees everything, as with the ROM's plain struct.
+  Link with -lz.
+*/
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <zlib.h>
+
+#define TINFL_LZ_DICT_SIZE 32768
+#define TINFL_FLAG_HAS_MORE_INPUT 2
+
+enum tinfl_status {
+  TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS = -4,
+  TINFL_STATUS_FAILED = -1,
+  TINFL_STATUS_DONE = 0,
+  TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+  TINFL_STATUS_HAS_MORE_OUTPUT = 2
+};
+
+// Inflate state (about 7 KB) plus zlib's 32 KB window
+const size_t FAKE_TINFL_ARENA_SIZE = 48 * 1024;
+
+struct tinfl_decompressor {
+  z_stream stream;
+  bool isStarted;
+  size_t totalOut;
+  uint8_t window[TINFL_LZ_DICT_SIZE];  // What the caller's buffer must hold
+  size_t arenaUsed;
+  alignas(16) uint8_t arena[FAKE_TINFL_ARENA_SIZE];
+};
+
+inline voidpf fakeTinflAlloc(voidpf opaque, uInt items, uInt size) {
+  tinfl_decompressor *r = (tinfl_decompressor *)opaque;
+  size_t len = ((size_t)items * size + 15) & ~(size_t)15;
+  if (r->arenaUsed + len > sizeof(r->arena)) {
+    return Z_NULL;
+  }
+  voidpf p = r->arena + r->arenaUsed;
+  r->arenaUsed += len;
+  return p;
+}
+
+inline void fakeTinflFree(voidpf opaque, voidpf address) {}
+
+inline void fakeTinflInit(tinfl_decompressor *r) {
+  memset(&r->stream, 0, sizeof(r->stream));
+  r->stream.zalloc = fakeTinflAlloc;
+  r->stream.zfree = fakeTinflFree;
+  r->stream.opaque = r;
+  r->arenaUsed = 0;
+  r->totalOut = 0;
+  r->isStarted = inflateInit2(&r->stream, -MAX_WBITS) == Z_OK;
+}
+
+#define tinfl_init(r) fakeTinflInit(r)
+
+inline tinfl_status tinfl_decompress(tinfl_decompressor *r, const uint8_t *in, size_t *inBytes,
+                                     uint8_t *outStart, uint8_t *outNext, size_t *outBytes,
+                                     uint32_t flags) {
+  size_t windowUsed = r->totalOut < TINFL_LZ_DICT_SIZE ? r->totalOut : TINFL_LZ_DICT_SIZE;
+  size_t position = r->totalOut & (TINFL_LZ_DICT_SIZE - 1);
+  if (!r->isStarted || outNext != outStart + position || position + *outBytes > TINFL_LZ_DICT_SIZE ||
+      memcmp(outStart, r->window, windowUsed) != 0) {
+    *inBytes = 0;
+    *outBytes = 0;
+    return TINFL_STATUS_FAILED;
+  }
+
+  z_stream &s = r->stream;
+  s.next_in = (Bytef *)in;
+  s.avail_in = *inBytes;
+  s.next_out = outNext;
+  s.avail_out = *outBytes;
+  int result = inflate(&s, Z_SYNC_FLUSH);
+  *inBytes -= s.avail_in;
+  *outBytes -= s.avail_out;
+  memcpy(r->window + position, outNext, *outBytes);
+  r->totalOut += *outBytes;
+
+  if (result == Z_STREAM_END) {
+    return TINFL_STATUS_DONE;
+  }
+  if (result != Z_OK && result != Z_BUF_ERROR) {
+    return TINFL_STATUS_FAILED;
+  }
+  if (s.avail_out == 0) {
+    return TINFL_STATUS_HAS_MORE_OUTPUT;
+  }
+  return (flags & TINFL_FLAG_HAS_MORE_INPUT) ? TINFL_STATUS_NEEDS_MORE_INPUT :
+                                               TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS;
+}
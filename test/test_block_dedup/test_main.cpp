@@ -0,0 +1,227 @@
+/*
+  -----------------------
+  Block Dedup Tests
+  -----------------------
+
+  Runs block-dedup updates (OTABlockDedup.h, /ota/blocks) against the fake
+  partitions, the way tools/ota_blocks.py drives a device: the running
+  slot holds the old image, the plan must ask for exactly the blocks that
+  differ, and after the needed blocks are sent the inactive slot must hold
+  the new image byte for byte.
+*/
+#include <Arduino.h>
+#include <unity.h>
+#include "OTA.h"
+#include "FakeImage.h"
+
+std::vector<uint8_t> running;
+std::vector<uint8_t> image;
+
+/**
+ * Replace the appended SHA-256 after editing an image
+ */
+void resealImage(std::vector<uint8_t> &data) {
+  mbedtls_sha256_ret(data.data(), data.size() - 32, data.data() + data.size() - 32, 0);
+}
+
+/**
+ * Change one byte in each of the given blocks of image
+ */
+void changeBlocks(std::initializer_list<size_t> blocks) {
+  for (size_t block : blocks) {
+    image[block * OTA_BLOCK_SIZE + 100] ^= 0x5a;
+  }
+  resealImage(image);
+}
+
+void setUp() {
+  fakeFlashReset();
+  fakeNVS.clear();
+  registerWebRoutes();
+  running = fakeAppImage(21, 40 * 1024, 2);
+  std::copy(running.begin(), running.end(), fakeOTASlots[0].data.begin());
+  computeRunningImageDigest();
+  image = running;
+}
+
+void tearDown() {
+  otaBlocksRelease();
+  otaWriterAbort();
+}
+
+std::vector<uint8_t> blockHashes(const std::vector<uint8_t> &data) {
+  std::vector<uint8_t> hashes;
+  for (size_t at = 0; at < data.size(); at += OTA_BLOCK_SIZE) {
+    uint8_t digest[32];
+    mbedtls_sha256_ret(data.data() + at, min(OTA_BLOCK_SIZE, data.size() - at), digest, 0);
+    hashes.insert(hashes.end(), digest, digest + sizeof(digest));
+  }
+  return hashes;
+}
+
+bool isNeeded(const String &bitmap, size_t block) {
+  int byte = strtol(bitmap.substring(block / 8 * 2, block / 8 * 2 + 2).c_str(), NULL, 16);
+  return byte & (1 << (block % 8));
+}
+
+/**
+ * POST the block hashes of image; returns the status, bitmap in reply
+ */
+int postPlan(String &bitmap, const char *extra = "") {
+  std::vector<uint8_t> hashes = blockHashes(image);
+  FakeConnection c(server, HTTP_POST, "/ota/blocks?size=" + String((unsigned long)image.size()) +
+                                          "&sha256=" + fakeSHA256Hex(image) + extra);
+  c.header("Content-Type", "application/octet-stream");
+  c.header("Content-Length", String((unsigned long)hashes.size()));
+  c.open();
+  c.receiveAll(hashes.data(), hashes.size());
+  bitmap = c.responseBody();
+  return c.responseCode();
+}
+
+/**
+ * The body /ota/blocks/data expects for bitmap: the needed blocks in order
+ */
+std::vector<uint8_t> neededBody(const String &bitmap) {
+  std::vector<uint8_t> body;
+  for (size_t block = 0; block * OTA_BLOCK_SIZE < image.size(); block++) {
+    if (isNeeded(bitmap, block)) {
+      size_t at = block * OTA_BLOCK_SIZE;
+      body.insert(body.end(), image.begin() + at, image.begin() + min(at + OTA_BLOCK_SIZE, image.size()));
+    }
+  }
+  return body;
+}
+
+int putData(const std::vector<uint8_t> &body, size_t segment = 1436) {
+  FakeConnection c(server, HTTP_PUT, "/ota/blocks/data");
+  c.header("Content-Type", "application/octet-stream");
+  c.header("Content-Length", String((unsigned long)body.size()));
+  c.open();
+  c.receiveAll(body.data(), body.size(), segment);
+  return c.responseCode();
+}
+
+size_t neededCount(const String &bitmap) {
+  size_t count = 0;
+  for (size_t block = 0; block * OTA_BLOCK_SIZE < image.size(); block++) {
+    count += isNeeded(bitmap, block);
+  }
+  return count;
+}
+
+void test_plan_asks_for_changed_blocks_only() {
+  changeBlocks({ 3, 10 });
+  String bitmap;
+  TEST_ASSERT_EQUAL(200, postPlan(bitmap));
+  TEST_ASSERT_TRUE(isNeeded(bitmap, 3));
+  TEST_ASSERT_TRUE(isNeeded(bitmap, 10));
+  // The last block carries the new appended SHA-256
+  size_t last = (image.size() - 1) / OTA_BLOCK_SIZE;
+  TEST_ASSERT_TRUE(isNeeded(bitmap, last));
+  TEST_ASSERT_EQUAL(3, neededCount(bitmap));
+  TEST_ASSERT_EQUAL(3, otaBlocks.neededCount);
+}
+
+void test_rebuilds_image_from_running_partition() {
+  changeBlocks({ 0, 7, 8 });
+  String bitmap;
+  TEST_ASSERT_EQUAL(200, postPlan(bitmap));
+  std::vector<uint8_t> body = neededBody(bitmap);
+  TEST_ASSERT_TRUE(body.size() < image.size() / 2);
+
+  TEST_ASSERT_EQUAL(200, putData(body));
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), fakeOTASlots[1].data.data(), image.size());
+  TEST_ASSERT_EQUAL(1, fakeBootSlot);
+}
+
+void test_any_segmentation_places_blocks() {
+  changeBlocks({ 1, 2, 12 });
+  for (size_t segment : { (size_t)1, (size_t)100, (size_t)OTA_BLOCK_SIZE + 1 }) {
+    fakeBootSlot = 0;
+    String bitmap;
+    TEST_ASSERT_EQUAL(200, postPlan(bitmap));
+    TEST_ASSERT_EQUAL(200, putData(neededBody(bitmap), segment));
+    TEST_ASSERT_EQUAL_MEMORY(image.data(), fakeOTASlots[1].data.data(), image.size());
+    TEST_ASSERT_EQUAL(1, fakeBootSlot);
+  }
+}
+
+void test_larger_image_sends_blocks_past_old_end() {
+  // The same two segments plus a third that ends mid-block; only the
+  // header block, the old tail and what lies past it differ
+  image = fakeAppImage(21, 40 * 1024, 3);
+  TEST_ASSERT_TRUE(image.size() % OTA_BLOCK_SIZE != 0);
+  String bitmap;
+  TEST_ASSERT_EQUAL(200, postPlan(bitmap));
+  size_t oldTail = (running.size() - 33) / OTA_BLOCK_SIZE;  // Holds the old checksum and hash
+  size_t last = (image.size() - 1) / OTA_BLOCK_SIZE;
+  TEST_ASSERT_TRUE(isNeeded(bitmap, 0));
+  TEST_ASSERT_FALSE(isNeeded(bitmap, 1));
+  TEST_ASSERT_FALSE(isNeeded(bitmap, oldTail - 1));
+  for (size_t block = oldTail; block <= last; block++) {
+    TEST_ASSERT_TRUE(isNeeded(bitmap, block));
+  }
+  TEST_ASSERT_EQUAL(last - oldTail + 2, neededCount(bitmap));
+  TEST_ASSERT_EQUAL(200, putData(neededBody(bitmap)));
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), fakeOTASlots[1].data.data(), image.size());
+}
+
+void test_unchanged_image_needs_no_blocks() {
+  String bitmap;
+  TEST_ASSERT_EQUAL(409, postPlan(bitmap));
+
+  TEST_ASSERT_EQUAL(200, postPlan(bitmap, "&force=1"));
+  TEST_ASSERT_EQUAL(0, neededCount(bitmap));
+  TEST_ASSERT_EQUAL(200, putData({}));
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), fakeOTASlots[1].data.data(), image.size());
+  TEST_ASSERT_EQUAL(1, fakeBootSlot);
+}
+
+void test_wrong_body_length_is_refused() {
+  changeBlocks({ 4 });
+  String bitmap;
+  TEST_ASSERT_EQUAL(200, postPlan(bitmap));
+  std::vector<uint8_t> body = neededBody(bitmap);
+  body.pop_back();
+  TEST_ASSERT_EQUAL(400, putData(body));
+  TEST_ASSERT_EQUAL(0, fakeBootSlot);
+}
+
+void test_corrupt_block_fails_hash_check() {
+  changeBlocks({ 5 });
+  String bitmap;
+  TEST_ASSERT_EQUAL(200, postPlan(bitmap));
+  std::vector<uint8_t> body = neededBody(bitmap);
+  body[10] ^= 1;
+  TEST_ASSERT_EQUAL(400, putData(body));
+  TEST_ASSERT_EQUAL(0, fakeBootSlot);
+}
+
+void test_data_without_plan_is_refused() {
+  TEST_ASSERT_EQUAL(409, putData(std::vector<uint8_t>(OTA_BLOCK_SIZE, 0)));
+}
+
+void test_hash_count_must_match_size() {
+  std::vector<uint8_t> hashes = blockHashes(image);
+  FakeConnection c(server, HTTP_POST, "/ota/blocks?size=" + String((unsigned long)image.size() + OTA_BLOCK_SIZE) +
+                                          "&sha256=" + fakeSHA256Hex(image));
+  c.header("Content-Type", "application/octet-stream");
+  c.header("Content-Length", String((unsigned long)hashes.size()));
+  c.open();
+  TEST_ASSERT_EQUAL(400, c.responseCode());
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_plan_asks_for_changed_blocks_only);
+  RUN_TEST(test_rebuilds_image_from_running_partition);
+  RUN_TEST(test_any_segmentation_places_blocks);
+  RUN_TEST(test_larger_image_sends_blocks_past_old_end);
+  RUN_TEST(test_unchanged_image_needs_no_blocks);
+  RUN_TEST(test_wrong_body_length_is_refused);
+  RUN_TEST(test_corrupt_block_fails_hash_check);
+  RUN_TEST(test_data_without_plan_is_refused);
+  RUN_TEST(test_hash_count_must_match_size);
+  return UNITY_END();
+}
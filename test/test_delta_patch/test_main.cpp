@@ -0,0 +1,249 @@
+/*
+  -----------------------
+  Delta Patch Tests
+  -----------------------
+
+  Applies hand-built patches against an image in the running slot of the
+  fake flash, fed whole, a byte at a time and through the flash writer,
+  and checks that malformed patches are refused.
+*/
+#include <Arduino.h>
+#include <unity.h>
+#include "OTAFlashWriter.h"
+#include "OTADeltaPatch.h"
+#include "FakeImage.h"
+
+struct DeltaRecord {
+  int64_t diffLen;
+  int64_t extraLen;
+  int64_t seek;
+};
+
+std::vector<uint8_t> oldImage;
+std::vector<uint8_t> rebuilt;
+
+void setUp() {
+  fakeFlashReset();
+  oldImage = fakeAppImage(1, 16 * 1024, 2);
+  std::copy(oldImage.begin(), oldImage.end(), fakeOTASlots[0].data.begin());
+  rebuilt.clear();
+}
+
+void tearDown() {
+  otaDeltaRelease();
+  otaWriterAbort();
+}
+
+bool collectSink(const uint8_t *data, size_t len) {
+  rebuilt.insert(rebuilt.end(), data, data + len);
+  return true;
+}
+
+bool failingSink(const uint8_t *data, size_t len) {
+  return false;
+}
+
+void appendInt64(std::vector<uint8_t> &out, int64_t value) {
+  for (int i = 0; i < 8; i++) {
+    out.push_back((uint8_t)((uint64_t)value >> (8 * i)));
+  }
+}
+
+/**
+ * Byte of the running slot, 0 outside it so malformed patches can be built
+ */
+uint8_t oldByte(size_t pos) {
+  return pos < FAKE_PARTITION_SIZE ? fakeOTASlots[0].data[pos] : 0;
+}
+
+/**
+ * Encode a patch turning the running image into newImage, the way
+ * tools/make_delta.py lays it out
+ */
+std::vector<uint8_t> makePatch(const std::vector<uint8_t> &newImage, const std::vector<DeltaRecord> &records) {
+  std::vector<uint8_t> out(DELTA_MAGIC, DELTA_MAGIC + sizeof(DELTA_MAGIC));
+  for (int i = 0; i < 4; i++) {
+    out.push_back((uint8_t)(newImage.size() >> (8 * i)));
+  }
+  uint8_t digest[32];
+  mbedtls_sha256_ret(newImage.data(), newImage.size(), digest, 0);
+  out.insert(out.end(), digest, digest + sizeof(digest));
+
+  size_t oldPos = 0;
+  size_t newPos = 0;
+  for (const DeltaRecord &record : records) {
+    appendInt64(out, record.diffLen);
+    appendInt64(out, record.extraLen);
+    appendInt64(out, record.seek);
+    for (int64_t i = 0; i < record.diffLen; i++) {
+      out.push_back((uint8_t)(newImage[newPos++] - oldByte(oldPos++)));
+    }
+    for (int64_t i = 0; i < record.extraLen; i++) {
+      out.push_back(newImage[newPos++]);
+    }
+    oldPos += record.seek;
+  }
+  return out;
+}
+
+/**
+ * Old image with 100 bytes inserted at 1000 and a few bytes changed after
+ */
+std::vector<uint8_t> editedImage() {
+  std::vector<uint8_t> image(oldImage.begin(), oldImage.begin() + 1000);
+  for (int i = 0; i < 100; i++) {
+    image.push_back((uint8_t)(i * 7));
+  }
+  image.insert(image.end(), oldImage.begin() + 1000, oldImage.end());
+  image[5000] ^= 0x55;
+  image[image.size() - 1] ^= 0x01;
+  return image;
+}
+
+std::vector<DeltaRecord> editedRecords() {
+  return { { 1000, 100, 0 }, { (int64_t)oldImage.size() - 1000, 0, 0 } };
+}
+
+bool applyInChunks(const std::vector<uint8_t> &patch, size_t chunk, OTASink sink = collectSink) {
+  if (!otaDeltaBegin(sink)) {
+    return false;
+  }
+  for (size_t at = 0; at < patch.size(); at += chunk) {
+    if (!otaDeltaWrite(patch.data() + at, min(chunk, patch.size() - at))) {
+      otaDeltaEnd();
+      return false;
+    }
+  }
+  return otaDeltaEnd();
+}
+
+void test_patch_is_recognised_by_first_byte() {
+  std::vector<uint8_t> patch = makePatch(editedImage(), editedRecords());
+  TEST_ASSERT_TRUE(isDeltaPatch(patch.data(), patch.size()));
+  TEST_ASSERT_FALSE(isDeltaPatch(oldImage.data(), oldImage.size()));
+  TEST_ASSERT_FALSE(isDeltaPatch(patch.data(), 0));
+}
+
+void test_rebuilds_image() {
+  std::vector<uint8_t> newImage = editedImage();
+  std::vector<uint8_t> patch = makePatch(newImage, editedRecords());
+  TEST_ASSERT_TRUE(applyInChunks(patch, patch.size()));
+  TEST_ASSERT_EQUAL(newImage.size(), rebuilt.size());
+  TEST_ASSERT_EQUAL_MEMORY(newImage.data(), rebuilt.data(), newImage.size());
+}
+
+void test_rebuilds_image_fed_byte_by_byte() {
+  std::vector<uint8_t> newImage = editedImage();
+  std::vector<uint8_t> patch = makePatch(newImage, editedRecords());
+  TEST_ASSERT_TRUE(applyInChunks(patch, 1));
+  TEST_ASSERT_EQUAL(newImage.size(), rebuilt.size());
+  TEST_ASSERT_EQUAL_MEMORY(newImage.data(), rebuilt.data(), newImage.size());
+}
+
+void test_seek_back_reuses_old_bytes() {
+  std::vector<uint8_t> newImage(oldImage.begin(), oldImage.begin() + 500);
+  newImage.insert(newImage.end(), oldImage.begin(), oldImage.begin() + 500);
+  std::vector<uint8_t> patch = makePatch(newImage, { { 500, 0, -500 }, { 500, 0, 0 } });
+  TEST_ASSERT_TRUE(applyInChunks(patch, 7));
+  TEST_ASSERT_EQUAL_MEMORY(newImage.data(), rebuilt.data(), newImage.size());
+}
+
+void test_chunk_ending_on_last_run_finishes_patch() {
+  std::vector<uint8_t> newImage = editedImage();
+  std::vector<uint8_t> patch = makePatch(newImage, editedRecords());
+  // The patch ends with a diff run followed by an empty extra run, so the
+  // last byte of the diff has to complete the record on its own
+  TEST_ASSERT_TRUE(otaDeltaBegin(collectSink));
+  TEST_ASSERT_TRUE(otaDeltaWrite(patch.data(), patch.size() - 1));
+  TEST_ASSERT_TRUE(otaDeltaWrite(patch.data() + patch.size() - 1, 1));
+  TEST_ASSERT_EQUAL(DELTA_STAGE_DONE, otaDelta.stage);
+  TEST_ASSERT_TRUE(otaDeltaEnd());
+}
+
+void test_applies_through_flash_writer() {
+  // A valid image of the same layout, so the result passes the commit check
+  std::vector<uint8_t> newImage = fakeAppImage(2, 16 * 1024, 2);
+  std::vector<uint8_t> patch = makePatch(newImage, { { (int64_t)newImage.size(), 0, 0 } });
+  TEST_ASSERT_TRUE(otaWriterBegin(OTA_WRITER_UPLOAD, 0));
+  TEST_ASSERT_TRUE(applyInChunks(patch, 1436, otaWriterSink));
+  TEST_ASSERT_TRUE(otaWriterEnd());
+  TEST_ASSERT_EQUAL_MEMORY(otaDelta.expectedSha256, otaWriterDigest(), 32);
+  TEST_ASSERT_EQUAL_MEMORY(newImage.data(), fakeOTASlots[1].data.data(), newImage.size());
+  TEST_ASSERT_TRUE(otaWriterCommit());
+  TEST_ASSERT_EQUAL(1, fakeBootSlot);
+}
+
+void test_rejects_bad_magic() {
+  std::vector<uint8_t> patch = makePatch(editedImage(), editedRecords());
+  patch[7] = '2';
+  TEST_ASSERT_FALSE(applyInChunks(patch, patch.size()));
+  TEST_ASSERT_EQUAL(0, rebuilt.size());
+}
+
+void test_rejects_run_past_new_size() {
+  std::vector<uint8_t> newImage = editedImage();
+  std::vector<uint8_t> patch = makePatch(newImage, editedRecords());
+  // Grow the first record's extra run beyond the rebuilt image
+  patch[DELTA_HEADER_SIZE + 8] = 0xff;
+  patch[DELTA_HEADER_SIZE + 9] = 0xff;
+  patch[DELTA_HEADER_SIZE + 10] = 0xff;
+  TEST_ASSERT_FALSE(applyInChunks(patch, patch.size()));
+}
+
+void test_rejects_negative_run() {
+  std::vector<uint8_t> newImage = editedImage();
+  std::vector<uint8_t> patch = makePatch(newImage, editedRecords());
+  patch[DELTA_HEADER_SIZE + 7] = 0x80;
+  TEST_ASSERT_FALSE(applyInChunks(patch, patch.size()));
+  TEST_ASSERT_EQUAL(0, rebuilt.size());
+}
+
+void test_rejects_seek_before_old_image() {
+  std::vector<uint8_t> newImage(oldImage.begin(), oldImage.begin() + 1000);
+  std::vector<uint8_t> patch = makePatch(newImage, { { 500, 0, -501 }, { 500, 0, 0 } });
+  TEST_ASSERT_FALSE(applyInChunks(patch, patch.size()));
+}
+
+void test_rejects_diff_past_old_image() {
+  std::vector<uint8_t> newImage(oldImage.begin(), oldImage.begin() + 1000);
+  std::vector<uint8_t> patch = makePatch(newImage, { { 500, 0, FAKE_PARTITION_SIZE - 999 }, { 500, 0, 0 } });
+  TEST_ASSERT_FALSE(applyInChunks(patch, patch.size()));
+}
+
+void test_rejects_data_after_last_record() {
+  std::vector<uint8_t> patch = makePatch(editedImage(), editedRecords());
+  patch.push_back(0);
+  TEST_ASSERT_FALSE(applyInChunks(patch, patch.size()));
+}
+
+void test_truncated_patch_is_incomplete() {
+  std::vector<uint8_t> patch = makePatch(editedImage(), editedRecords());
+  patch.resize(patch.size() - 10);
+  TEST_ASSERT_FALSE(applyInChunks(patch, 1436));
+}
+
+void test_sink_failure_stops_patch() {
+  std::vector<uint8_t> patch = makePatch(editedImage(), editedRecords());
+  TEST_ASSERT_TRUE(otaDeltaBegin(failingSink));
+  TEST_ASSERT_FALSE(otaDeltaWrite(patch.data(), patch.size()));
+  TEST_ASSERT_FALSE(otaDeltaEnd());
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_patch_is_recognised_by_first_byte);
+  RUN_TEST(test_rebuilds_image);
+  RUN_TEST(test_rebuilds_image_fed_byte_by_byte);
+  RUN_TEST(test_seek_back_reuses_old_bytes);
+  RUN_TEST(test_chunk_ending_on_last_run_finishes_patch);
+  RUN_TEST(test_applies_through_flash_writer);
+  RUN_TEST(test_rejects_bad_magic);
+  RUN_TEST(test_rejects_run_past_new_size);
+  RUN_TEST(test_rejects_negative_run);
+  RUN_TEST(test_rejects_seek_before_old_image);
+  RUN_TEST(test_rejects_diff_past_old_image);
+  RUN_TEST(test_rejects_data_after_last_record);
+  RUN_TEST(test_truncated_patch_is_incomplete);
+  RUN_TEST(test_sink_failure_stops_patch);
+  return UNITY_END();
+}
@@ -0,0 +1,108 @@
+/*
+  -----------------------
+  Early Refusal Tests
+  -----------------------
+
+  Uploads that can be refused from their headers alone are answered
+  before any body byte is read or anything is erased: too large for the
+  partition (also before the first session of the boot has picked a
+  target partition), the running build, or a busy writer. The library's
+  "100 Continue" still follows such a reply, so the connection is closed
+  as soon as the client stops sending.
+*/
+#include <Arduino.h>
+#include <unity.h>
+#include "OTA.h"
+#include "FakeImage.h"
+
+void setUp() {
+  fakeFlashReset();
+  fakeNVS.clear();
+  registerWebRoutes();
+}
+
+void tearDown() {
+  otaWriterAbort();
+}
+
+void test_oversized_upload_refused_at_boot() {
+  // No session has run yet, so no writer has picked the target partition
+  otaTargetPartition = NULL;
+  FakeConnection c(server, HTTP_PUT, "/ota/firmware");
+  c.header("Content-Type", "application/octet-stream");
+  c.header("Content-Length", String((unsigned long)(FAKE_PARTITION_SIZE + OTA_MULTIPART_OVERHEAD_MAX + 1)));
+  c.open();
+  TEST_ASSERT_EQUAL(413, c.responseCode());
+  TEST_ASSERT_EQUAL_STRING(otaImageErrorString(OTA_IMAGE_TOO_LARGE), c.responseBody().c_str());
+  TEST_ASSERT_EQUAL(0, fakeFlashErases);
+}
+
+void test_oversized_multipart_refused_at_boot() {
+  FakeConnection start(server, HTTP_GET, "/ota/start?mode=fr");
+  start.open();
+  TEST_ASSERT_EQUAL(200, start.responseCode());
+  otaTargetPartition = NULL;
+
+  FakeConnection c(server, HTTP_POST, "/ota/upload");
+  c.header("Content-Type", "multipart/form-data; boundary=x");
+  c.header("Content-Length", String((unsigned long)(FAKE_PARTITION_SIZE + OTA_MULTIPART_OVERHEAD_MAX + 1)));
+  c.open();
+  TEST_ASSERT_EQUAL(413, c.responseCode());
+}
+
+void test_upload_that_fits_is_admitted() {
+  otaTargetPartition = NULL;
+  std::vector<uint8_t> image = fakeAppImage(9, 8 * 1024, 2);
+  FakeConnection c(server, HTTP_PUT, "/ota/firmware");
+  c.header("Content-Type", "application/octet-stream");
+  c.header("Content-Length", String((unsigned long)image.size()));
+  c.open();
+  TEST_ASSERT_EQUAL(0, c.responseCode());
+  c.receiveAll(image.data(), image.size());
+  TEST_ASSERT_EQUAL(200, c.responseCode());
+}
+
+void test_refused_connection_is_closed() {
+  FakeConnection c(server, HTTP_PUT, "/ota/firmware");
+  c.header("Content-Type", "application/octet-stream");
+  c.header("Content-Length", String((unsigned long)(FAKE_PARTITION_SIZE + OTA_MULTIPART_OVERHEAD_MAX + 1)));
+  c.header("Expect", "100-continue");
+  c.open();
+  TEST_ASSERT_EQUAL(413, c.responseCode());
+  TEST_ASSERT_TRUE(c.isContinueSent);
+  c.idle(OTA_REFUSED_CLOSE_SECONDS);
+  TEST_ASSERT_FALSE(c.isOpen());
+  TEST_ASSERT_EQUAL(413, c.responseCode());
+
+  // Whatever the refusal was for
+  FakeConnection form(server, HTTP_PUT, "/ota/firmware");
+  form.header("Content-Type", "multipart/form-data; boundary=x");
+  form.header("Content-Length", "4096");
+  form.header("Expect", "100-continue");
+  form.open();
+  TEST_ASSERT_EQUAL(415, form.responseCode());
+  form.idle(OTA_REFUSED_CLOSE_SECONDS);
+  TEST_ASSERT_FALSE(form.isOpen());
+
+  // An admitted upload waits for its body
+  std::vector<uint8_t> image = fakeAppImage(10, 8 * 1024, 2);
+  FakeConnection ok(server, HTTP_PUT, "/ota/firmware");
+  ok.header("Content-Type", "application/octet-stream");
+  ok.header("Content-Length", String((unsigned long)image.size()));
+  ok.header("Expect", "100-continue");
+  ok.open();
+  TEST_ASSERT_TRUE(ok.isContinueSent);
+  ok.idle(60);
+  TEST_ASSERT_TRUE(ok.isOpen());
+  ok.receiveAll(image.data(), image.size());
+  TEST_ASSERT_EQUAL(200, ok.responseCode());
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_oversized_upload_refused_at_boot);
+  RUN_TEST(test_oversized_multipart_refused_at_boot);
+  RUN_TEST(test_upload_that_fits_is_admitted);
+  RUN_TEST(test_refused_connection_is_closed);
+  return UNITY_END();
+}
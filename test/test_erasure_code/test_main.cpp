@@ -0,0 +1,177 @@
+/*
+  -----------------------
+  Erasure Code Tests
+  -----------------------
+
+  Encodes groups with the definition in ErasureCode.h, drops sources and
+  recovers them the way the multicast receiver does: take the received
+  sources out of each repair symbol, then fecSolve(). Covers every loss
+  pattern of a small group, random groups up to FEC_MAX_SYMBOLS, and
+  repair symbols from tools/ota_multicast.py, so both ends agree.
+*/
+#include <Arduino.h>
+#include <unity.h>
+#include "ErasureCode.h"
+
+typedef std::vector<std::vector<uint8_t>> Symbols;
+
+uint32_t seed;
+
+uint8_t nextRandom() {
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+void setUp() {
+  fecInit();
+  seed = 1;
+}
+
+void tearDown() {}
+
+Symbols randomSources(uint8_t k, size_t size) {
+  Symbols sources(k, std::vector<uint8_t>(size));
+  for (auto &source : sources) {
+    for (uint8_t &b : source) {
+      b = nextRandom();
+    }
+  }
+  return sources;
+}
+
+std::vector<uint8_t> encodeRepair(const Symbols &sources, uint8_t x) {
+  std::vector<uint8_t> repair(sources[0].size(), 0);
+  for (uint8_t i = 0; i < sources.size(); i++) {
+    fecMulAdd(repair.data(), sources[i].data(), fecCoefficient(x, i), repair.size());
+  }
+  return repair;
+}
+
+/**
+ * Lose the sources in lost, recover them from the repair symbols with the
+ * indices in repairIndices; returns true if every source came back
+ */
+bool recover(const Symbols &sources, const std::vector<uint8_t> &lost, const std::vector<uint8_t> &repairIndices) {
+  size_t size = sources[0].size();
+  Symbols rows;
+  for (uint8_t x : repairIndices) {
+    std::vector<uint8_t> row = encodeRepair(sources, x);
+    // Take out every source the receiver has
+    for (uint8_t i = 0; i < sources.size(); i++) {
+      if (std::find(lost.begin(), lost.end(), i) == lost.end()) {
+        fecMulAdd(row.data(), sources[i].data(), fecCoefficient(x, i), size);
+      }
+    }
+    rows.push_back(row);
+  }
+
+  std::vector<uint8_t *> pointers;
+  for (auto &row : rows) {
+    pointers.push_back(row.data());
+  }
+  if (!fecSolve(pointers.data(), repairIndices.data(), lost.data(), lost.size(), size)) {
+    return false;
+  }
+  for (size_t a = 0; a < lost.size(); a++) {
+    if (memcmp(pointers[a], sources[lost[a]].data(), size) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void test_field_arithmetic() {
+  for (int a = 1; a < 256; a++) {
+    TEST_ASSERT_EQUAL(1, fecMul(a, fecInverse(a)));
+    TEST_ASSERT_EQUAL(a, fecMul(a, 1));
+    TEST_ASSERT_EQUAL(0, fecMul(a, 0));
+    for (int b = 1; b < 256; b += 17) {
+      TEST_ASSERT_EQUAL(fecMul(a, b), fecMul(b, a));
+    }
+  }
+  // x^8 = x^4 + x^3 + x^2 + 1 under 0x11D
+  TEST_ASSERT_EQUAL(0x1D, fecMul(0x80, 2));
+}
+
+void test_matches_python_encoder() {
+  // tools/ota_multicast.py encode_repair() of these sources
+  Symbols sources(4, std::vector<uint8_t>(8));
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < 8; j++) {
+      sources[i][j] = (i * 37 + j * 11) & 255;
+    }
+  }
+  const struct {
+    uint8_t x;
+    const char *hex;
+  } expected[] = { { 4, "7767f25104a8ba88" }, { 5, "a3efab4c176abc80" }, { 200, "2cd288a9545797b0" } };
+  for (auto &e : expected) {
+    std::vector<uint8_t> repair = encodeRepair(sources, e.x);
+    char hex[17];
+    for (int j = 0; j < 8; j++) {
+      snprintf(hex + j * 2, 3, "%02x", repair[j]);
+    }
+    TEST_ASSERT_EQUAL_STRING(e.hex, hex);
+  }
+}
+
+void test_every_loss_pattern_of_small_group() {
+  const uint8_t k = 8;
+  Symbols sources = randomSources(k, 64);
+  for (uint32_t mask = 1; mask < (1u << k); mask++) {
+    std::vector<uint8_t> lost, repairIndices;
+    for (uint8_t i = 0; i < k; i++) {
+      if (mask & (1u << i)) {
+        lost.push_back(i);
+        // Any repair indices will do; use spread-out ones
+        repairIndices.push_back(k + lost.size() * 29 % (256 - k));
+      }
+    }
+    TEST_ASSERT_TRUE(recover(sources, lost, repairIndices));
+  }
+}
+
+void test_random_groups_and_losses() {
+  for (int round = 0; round < 200; round++) {
+    uint8_t k = 1 + nextRandom() % FEC_MAX_SYMBOLS;
+    Symbols sources = randomSources(k, 1 + nextRandom() % 100);
+
+    std::vector<uint8_t> lost;
+    for (uint8_t i = 0; i < k; i++) {
+      if (nextRandom() % 4 == 0) {
+        lost.push_back(i);
+      }
+    }
+    std::vector<uint8_t> repairIndices;
+    while (repairIndices.size() < lost.size()) {
+      uint8_t x = k + nextRandom() % (256 - k);
+      if (std::find(repairIndices.begin(), repairIndices.end(), x) == repairIndices.end()) {
+        repairIndices.push_back(x);
+      }
+    }
+    TEST_ASSERT_TRUE(recover(sources, lost, repairIndices));
+  }
+}
+
+void test_repeated_repair_index_fails() {
+  Symbols sources = randomSources(6, 16);
+  TEST_ASSERT_FALSE(recover(sources, { 1, 4 }, { 10, 10 }));
+}
+
+void test_group_larger_than_decoder_is_refused() {
+  uint8_t rowData[1];
+  std::vector<uint8_t *> rows(FEC_MAX_SYMBOLS + 1, rowData);
+  std::vector<uint8_t> indices(FEC_MAX_SYMBOLS + 1);
+  TEST_ASSERT_FALSE(fecSolve(rows.data(), indices.data(), indices.data(), FEC_MAX_SYMBOLS + 1, 1));
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_field_arithmetic);
+  RUN_TEST(test_matches_python_encoder);
+  RUN_TEST(test_every_loss_pattern_of_small_group);
+  RUN_TEST(test_random_groups_and_losses);
+  RUN_TEST(test_repeated_repair_index_fails);
+  RUN_TEST(test_group_larger_than_decoder_is_refused);
+  return UNITY_END();
+}
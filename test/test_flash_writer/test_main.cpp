@@ -0,0 +1,365 @@
+/*
+  -----------------------
+  Flash Writer Tests
+  -----------------------
+
+  Runs the double-buffered writer with its real task and ring against the
+  fake flash, including erase and write failures, abort, suspend/resume
+  and the image check at commit.
+
+  test_benchmark delivers an image over a paced link to the writer and to
+  inline flash writes in the receive path (the path before the writer),
+  with flash and link times scaled down from the device, and prints
+  throughput and how long the receive path was held up. While the flash
+  is the bottleneck both paths run at the flash rate (the writer's total
+  includes up to OTA_WRITER_RECEIVE_TIMEOUT for it to notice the end of
+  input); below it, only the writer leaves the receive path free. The
+  same link checks the erase and stall statistics: below the flash rate
+  erasing happens ahead of the data, above it the receive path stalls.
+*/
+#include <Arduino.h>
+#include <unity.h>
+#include <chrono>
+#include "OTAFlashWriter.h"
+#include "FakeImage.h"
+
+std::vector<uint8_t> image;
+
+void setUp() {
+  fakeFlashReset();
+  image = fakeAppImage(1, 32 * 1024, 2);
+}
+
+void tearDown() {
+  otaWriterAbort();
+  fakeUseWallClock(false);
+}
+
+const uint8_t *partitionData() {
+  return fakeOTASlots[1].data.data();
+}
+
+/**
+ * Feed data in TCP-segment-sized pieces; returns the bytes queued
+ */
+size_t writeChunks(const uint8_t *data, size_t len) {
+  size_t queued = 0;
+  while (queued < len) {
+    size_t n = min((size_t)1436, len - queued);
+    size_t accepted = otaWriterWrite(data + queued, n);
+    queued += accepted;
+    if (accepted < n) {
+      break;
+    }
+  }
+  return queued;
+}
+
+void test_writes_image_and_commits() {
+  TEST_ASSERT_TRUE(otaWriterBegin(OTA_WRITER_UPLOAD, image.size()));
+  TEST_ASSERT_EQUAL(image.size(), writeChunks(image.data(), image.size()));
+  TEST_ASSERT_TRUE(otaWriterEnd());
+  TEST_ASSERT_FALSE(isOTAWriterActive);
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), partitionData(), image.size());
+
+  uint8_t digest[32];
+  mbedtls_sha256_ret(image.data(), image.size(), digest, 0);
+  TEST_ASSERT_EQUAL_MEMORY(digest, otaWriterDigest(), 32);
+  TEST_ASSERT_TRUE(otaWriterCommit());
+  TEST_ASSERT_EQUAL(1, fakeBootSlot);
+}
+
+void test_one_session_at_a_time() {
+  TEST_ASSERT_TRUE(otaWriterBegin(OTA_WRITER_UPLOAD, 0));
+  TEST_ASSERT_FALSE(otaWriterBegin(OTA_WRITER_UPLOAD, 0));
+  otaWriterAbort();
+  TEST_ASSERT_TRUE(otaWriterBegin(OTA_WRITER_UPLOAD, 0));
+}
+
+void test_rejects_image_larger_than_partition() {
+  TEST_ASSERT_FALSE(otaWriterBegin(OTA_WRITER_UPLOAD, FAKE_PARTITION_SIZE + 1));
+  TEST_ASSERT_FALSE(isOTAWriterActive);
+  TEST_ASSERT_FALSE(otaWriterBegin(OTA_WRITER_UPLOAD, 0, 100));
+}
+
+void test_write_error_stops_session() {
+  fakeFlashFailFrom = 3 * OTA_SECTOR_SIZE;
+  TEST_ASSERT_TRUE(otaWriterBegin(OTA_WRITER_UPLOAD, image.size()));
+  writeChunks(image.data(), image.size());
+  TEST_ASSERT_FALSE(otaWriterEnd());
+  TEST_ASSERT_EQUAL(ESP_ERR_FLASH_OP_FAIL, otaWriterError);
+  TEST_ASSERT_FALSE(isOTAWriterActive);
+  TEST_ASSERT_EQUAL(0, fakeBootSlot);
+
+  // Once failed, further data is refused instead of queued. Erasing
+  // starts with the first data, which fails.
+  fakeFlashFailFrom = 0;
+  TEST_ASSERT_TRUE(otaWriterBegin(OTA_WRITER_UPLOAD, image.size()));
+  TEST_ASSERT_EQUAL(100, otaWriterWrite(image.data(), 100));
+  for (int i = 0; i < 200 && otaWriterError == ESP_OK; i++) {
+    delay(1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  TEST_ASSERT_EQUAL(0, otaWriterWrite(image.data(), 1024));
+  TEST_ASSERT_FALSE(otaWriterEnd());
+
+  // The writer is free again for the next attempt
+  fakeFlashFailFrom = SIZE_MAX;
+  TEST_ASSERT_TRUE(otaWriterBegin(OTA_WRITER_UPLOAD, image.size()));
+  writeChunks(image.data(), image.size());
+  TEST_ASSERT_TRUE(otaWriterEnd());
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), partitionData(), image.size());
+}
+
+void test_write_past_partition_end_fails() {
+  TEST_ASSERT_TRUE(otaWriterBegin(OTA_WRITER_UPLOAD, 0, FAKE_PARTITION_SIZE - OTA_SECTOR_SIZE));
+  std::vector<uint8_t> data(2 * OTA_SECTOR_SIZE, 0x5a);
+  writeChunks(data.data(), data.size());
+  TEST_ASSERT_FALSE(otaWriterEnd());
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, otaWriterError);
+}
+
+void test_abort_keeps_boot_partition() {
+  TEST_ASSERT_TRUE(otaWriterBegin(OTA_WRITER_UPLOAD, image.size()));
+  writeChunks(image.data(), image.size() / 2);
+  otaWriterAbort();
+  TEST_ASSERT_FALSE(isOTAWriterActive);
+  TEST_ASSERT_EQUAL(0, fakeBootSlot);
+}
+
+void test_suspend_and_resume() {
+  size_t first = 2 * OTA_SECTOR_SIZE + 1000;
+  TEST_ASSERT_TRUE(otaWriterBegin(OTA_WRITER_UPLOAD, image.size()));
+  writeChunks(image.data(), first);
+  size_t offset = otaWriterSuspend();
+  TEST_ASSERT_EQUAL(2 * OTA_SECTOR_SIZE, offset);
+
+  TEST_ASSERT_TRUE(otaWriterBegin(OTA_WRITER_UPLOAD, image.size(), offset));
+  writeChunks(image.data() + offset, image.size() - offset);
+  TEST_ASSERT_TRUE(otaWriterEnd());
+
+  // The resumed hash covers the sectors written before the suspend
+  uint8_t digest[32];
+  mbedtls_sha256_ret(image.data(), image.size(), digest, 0);
+  TEST_ASSERT_EQUAL_MEMORY(digest, otaWriterDigest(), 32);
+  TEST_ASSERT_TRUE(otaWriterCommit());
+}
+
+void test_commit_refuses_corrupt_image() {
+  image[image.size() / 2] ^= 0xff;
+  TEST_ASSERT_TRUE(otaWriterBegin(OTA_WRITER_UPLOAD, image.size()));
+  writeChunks(image.data(), image.size());
+  TEST_ASSERT_TRUE(otaWriterEnd());
+  TEST_ASSERT_FALSE(otaWriterCommit());
+  TEST_ASSERT_EQUAL(0, fakeBootSlot);
+}
+
+// Device flash (45 ms sector erase, ~2 ms 4 KB write) and link rates,
+// all 20x faster so a run takes well under a second
+const uint32_t BENCH_ERASE_MICROS = 45000 / 20;
+const uint32_t BENCH_WRITE_MICROS = 2000 / 20;
+const double BENCH_SLOW_LINK = 50e3 * 20;  // Bytes per second
+const double BENCH_FAST_LINK = 1e6 * 20;
+const size_t BENCH_SEGMENT = 1436;
+const size_t BENCH_TCP_WINDOW = 4 * BENCH_SEGMENT;
+
+struct LinkRun {
+  double seconds;          // First segment to everything on flash
+  double receiveSeconds;   // Time the receive path was busy
+};
+
+/**
+ * Deliver data in TCP segments at bytesPerSecond. The sender stays within
+ * a TCP window of what receive() has taken, so a busy receive path slows
+ * the link down as it does on the device.
+ */
+LinkRun deliver(const std::vector<uint8_t> &data, double bytesPerSecond,
+                std::function<void(const uint8_t *, size_t)> receive, std::function<void()> finish) {
+  typedef std::chrono::steady_clock Clock;
+  auto segmentTime = std::chrono::microseconds((uint64_t)(BENCH_SEGMENT / bytesPerSecond * 1e6));
+  auto start = Clock::now();
+  auto arrival = start;
+  std::vector<Clock::time_point> taken;  // When receive() finished each segment
+  LinkRun run = {};
+  for (size_t at = 0; at < data.size(); at += BENCH_SEGMENT) {
+    size_t index = at / BENCH_SEGMENT;
+    size_t windowSegments = BENCH_TCP_WINDOW / BENCH_SEGMENT;
+    Clock::time_point sent = index >= windowSegments ? max(arrival, taken[index - windowSegments]) : arrival;
+    arrival = sent + segmentTime;
+    std::this_thread::sleep_until(arrival);
+
+    auto t0 = Clock::now();
+    receive(data.data() + at, min(BENCH_SEGMENT, data.size() - at));
+    taken.push_back(Clock::now());
+    run.receiveSeconds += std::chrono::duration<double>(taken.back() - t0).count();
+  }
+  finish();
+  run.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  return run;
+}
+
+// Inline path: coalesce in the receive path, erase and write each sector
+std::vector<uint8_t> inlineSector;
+size_t inlineOffset;
+
+void inlineFlush() {
+  const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+  esp_partition_erase_range(partition, inlineOffset, OTA_SECTOR_SIZE);
+  esp_partition_write(partition, inlineOffset, inlineSector.data(), inlineSector.size());
+  inlineOffset += inlineSector.size();
+  inlineSector.clear();
+}
+
+void inlineReceive(const uint8_t *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    inlineSector.push_back(data[i]);
+    if (inlineSector.size() == OTA_SECTOR_SIZE) {
+      inlineFlush();
+    }
+  }
+}
+
+LinkRun benchInline(const std::vector<uint8_t> &data, double bytesPerSecond) {
+  fakeFlashReset();
+  fakeFlashEraseMicros = BENCH_ERASE_MICROS;
+  fakeFlashWriteMicros = BENCH_WRITE_MICROS;
+  inlineSector.clear();
+  inlineOffset = 0;
+  return deliver(data, bytesPerSecond, inlineReceive, [] {
+    if (!inlineSector.empty()) {
+      inlineFlush();
+    }
+  });
+}
+
+LinkRun benchWriter(const std::vector<uint8_t> &data, double bytesPerSecond) {
+  fakeFlashReset();
+  fakeFlashEraseMicros = BENCH_ERASE_MICROS;
+  fakeFlashWriteMicros = BENCH_WRITE_MICROS;
+  otaWriterBegin(OTA_WRITER_UPLOAD, data.size());
+  return deliver(
+      data, bytesPerSecond, [](const uint8_t *segment, size_t len) { otaWriterWrite(segment, len); },
+      [] { otaWriterEnd(); });
+}
+
+void test_benchmark() {
+  fakeUseWallClock(true);
+  std::vector<uint8_t> data = fakeAppImage(2, 96 * 1024, 2);
+  for (double link : { BENCH_SLOW_LINK, BENCH_FAST_LINK }) {
+    LinkRun inline_ = benchInline(data, link);
+    TEST_ASSERT_EQUAL_MEMORY(data.data(), partitionData(), data.size());
+    LinkRun writer = benchWriter(data, link);
+    TEST_ASSERT_EQUAL_MEMORY(data.data(), partitionData(), data.size());
+
+    double linkSeconds = data.size() / link;
+    Serial.printf("OTA: link %.1f MB/s (scaled), %u bytes, link alone %.0f ms\n", link / 1e6,
+                  (unsigned)data.size(), linkSeconds * 1000);
+    Serial.printf("OTA:   inline  %.2f MB/s, %.0f ms, receive path busy %.0f ms\n",
+                  data.size() / inline_.seconds / 1e6, inline_.seconds * 1000, inline_.receiveSeconds * 1000);
+    Serial.printf("OTA:   writer  %.2f MB/s, %.0f ms, receive path busy %.0f ms, %lu stalls (%lu ms)\n",
+                  data.size() / writer.seconds / 1e6, writer.seconds * 1000, writer.receiveSeconds * 1000,
+                  (unsigned long)otaWriterStats.stallCount, (unsigned long)(otaWriterStats.stallMicros / 1000));
+
+    // Inline, every erase and write holds up the receive path
+    double flashSeconds = otaWriterStats.sectorsWritten * (BENCH_ERASE_MICROS + BENCH_WRITE_MICROS) / 1e6;
+    TEST_ASSERT_TRUE(inline_.receiveSeconds >= flashSeconds);
+    if (link == BENCH_SLOW_LINK) {
+      // Below the flash rate the writer keeps up, so the receive path
+      // only copies
+      TEST_ASSERT_TRUE(writer.receiveSeconds < flashSeconds / 4);
+    }
+  }
+}
+
+void test_erases_ahead_on_slow_link() {
+  fakeUseWallClock(true);
+  std::vector<uint8_t> data = fakeAppImage(3, 48 * 1024, 2);
+  // Half the benchmark's slow link: a sector arrives every 8 ms, which
+  // leaves room for a late erase on a loaded host
+  benchWriter(data, BENCH_SLOW_LINK / 2);
+  TEST_ASSERT_EQUAL_MEMORY(data.data(), partitionData(), data.size());
+
+  // Erase happens while waiting for data, off the receive path
+  OTAWriterStats &stats = otaWriterStats;
+  TEST_ASSERT_TRUE(stats.sectorsPreErased >= stats.sectorsWritten * 3 / 4);
+  TEST_ASSERT_TRUE(stats.preEraseMicros >= stats.sectorsPreErased * BENCH_ERASE_MICROS);
+  TEST_ASSERT_TRUE(stats.eraseMicros < stats.preEraseMicros / 2);
+  TEST_ASSERT_EQUAL(0, stats.stallCount);
+  TEST_ASSERT_EQUAL(0, stats.stallMicros);
+}
+
+void test_stalls_counted_on_fast_link() {
+  fakeUseWallClock(true);
+  std::vector<uint8_t> data = fakeAppImage(4, 48 * 1024, 2);
+  benchWriter(data, BENCH_FAST_LINK);
+  TEST_ASSERT_EQUAL_MEMORY(data.data(), partitionData(), data.size());
+
+  // The ring fills, so erasing is on the critical path and the receive
+  // path waits
+  OTAWriterStats &stats = otaWriterStats;
+  TEST_ASSERT_TRUE(stats.stallCount > 0);
+  TEST_ASSERT_TRUE(stats.stallMicros > 0);
+  TEST_ASSERT_TRUE(stats.eraseMicros > stats.preEraseMicros);
+  TEST_ASSERT_TRUE(stats.writeMicros >= stats.sectorsWritten * BENCH_WRITE_MICROS);
+}
+
+void test_erase_ahead_stops_at_image_end() {
+  // Fewer sectors than OTA_PREERASE_SECTORS, so only the end bounds it
+  image = fakeAppImage(9, 20 * 1024, 2);
+  size_t imageSectors = (image.size() + OTA_SECTOR_SIZE - 1) / OTA_SECTOR_SIZE;
+  TEST_ASSERT_TRUE(imageSectors < OTA_PREERASE_SECTORS);
+  // Mark the sector after the image; erasing it would set it to 0xFF
+  fakeOTASlots[1].data[imageSectors * OTA_SECTOR_SIZE] = 0;
+
+  TEST_ASSERT_TRUE(otaWriterBegin(OTA_WRITER_UPLOAD, image.size()));
+  // Give the idle writer time to erase as far ahead as it may
+  writeChunks(image.data(), 100);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  TEST_ASSERT_EQUAL(imageSectors, otaWriterStats.sectorsPreErased);
+
+  writeChunks(image.data() + 100, image.size() - 100);
+  TEST_ASSERT_TRUE(otaWriterEnd());
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), partitionData(), image.size());
+  TEST_ASSERT_EQUAL(imageSectors, fakeFlashErases);
+  TEST_ASSERT_EQUAL(0, fakeOTASlots[1].data[imageSectors * OTA_SECTOR_SIZE]);
+}
+
+void test_erase_ahead_of_unknown_size_stays_within_ring() {
+  // Image size unknown, as for chunked and gzip uploads: erasing ahead
+  // goes as far as the sector buffer and ring can hold, not 16 sectors
+  size_t reachSectors = (OTA_SECTOR_SIZE + OTA_WRITER_RING_SIZE) / OTA_SECTOR_SIZE;
+  TEST_ASSERT_TRUE(reachSectors < OTA_PREERASE_SECTORS);
+  image = fakeAppImage(10, 4 * 1024, 2);
+  // The reach moves on with each sector written, up to the last whole one
+  size_t farthest = image.size() / OTA_SECTOR_SIZE + reachSectors;
+  fakeOTASlots[1].data[farthest * OTA_SECTOR_SIZE] = 0;
+
+  TEST_ASSERT_TRUE(otaWriterBegin(OTA_WRITER_UPLOAD, 0));
+  writeChunks(image.data(), 100);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  TEST_ASSERT_EQUAL(reachSectors, otaWriterStats.sectorsPreErased);
+
+  writeChunks(image.data() + 100, image.size() - 100);
+  TEST_ASSERT_TRUE(otaWriterEnd());
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), partitionData(), image.size());
+  TEST_ASSERT_TRUE(fakeFlashErases <= farthest);
+  TEST_ASSERT_EQUAL(0, fakeOTASlots[1].data[farthest * OTA_SECTOR_SIZE]);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_writes_image_and_commits);
+  RUN_TEST(test_one_session_at_a_time);
+  RUN_TEST(test_rejects_image_larger_than_partition);
+  RUN_TEST(test_write_error_stops_session);
+  RUN_TEST(test_write_past_partition_end_fails);
+  RUN_TEST(test_abort_keeps_boot_partition);
+  RUN_TEST(test_suspend_and_resume);
+  RUN_TEST(test_commit_refuses_corrupt_image);
+  RUN_TEST(test_benchmark);
+  RUN_TEST(test_erases_ahead_on_slow_link);
+  RUN_TEST(test_stalls_counted_on_fast_link);
+  RUN_TEST(test_erase_ahead_stops_at_image_end);
+  RUN_TEST(test_erase_ahead_of_unknown_size_stays_within_ring);
+  return UNITY_END();
+}
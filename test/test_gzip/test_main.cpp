@@ -0,0 +1,250 @@
+/*
+  -----------------------
+  Gzip Decompressor Tests
+  -----------------------
+
+  Compresses images with the host's zlib and streams them through
+  OTADecompressor.h: whole, a byte at a time and in TCP-sized pieces, at
+  several compression levels, with every optional gzip header field, and
+  damaged in the CRC32, ISIZE and deflate data. The images are larger
+  than the 32 KB window, so the output position wraps many times. A
+  compressed raw upload is also taken through /ota/firmware to flash.
+
+  test_benchmark prints the inflate rate per compression level (host
+  time; on the device the ROM inflater is what counts).
+*/
+#include <Arduino.h>
+#include <unity.h>
+#include <chrono>
+#include "OTA.h"
+#include "FakeImage.h"
+
+const int LEVELS[] = { 1, 6, 9 };
+
+std::vector<uint8_t> inflated;
+
+bool collectSink(const uint8_t *data, size_t len) {
+  inflated.insert(inflated.end(), data, data + len);
+  return true;
+}
+
+bool rejectingSink(const uint8_t *data, size_t len) {
+  return false;
+}
+
+void setUp() {
+  inflated.clear();
+  fakeFlashReset();
+  fakeNVS.clear();
+  registerWebRoutes();
+}
+
+void tearDown() {
+  otaInflateRelease();
+  otaWriterAbort();
+}
+
+/**
+ * Data that compresses about as well as firmware: runs of code-like words
+ * with some noise
+ */
+std::vector<uint8_t> compressibleData(size_t size, uint32_t seed) {
+  std::vector<uint8_t> data(size);
+  for (size_t i = 0; i < size; i++) {
+    seed = seed * 1103515245 + 12345;
+    data[i] = (seed >> 24) < 200 ? (uint8_t)("\x00\x10\x20\x3f\xe0\x60\x13\x06"[(i / 3) % 8] + (i & 1)) :
+                                   (uint8_t)(seed >> 16);
+  }
+  return data;
+}
+
+/**
+ * Gzip data with zlib; header fields are added when withFields is set
+ */
+std::vector<uint8_t> gzip(const std::vector<uint8_t> &data, int level, bool withFields = false) {
+  z_stream s = {};
+  deflateInit2(&s, level, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY);
+  gz_header header = {};
+  uint8_t extra[] = { 'O', 'T', 3, 0, 1, 2, 3 };
+  if (withFields) {
+    header.extra = extra;
+    header.extra_len = sizeof(extra);
+    header.name = (Bytef *)"firmware.bin";
+    header.comment = (Bytef *)"built for the native tests";
+    header.hcrc = 1;
+    deflateSetHeader(&s, &header);
+  }
+  std::vector<uint8_t> out(deflateBound(&s, data.size()) + 256);
+  s.next_in = (Bytef *)data.data();
+  s.avail_in = data.size();
+  s.next_out = out.data();
+  s.avail_out = out.size();
+  deflate(&s, Z_FINISH);
+  out.resize(s.total_out);
+  deflateEnd(&s);
+  return out;
+}
+
+/**
+ * Feed gz in chunk-byte pieces; returns true if every write was accepted
+ * and the stream ended intact
+ */
+bool inflateInPieces(const std::vector<uint8_t> &gz, size_t chunk, OTASink sink = collectSink) {
+  inflated.clear();
+  if (!otaInflateBegin(sink)) {
+    return false;
+  }
+  bool ok = true;
+  for (size_t at = 0; at < gz.size() && ok; at += chunk) {
+    ok = otaInflateWrite(gz.data() + at, min(chunk, gz.size() - at));
+  }
+  return otaInflateEnd() && ok;
+}
+
+void test_round_trip_at_each_level() {
+  std::vector<uint8_t> data = compressibleData(200 * 1024, 1);
+  for (int level : LEVELS) {
+    std::vector<uint8_t> gz = gzip(data, level);
+    TEST_ASSERT_TRUE(gz.size() < data.size());
+    TEST_ASSERT_TRUE(inflateInPieces(gz, gz.size()));
+    TEST_ASSERT_EQUAL(data.size(), inflated.size());
+    TEST_ASSERT_EQUAL_MEMORY(data.data(), inflated.data(), data.size());
+    TEST_ASSERT_EQUAL(gz.size(), otaInflateStats.compressedBytes);
+    TEST_ASSERT_EQUAL(data.size(), otaInflateStats.outputBytes);
+  }
+}
+
+void test_incompressible_data_round_trips() {
+  // Stored blocks at level 0, and random data that deflate can't shrink
+  std::vector<uint8_t> data = fakeAppImage(2, 60 * 1024, 2);
+  TEST_ASSERT_TRUE(inflateInPieces(gzip(data, 0), 1436));
+  TEST_ASSERT_EQUAL_MEMORY(data.data(), inflated.data(), data.size());
+  TEST_ASSERT_TRUE(inflateInPieces(gzip(data, 9), 1436));
+  TEST_ASSERT_EQUAL_MEMORY(data.data(), inflated.data(), data.size());
+}
+
+void test_split_input() {
+  std::vector<uint8_t> data = compressibleData(100 * 1024, 2);
+  std::vector<uint8_t> gz = gzip(data, 6, true);
+  for (size_t chunk : { (size_t)1, (size_t)7, (size_t)1436, (size_t)4096 }) {
+    TEST_ASSERT_TRUE(inflateInPieces(gz, chunk));
+    TEST_ASSERT_EQUAL(data.size(), inflated.size());
+    TEST_ASSERT_EQUAL_MEMORY(data.data(), inflated.data(), data.size());
+  }
+}
+
+void test_window_wraps() {
+  // Exactly a multiple of the window, and one byte more
+  for (size_t size : { (size_t)4 * TINFL_LZ_DICT_SIZE, (size_t)4 * TINFL_LZ_DICT_SIZE + 1 }) {
+    std::vector<uint8_t> data = compressibleData(size, 3);
+    TEST_ASSERT_TRUE(inflateInPieces(gzip(data, 9), 1000));
+    TEST_ASSERT_EQUAL(size, inflated.size());
+    TEST_ASSERT_EQUAL_MEMORY(data.data(), inflated.data(), size);
+  }
+}
+
+void test_crc_mismatch() {
+  std::vector<uint8_t> gz = gzip(compressibleData(50 * 1024, 4), 6);
+  gz[gz.size() - 8] ^= 0x01;
+  TEST_ASSERT_FALSE(inflateInPieces(gz, 1436));
+}
+
+void test_size_mismatch() {
+  std::vector<uint8_t> gz = gzip(compressibleData(50 * 1024, 5), 6);
+  gz[gz.size() - 4] ^= 0x01;
+  TEST_ASSERT_FALSE(inflateInPieces(gz, 1436));
+}
+
+void test_truncated_stream() {
+  std::vector<uint8_t> gz = gzip(compressibleData(50 * 1024, 6), 6);
+  gz.resize(gz.size() - 5);
+  TEST_ASSERT_FALSE(inflateInPieces(gz, 1436));
+  gz.resize(gz.size() / 2);
+  TEST_ASSERT_FALSE(inflateInPieces(gz, 1436));
+}
+
+void test_corrupt_deflate_data() {
+  std::vector<uint8_t> gz = gzip(compressibleData(50 * 1024, 7), 6);
+  // Block type 3 is reserved
+  gz[10] |= 0x06;
+  TEST_ASSERT_FALSE(inflateInPieces(gz, 1436));
+}
+
+void test_bad_header() {
+  std::vector<uint8_t> gz = gzip(compressibleData(1024, 8), 6);
+  gz[2] = 7; // Not deflate
+  TEST_ASSERT_FALSE(inflateInPieces(gz, gz.size()));
+}
+
+void test_trailing_padding_is_ignored() {
+  std::vector<uint8_t> data = compressibleData(10 * 1024, 9);
+  std::vector<uint8_t> gz = gzip(data, 6);
+  gz.insert(gz.end(), 512, 0);
+  TEST_ASSERT_TRUE(inflateInPieces(gz, 1436));
+  TEST_ASSERT_EQUAL(data.size(), inflated.size());
+}
+
+void test_sink_failure_stops_stream() {
+  std::vector<uint8_t> gz = gzip(compressibleData(50 * 1024, 10), 6);
+  TEST_ASSERT_FALSE(inflateInPieces(gz, 1436, rejectingSink));
+}
+
+void test_compressed_upload_reaches_flash() {
+  std::vector<uint8_t> image = fakeAppImage(11, 80 * 1024, 2);
+  std::vector<uint8_t> gz = gzip(image, 9);
+  FakeConnection c(server, HTTP_PUT, "/ota/firmware");
+  c.header("Content-Type", "application/octet-stream");
+  c.header("Content-Length", String((unsigned long)gz.size()));
+  c.open();
+  c.receiveAll(gz.data(), gz.size());
+  TEST_ASSERT_EQUAL(200, c.responseCode());
+  c.close();
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), fakeOTASlots[1].data.data(), image.size());
+  TEST_ASSERT_EQUAL(1, fakeBootSlot);
+}
+
+void test_corrupt_compressed_upload_is_refused() {
+  std::vector<uint8_t> image = fakeAppImage(12, 80 * 1024, 2);
+  std::vector<uint8_t> gz = gzip(image, 9);
+  gz[gz.size() - 6] ^= 0x10;
+  FakeConnection c(server, HTTP_PUT, "/ota/firmware");
+  c.header("Content-Type", "application/octet-stream");
+  c.header("Content-Length", String((unsigned long)gz.size()));
+  c.open();
+  c.receiveAll(gz.data(), gz.size());
+  TEST_ASSERT_EQUAL(400, c.responseCode());
+  c.close();
+  TEST_ASSERT_EQUAL(0, fakeBootSlot);
+}
+
+void test_benchmark() {
+  std::vector<uint8_t> data = compressibleData(1024 * 1024, 13);
+  for (int level : LEVELS) {
+    std::vector<uint8_t> gz = gzip(data, level);
+    auto t0 = std::chrono::steady_clock::now();
+    TEST_ASSERT_TRUE(inflateInPieces(gz, 1436));
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    Serial.printf("OTA: gzip -%d: %u -> %u bytes (%.0f%%), inflated at %.0f MB/s\n", level,
+                  (unsigned)gz.size(), (unsigned)data.size(), 100.0 * gz.size() / data.size(),
+                  data.size() / seconds / 1e6);
+  }
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_round_trip_at_each_level);
+  RUN_TEST(test_incompressible_data_round_trips);
+  RUN_TEST(test_split_input);
+  RUN_TEST(test_window_wraps);
+  RUN_TEST(test_crc_mismatch);
+  RUN_TEST(test_size_mismatch);
+  RUN_TEST(test_truncated_stream);
+  RUN_TEST(test_corrupt_deflate_data);
+  RUN_TEST(test_bad_header);
+  RUN_TEST(test_trailing_padding_is_ignored);
+  RUN_TEST(test_sink_failure_stops_stream);
+  RUN_TEST(test_compressed_upload_reaches_flash);
+  RUN_TEST(test_corrupt_compressed_upload_is_refused);
+  RUN_TEST(test_benchmark);
+  return UNITY_END();
+}
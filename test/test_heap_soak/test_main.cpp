@@ -0,0 +1,218 @@
+/*
+  -----------------------
+  Lifecycle Heap Soak
+  -----------------------
+
+  Runs the WiFi/OTA lifecycle through SOAK_CYCLES rounds of link flaps,
+  portal sessions and disable/enable cycles against the fakes and fails
+  if the free heap drifts down. Each round ends in the same state (station
+  connected, server running, no portal), so the heap has to come back to
+  the same level every time.
+
+  The fake heap is the host allocator (ESP.getFreeHeap(), see Arduino.h),
+  so this catches leaks in src/, not fragmentation of the device heap;
+  HeapMonitor.h keeps watching that on the device. The free heap, largest
+  free block and allocation count are all held to HeapMonitor.h's drift
+  tolerances. Heap accounting needs the host allocator, so build this
+  test without AddressSanitizer.
+
+  Run more cycles with -DSOAK_CYCLES=100000 in build_flags.
+*/
+#include <Arduino.h>
+#include <unity.h>
+#include "OTA.h"
+
+#ifndef SOAK_CYCLES
+#define SOAK_CYCLES 10000
+#endif
+
+// Rounds before the baseline is taken: first-time allocations (event
+// queues, route table, String capacity) are not leaks
+const int SOAK_WARMUP_CYCLES = 20;
+
+// Drift allowed against the baseline, as for HeapMonitor.h on the device
+const uint32_t SOAK_DRIFT_TOLERANCE_BYTES = HEAP_DRIFT_TOLERANCE_BYTES;
+const uint32_t SOAK_DRIFT_TOLERANCE_BLOCKS = HEAP_DRIFT_TOLERANCE_BLOCKS;
+
+// Worst drift seen against the baseline over a soak
+struct SoakDrift {
+  uint32_t freeBytes;
+  uint32_t largestFreeBlock;
+  uint32_t allocatedBlocks;
+};
+
+void setUp() {
+  fakeNVS.clear();
+  wifiManager.hasSavedCredentials = true;
+  wifiManager.stopConfigPortal();
+  memset(heapLifecycleStats, 0, sizeof(heapLifecycleStats));
+  startWiFiConnection();
+  fakeWiFiGotIP();
+  handleOTA();
+}
+
+void tearDown() {}
+
+void loopFor(unsigned long ms) {
+  for (unsigned long t = 0; t < ms; t += 100) {
+    fakeAdvanceMillis(100);
+    handleOTA();
+  }
+}
+
+/**
+ * The AP goes away for a few seconds and comes back
+ */
+void cycleLinkFlap() {
+  fakeWiFiDisconnected();
+  loopFor(3000);
+  fakeWiFiGotIP();
+  handleOTA();
+}
+
+/**
+ * The button opens the portal, nobody uses it and it times out
+ */
+void cyclePortalTimeout() {
+  startConfigPortal();
+  handleOTA();
+  fakeWiFiGotIP();
+  handleOTA();
+  handleOTA();
+  TEST_ASSERT_TRUE(isPortalActive);
+  fakeAdvanceMillis(180000);
+  handleOTA();
+  TEST_ASSERT_FALSE(isPortalActive);
+}
+
+/**
+ * The saved network is gone; the portal opens and a user enters new
+ * credentials
+ */
+void cyclePortalSave() {
+  wifiManager.hasSavedCredentials = false;
+  disableWiFi();
+  startWiFiConnection();
+  handleOTA();
+  handleOTA();
+  TEST_ASSERT_TRUE(isPortalActive);
+  wifiManager.fakePortalSave();
+  handleOTA();
+  wifiManager.stopConfigPortal();
+  handleOTA();
+  TEST_ASSERT_FALSE(isPortalActive);
+}
+
+/**
+ * The application switches WiFi off and back on
+ */
+void cycleDisableEnable() {
+  disableWiFi();
+  loopFor(1000);
+  startWiFiConnection();
+  handleOTA();
+  fakeWiFiGotIP();
+  handleOTA();
+}
+
+void runCycle(int i) {
+  switch (i % 4) {
+    case 0: cycleLinkFlap(); break;
+    case 1: cyclePortalTimeout(); break;
+    case 2: cyclePortalSave(); break;
+    case 3: cycleDisableEnable(); break;
+  }
+  TEST_ASSERT_TRUE(isWiFiLinkUp);
+  TEST_ASSERT_TRUE(isOTAServerRunning);
+  TEST_ASSERT_FALSE(isPortalActive);
+}
+
+/**
+ * Run cycles rounds, calling leak after each; returns the largest drop of
+ * the free heap and largest free block, and the largest growth in
+ * allocated blocks, against the baseline
+ */
+SoakDrift soak(int cycles, void (*leak)() = NULL) {
+  HeapSample baseline = {};
+  SoakDrift worst = {};
+  for (int i = 0; i < cycles; i++) {
+    runCycle(i);
+    if (leak) {
+      leak();
+    }
+    HeapSample sample = sampleHeap();
+    if (i == SOAK_WARMUP_CYCLES - 1) {
+      baseline = sample;
+    } else if (i >= SOAK_WARMUP_CYCLES) {
+      if (sample.freeBytes < baseline.freeBytes) {
+        worst.freeBytes = max(worst.freeBytes, baseline.freeBytes - sample.freeBytes);
+      }
+      if (sample.largestFreeBlock < baseline.largestFreeBlock) {
+        worst.largestFreeBlock = max(worst.largestFreeBlock, baseline.largestFreeBlock - sample.largestFreeBlock);
+      }
+      if (sample.allocatedBlocks > baseline.allocatedBlocks) {
+        worst.allocatedBlocks = max(worst.allocatedBlocks, sample.allocatedBlocks - baseline.allocatedBlocks);
+      }
+    }
+  }
+  return worst;
+}
+
+std::vector<void *> leaked;
+
+void leak64() {
+  leaked.push_back(malloc(64));
+}
+
+/**
+ * Whether a live allocation shows in the heap samples. It doesn't under
+ * AddressSanitizer, which replaces malloc(). The pointer is volatile and
+ * the block written so the compiler cannot drop the malloc()/free() pair.
+ */
+bool isHeapObservable() {
+  HeapSample before = sampleHeap();
+  void *volatile probe = malloc(4096);
+  memset(probe, 0xA5, 4096);
+  HeapSample during = sampleHeap();
+  free(probe);
+  return during.freeBytes + 4096 <= before.freeBytes &&
+         during.allocatedBlocks == before.allocatedBlocks + 1;
+}
+
+void test_harness_detects_small_leak() {
+  if (!isHeapObservable()) {
+    TEST_FAIL_MESSAGE("Heap usage not visible in this build (AddressSanitizer?)");
+  }
+  // 64 bytes per round must not hide under the tolerances for long
+  SoakDrift drift = soak(200, leak64);
+  for (void *p : leaked) {
+    free(p);
+  }
+  leaked.clear();
+  TEST_ASSERT_TRUE(drift.freeBytes > SOAK_DRIFT_TOLERANCE_BYTES);
+  TEST_ASSERT_TRUE(drift.allocatedBlocks > SOAK_DRIFT_TOLERANCE_BLOCKS);
+}
+
+void test_lifecycle_keeps_heap_flat() {
+  if (!isHeapObservable()) {
+    TEST_FAIL_MESSAGE("Heap usage not visible in this build (AddressSanitizer?)");
+  }
+  SoakDrift drift = soak(SOAK_CYCLES);
+  Serial.printf("HEAP: %d cycles, worst drift - free %lu, largest block %lu, blocks %lu\n", SOAK_CYCLES,
+                (unsigned long)drift.freeBytes, (unsigned long)drift.largestFreeBlock,
+                (unsigned long)drift.allocatedBlocks);
+  TEST_ASSERT_TRUE(drift.freeBytes <= SOAK_DRIFT_TOLERANCE_BYTES);
+  TEST_ASSERT_TRUE(drift.largestFreeBlock <= SOAK_DRIFT_TOLERANCE_BYTES);
+  TEST_ASSERT_TRUE(drift.allocatedBlocks <= SOAK_DRIFT_TOLERANCE_BLOCKS);
+  for (int point = 0; point < HEAP_LIFECYCLE_POINT_COUNT; point++) {
+    TEST_ASSERT_FALSE(heapLifecycleStats[point].driftReported);
+  }
+}
+
+int main(int argc, char **argv) {
+  setupOTA();
+  UNITY_BEGIN();
+  RUN_TEST(test_harness_detects_small_leak);
+  RUN_TEST(test_lifecycle_keeps_heap_flat);
+  return UNITY_END();
+}
@@ -0,0 +1,239 @@
+/*
+  -----------------------
+  Image Check Tests
+  -----------------------
+
+  Streams valid and damaged images through the early image check, whole
+  and a byte at a time, and checks that a raw upload of a wrong image is
+  refused from its header before anything is erased. In front of the
+  writer, the check keeps erasing ahead within an image of unknown size.
+*/
+#include <Arduino.h>
+#include <unity.h>
+#include <chrono>
+#include "OTA.h"
+#include "FakeImage.h"
+
+// Offset of the second segment header in a fakeAppImage(seed, 1024)
+const size_t SECOND_SEGMENT = ESP_IMAGE_HEADER_SIZE + ESP_SEGMENT_HEADER_SIZE + 1024;
+
+std::vector<uint8_t> image;
+
+void setUp() {
+  fakeFlashReset();
+  fakeNVS.clear();
+  registerWebRoutes();
+  image = fakeAppImage(5, 1024, 2);
+}
+
+void tearDown() {
+  otaWriterAbort();
+}
+
+void putLE32(uint8_t *p, uint32_t value) {
+  memcpy(p, &value, sizeof(value));
+}
+
+/**
+ * Check data fed in chunk-byte pieces; returns the error, including a
+ * truncation found at the end
+ */
+OTAImageError checkImage(const std::vector<uint8_t> &data, size_t chunk, size_t limit = FAKE_PARTITION_SIZE) {
+  otaImageCheckBegin(limit);
+  for (size_t at = 0; at < data.size(); at += chunk) {
+    if (!otaImageCheckWrite(data.data() + at, min(chunk, data.size() - at))) {
+      return otaImageCheck.error;
+    }
+  }
+  otaImageCheckEnd();
+  return otaImageCheck.error;
+}
+
+void test_accepts_valid_images() {
+  TEST_ASSERT_EQUAL(OTA_IMAGE_OK, checkImage(image, image.size()));
+  TEST_ASSERT_EQUAL(image.size(), otaImageCheck.imageLength);
+  TEST_ASSERT_EQUAL(OTA_IMAGE_OK, checkImage(image, 1));
+  TEST_ASSERT_EQUAL(OTA_IMAGE_OK, checkImage(image, 1436));
+
+  std::vector<uint8_t> plain = fakeAppImage(5, 1024, 3, false);
+  TEST_ASSERT_EQUAL(OTA_IMAGE_OK, checkImage(plain, 7));
+  TEST_ASSERT_EQUAL(plain.size(), otaImageCheck.imageLength);
+
+  std::vector<uint8_t> single = fakeAppImage(5, 1024, 1);
+  TEST_ASSERT_EQUAL(OTA_IMAGE_OK, checkImage(single, single.size()));
+}
+
+/**
+ * Check data in two pieces, split at offset at
+ */
+OTAImageError checkSplit(const std::vector<uint8_t> &data, size_t at) {
+  otaImageCheckBegin(FAKE_PARTITION_SIZE);
+  if (otaImageCheckWrite(data.data(), at) && otaImageCheckWrite(data.data() + at, data.size() - at)) {
+    otaImageCheckEnd();
+  }
+  return otaImageCheck.error;
+}
+
+void test_every_split_point() {
+  // A piece can end in the prefix, a segment header, segment data or the
+  // trailer; each stage must account for what it took
+  std::vector<uint8_t> small = fakeAppImage(6, 1024, 3);
+  std::vector<uint8_t> longer = small;
+  longer.push_back(0);
+  for (size_t at = 1; at < small.size(); at++) {
+    TEST_ASSERT_EQUAL(OTA_IMAGE_OK, checkSplit(small, at));
+    TEST_ASSERT_EQUAL(small.size(), otaImageCheck.position);
+    TEST_ASSERT_EQUAL(OTA_IMAGE_TRAILING_DATA, checkSplit(longer, at));
+  }
+}
+
+void test_image_that_fills_partition_fits() {
+  TEST_ASSERT_EQUAL(OTA_IMAGE_OK, checkImage(image, image.size(), image.size()));
+  TEST_ASSERT_EQUAL(OTA_IMAGE_TOO_LARGE, checkImage(image, image.size(), image.size() - 1));
+}
+
+void test_rejects_bad_magic() {
+  image[0] = 0xE8;
+  TEST_ASSERT_EQUAL(OTA_IMAGE_BAD_MAGIC, checkImage(image, image.size()));
+}
+
+void test_rejects_bad_segment_count() {
+  image[1] = 0;
+  TEST_ASSERT_EQUAL(OTA_IMAGE_BAD_SEGMENT_COUNT, checkImage(image, image.size()));
+  image[1] = ESP_IMAGE_SEGMENTS_MAX + 1;
+  TEST_ASSERT_EQUAL(OTA_IMAGE_BAD_SEGMENT_COUNT, checkImage(image, image.size()));
+}
+
+void test_rejects_other_chip() {
+  // ESP32 (chip ID 0)
+  image[12] = 0;
+  image[13] = 0;
+  TEST_ASSERT_EQUAL(OTA_IMAGE_WRONG_CHIP, checkImage(image, image.size()));
+}
+
+void test_rejects_newer_chip_revision() {
+  image[14] = ESP.getChipRevision() + 1;
+  TEST_ASSERT_EQUAL(OTA_IMAGE_CHIP_REVISION, checkImage(image, image.size()));
+}
+
+void test_rejects_image_without_app_description() {
+  // A bootloader's first segment starts with code, not the app description
+  putLE32(image.data() + ESP_IMAGE_HEADER_SIZE + ESP_SEGMENT_HEADER_SIZE, 0);
+  TEST_ASSERT_EQUAL(OTA_IMAGE_NOT_APP, checkImage(image, image.size()));
+}
+
+void test_header_errors_need_only_the_prefix() {
+  image[12] = 0;
+  image[13] = 0;
+  otaImageCheckBegin(FAKE_PARTITION_SIZE);
+  TEST_ASSERT_TRUE(otaImageCheckWrite(image.data(), OTA_IMAGE_CHECK_PREFIX - 1));
+  TEST_ASSERT_FALSE(otaImageCheckWrite(image.data() + OTA_IMAGE_CHECK_PREFIX - 1, 1));
+  TEST_ASSERT_EQUAL(OTA_IMAGE_WRONG_CHIP, otaImageCheck.error);
+}
+
+void test_rejects_unaligned_segment() {
+  putLE32(image.data() + SECOND_SEGMENT + 4, 1022);
+  TEST_ASSERT_EQUAL(OTA_IMAGE_BAD_SEGMENT, checkImage(image, 5));
+}
+
+void test_rejects_segment_past_partition() {
+  putLE32(image.data() + SECOND_SEGMENT + 4, FAKE_PARTITION_SIZE);
+  TEST_ASSERT_EQUAL(OTA_IMAGE_TOO_LARGE, checkImage(image, image.size()));
+}
+
+void test_rejects_trailing_data() {
+  // E.g. a merged factory image cut after the app, or two files joined
+  image.push_back(0);
+  otaImageCheckBegin(FAKE_PARTITION_SIZE);
+  TEST_ASSERT_TRUE(otaImageCheckWrite(image.data(), image.size() - 1));
+  TEST_ASSERT_FALSE(otaImageCheckWrite(image.data() + image.size() - 1, 1));
+  TEST_ASSERT_EQUAL(OTA_IMAGE_TRAILING_DATA, otaImageCheck.error);
+}
+
+void test_reports_truncated_image() {
+  image.resize(image.size() - 1);
+  TEST_ASSERT_EQUAL(OTA_IMAGE_TRUNCATED, checkImage(image, 1436));
+
+  // Cut inside the segment table, before the length is known
+  image.resize(SECOND_SEGMENT + 3);
+  TEST_ASSERT_EQUAL(OTA_IMAGE_TRUNCATED, checkImage(image, image.size()));
+}
+
+void test_disabled_check_passes_anything() {
+  image[0] = 0;
+  otaImageCheckBegin(FAKE_PARTITION_SIZE);
+  otaImageCheckDisable();
+  TEST_ASSERT_TRUE(otaImageCheckWrite(image.data(), image.size()));
+  TEST_ASSERT_TRUE(otaImageCheckEnd());
+}
+
+void test_upload_refused_before_erasing() {
+  image[12] = 0;
+  image[13] = 0;
+  FakeConnection c(server, HTTP_PUT, "/ota/firmware");
+  c.header("Content-Type", "application/octet-stream");
+  c.header("Content-Length", String((unsigned long)image.size()));
+  c.open();
+  c.receiveAll(image.data(), image.size());
+  TEST_ASSERT_EQUAL(400, c.responseCode());
+  TEST_ASSERT_EQUAL_STRING(otaImageErrorString(OTA_IMAGE_WRONG_CHIP), c.responseBody().c_str());
+  c.close();
+  TEST_ASSERT_EQUAL(0, fakeFlashErases);
+  TEST_ASSERT_EQUAL(0, fakeBootSlot);
+}
+
+void test_erase_ahead_stops_at_checked_image_end() {
+  // One segment, so the length is known from the first bytes
+  image = fakeAppImage(6, 12 * 1024, 1);
+  size_t imageSectors = (image.size() + OTA_SECTOR_SIZE - 1) / OTA_SECTOR_SIZE;
+  TEST_ASSERT_TRUE(imageSectors * OTA_SECTOR_SIZE < OTA_SECTOR_SIZE + OTA_WRITER_RING_SIZE);
+  fakeOTASlots[1].data[imageSectors * OTA_SECTOR_SIZE] = 0;
+
+  // Size unknown to the writer, as for a chunked upload
+  TEST_ASSERT_TRUE(otaWriterBegin(OTA_WRITER_UPLOAD, 0));
+  otaImageCheckBegin(FAKE_PARTITION_SIZE);
+  TEST_ASSERT_TRUE(otaCheckedWriterSink(image.data(), 100));
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  TEST_ASSERT_EQUAL(imageSectors, otaWriterStats.sectorsPreErased);
+
+  TEST_ASSERT_TRUE(otaCheckedWriterSink(image.data() + 100, image.size() - 100));
+  TEST_ASSERT_TRUE(otaImageCheckEnd());
+  TEST_ASSERT_TRUE(otaWriterEnd());
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), fakeOTASlots[1].data.data(), image.size());
+  TEST_ASSERT_EQUAL(imageSectors, fakeFlashErases);
+  TEST_ASSERT_EQUAL(0, fakeOTASlots[1].data[imageSectors * OTA_SECTOR_SIZE]);
+}
+
+void test_header_error_costs_no_erase() {
+  image[0] = 0;
+  TEST_ASSERT_TRUE(otaWriterBegin(OTA_WRITER_UPLOAD, image.size()));
+  otaImageCheckBegin(FAKE_PARTITION_SIZE);
+  // The idle writer waits for data instead of erasing ahead
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  TEST_ASSERT_FALSE(otaCheckedWriterSink(image.data(), 100));
+  TEST_ASSERT_EQUAL(OTA_IMAGE_BAD_MAGIC, otaImageCheck.error);
+  otaWriterAbort();
+  TEST_ASSERT_EQUAL(0, fakeFlashErases);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_accepts_valid_images);
+  RUN_TEST(test_every_split_point);
+  RUN_TEST(test_image_that_fills_partition_fits);
+  RUN_TEST(test_rejects_bad_magic);
+  RUN_TEST(test_rejects_bad_segment_count);
+  RUN_TEST(test_rejects_other_chip);
+  RUN_TEST(test_rejects_newer_chip_revision);
+  RUN_TEST(test_rejects_image_without_app_description);
+  RUN_TEST(test_header_errors_need_only_the_prefix);
+  RUN_TEST(test_rejects_unaligned_segment);
+  RUN_TEST(test_rejects_segment_past_partition);
+  RUN_TEST(test_rejects_trailing_data);
+  RUN_TEST(test_reports_truncated_image);
+  RUN_TEST(test_disabled_check_passes_anything);
+  RUN_TEST(test_upload_refused_before_erasing);
+  RUN_TEST(test_erase_ahead_stops_at_checked_image_end);
+  RUN_TEST(test_header_error_costs_no_erase);
+  return UNITY_END();
+}
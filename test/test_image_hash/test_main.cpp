@@ -0,0 +1,150 @@
+/*
+  -----------------------
+  Image Hash Tests
+  -----------------------
+
+  The streaming SHA-256 of OTAImageHash.h against one-shot digests at
+  every split, the hex parser, and the X-Image-SHA256 check of a raw
+  upload.
+
+  test_benchmark prints the hashing cost per MB and what the check costs
+  after the last byte, streamed and as a read-back pass over the
+  partition. The host runs the software SHA-256; on the device the same
+  numbers come from printOTAWriterStats() with the SHA peripheral.
+*/
+#include <Arduino.h>
+#include <unity.h>
+#include <chrono>
+#include "OTA.h"
+#include "FakeImage.h"
+
+void setUp() {
+  fakeFlashReset();
+  fakeNVS.clear();
+  registerWebRoutes();
+}
+
+void tearDown() {
+  otaWriterAbort();
+  fakeUseWallClock(false);
+}
+
+std::vector<uint8_t> digestOf(const std::vector<uint8_t> &data) {
+  std::vector<uint8_t> digest(OTA_SHA256_SIZE);
+  mbedtls_sha256_ret(data.data(), data.size(), digest.data(), 0);
+  return digest;
+}
+
+void test_streaming_matches_one_shot() {
+  std::vector<uint8_t> data = fakeAppImage(3, 10 * 1024, 2);
+  std::vector<uint8_t> expected = digestOf(data);
+  for (size_t split : { (size_t)1, (size_t)63, (size_t)64, (size_t)65, (size_t)OTA_SECTOR_SIZE }) {
+    OTAImageHash hash;
+    otaHashBegin(hash);
+    for (size_t at = 0; at < data.size(); at += split) {
+      otaHashUpdate(hash, data.data() + at, min(split, data.size() - at));
+    }
+    otaHashFinish(hash);
+    TEST_ASSERT_EQUAL(data.size(), hash.bytes);
+    TEST_ASSERT_EQUAL_MEMORY(expected.data(), hash.digest, OTA_SHA256_SIZE);
+    TEST_ASSERT_FALSE(hash.isActive);
+  }
+}
+
+void test_parse_hex() {
+  std::vector<uint8_t> digest = digestOf({ 'a', 'b', 'c' });
+  String hex = fakeHex(digest.data(), digest.size());
+  uint8_t parsed[OTA_SHA256_SIZE];
+  TEST_ASSERT_TRUE(parseSHA256Hex(hex, parsed));
+  TEST_ASSERT_EQUAL_MEMORY(digest.data(), parsed, OTA_SHA256_SIZE);
+  String upper = hex;
+  upper.toUpperCase();
+  TEST_ASSERT_TRUE(parseSHA256Hex(upper, parsed));
+  TEST_ASSERT_EQUAL_MEMORY(digest.data(), parsed, OTA_SHA256_SIZE);
+
+  TEST_ASSERT_FALSE(parseSHA256Hex(hex.substring(2), parsed));
+  TEST_ASSERT_FALSE(parseSHA256Hex(hex + "00", parsed));
+  TEST_ASSERT_FALSE(parseSHA256Hex(hex.substring(0, 10) + "g" + hex.substring(11), parsed));
+}
+
+/**
+ * PUT image to /ota/firmware with sha256 as X-Image-SHA256
+ */
+int uploadWithDigest(const std::vector<uint8_t> &image, const String &sha256) {
+  FakeConnection c(server, HTTP_PUT, "/ota/firmware");
+  c.header("Content-Type", "application/octet-stream");
+  c.header("Content-Length", String((unsigned long)image.size()));
+  c.header(OTA_SHA256_HEADER, sha256);
+  c.open();
+  c.receiveAll(image.data(), image.size());
+  int code = c.responseCode();
+  c.close();
+  return code;
+}
+
+void test_upload_digest_is_checked_without_read_back() {
+  std::vector<uint8_t> image = fakeAppImage(4, 40 * 1024, 2);
+  TEST_ASSERT_EQUAL(200, uploadWithDigest(image, fakeSHA256Hex(image)));
+  TEST_ASSERT_EQUAL(1, fakeBootSlot);
+  // The writer hashed exactly what it wrote, once
+  TEST_ASSERT_EQUAL(image.size(), otaWriterHash.bytes);
+  TEST_ASSERT_EQUAL_MEMORY(digestOf(image).data(), otaWriterDigest(), OTA_SHA256_SIZE);
+}
+
+void test_upload_digest_mismatch_is_refused() {
+  std::vector<uint8_t> image = fakeAppImage(5, 40 * 1024, 2);
+  std::vector<uint8_t> other = fakeAppImage(6, 40 * 1024, 2);
+  TEST_ASSERT_EQUAL(400, uploadWithDigest(image, fakeSHA256Hex(other)));
+  TEST_ASSERT_EQUAL(0, fakeBootSlot);
+}
+
+void test_benchmark() {
+  fakeUseWallClock(true);
+  std::vector<uint8_t> data = fakeAppImage(7, 384 * 1024, 2);
+  std::copy(data.begin(), data.end(), fakeOTASlots[1].data.begin());
+  double mb = data.size() / 1048576.0;
+
+  // Streamed: one update per sector as the writer does it
+  OTAImageHash hash;
+  otaHashBegin(hash);
+  size_t last = (data.size() - 1) / OTA_SECTOR_SIZE * OTA_SECTOR_SIZE;
+  for (size_t at = 0; at < last; at += OTA_SECTOR_SIZE) {
+    otaHashUpdate(hash, data.data() + at, OTA_SECTOR_SIZE);
+  }
+  uint32_t beforeLast = hash.micros;
+  otaHashUpdate(hash, data.data() + last, data.size() - last);
+  otaHashFinish(hash);
+  uint32_t afterLastByte = hash.micros - beforeLast;
+  TEST_ASSERT_EQUAL_MEMORY(digestOf(data).data(), hash.digest, OTA_SHA256_SIZE);
+
+  // Read-back: the whole partition is read and hashed after the last byte
+  auto t0 = std::chrono::steady_clock::now();
+  const esp_partition_t *partition = &fakeOTASlots[1].partition;
+  uint8_t sector[OTA_SECTOR_SIZE];
+  OTAImageHash readBack;
+  otaHashBegin(readBack);
+  for (size_t at = 0; at < data.size(); at += OTA_SECTOR_SIZE) {
+    size_t n = min(OTA_SECTOR_SIZE, data.size() - at);
+    esp_partition_read(partition, at, sector, n);
+    otaHashUpdate(readBack, sector, n);
+  }
+  otaHashFinish(readBack);
+  double readBackMicros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+  TEST_ASSERT_EQUAL_MEMORY(hash.digest, readBack.digest, OTA_SHA256_SIZE);
+
+  Serial.printf("OTA: SHA-256 (software) %.1f ms/MB over %u bytes\n", hash.micros / 1000.0 / mb,
+                (unsigned)data.size());
+  Serial.printf("OTA: after the last byte: streamed %.2f ms, read-back pass %.1f ms\n",
+                afterLastByte / 1000.0, readBackMicros / 1000.0);
+  TEST_ASSERT_TRUE(afterLastByte < readBackMicros / 10);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_streaming_matches_one_shot);
+  RUN_TEST(test_parse_hex);
+  RUN_TEST(test_upload_digest_is_checked_without_read_back);
+  RUN_TEST(test_upload_digest_mismatch_is_refused);
+  RUN_TEST(test_benchmark);
+  return UNITY_END();
+}
@@ -0,0 +1,393 @@
+/*
+  -----------------------
+  Multicast Receiver Tests
+  -----------------------
+
+  Plays the sender of tools/ota_multicast.py against the receiver in
+  OTAMulticast.h: announce, every source symbol of every group with
+  seeded random loss, then rounds of ROUND_END and the fresh repair
+  symbols the NACKs ask for, until nothing is missing. The partition must
+  then hold the image byte for byte.
+
+  The flash task runs as a thread; the sender waits for it to write each
+  source (waitForFlash()) so that buffers only run out where a test
+  fills the repair pool on purpose.
+*/
+#define OTA_MULTICAST_GROUP "239.255.0.1"
+
+#include <Arduino.h>
+#include <unity.h>
+#include <chrono>
+#include "OTA.h"
+#include "FakeImage.h"
+
+const uint16_t SYMBOL_SIZE = 1024;
+const uint8_t GROUP_SYMBOLS = 16;
+const size_t GROUP_BYTES = SYMBOL_SIZE * GROUP_SYMBOLS;
+
+std::vector<uint8_t> image;
+uint32_t session = 0x5E550000;
+std::vector<int> nextIndex;  // Next repair index per group
+int roundNumber;
+uint32_t seed;
+
+uint8_t nextRandom() {
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+void setUp() {
+  fakeFlashReset();
+  fakeNVS.clear();
+  isRebootScheduled = false;
+  otaMulticastResult = MCAST_RESULT_NONE;
+  handleOTAMulticast(true);
+  otaMulticastUdp.sent.clear();
+  session++;
+  roundNumber = 0;
+  seed = 1;
+}
+
+void tearDown() {}
+
+uint16_t groupCount() {
+  return (image.size() + GROUP_BYTES - 1) / GROUP_BYTES;
+}
+
+uint8_t groupK(uint16_t group) {
+  size_t left = min(GROUP_BYTES, image.size() - group * GROUP_BYTES);
+  return (left + SYMBOL_SIZE - 1) / SYMBOL_SIZE;
+}
+
+std::vector<uint8_t> sourceSymbol(uint16_t group, uint8_t index) {
+  std::vector<uint8_t> symbol(SYMBOL_SIZE, 0);
+  size_t offset = group * GROUP_BYTES + index * SYMBOL_SIZE;
+  memcpy(symbol.data(), image.data() + offset, min((size_t)SYMBOL_SIZE, image.size() - offset));
+  return symbol;
+}
+
+void deliver(uint8_t type, uint16_t group, uint8_t index, uint8_t k, const std::vector<uint8_t> &payload) {
+  OTAMulticastHeader h = {OTA_MULTICAST_MAGIC, type, GROUP_SYMBOLS, SYMBOL_SIZE, session,
+                          (uint32_t)image.size(), group, index, k};
+  std::vector<uint8_t> packet((uint8_t *)&h, (uint8_t *)&h + sizeof(h));
+  packet.insert(packet.end(), payload.begin(), payload.end());
+  otaMulticastUdp.fakeDeliver(packet.data(), packet.size());
+}
+
+void announce(bool isHashCorrupt = false) {
+  OTAImageHash hash;
+  otaHashBegin(hash);
+  otaHashUpdate(hash, image.data(), image.size());
+  otaHashFinish(hash);
+  std::vector<uint8_t> payload(hash.digest, hash.digest + OTA_SHA256_SIZE);
+  if (isHashCorrupt) {
+    payload[0] ^= 1;
+  }
+  nextIndex.clear();
+  for (uint16_t g = 0; g < groupCount(); g++) {
+    nextIndex.push_back(groupK(g));
+  }
+  deliver(MCAST_ANNOUNCE, 0, 0, 0, payload);
+}
+
+/**
+ * Wait until the flash task has written every queued source and decoded
+ * every group with k symbols
+ */
+void waitForFlash() {
+  for (int i = 0; i < 5000; i++) {
+    bool isBusy = false;
+    xSemaphoreTake(otaMulticastLock, portMAX_DELAY);
+    if (otaMulticast.isActive) {
+      for (uint8_t b = 0; b < otaMulticast.bufferCount; b++) {
+        isBusy = isBusy || otaMulticastBuffers[b].state == MCAST_BUFFER_SOURCE;
+      }
+      for (uint16_t g = 0; g < otaMulticast.groupCount; g++) {
+        isBusy = isBusy || (otaMulticast.groupHave[g] == groupK(g) && otaMulticast.groupWritten[g] < groupK(g));
+      }
+    }
+    xSemaphoreGive(otaMulticastLock);
+    if (!isBusy) {
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+void sendSource(uint16_t group, uint8_t index) {
+  deliver(MCAST_SYMBOL, group, index, groupK(group), sourceSymbol(group, index));
+  waitForFlash();
+}
+
+void sendRepair(uint16_t group) {
+  uint8_t x = nextIndex[group]++;
+  std::vector<uint8_t> repair(SYMBOL_SIZE, 0);
+  for (uint8_t i = 0; i < groupK(group); i++) {
+    fecMulAdd(repair.data(), sourceSymbol(group, i).data(), fecCoefficient(x, i), SYMBOL_SIZE);
+  }
+  deliver(MCAST_SYMBOL, group, x, groupK(group), repair);
+}
+
+/**
+ * End a round; returns the (group, missing) entries of the device's NACK
+ * in the order it sent them
+ */
+std::vector<std::pair<uint16_t, uint8_t>> endRound(bool isRepeat = false) {
+  otaMulticastUdp.sent.clear();
+  if (!isRepeat) {
+    roundNumber++;
+  }
+  deliver(MCAST_ROUND_END, roundNumber, 0, 0, {});
+  std::vector<std::pair<uint16_t, uint8_t>> entries;
+  for (const auto &packet : otaMulticastUdp.sent) {
+    const OTAMulticastHeader *h = (const OTAMulticastHeader *)packet.data();
+    if (h->type != MCAST_NACK || h->session != session) {
+      continue;
+    }
+    for (size_t at = sizeof(OTAMulticastHeader); at + 3 <= packet.size(); at += 3) {
+      entries.push_back({ (uint16_t)(packet[at] | packet[at + 1] << 8), packet[at + 2] });
+    }
+  }
+  return entries;
+}
+
+/**
+ * Send the whole image, losing lossPercent of the symbols, then repair
+ * rounds until the device asks for nothing; returns the rounds needed
+ */
+int sendImage(int lossPercent) {
+  announce();
+  for (uint16_t g = 0; g < groupCount(); g++) {
+    for (uint8_t i = 0; i < groupK(g); i++) {
+      if (nextRandom() % 100 >= lossPercent) {
+        sendSource(g, i);
+      }
+    }
+  }
+  for (int rounds = 1; rounds < 50; rounds++) {
+    auto nack = endRound();
+    if (nack.empty()) {
+      return rounds;
+    }
+    for (auto &entry : nack) {
+      for (uint8_t n = 0; n < entry.second; n++) {
+        if (nextRandom() % 100 >= lossPercent) {
+          sendRepair(entry.first);
+        }
+      }
+      waitForFlash();
+    }
+  }
+  return -1;
+}
+
+/**
+ * Wait for the flash task to verify and commit, and report the outcome
+ * from the loop as the device does; returns the result
+ */
+OTAMulticastResult finishSession() {
+  for (int i = 0; i < 5000 && otaMulticastResult == MCAST_RESULT_NONE; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  OTAMulticastResult result = otaMulticastResult;
+  handleOTAMulticast(true);
+  return result;
+}
+
+void assertInstalled() {
+  TEST_ASSERT_EQUAL(MCAST_RESULT_DONE, finishSession());
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), fakeOTASlots[1].data.data(), image.size());
+  TEST_ASSERT_EQUAL(1, fakeBootSlot);
+  TEST_ASSERT_TRUE(isRebootScheduled);
+}
+
+void test_image_received_without_loss() {
+  image = fakeAppImage(1, 40 * 1024, 2);
+  TEST_ASSERT_EQUAL(1, sendImage(0));
+  assertInstalled();
+  TEST_ASSERT_EQUAL(0, otaMulticast.repairsUsed);
+  TEST_ASSERT_EQUAL(0, otaMulticast.nacksSent);
+  TEST_ASSERT_EQUAL(0, otaMulticast.dropped);
+}
+
+void test_lost_symbols_are_rebuilt() {
+  image = fakeAppImage(2, 40 * 1024, 2);
+  for (uint32_t s : { 1, 7, 42 }) {
+    fakeFlashReset();
+    isRebootScheduled = false;
+    session++;
+    roundNumber = 0;
+    seed = s;
+    TEST_ASSERT_TRUE(sendImage(20) > 1);
+    assertInstalled();
+    TEST_ASSERT_TRUE(otaMulticast.repairsUsed > 0);
+    TEST_ASSERT_EQUAL(0, otaMulticast.dropped);
+  }
+}
+
+void test_nack_names_missing_symbols_per_group() {
+  image = fakeAppImage(3, 40 * 1024, 2);
+  announce();
+  for (uint16_t g = 0; g < groupCount(); g++) {
+    for (uint8_t i = 0; i < groupK(g); i++) {
+      // Group 0 loses three sources, group 2 two and gets one repair
+      if (!(g == 0 && i < 3) && !(g == 2 && (i == 5 || i == 9))) {
+        sendSource(g, i);
+      }
+    }
+  }
+  sendRepair(2);
+
+  // Groups already holding repair symbols first
+  auto nack = endRound();
+  TEST_ASSERT_EQUAL(2, nack.size());
+  TEST_ASSERT_EQUAL(2, nack[0].first);
+  TEST_ASSERT_EQUAL(1, nack[0].second);
+  TEST_ASSERT_EQUAL(0, nack[1].first);
+  TEST_ASSERT_EQUAL(3, nack[1].second);
+
+  // A repeated ROUND_END is answered once
+  TEST_ASSERT_EQUAL(0, endRound(true).size());
+
+  sendRepair(2);
+  sendRepair(0);
+  waitForFlash();
+  nack = endRound();
+  TEST_ASSERT_EQUAL(1, nack.size());
+  TEST_ASSERT_EQUAL(0, nack[0].first);
+  TEST_ASSERT_EQUAL(2, nack[0].second);
+
+  sendRepair(0);
+  sendRepair(0);
+  waitForFlash();
+  TEST_ASSERT_EQUAL(0, endRound().size());
+  assertInstalled();
+  TEST_ASSERT_EQUAL(2 + 3, otaMulticast.repairsUsed);
+}
+
+void test_nack_asks_for_what_the_pool_holds() {
+  // 8 groups of 16 symbols; 16 + 32 buffers
+  image = fakeAppImage(4, 63 * 1024, 2);
+  TEST_ASSERT_EQUAL(8, groupCount());
+  announce();
+  TEST_ASSERT_EQUAL(48, otaMulticast.bufferCount);
+  for (uint16_t g = 0; g < groupCount(); g++) {
+    for (uint8_t i = 10; i < groupK(g); i++) {
+      sendSource(g, i);
+    }
+  }
+
+  // 10 missing per group: four groups fit in 48 buffers
+  auto nack = endRound();
+  TEST_ASSERT_EQUAL(4, nack.size());
+  for (uint16_t g = 0; g < 4; g++) {
+    TEST_ASSERT_EQUAL(g, nack[g].first);
+    TEST_ASSERT_EQUAL(10, nack[g].second);
+    TEST_ASSERT_TRUE(isOTAMulticastBitSet(otaMulticast.groupAsked, g));
+  }
+  TEST_ASSERT_FALSE(isOTAMulticastBitSet(otaMulticast.groupAsked, 4));
+
+  // Another device's NACK brings repair symbols of groups not asked for:
+  // 36 buffers for groups 4-7, then 12 for groups 0 and 1 fill the pool
+  for (uint16_t g = 4; g < 8; g++) {
+    for (int n = 0; n < 9; n++) {
+      sendRepair(g);
+    }
+  }
+  for (uint16_t g = 0; g < 2; g++) {
+    for (int n = 0; n < 6; n++) {
+      sendRepair(g);
+    }
+  }
+  TEST_ASSERT_EQUAL(0, otaMulticast.evicted);
+
+  // An asked group takes a buffer from one that wasn't
+  sendRepair(2);
+  TEST_ASSERT_EQUAL(1, otaMulticast.evicted);
+  TEST_ASSERT_EQUAL(0, otaMulticast.dropped);
+  TEST_ASSERT_EQUAL(2, otaMulticastGroupMissing(4));
+
+  // A repair symbol doesn't displace one of a group closer to done
+  sendRepair(4);
+  TEST_ASSERT_EQUAL(1, otaMulticast.evicted);
+  TEST_ASSERT_EQUAL(1, otaMulticast.dropped);
+
+  // The NACK counts given up symbols as missing again; it asks for the
+  // groups holding some first, as far as the pool goes
+  nack = endRound();
+  uint16_t asked[] = { 0, 1, 2, 4 };
+  uint8_t missing[] = { 4, 4, 9, 2 };
+  TEST_ASSERT_EQUAL(4, nack.size());
+  for (int i = 0; i < 4; i++) {
+    TEST_ASSERT_EQUAL(asked[i], nack[i].first);
+    TEST_ASSERT_EQUAL(missing[i], nack[i].second);
+  }
+
+  for (int rounds = 0; rounds < 20 && !nack.empty(); rounds++) {
+    for (auto &entry : nack) {
+      for (uint8_t n = 0; n < entry.second; n++) {
+        sendRepair(entry.first);
+      }
+      waitForFlash();
+    }
+    nack = endRound();
+  }
+  TEST_ASSERT_EQUAL(0, nack.size());
+  assertInstalled();
+}
+
+void test_decode_without_enough_repair_symbols_is_refused() {
+  image = fakeAppImage(6, 40 * 1024, 2);
+  announce();
+  for (uint8_t i = 2; i < groupK(0); i++) {
+    sendSource(0, i);
+  }
+  sendRepair(0);
+
+  // Two sources missing and one repair symbol held: nothing to solve with
+  TEST_ASSERT_FALSE(decodeOTAMulticastGroup(0));
+  TEST_ASSERT_EQUAL_STRING("Repair symbols lost", otaMulticast.error.c_str());
+  TEST_ASSERT_TRUE(isOTAMulticastRepairHeld(0, groupK(0)));
+  TEST_ASSERT_EQUAL(0, otaMulticast.repairsUsed);
+  otaMulticast.error = "";
+
+  // The session goes on once the group has k symbols
+  for (uint16_t g = 1; g < groupCount(); g++) {
+    for (uint8_t i = 0; i < groupK(g); i++) {
+      sendSource(g, i);
+    }
+  }
+  auto nack = endRound();
+  TEST_ASSERT_EQUAL(1, nack.size());
+  TEST_ASSERT_EQUAL(1, nack[0].second);
+  sendRepair(0);
+  waitForFlash();
+  TEST_ASSERT_EQUAL(0, endRound().size());
+  assertInstalled();
+  TEST_ASSERT_EQUAL(2, otaMulticast.repairsUsed);
+}
+
+void test_hash_mismatch_is_not_booted() {
+  image = fakeAppImage(5, 40 * 1024, 2);
+  announce(true);
+  for (uint16_t g = 0; g < groupCount(); g++) {
+    for (uint8_t i = 0; i < groupK(g); i++) {
+      sendSource(g, i);
+    }
+  }
+  TEST_ASSERT_EQUAL(MCAST_RESULT_FAILED, finishSession());
+  TEST_ASSERT_EQUAL_STRING("SHA-256 mismatch", otaMulticast.error.c_str());
+  TEST_ASSERT_EQUAL(0, fakeBootSlot);
+  TEST_ASSERT_FALSE(isRebootScheduled);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_image_received_without_loss);
+  RUN_TEST(test_lost_symbols_are_rebuilt);
+  RUN_TEST(test_nack_names_missing_symbols_per_group);
+  RUN_TEST(test_nack_asks_for_what_the_pool_holds);
+  RUN_TEST(test_decode_without_enough_repair_symbols_is_refused);
+  RUN_TEST(test_hash_mismatch_is_not_booted);
+  return UNITY_END();
+}
@@ -0,0 +1,385 @@
+/*
+  -----------------------
+  Multipart Scanner Tests
+  -----------------------
+
+  Checks MultipartScanner.h against a byte-at-a-time reference parser on
+  bodies cut into TCP-sized segments, with the delimiter and look-alikes
+  of it split across segment edges, then uploads through /ota/upload to
+  cover the hand-over from the library's parser to the scanner
+  (len < OTA_MULTIPART_ITEM_BUFFER).
+
+  test_benchmark prints the scan rate of both parsers for 536-1460 byte
+  segments; it only fails if the results differ.
+*/
+#include <Arduino.h>
+#include <unity.h>
+#include <chrono>
+#include "OTA.h"
+#include "FakeImage.h"
+
+const char *BOUNDARY = "----WebKitFormBoundary7MA4YWxkTrZu0gW";
+
+// The delimiter as it appears in a body
+std::string delimiter() {
+  return std::string("\r\n--") + BOUNDARY;
+}
+
+void setUp() {
+  fakeFlashReset();
+  fakeNVS.clear();
+  registerWebRoutes();
+}
+
+void tearDown() {
+  otaWriterAbort();
+}
+
+/**
+ * Content with delimiter look-alikes: every prefix of the delimiter, and
+ * the delimiter with its last byte changed
+ */
+std::vector<uint8_t> trickyContent(size_t size, uint32_t seed) {
+  std::vector<uint8_t> data(size);
+  uint32_t x = seed * 2654435761u + 1;
+  for (uint8_t &b : data) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    b = (uint8_t)x;
+  }
+  std::string d = delimiter();
+  size_t at = 64;
+  for (size_t n = 1; n < d.size() && at + d.size() + 1 < size; n++, at += 97) {
+    memcpy(data.data() + at, d.data(), n);
+  }
+  if (at + d.size() < size) {
+    memcpy(data.data() + at, d.data(), d.size());
+    data[at + d.size() - 1] ^= 1;
+  }
+  return data;
+}
+
+/**
+ * content followed by the closing delimiter and epilogue
+ */
+std::vector<uint8_t> partBody(const std::vector<uint8_t> &content) {
+  std::vector<uint8_t> body(content);
+  std::string end = delimiter() + "--\r\n";
+  body.insert(body.end(), end.begin(), end.end());
+  return body;
+}
+
+/**
+ * Reference: the per-byte matching of the library's parser
+ */
+size_t byteScan(const std::vector<uint8_t> &body, std::vector<uint8_t> &out) {
+  std::string d = delimiter();
+  size_t matched = 0;
+  for (size_t i = 0; i < body.size(); i++) {
+    uint8_t b = body[i];
+    if (b == (uint8_t)d[matched]) {
+      if (++matched == d.size()) {
+        return i + 1;
+      }
+      continue;
+    }
+    out.insert(out.end(), d.begin(), d.begin() + matched);
+    matched = b == (uint8_t)d[0] ? 1 : 0;
+    if (matched == 0) {
+      out.push_back(b);
+    }
+  }
+  return 0;
+}
+
+// Payload slices that pointed neither into the segment nor the delimiter
+int copiedSlices = 0;
+
+/**
+ * Scan body delivered in the given segment sizes (cycled); returns the
+ * bytes consumed up to and including the delimiter, 0 if none was found
+ */
+size_t blockScan(const std::vector<uint8_t> &body, const std::vector<size_t> &segments,
+                 std::vector<uint8_t> &out) {
+  MultipartScanner s;
+  if (!multipartScanBegin(s, BOUNDARY)) {
+    return 0;
+  }
+  size_t consumed = 0;
+  size_t at = 0;
+  for (size_t i = 0; at < body.size() && s.state == MULTIPART_DATA; i++) {
+    const uint8_t *data = body.data() + at;
+    size_t len = min(segments[i % segments.size()], body.size() - at);
+    at += len;
+    while (len > 0 && s.state == MULTIPART_DATA) {
+      const uint8_t *payload;
+      size_t payloadLen;
+      size_t used = multipartScan(s, data, len, payload, payloadLen);
+      if (payloadLen > 0) {
+        // Zero copy: slices point into the segment or the delimiter
+        bool inSegment = payload >= data && payload + payloadLen <= data + len;
+        bool inDelimiter = payload >= s.delimiter && payload + payloadLen <= s.delimiter + s.length;
+        if (!inSegment && !inDelimiter) {
+          copiedSlices++;
+        }
+        out.insert(out.end(), payload, payload + payloadLen);
+      }
+      data += used;
+      len -= used;
+      consumed += used;
+    }
+  }
+  return s.state == MULTIPART_DELIMITER ? consumed : 0;
+}
+
+void assertScansLike(const std::vector<uint8_t> &body, const std::vector<size_t> &segments) {
+  std::vector<uint8_t> expected, actual;
+  size_t expectedEnd = byteScan(body, expected);
+  size_t actualEnd = blockScan(body, segments, actual);
+  TEST_ASSERT_EQUAL(expectedEnd, actualEnd);
+  TEST_ASSERT_EQUAL(0, copiedSlices);
+  TEST_ASSERT_EQUAL(expected.size(), actual.size());
+  TEST_ASSERT_EQUAL_MEMORY(expected.data(), actual.data(), expected.size());
+}
+
+void test_rejects_bad_boundary() {
+  MultipartScanner s;
+  TEST_ASSERT_FALSE(multipartScanBegin(s, ""));
+  std::string longest(MULTIPART_BOUNDARY_MAX, 'x');
+  TEST_ASSERT_TRUE(multipartScanBegin(s, longest.c_str()));
+  TEST_ASSERT_FALSE(multipartScanBegin(s, (longest + "x").c_str()));
+}
+
+void test_matches_reference_for_segment_sizes() {
+  std::vector<uint8_t> content = trickyContent(20000, 1);
+  std::vector<uint8_t> body = partBody(content);
+  for (size_t segment : { (size_t)1, (size_t)2, (size_t)3, (size_t)536, (size_t)1072, (size_t)1436,
+                          (size_t)1460, (size_t)2920, body.size() }) {
+    assertScansLike(body, { segment });
+  }
+  assertScansLike(body, { 536, 1460, 7, 1436, 1 });
+
+  std::vector<uint8_t> actual;
+  TEST_ASSERT_EQUAL(content.size() + delimiter().size(), blockScan(body, { 1436 }, actual));
+  TEST_ASSERT_EQUAL_MEMORY(content.data(), actual.data(), content.size());
+}
+
+void test_delimiter_split_at_every_offset() {
+  std::vector<uint8_t> content = trickyContent(3000, 2);
+  std::vector<uint8_t> body = partBody(content);
+  size_t d = delimiter().size();
+  for (size_t cut = content.size() - 1; cut <= content.size() + d; cut++) {
+    assertScansLike(body, { cut, body.size() });
+  }
+}
+
+void test_lookalike_split_at_every_offset() {
+  std::vector<uint8_t> content = trickyContent(3000, 3);
+  std::vector<uint8_t> body = partBody(content);
+  // Cut through each look-alike in turn
+  for (size_t cut = 60; cut < 64 + 97 * delimiter().size(); cut++) {
+    assertScansLike(body, { cut, 1436 });
+  }
+}
+
+void test_crlf_at_segment_edge() {
+  // Content ending a segment with CR, the next starting with LF and data
+  std::vector<uint8_t> content = trickyContent(2000, 4);
+  content[999] = '\r';
+  content[1000] = '\n';
+  content[1001] = '-';
+  std::vector<uint8_t> body = partBody(content);
+  for (size_t cut : { (size_t)999, (size_t)1000, (size_t)1001, (size_t)1002 }) {
+    assertScansLike(body, { cut, 1436 });
+  }
+
+  // A CR held back, then the real delimiter right behind another CR
+  std::vector<uint8_t> crs(500, 'a');
+  crs[499] = '\r';
+  std::vector<uint8_t> twice = partBody(crs);
+  assertScansLike(twice, { 500, 1 });
+  assertScansLike(twice, { 499, 2, 1436 });
+}
+
+void test_no_delimiter_keeps_scanning() {
+  std::vector<uint8_t> content = trickyContent(5000, 5);
+  std::vector<uint8_t> expected, actual;
+  TEST_ASSERT_EQUAL(0, byteScan(content, expected));
+  TEST_ASSERT_EQUAL(0, blockScan(content, { 1436 }, actual));
+  // Only a held-back prefix of the delimiter may be missing at the end
+  TEST_ASSERT_TRUE(actual.size() <= content.size());
+  TEST_ASSERT_TRUE(content.size() - actual.size() < delimiter().size());
+  TEST_ASSERT_EQUAL_MEMORY(content.data(), actual.data(), actual.size());
+}
+
+// -----------------------------------------------------------------------
+// Through /ota/upload
+// -----------------------------------------------------------------------
+
+/**
+ * An image without appended hash, so delimiter look-alikes can be planted
+ * in its segment data
+ */
+std::vector<uint8_t> lookalikeImage() {
+  std::vector<uint8_t> image = fakeAppImage(6, 8 * 1024, 2, false);
+  std::string d = delimiter();
+  for (size_t at = 2000; at < 12000; at += 1500) {
+    memcpy(image.data() + at, d.data(), d.size() - 1 - at % 7);
+  }
+  return image;
+}
+
+/**
+ * Upload image as the /update page does, cutting the body after each of
+ * cuts (body offsets) and then into 1436-byte segments
+ */
+int upload(const std::vector<uint8_t> &image, std::vector<size_t> cuts, size_t &headLength) {
+  MD5Builder md5;
+  md5.begin();
+  for (size_t at = 0; at < image.size(); at += 4096) {
+    md5.add(image.data() + at, min((size_t)4096, image.size() - at));
+  }
+  md5.calculate();
+  FakeConnection start(server, HTTP_GET, "/ota/start?mode=fr&hash=" + md5.toString());
+  start.open();
+  if (start.responseCode() != 200) {
+    return start.responseCode();
+  }
+
+  std::string head = std::string("--") + BOUNDARY + "\r\n" +
+                     "Content-Disposition: form-data; name=\"firmware\"; filename=\"firmware.bin\"\r\n" +
+                     "Content-Type: application/octet-stream\r\n\r\n";
+  headLength = head.size();
+  std::vector<uint8_t> body(head.begin(), head.end());
+  std::vector<uint8_t> part = partBody(image);
+  body.insert(body.end(), part.begin(), part.end());
+
+  FakeConnection c(server, HTTP_POST, "/ota/upload");
+  c.header("Content-Type", String("multipart/form-data; boundary=") + BOUNDARY);
+  c.header("Content-Length", String((unsigned long)body.size()));
+  c.open();
+  size_t at = 0;
+  for (size_t cut : cuts) {
+    c.receive(body.data() + at, cut - at);
+    at = cut;
+  }
+  c.receiveAll(body.data() + at, body.size() - at);
+  int status = c.responseCode();
+  c.close();
+  return status;
+}
+
+void assertUploaded(const std::vector<uint8_t> &image) {
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), fakeOTASlots[1].data.data(), image.size());
+  TEST_ASSERT_EQUAL(1, fakeBootSlot);
+  fakeFlashReset();
+}
+
+void test_upload_hands_over_to_scanner() {
+  std::vector<uint8_t> image = lookalikeImage();
+  size_t head;
+  TEST_ASSERT_EQUAL(200, upload(image, {}, head));
+  TEST_ASSERT_EQUAL_STRING("multipart, block scan", otaSession.transport);
+  assertUploaded(image);
+}
+
+void test_full_item_buffer_does_not_hand_over() {
+  std::vector<uint8_t> image = lookalikeImage();
+  size_t head;
+  upload(image, {}, head);
+  fakeFlashReset();
+
+  // The first segment fills the library's buffer exactly: that flush is
+  // not the end of a TCP buffer, so only a later, shorter one hands over
+  TEST_ASSERT_EQUAL(200, upload(image, { head + OTA_MULTIPART_ITEM_BUFFER }, head));
+  TEST_ASSERT_EQUAL_STRING("multipart, block scan", otaSession.transport);
+  assertUploaded(image);
+
+  // Every segment a full buffer: the library parses the whole body
+  std::vector<size_t> cuts;
+  for (size_t at = head + OTA_MULTIPART_ITEM_BUFFER; at < head + image.size(); at += OTA_MULTIPART_ITEM_BUFFER) {
+    cuts.push_back(at);
+  }
+  TEST_ASSERT_EQUAL(200, upload(image, cuts, head));
+  TEST_ASSERT_EQUAL_STRING("multipart", otaSession.transport);
+  assertUploaded(image);
+}
+
+void test_upload_segment_ending_inside_lookalike() {
+  // A segment that ends in a partial delimiter match leaves bytes held in
+  // the library's parser, so it must not hand over there
+  std::vector<uint8_t> image = lookalikeImage();
+  size_t head;
+  upload(image, {}, head);
+  fakeFlashReset();
+  for (size_t n = 1; n < 6; n++) {
+    TEST_ASSERT_EQUAL(200, upload(image, { head + 2000 + n }, head));
+    assertUploaded(image);
+  }
+}
+
+void test_upload_delimiter_split_across_segments() {
+  std::vector<uint8_t> image = lookalikeImage();
+  size_t head;
+  upload(image, {}, head);
+  fakeFlashReset();
+  size_t end = head + image.size();
+  for (size_t cut = end - 1; cut <= end + delimiter().size() + 2; cut++) {
+    TEST_ASSERT_EQUAL(200, upload(image, { head + 500, cut }, head));
+    TEST_ASSERT_EQUAL_STRING("multipart, block scan", otaSession.transport);
+    assertUploaded(image);
+  }
+}
+
+// -----------------------------------------------------------------------
+// Microbenchmark
+// -----------------------------------------------------------------------
+
+double megabytesPerSecond(size_t bytes, std::chrono::steady_clock::duration elapsed) {
+  double seconds = std::chrono::duration<double>(elapsed).count();
+  return seconds > 0 ? bytes / 1048576.0 / seconds : 0;
+}
+
+void test_benchmark() {
+  std::vector<uint8_t> body = partBody(trickyContent(1024 * 1024, 7));
+  const int rounds = 20;
+
+  for (size_t segment : { (size_t)536, (size_t)1072, (size_t)1436, (size_t)1460 }) {
+    std::vector<uint8_t> expected, actual;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+      expected.clear();
+      byteScan(body, expected);
+    }
+    auto byteTime = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+      actual.clear();
+      blockScan(body, { segment }, actual);
+    }
+    auto blockTime = std::chrono::steady_clock::now() - start;
+
+    printf("multipart %4u B segments: per byte %7.1f MB/s, block scan %7.1f MB/s\n", (unsigned)segment,
+           megabytesPerSecond(body.size() * rounds, byteTime), megabytesPerSecond(body.size() * rounds, blockTime));
+    TEST_ASSERT_EQUAL(expected.size(), actual.size());
+    TEST_ASSERT_EQUAL_MEMORY(expected.data(), actual.data(), expected.size());
+  }
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_rejects_bad_boundary);
+  RUN_TEST(test_matches_reference_for_segment_sizes);
+  RUN_TEST(test_delimiter_split_at_every_offset);
+  RUN_TEST(test_lookalike_split_at_every_offset);
+  RUN_TEST(test_crlf_at_segment_edge);
+  RUN_TEST(test_no_delimiter_keeps_scanning);
+  RUN_TEST(test_upload_hands_over_to_scanner);
+  RUN_TEST(test_full_item_buffer_does_not_hand_over);
+  RUN_TEST(test_upload_segment_ending_inside_lookalike);
+  RUN_TEST(test_upload_delimiter_split_across_segments);
+  RUN_TEST(test_benchmark);
+  return UNITY_END();
+}
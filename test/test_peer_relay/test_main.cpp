@@ -0,0 +1,260 @@
+/*
+  -----------------------
+  Peer Relay Tests
+  -----------------------
+
+  Pull updates fetched from seeders (OTAPeerRelay.h) through the HTTPClient
+  fake, one URL per seeder found over mDNS: chunks fetched in parallel and
+  written in image order, the chunk of a failing seeder handed to the
+  others, seeders of another image ignored, and the server taking over
+  from the whole sectors written when every seeder fails. The seeding
+  side serves GET /ota/image ranges out of the running slot.
+*/
+#define OTA_PULL_MANIFEST_URL "http://updates.local/manifest.json"
+#define OTA_PEER_RELAY 1
+
+#include <Arduino.h>
+#include <unity.h>
+#include <chrono>
+#include "OTA.h"
+#include "FakeImage.h"
+
+const char *IMAGE_URL = "http://updates.local/firmware.bin";
+
+std::vector<uint8_t> image;
+
+void setUp() {
+  fakeFlashReset();
+  fakeNVS.clear();
+  fakeHTTPReset();
+  fakeMDNSServices.clear();
+  registerWebRoutes();
+  // 98 KB: 7 chunks
+  image = fakeAppImage(11, 48 * 1024, 2);
+  otaPullState = OTA_PULL_IDLE;
+  otaManifestETag = "";
+  isRebootScheduled = false;
+  rebootHolds = 0;
+  isOTAMDNSStarted = true;
+  isOTASeeding = false;
+  // The fetch tasks are threads; the stall timeout must not run ahead
+  fakeUseWallClock(true);
+}
+
+void tearDown() {
+  otaWriterAbort();
+  fakeUseWallClock(false);
+}
+
+String seederURL(int n) {
+  return "http://10.0.0." + String(n) + ":80/ota/image";
+}
+
+/**
+ * Advertise seeder n (at 10.0.0.n) over mDNS with sha256, serving body
+ * with sha256 in its X-Image-SHA256 header
+ */
+FakeHTTPResource &serveSeeder(int n, const std::vector<uint8_t> &body, const String &sha256) {
+  fakeMDNSServices.push_back({ IPAddress(10, 0, 0, n), 80, sha256 });
+  return fakeHTTPServe(seederURL(n), body, { { OTA_SHA256_HEADER, sha256 } });
+}
+
+void serveManifest() {
+  String manifest = String("{\"version\": \"2.0.0\", \"size\": ") + String((unsigned long)image.size()) +
+                    ", \"sha256\": \"" + fakeSHA256Hex(image) + "\", \"url\": \"" + IMAGE_URL + "\"}";
+  fakeHTTPServe(OTA_PULL_MANIFEST_URL, manifest);
+  fakeHTTPServe(IMAGE_URL, image);
+}
+
+OTAPullState runPull() {
+  if (!startOTAPull()) {
+    return OTA_PULL_IDLE;
+  }
+  for (int i = 0; i < 10000 && otaPullState == OTA_PULL_RUNNING; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return handleOTAPull();
+}
+
+/**
+ * Ranges requested from url, in order
+ */
+std::vector<String> rangesOf(const String &url) {
+  std::vector<String> ranges;
+  for (const FakeHTTPRequest &request : fakeHTTPRequests) {
+    if (request.url == url) {
+      ranges.push_back(request.range);
+    }
+  }
+  return ranges;
+}
+
+size_t chunkCount() {
+  return (image.size() + OTA_PEER_CHUNK_SIZE - 1) / OTA_PEER_CHUNK_SIZE;
+}
+
+void assertInstalled() {
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), fakeOTASlots[1].data.data(), image.size());
+  TEST_ASSERT_EQUAL(1, fakeBootSlot);
+  TEST_ASSERT_TRUE(isRebootScheduled);
+}
+
+void test_pull_fetches_chunks_from_seeders() {
+  serveManifest();
+  for (int n = 2; n <= 4; n++) {
+    serveSeeder(n, image, fakeSHA256Hex(image));
+  }
+  TEST_ASSERT_EQUAL(OTA_PULL_DOWNLOADED, runPull());
+  assertInstalled();
+  TEST_ASSERT_EQUAL(0, rangesOf(IMAGE_URL).size());
+
+  // Every chunk requested once, as one closed range
+  std::vector<bool> isFetched(chunkCount(), false);
+  for (int n = 2; n <= 4; n++) {
+    for (const String &range : rangesOf(seederURL(n))) {
+      size_t first = range.substring(6, range.indexOf('-')).toInt();
+      size_t last = range.substring(range.indexOf('-') + 1).toInt();
+      size_t chunk = first / OTA_PEER_CHUNK_SIZE;
+      TEST_ASSERT_EQUAL(chunk * OTA_PEER_CHUNK_SIZE, first);
+      TEST_ASSERT_EQUAL(min(first + OTA_PEER_CHUNK_SIZE, image.size()) - 1, last);
+      TEST_ASSERT_FALSE(isFetched[chunk]);
+      isFetched[chunk] = true;
+    }
+  }
+  for (bool b : isFetched) {
+    TEST_ASSERT_TRUE(b);
+  }
+}
+
+void test_failed_seeder_hands_chunk_to_others() {
+  serveManifest();
+  // Seeder 2 loses the connection in its first chunk
+  serveSeeder(2, image, fakeSHA256Hex(image)).dropAt = 1000;
+  serveSeeder(3, image, fakeSHA256Hex(image));
+  serveSeeder(4, image, fakeSHA256Hex(image));
+  TEST_ASSERT_EQUAL(OTA_PULL_DOWNLOADED, runPull());
+  assertInstalled();
+  TEST_ASSERT_EQUAL(0, rangesOf(IMAGE_URL).size());
+  TEST_ASSERT_EQUAL(1, rangesOf(seederURL(2)).size());
+  // A chunk held while the dropped one waits may be fetched again
+  size_t fetched = rangesOf(seederURL(3)).size() + rangesOf(seederURL(4)).size();
+  TEST_ASSERT_TRUE(fetched >= chunkCount() && fetched <= chunkCount() + 1);
+}
+
+void test_seeders_of_other_images_are_not_used() {
+  serveManifest();
+  std::vector<uint8_t> other = fakeAppImage(12, 48 * 1024, 2);
+  // Advertises another image
+  serveSeeder(2, other, fakeSHA256Hex(other));
+  // Advertises this one, but answers with another
+  serveSeeder(3, image, fakeSHA256Hex(image)).headers[OTA_SHA256_HEADER] = fakeSHA256Hex(other);
+  serveSeeder(4, image, fakeSHA256Hex(image));
+  TEST_ASSERT_EQUAL(OTA_PULL_DOWNLOADED, runPull());
+  assertInstalled();
+  TEST_ASSERT_EQUAL(0, rangesOf(seederURL(2)).size());
+  TEST_ASSERT_EQUAL(1, rangesOf(seederURL(3)).size());
+  TEST_ASSERT_TRUE(rangesOf(seederURL(4)).size() >= chunkCount());
+  TEST_ASSERT_TRUE(rangesOf(seederURL(4)).size() <= chunkCount() + 1);
+}
+
+void test_server_takes_over_from_whole_sectors() {
+  serveManifest();
+  // The only seeder fails in its third chunk
+  serveSeeder(2, image, fakeSHA256Hex(image)).dropAt = 2 * OTA_PEER_CHUNK_SIZE + 1000;
+  TEST_ASSERT_EQUAL(OTA_PULL_DOWNLOADED, runPull());
+  assertInstalled();
+  TEST_ASSERT_EQUAL(3, rangesOf(seederURL(2)).size());
+  std::vector<String> ranges = rangesOf(IMAGE_URL);
+  TEST_ASSERT_EQUAL(1, ranges.size());
+  TEST_ASSERT_EQUAL_STRING(("bytes=" + String((unsigned long)(2 * OTA_PEER_CHUNK_SIZE)) + "-").c_str(),
+                           ranges[0].c_str());
+}
+
+void test_no_seeders_pulls_from_server() {
+  serveManifest();
+  TEST_ASSERT_EQUAL(OTA_PULL_DOWNLOADED, runPull());
+  assertInstalled();
+  TEST_ASSERT_EQUAL(1, rangesOf(IMAGE_URL).size());
+}
+
+void test_stuck_chunk_is_released_to_a_holding_task() {
+  // Tasks hold chunks 2 and 1 while chunk 0, given back by a failed
+  // seeder, waits for a free task
+  otaPeerFetch.lock = xSemaphoreCreateMutex();
+  otaPeerFetch.workerCount = 3;
+  otaPeerFetch.workers[0].state = PEER_READY;
+  otaPeerFetch.workers[0].chunk = 2;
+  otaPeerFetch.workers[1].state = PEER_READY;
+  otaPeerFetch.workers[1].chunk = 1;
+  otaPeerFetch.workers[2].state = PEER_STOPPED;
+  otaPeerFetch.chunkCount = 4;
+  otaPeerFetch.nextChunk = 3;
+  otaPeerFetch.retry[0] = 0;
+  otaPeerFetch.retryCount = 1;
+
+  // The furthest chunk goes back, and its task takes the lowest retry
+  releaseOTAPeerWorker(0);
+  TEST_ASSERT_EQUAL(PEER_FETCHING, otaPeerFetch.workers[0].state);
+  TEST_ASSERT_EQUAL(PEER_READY, otaPeerFetch.workers[1].state);
+  TEST_ASSERT_EQUAL(2, otaPeerFetch.retryCount);
+  size_t chunk;
+  TEST_ASSERT_TRUE(takeOTAPeerChunk(chunk));
+  TEST_ASSERT_EQUAL(0, chunk);
+  TEST_ASSERT_TRUE(takeOTAPeerChunk(chunk));
+  TEST_ASSERT_EQUAL(2, chunk);
+  TEST_ASSERT_TRUE(takeOTAPeerChunk(chunk));
+  TEST_ASSERT_EQUAL(3, chunk);
+  TEST_ASSERT_FALSE(takeOTAPeerChunk(chunk));
+
+  // Nothing to release while a task is free to fetch
+  otaPeerFetch.workers[0].state = PEER_FETCHING;
+  releaseOTAPeerWorker(0);
+  TEST_ASSERT_EQUAL(0, otaPeerFetch.retryCount);
+
+  vSemaphoreDelete(otaPeerFetch.lock);
+  otaPeerFetch.lock = NULL;
+}
+
+void test_seeder_serves_ranges_of_running_image() {
+  FakeConnection idle(server, HTTP_GET, "/ota/image");
+  idle.open();
+  TEST_ASSERT_EQUAL(503, idle.responseCode());
+
+  std::copy(image.begin(), image.end(), fakeOTASlots[0].data.begin());
+  computeRunningImageDigest();
+  isOTASeeding = beginOTASeeding(80);
+  TEST_ASSERT_TRUE(isOTASeeding);
+
+  FakeConnection c(server, HTTP_GET, "/ota/image");
+  c.header("Range", "bytes=16384-32767");
+  c.open();
+  TEST_ASSERT_EQUAL(206, c.responseCode());
+  AsyncWebServerResponse *response = c.request->response;
+  TEST_ASSERT_EQUAL_STRING(("bytes 16384-32767/" + String((unsigned long)image.size())).c_str(),
+                           response->header("Content-Range").c_str());
+  TEST_ASSERT_EQUAL_STRING(fakeSHA256Hex(image).c_str(), response->header(OTA_SHA256_HEADER).c_str());
+  TEST_ASSERT_EQUAL(16384, response->content.length());
+  TEST_ASSERT_EQUAL_MEMORY(image.data() + 16384, response->content.c_str(), 16384);
+
+  FakeConnection whole(server, HTTP_GET, "/ota/image");
+  whole.open();
+  TEST_ASSERT_EQUAL(200, whole.responseCode());
+  TEST_ASSERT_EQUAL(image.size(), whole.responseBody().length());
+
+  FakeConnection past(server, HTTP_GET, "/ota/image");
+  past.header("Range", "bytes=" + String((unsigned long)image.size()) + "-");
+  past.open();
+  TEST_ASSERT_EQUAL(416, past.responseCode());
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_pull_fetches_chunks_from_seeders);
+  RUN_TEST(test_failed_seeder_hands_chunk_to_others);
+  RUN_TEST(test_seeders_of_other_images_are_not_used);
+  RUN_TEST(test_server_takes_over_from_whole_sectors);
+  RUN_TEST(test_no_seeders_pulls_from_server);
+  RUN_TEST(test_stuck_chunk_is_released_to_a_holding_task);
+  RUN_TEST(test_seeder_serves_ranges_of_running_image);
+  return UNITY_END();
+}
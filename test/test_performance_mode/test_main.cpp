@@ -0,0 +1,151 @@
+/*
+  -----------------------
+  Performance Mode Tests
+  -----------------------
+
+  The upload profile of OTAPerformanceMode.h: what an upload switches on,
+  that the previous profile comes back after success, failure and an
+  abandoned session, and that a running profile is not saved twice.
+
+  test_benchmark uploads the same image with and without the profile over
+  a modelled link. The host's radio and clock don't change with the
+  profile, so the link reads the fake's power-save setting: the sender
+  gets one TCP window per round trip, and with modem sleep a round trip
+  waits for the next DTIM beacon (~100 ms) instead of ~4 ms. Times are
+  scaled 20x down.
+*/
+#include <Arduino.h>
+#include <unity.h>
+#include <chrono>
+#include "OTA.h"
+#include "FakeImage.h"
+
+void setUp() {
+  fakeFlashReset();
+  fakeNVS.clear();
+  registerWebRoutes();
+  fakePowerSave = WIFI_PS_MIN_MODEM;
+  fakeCpuMhz = 160;
+}
+
+void tearDown() {
+  otaWriterAbort();
+  exitOTAPerformanceMode();
+  fakeUseWallClock(false);
+}
+
+int rawUpload(const std::vector<uint8_t> &image) {
+  FakeConnection c(server, HTTP_PUT, "/ota/firmware");
+  c.header("Content-Type", "application/octet-stream");
+  c.header("Content-Length", String((unsigned long)image.size()));
+  c.open();
+  c.receiveAll(image.data(), image.size());
+  int code = c.responseCode();
+  c.close();
+  return code;
+}
+
+void test_upload_switches_profile_on() {
+  onOTAStart();
+  TEST_ASSERT_TRUE(isOTAPerformanceModeActive);
+  TEST_ASSERT_EQUAL(WIFI_PS_NONE, fakePowerSave);
+  TEST_ASSERT_EQUAL(OTA_PERFORMANCE_CPU_MHZ, getCpuFrequencyMhz());
+}
+
+void test_profile_restored_after_upload() {
+  std::vector<uint8_t> image = fakeAppImage(1, 16 * 1024, 2);
+  TEST_ASSERT_EQUAL(200, rawUpload(image));
+  TEST_ASSERT_FALSE(isOTAPerformanceModeActive);
+  TEST_ASSERT_EQUAL(WIFI_PS_MIN_MODEM, fakePowerSave);
+  TEST_ASSERT_EQUAL(160, getCpuFrequencyMhz());
+
+  image[100] ^= 1;
+  TEST_ASSERT_EQUAL(400, rawUpload(image));
+  TEST_ASSERT_FALSE(isOTAPerformanceModeActive);
+  TEST_ASSERT_EQUAL(WIFI_PS_MIN_MODEM, fakePowerSave);
+  TEST_ASSERT_EQUAL(160, getCpuFrequencyMhz());
+}
+
+void test_second_start_keeps_saved_profile() {
+  onOTAStart();
+  onOTAStart();
+  exitOTAPerformanceMode();
+  TEST_ASSERT_EQUAL(WIFI_PS_MIN_MODEM, fakePowerSave);
+  TEST_ASSERT_EQUAL(160, getCpuFrequencyMhz());
+}
+
+void test_idle_session_drops_profile() {
+  onOTAStart();
+  fakeAdvanceMillis(OTA_PERFORMANCE_IDLE_MS / 2);
+  noteOTAPerformanceActivity();
+  fakeAdvanceMillis(OTA_PERFORMANCE_IDLE_MS / 2 + 1);
+  handleOTAPerformanceMode();
+  TEST_ASSERT_TRUE(isOTAPerformanceModeActive);
+
+  fakeAdvanceMillis(OTA_PERFORMANCE_IDLE_MS);
+  handleOTAPerformanceMode();
+  TEST_ASSERT_FALSE(isOTAPerformanceModeActive);
+  TEST_ASSERT_EQUAL(WIFI_PS_MIN_MODEM, fakePowerSave);
+}
+
+// Modelled link, 20x faster than the device
+const size_t BENCH_SEGMENT = 1436;
+const size_t BENCH_TCP_WINDOW = 4 * BENCH_SEGMENT;
+const uint32_t BENCH_RTT_MICROS = 4000 / 20;
+const uint32_t BENCH_DTIM_RTT_MICROS = 102400 / 20;
+
+/**
+ * Upload over the modelled link; without the profile, the one saved at
+ * the start is put back right away, as with -DOTA_PERFORMANCE_MODE=0.
+ * Returns the seconds the upload took.
+ */
+double benchUpload(const std::vector<uint8_t> &image, bool withProfile) {
+  fakeFlashReset();
+  fakePowerSave = WIFI_PS_MIN_MODEM;
+  FakeConnection c(server, HTTP_PUT, "/ota/firmware");
+  c.header("Content-Type", "application/octet-stream");
+  c.header("Content-Length", String((unsigned long)image.size()));
+  c.open();
+
+  auto start = std::chrono::steady_clock::now();
+  for (size_t at = 0; at < image.size(); at += BENCH_TCP_WINDOW) {
+    size_t window = min(BENCH_TCP_WINDOW, image.size() - at);
+    c.receiveAll(image.data() + at, window, BENCH_SEGMENT);
+    if (at == 0 && !withProfile) {
+      exitOTAPerformanceMode();
+    }
+    wifi_ps_type_t powerSave;
+    esp_wifi_get_ps(&powerSave);
+    uint32_t rtt = powerSave == WIFI_PS_NONE ? BENCH_RTT_MICROS : BENCH_DTIM_RTT_MICROS;
+    std::this_thread::sleep_for(std::chrono::microseconds(rtt));
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  int code = c.responseCode();
+  c.close();
+  return code == 200 ? seconds : -1;
+}
+
+void test_benchmark() {
+  fakeUseWallClock(true);
+  std::vector<uint8_t> image = fakeAppImage(2, 128 * 1024, 2);
+  double with = benchUpload(image, true);
+  TEST_ASSERT_TRUE(with > 0);
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), fakeOTASlots[1].data.data(), image.size());
+  double without = benchUpload(image, false);
+  TEST_ASSERT_TRUE(without > 0);
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), fakeOTASlots[1].data.data(), image.size());
+
+  Serial.printf("OTA: modelled link (20x scaled): with profile %.2f MB/s, without %.2f MB/s\n",
+                image.size() / with / 1e6, image.size() / without / 1e6);
+  TEST_ASSERT_TRUE(with < without);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_upload_switches_profile_on);
+  RUN_TEST(test_profile_restored_after_upload);
+  RUN_TEST(test_second_start_keeps_saved_profile);
+  RUN_TEST(test_idle_session_drops_profile);
+  RUN_TEST(test_benchmark);
+  return UNITY_END();
+}
@@ -0,0 +1,225 @@
+/*
+  -----------------------
+  Pull Session Tests
+  -----------------------
+
+  The writer belongs to whichever session claimed it. Checks that upload
+  requests arriving while a pull (or the peer relay inside it) holds the
+  writer are refused with 409 and leave the pull's session running.
+
+  End to end, pulls run their real task against manifests and images
+  served by the HTTPClient fake: an install, a download interrupted and
+  resumed with a Range request, a server that ignores ranges, a manifest
+  whose digest doesn't match, and an unchanged manifest.
+*/
+#define OTA_PULL_MANIFEST_URL "http://updates.local/manifest.json"
+
+#include <Arduino.h>
+#include <unity.h>
+#include "OTA.h"
+#include "FakeImage.h"
+
+const char *IMAGE_URL = "http://updates.local/firmware.bin";
+
+std::vector<uint8_t> image;
+
+void setUp() {
+  fakeFlashReset();
+  fakeNVS.clear();
+  fakeHTTPReset();
+  registerWebRoutes();
+  image = fakeAppImage(7, 16 * 1024, 2);
+  otaPullState = OTA_PULL_IDLE;
+  otaManifestETag = "";
+  isRebootScheduled = false;
+  rebootHolds = 0;
+}
+
+void tearDown() {
+  otaWriterAbort();
+}
+
+/**
+ * Claim the writer the way pullOTAImage() does and queue the first sector
+ */
+void startPullSession() {
+  TEST_ASSERT_TRUE(otaWriterBegin(OTA_WRITER_PULL, image.size()));
+  TEST_ASSERT_EQUAL(OTA_SECTOR_SIZE, otaWriterWrite(image.data(), OTA_SECTOR_SIZE));
+}
+
+void test_start_is_refused_while_pull_writes() {
+  startPullSession();
+  FakeConnection c(server, HTTP_GET, "/ota/start?mode=fr");
+  c.open();
+  TEST_ASSERT_EQUAL(409, c.responseCode());
+  TEST_ASSERT_TRUE(isOTAWriterActive);
+  TEST_ASSERT_EQUAL(OTA_WRITER_PULL, otaWriterOwner);
+
+  // The pull carries on and completes
+  TEST_ASSERT_EQUAL(image.size() - OTA_SECTOR_SIZE,
+                    otaWriterWrite(image.data() + OTA_SECTOR_SIZE, image.size() - OTA_SECTOR_SIZE));
+  TEST_ASSERT_TRUE(otaWriterEnd());
+  TEST_ASSERT_TRUE(otaWriterCommit());
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), fakeOTASlots[1].data.data(), image.size());
+}
+
+void test_failed_upload_session_cannot_abort_pull() {
+  FakeConnection first(server, HTTP_GET, "/ota/start?mode=fr");
+  first.open();
+  TEST_ASSERT_EQUAL(200, first.responseCode());
+
+  // The upload fails and lets go of the writer, the pull takes it
+  failOTAUpload("Image invalid");
+  startPullSession();
+
+  FakeConnection second(server, HTTP_GET, "/ota/start?mode=fr");
+  second.open();
+  TEST_ASSERT_EQUAL(409, second.responseCode());
+  TEST_ASSERT_EQUAL(OTA_WRITER_PULL, otaWriterOwner);
+  abandonOTASession("Replaced");
+  TEST_ASSERT_EQUAL(OTA_WRITER_PULL, otaWriterOwner);
+}
+
+void test_raw_upload_is_refused_while_pull_writes() {
+  startPullSession();
+  FakeConnection c(server, HTTP_PUT, "/ota/firmware");
+  c.header("Content-Type", "application/octet-stream");
+  c.header("Content-Length", String((unsigned long)image.size()));
+  c.open();
+  c.receiveAll(image.data(), image.size());
+  TEST_ASSERT_EQUAL(409, c.responseCode());
+  c.close();
+  TEST_ASSERT_TRUE(isOTAWriterActive);
+  TEST_ASSERT_EQUAL(OTA_WRITER_PULL, otaWriterOwner);
+}
+
+void test_new_start_replaces_stale_upload_session() {
+  FakeConnection first(server, HTTP_GET, "/ota/start?mode=fr");
+  first.open();
+  TEST_ASSERT_EQUAL(200, first.responseCode());
+  TEST_ASSERT_EQUAL(OTA_WRITER_UPLOAD, otaWriterOwner);
+
+  FakeConnection second(server, HTTP_GET, "/ota/start?mode=fr");
+  second.open();
+  TEST_ASSERT_EQUAL(200, second.responseCode());
+  TEST_ASSERT_EQUAL(OTA_WRITER_UPLOAD, otaWriterOwner);
+}
+
+void test_released_writer_has_no_owner() {
+  startPullSession();
+  otaWriterAbort();
+  TEST_ASSERT_EQUAL(OTA_WRITER_IDLE, otaWriterOwner);
+  TEST_ASSERT_FALSE(isOTAWriterActive);
+}
+
+/**
+ * Serve a manifest for image under version, and the image itself
+ */
+FakeHTTPResource &serveUpdate(const char *version, const String &sha256) {
+  String manifest = String("{\"version\": \"") + version + "\", \"size\": " +
+                    String((unsigned long)image.size()) + ", \"sha256\": \"" + sha256 + "\", \"url\": \"" +
+                    IMAGE_URL + "\"}";
+  fakeHTTPServe(OTA_PULL_MANIFEST_URL, manifest, { { "ETag", "\"m1\"" } });
+  return fakeHTTPServe(IMAGE_URL, image);
+}
+
+/**
+ * Start a pull, wait for its task and finish it as loop() does
+ */
+OTAPullState runPull() {
+  if (!startOTAPull()) {
+    return OTA_PULL_IDLE;
+  }
+  for (int i = 0; i < 5000 && otaPullState == OTA_PULL_RUNNING; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return handleOTAPull();
+}
+
+/**
+ * Ranges requested for the image, in order ("" for none)
+ */
+std::vector<String> imageRanges() {
+  std::vector<String> ranges;
+  for (const FakeHTTPRequest &request : fakeHTTPRequests) {
+    if (request.url == IMAGE_URL) {
+      ranges.push_back(request.range);
+    }
+  }
+  return ranges;
+}
+
+void test_pull_installs_new_image() {
+  serveUpdate("2.0.0", fakeSHA256Hex(image));
+  TEST_ASSERT_EQUAL(OTA_PULL_DOWNLOADED, runPull());
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), fakeOTASlots[1].data.data(), image.size());
+  TEST_ASSERT_EQUAL(1, fakeBootSlot);
+  TEST_ASSERT_TRUE(isRebootScheduled);
+  TEST_ASSERT_EQUAL(OTA_WRITER_IDLE, otaWriterOwner);
+  TEST_ASSERT_EQUAL(1, imageRanges().size());
+}
+
+void test_interrupted_pull_resumes_from_whole_sectors() {
+  serveUpdate("2.0.0", fakeSHA256Hex(image)).dropAt = 2 * OTA_SECTOR_SIZE + 1000;
+  TEST_ASSERT_EQUAL(OTA_PULL_DOWNLOADED, runPull());
+  std::vector<String> ranges = imageRanges();
+  TEST_ASSERT_EQUAL(2, ranges.size());
+  TEST_ASSERT_EQUAL_STRING("", ranges[0].c_str());
+  TEST_ASSERT_EQUAL_STRING(("bytes=" + String((unsigned long)(2 * OTA_SECTOR_SIZE)) + "-").c_str(),
+                           ranges[1].c_str());
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), fakeOTASlots[1].data.data(), image.size());
+  TEST_ASSERT_EQUAL(1, fakeBootSlot);
+}
+
+void test_server_ignoring_range_starts_over() {
+  FakeHTTPResource &resource = serveUpdate("2.0.0", fakeSHA256Hex(image));
+  resource.acceptsRanges = false;
+  resource.dropAt = 3 * OTA_SECTOR_SIZE + 10;
+  TEST_ASSERT_EQUAL(OTA_PULL_DOWNLOADED, runPull());
+  TEST_ASSERT_EQUAL(2, imageRanges().size());
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), fakeOTASlots[1].data.data(), image.size());
+  TEST_ASSERT_EQUAL(1, fakeBootSlot);
+}
+
+void test_digest_mismatch_is_not_installed() {
+  std::vector<uint8_t> other = fakeAppImage(8, 16 * 1024, 2);
+  serveUpdate("2.0.0", fakeSHA256Hex(other));
+  TEST_ASSERT_EQUAL(OTA_PULL_FAILED, runPull());
+  TEST_ASSERT_EQUAL_STRING("SHA-256 mismatch", otaPullError.c_str());
+  TEST_ASSERT_EQUAL(0, fakeBootSlot);
+  TEST_ASSERT_FALSE(isRebootScheduled);
+  TEST_ASSERT_EQUAL(OTA_WRITER_IDLE, otaWriterOwner);
+}
+
+void test_unchanged_manifest_costs_a_304() {
+  serveUpdate(currentFirmwareVersion(), fakeSHA256Hex(image));
+  TEST_ASSERT_EQUAL(OTA_PULL_UP_TO_DATE, runPull());
+  TEST_ASSERT_EQUAL(0, imageRanges().size());
+  TEST_ASSERT_EQUAL_STRING("\"m1\"", otaManifestETag.c_str());
+
+  TEST_ASSERT_EQUAL(OTA_PULL_UP_TO_DATE, runPull());
+  TEST_ASSERT_EQUAL_STRING("\"m1\"", fakeHTTPRequests.back().ifNoneMatch.c_str());
+  TEST_ASSERT_EQUAL(0, fakeBootSlot);
+}
+
+void test_unreachable_server_fails_cleanly() {
+  TEST_ASSERT_EQUAL(OTA_PULL_FAILED, runPull());
+  TEST_ASSERT_EQUAL(OTA_WRITER_IDLE, otaWriterOwner);
+  TEST_ASSERT_FALSE(isOTAWriterActive);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_start_is_refused_while_pull_writes);
+  RUN_TEST(test_failed_upload_session_cannot_abort_pull);
+  RUN_TEST(test_raw_upload_is_refused_while_pull_writes);
+  RUN_TEST(test_new_start_replaces_stale_upload_session);
+  RUN_TEST(test_released_writer_has_no_owner);
+  RUN_TEST(test_pull_installs_new_image);
+  RUN_TEST(test_interrupted_pull_resumes_from_whole_sectors);
+  RUN_TEST(test_server_ignoring_range_starts_over);
+  RUN_TEST(test_digest_mismatch_is_not_installed);
+  RUN_TEST(test_unchanged_manifest_costs_a_304);
+  RUN_TEST(test_unreachable_server_fails_cleanly);
+  return UNITY_END();
+}
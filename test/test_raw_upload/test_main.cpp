@@ -0,0 +1,169 @@
+/*
+  -----------------------
+  Raw Upload Tests
+  -----------------------
+
+  Uploads through the raw-body endpoint (PUT/POST /ota/firmware) at
+  several segment sizes, next to the multipart path of the /update page.
+  Chunked bodies are only taken from clients that wait for the interim
+  "100 Continue", so no body byte can come in with the headers.
+
+  test_benchmark uploads the same image both ways on the host's clock and
+  prints throughput and the handler cycles per MB the session statistics
+  report (host time counted at 240 MHz).
+*/
+#include <Arduino.h>
+#include <unity.h>
+#include <chrono>
+#include "OTA.h"
+#include "FakeImage.h"
+
+const char *BOUNDARY = "----WebKitFormBoundary7MA4YWxkTrZu0gW";
+
+void setUp() {
+  fakeFlashReset();
+  fakeNVS.clear();
+  registerWebRoutes();
+}
+
+void tearDown() {
+  otaWriterAbort();
+  fakeUseWallClock(false);
+}
+
+int rawUpload(const std::vector<uint8_t> &image, size_t segment = 1436) {
+  FakeConnection c(server, HTTP_PUT, "/ota/firmware");
+  c.header("Content-Type", "application/octet-stream");
+  c.header("Content-Length", String((unsigned long)image.size()));
+  c.open();
+  c.receiveAll(image.data(), image.size(), segment);
+  int code = c.responseCode();
+  c.close();
+  return code;
+}
+
+/**
+ * Upload image with chunked transfer encoding, chunkSize bytes per chunk
+ */
+int chunkedUpload(const std::vector<uint8_t> &image, bool isExpectingContinue, size_t chunkSize = 4000) {
+  std::vector<uint8_t> body;
+  // Ends with the zero-size chunk
+  for (size_t at = 0, n = 1; n > 0; at += n) {
+    n = min(chunkSize, image.size() - at);
+    char size[16];
+    snprintf(size, sizeof(size), "%zx\r\n", n);
+    body.insert(body.end(), size, size + strlen(size));
+    body.insert(body.end(), image.begin() + at, image.begin() + at + n);
+    body.push_back('\r');
+    body.push_back('\n');
+  }
+
+  FakeConnection c(server, HTTP_PUT, "/ota/firmware");
+  c.header("Content-Type", "application/octet-stream");
+  c.header("Transfer-Encoding", "chunked");
+  if (isExpectingContinue) {
+    c.header("Expect", "100-continue");
+  }
+  c.open();
+  c.receiveAll(body.data(), body.size());
+  int code = c.responseCode();
+  c.close();
+  return code;
+}
+
+/**
+ * Upload image as the /update page does
+ */
+int multipartUpload(const std::vector<uint8_t> &image, size_t segment = 1436) {
+  MD5Builder md5;
+  md5.begin();
+  // add() takes at most 64 KB at a time
+  for (size_t at = 0; at < image.size(); at += 4096) {
+    md5.add(image.data() + at, min((size_t)4096, image.size() - at));
+  }
+  md5.calculate();
+  FakeConnection start(server, HTTP_GET, "/ota/start?mode=fr&hash=" + md5.toString());
+  start.open();
+  if (start.responseCode() != 200) {
+    return start.responseCode();
+  }
+
+  std::string head = std::string("--") + BOUNDARY + "\r\n" +
+                     "Content-Disposition: form-data; name=\"firmware\"; filename=\"firmware.bin\"\r\n" +
+                     "Content-Type: application/octet-stream\r\n\r\n";
+  std::string tail = std::string("\r\n--") + BOUNDARY + "--\r\n";
+  std::vector<uint8_t> body(head.begin(), head.end());
+  body.insert(body.end(), image.begin(), image.end());
+  body.insert(body.end(), tail.begin(), tail.end());
+
+  FakeConnection c(server, HTTP_POST, "/ota/upload");
+  c.header("Content-Type", String("multipart/form-data; boundary=") + BOUNDARY);
+  c.header("Content-Length", String((unsigned long)body.size()));
+  c.open();
+  c.receiveAll(body.data(), body.size(), segment);
+  int code = c.responseCode();
+  c.close();
+  return code;
+}
+
+void assertInstalled(const std::vector<uint8_t> &image) {
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), fakeOTASlots[1].data.data(), image.size());
+  TEST_ASSERT_EQUAL(1, fakeBootSlot);
+}
+
+void test_raw_upload_installs_image() {
+  std::vector<uint8_t> image = fakeAppImage(1, 40 * 1024, 2);
+  for (size_t segment : { (size_t)1, (size_t)536, (size_t)1436, (size_t)OTA_SECTOR_SIZE + 3 }) {
+    fakeFlashReset();
+    TEST_ASSERT_EQUAL(200, rawUpload(image, segment));
+    TEST_ASSERT_EQUAL_STRING("raw", otaSession.transport);
+    TEST_ASSERT_EQUAL(image.size(), otaSession.received);
+    assertInstalled(image);
+  }
+}
+
+void test_raw_upload_of_corrupt_image_is_refused() {
+  std::vector<uint8_t> image = fakeAppImage(2, 40 * 1024, 2);
+  image[image.size() - 1] ^= 1;
+  TEST_ASSERT_EQUAL(400, rawUpload(image));
+  TEST_ASSERT_EQUAL(0, fakeBootSlot);
+}
+
+void test_chunked_upload_installs_image() {
+  std::vector<uint8_t> image = fakeAppImage(4, 40 * 1024, 2);
+  TEST_ASSERT_EQUAL(200, chunkedUpload(image, true));
+  TEST_ASSERT_EQUAL_STRING("raw chunked", otaSession.transport);
+  assertInstalled(image);
+}
+
+void test_chunked_upload_without_expect_is_refused() {
+  std::vector<uint8_t> image = fakeAppImage(5, 40 * 1024, 2);
+  TEST_ASSERT_EQUAL(411, chunkedUpload(image, false));
+  TEST_ASSERT_EQUAL(0, fakeFlashErases);
+  TEST_ASSERT_EQUAL(0, fakeBootSlot);
+}
+
+void test_benchmark() {
+  fakeUseWallClock(true);
+  std::vector<uint8_t> image = fakeAppImage(3, 384 * 1024, 2);
+  for (bool isRaw : { true, false }) {
+    fakeFlashReset();
+    auto t0 = std::chrono::steady_clock::now();
+    TEST_ASSERT_EQUAL(200, isRaw ? rawUpload(image) : multipartUpload(image));
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    assertInstalled(image);
+    double mb = otaSession.received / 1048576.0;
+    Serial.printf("OTA: %-22s %6.1f MB/s, %8.0f handler cycles/MB\n", otaSession.transport,
+                  image.size() / seconds / 1e6, otaSession.receiveCycles / mb);
+  }
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_raw_upload_installs_image);
+  RUN_TEST(test_raw_upload_of_corrupt_image_is_refused);
+  RUN_TEST(test_chunked_upload_installs_image);
+  RUN_TEST(test_chunked_upload_without_expect_is_refused);
+  RUN_TEST(test_benchmark);
+  return UNITY_END();
+}
@@ -0,0 +1,156 @@
+/*
+  -----------------------
+  Reboot Scheduler Tests
+  -----------------------
+
+  Reboots after a successful upload, with simulated time and the loop
+  step (handleScheduledReboot()) called every LOOP_MS. Measures the time
+  from the last byte of the upload to the restart, which used to be a
+  fixed delay(3000) inside the upload callback. The hold, release and
+  deadline rules are also checked on their own, with the deadline
+  overridden the way a build flag would.
+*/
+#define REBOOT_DEADLINE_MS 1000UL
+
+#include <Arduino.h>
+#include <unity.h>
+#include "OTA.h"
+#include "FakeImage.h"
+
+const unsigned long LOOP_MS = 10;
+
+void setUp() {
+  fakeFlashReset();
+  fakeNVS.clear();
+  registerWebRoutes();
+  isRebootScheduled = false;
+  rebootHolds = 0;
+  ESP.restarts = 0;
+}
+
+void tearDown() {
+  otaWriterAbort();
+}
+
+/**
+ * Run the loop until the device restarts or limitMs pass; returns the
+ * time that took
+ */
+unsigned long loopUntilRestart(unsigned long limitMs) {
+  unsigned long start = millis();
+  while (ESP.restarts == 0 && millis() - start < limitMs) {
+    handleScheduledReboot();
+    if (ESP.restarts == 0) {
+      fakeAdvanceMillis(LOOP_MS);
+    }
+  }
+  return millis() - start;
+}
+
+/**
+ * Upload an image; the client takes closeAfterMs to read the response
+ * and close (never if 0). Returns the time from the last byte to restart.
+ */
+unsigned long uploadAndReboot(unsigned long closeAfterMs) {
+  std::vector<uint8_t> image = fakeAppImage(5, 32 * 1024, 2);
+  FakeConnection c(server, HTTP_PUT, "/ota/firmware");
+  c.header("Content-Type", "application/octet-stream");
+  c.header("Content-Length", String((unsigned long)image.size()));
+  c.open();
+  c.receiveAll(image.data(), image.size());
+  unsigned long lastByte = millis();
+  if (c.responseCode() != 200) {
+    return 0;
+  }
+
+  // Response still on its way to the client
+  if (closeAfterMs > 0) {
+    loopUntilRestart(closeAfterMs);
+    c.close();
+  }
+  loopUntilRestart(2 * REBOOT_DEADLINE_MS);
+  return millis() - lastByte;
+}
+
+void test_reboots_once_response_is_delivered() {
+  unsigned long elapsed = uploadAndReboot(50);
+  TEST_ASSERT_EQUAL(1, ESP.restarts);
+  TEST_ASSERT_EQUAL(1, fakeBootSlot);
+  // Not before the client closed, and within one loop pass after
+  TEST_ASSERT_TRUE(elapsed >= 50);
+  TEST_ASSERT_TRUE(elapsed <= 50 + LOOP_MS);
+  Serial.printf("REBOOT: %lu ms from last byte to restart (was a fixed 3000 ms)\n", elapsed);
+}
+
+void test_client_that_never_closes_reboots_at_deadline() {
+  unsigned long elapsed = uploadAndReboot(0);
+  TEST_ASSERT_EQUAL(1, ESP.restarts);
+  TEST_ASSERT_TRUE(elapsed >= REBOOT_DEADLINE_MS);
+  TEST_ASSERT_TRUE(elapsed <= REBOOT_DEADLINE_MS + LOOP_MS);
+}
+
+void test_failed_upload_does_not_reboot() {
+  std::vector<uint8_t> image = fakeAppImage(6, 32 * 1024, 2);
+  image[image.size() / 2] ^= 0xff;
+  FakeConnection c(server, HTTP_PUT, "/ota/firmware");
+  c.header("Content-Type", "application/octet-stream");
+  c.header("Content-Length", String((unsigned long)image.size()));
+  c.open();
+  c.receiveAll(image.data(), image.size());
+  TEST_ASSERT_EQUAL(400, c.responseCode());
+  c.close();
+  loopUntilRestart(2 * REBOOT_DEADLINE_MS);
+  TEST_ASSERT_EQUAL(0, ESP.restarts);
+  TEST_ASSERT_FALSE(isRebootScheduled);
+}
+
+void test_hold_delays_reboot_until_released() {
+  scheduleReboot();
+  holdReboot();
+  holdReboot();
+  fakeAdvanceMillis(REBOOT_DEADLINE_MS / 2);
+  TEST_ASSERT_FALSE(isRebootDue());
+  releaseReboot();
+  TEST_ASSERT_FALSE(isRebootDue());
+  releaseReboot();
+  TEST_ASSERT_TRUE(isRebootDue());
+}
+
+void test_deadline_overrides_hold() {
+  scheduleReboot();
+  holdReboot();
+  fakeAdvanceMillis(REBOOT_DEADLINE_MS - 1);
+  TEST_ASSERT_FALSE(isRebootDue());
+  fakeAdvanceMillis(1);
+  TEST_ASSERT_TRUE(isRebootDue());
+}
+
+void test_deadline_counts_from_first_request() {
+  scheduleReboot();
+  holdReboot();
+  fakeAdvanceMillis(REBOOT_DEADLINE_MS / 2);
+  scheduleReboot();
+  fakeAdvanceMillis(REBOOT_DEADLINE_MS / 2);
+  TEST_ASSERT_TRUE(isRebootDue());
+}
+
+void test_hold_without_request_does_not_reboot() {
+  holdReboot();
+  releaseReboot();
+  fakeAdvanceMillis(2 * REBOOT_DEADLINE_MS);
+  TEST_ASSERT_FALSE(isRebootDue());
+  handleScheduledReboot();
+  TEST_ASSERT_EQUAL(0, ESP.restarts);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_reboots_once_response_is_delivered);
+  RUN_TEST(test_client_that_never_closes_reboots_at_deadline);
+  RUN_TEST(test_failed_upload_does_not_reboot);
+  RUN_TEST(test_hold_delays_reboot_until_released);
+  RUN_TEST(test_deadline_overrides_hold);
+  RUN_TEST(test_deadline_counts_from_first_request);
+  RUN_TEST(test_hold_without_request_does_not_reboot);
+  return UNITY_END();
+}
@@ -0,0 +1,270 @@
+/*
+  -----------------------
+  Upload Resume Tests
+  -----------------------
+
+  Drops multipart uploads part way through and continues them the way
+  tools/ota_upload.py does (/ota/resume, /ota/start?resume=1, then
+  /ota/upload?offset=N). Checks that only whole sectors are kept, that the
+  offset reaches NVS at checkpoints rather than per sector, and that the
+  resumed image still passes the MD5 and image checks.
+
+  test_random_kill_points interrupts uploads at seeded random points,
+  either by dropping the connection or by cutting power (the NVS state of
+  the moment survives, the offset stored on disconnect doesn't), and
+  resumes each time until the partition holds the image byte for byte.
+*/
+#include <Arduino.h>
+#include <unity.h>
+#include "OTA.h"
+#include "FakeImage.h"
+
+const char *BOUNDARY = "----otaResumeTest";
+
+std::vector<uint8_t> image;
+String imageMD5;
+
+String md5Of(const std::vector<uint8_t> &data) {
+  MD5Builder md5;
+  md5.begin();
+  for (size_t at = 0; at < data.size(); at += 4096) {
+    md5.add(data.data() + at, min((size_t)4096, data.size() - at));
+  }
+  md5.calculate();
+  return md5.toString();
+}
+
+void setUp() {
+  fakeFlashReset();
+  fakeNVS.clear();
+  fakeNVSWrites = 0;
+  registerWebRoutes();
+  image = fakeAppImage(3, 100 * 1024, 2);
+  imageMD5 = md5Of(image);
+}
+
+void tearDown() {
+  otaWriterAbort();
+}
+
+/**
+ * GET an OTA endpoint; returns the status, body in reply
+ */
+int getOTA(const String &path, String &reply) {
+  FakeConnection c(server, HTTP_GET, path);
+  c.open();
+  reply = c.responseBody();
+  return c.responseCode();
+}
+
+int startSession(const String &hash, bool resume, String &reply) {
+  return getOTA("/ota/start?mode=fr&hash=" + hash + (resume ? "&resume=1" : ""), reply);
+}
+
+/**
+ * POST the image from offset on as the page does, dropping the
+ * connection after sendBytes of the image if that is less than the rest.
+ * nvs, if given, gets the NVS contents from just before the connection
+ * closes.
+ */
+int uploadFrom(size_t offset, size_t sendBytes = SIZE_MAX,
+               std::map<std::string, std::map<std::string, std::vector<uint8_t>>> *nvs = NULL) {
+  String head = String("--") + BOUNDARY + "\r\n" +
+                "Content-Disposition: form-data; name=\"firmware\"; filename=\"firmware.bin\"\r\n" +
+                "Content-Type: application/octet-stream\r\n\r\n";
+  String tail = String("\r\n--") + BOUNDARY + "--\r\n";
+  std::vector<uint8_t> body(head.c_str(), head.c_str() + head.length());
+  body.insert(body.end(), image.begin() + offset, image.end());
+  body.insert(body.end(), tail.c_str(), tail.c_str() + tail.length());
+
+  FakeConnection c(server, HTTP_POST, "/ota/upload?offset=" + String((unsigned long)offset));
+  c.header("Content-Type", String("multipart/form-data; boundary=") + BOUNDARY);
+  c.header("Content-Length", String((unsigned long)body.size()));
+  c.open();
+  c.receiveAll(body.data(), sendBytes < image.size() - offset ? head.length() + sendBytes : body.size());
+  if (nvs != NULL) {
+    *nvs = fakeNVS;
+  }
+  c.close();
+  return c.responseCode();
+}
+
+uint32_t savedOffset() {
+  OTAResumeState resume;
+  return loadOTAResume(resume) ? resume.offset : UINT32_MAX;
+}
+
+void test_no_session_to_resume() {
+  String reply;
+  TEST_ASSERT_EQUAL(404, getOTA("/ota/resume", reply));
+}
+
+void test_drop_keeps_whole_sectors() {
+  String reply;
+  TEST_ASSERT_EQUAL(200, startSession(imageMD5, false, reply));
+  TEST_ASSERT_EQUAL(0, uploadFrom(0, 3 * OTA_SECTOR_SIZE + 1000));
+
+  // The partial fourth sector is dropped; the first three are on flash
+  TEST_ASSERT_EQUAL(3 * OTA_SECTOR_SIZE, savedOffset());
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), fakeOTASlots[1].data.data(), 3 * OTA_SECTOR_SIZE);
+  TEST_ASSERT_EQUAL(0, fakeBootSlot);
+
+  TEST_ASSERT_EQUAL(200, getOTA("/ota/resume", reply));
+  TEST_ASSERT_TRUE(reply.indexOf("\"offset\":12288") >= 0);
+  TEST_ASSERT_TRUE(reply.indexOf(imageMD5) >= 0);
+}
+
+void test_drop_inside_first_sector_starts_over() {
+  String reply;
+  TEST_ASSERT_EQUAL(200, startSession(imageMD5, false, reply));
+  uploadFrom(0, OTA_SECTOR_SIZE - 1);
+  TEST_ASSERT_EQUAL(0, savedOffset());
+
+  TEST_ASSERT_EQUAL(200, startSession(imageMD5, true, reply));
+  TEST_ASSERT_EQUAL_STRING("OK", reply.c_str());
+  TEST_ASSERT_EQUAL(200, uploadFrom(0));
+  TEST_ASSERT_EQUAL(1, fakeBootSlot);
+}
+
+void test_resumes_from_offset_and_commits() {
+  String reply;
+  TEST_ASSERT_EQUAL(200, startSession(imageMD5, false, reply));
+  uploadFrom(0, 20 * OTA_SECTOR_SIZE + 123);
+  uint32_t offset = savedOffset();
+  TEST_ASSERT_EQUAL(20 * OTA_SECTOR_SIZE, offset);
+
+  TEST_ASSERT_EQUAL(200, startSession(imageMD5, true, reply));
+  TEST_ASSERT_EQUAL_STRING(String((unsigned long)offset).c_str(), reply.c_str());
+
+  // The MD5 of the first part is rebuilt from flash, so the whole-file
+  // check at the end only passes if the resumed bytes line up
+  TEST_ASSERT_EQUAL(200, uploadFrom(offset));
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), fakeOTASlots[1].data.data(), image.size());
+  TEST_ASSERT_EQUAL(1, fakeBootSlot);
+  TEST_ASSERT_EQUAL(404, getOTA("/ota/resume", reply));
+}
+
+void test_resume_twice() {
+  String reply;
+  TEST_ASSERT_EQUAL(200, startSession(imageMD5, false, reply));
+  uploadFrom(0, 5 * OTA_SECTOR_SIZE + 7);
+  TEST_ASSERT_EQUAL(200, startSession(imageMD5, true, reply));
+  uploadFrom(5 * OTA_SECTOR_SIZE, 30 * OTA_SECTOR_SIZE + 3000);
+  TEST_ASSERT_EQUAL(35 * OTA_SECTOR_SIZE, savedOffset());
+
+  TEST_ASSERT_EQUAL(200, startSession(imageMD5, true, reply));
+  TEST_ASSERT_EQUAL(200, uploadFrom(35 * OTA_SECTOR_SIZE));
+  TEST_ASSERT_EQUAL(1, fakeBootSlot);
+}
+
+void test_offset_mismatch_is_refused() {
+  String reply;
+  TEST_ASSERT_EQUAL(200, startSession(imageMD5, false, reply));
+  uploadFrom(0, 4 * OTA_SECTOR_SIZE);
+  TEST_ASSERT_EQUAL(200, startSession(imageMD5, true, reply));
+  TEST_ASSERT_EQUAL(400, uploadFrom(0));
+  TEST_ASSERT_EQUAL(0, fakeBootSlot);
+}
+
+void test_other_image_starts_over() {
+  String reply;
+  TEST_ASSERT_EQUAL(200, startSession(imageMD5, false, reply));
+  uploadFrom(0, 4 * OTA_SECTOR_SIZE);
+
+  image = fakeAppImage(4, 100 * 1024, 2);
+  imageMD5 = md5Of(image);
+  TEST_ASSERT_EQUAL(200, startSession(imageMD5, true, reply));
+  TEST_ASSERT_EQUAL_STRING("OK", reply.c_str());
+  TEST_ASSERT_EQUAL(0, savedOffset());
+  TEST_ASSERT_EQUAL(200, uploadFrom(0));
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), fakeOTASlots[1].data.data(), image.size());
+}
+
+void test_offset_checkpoints_limit_nvs_writes() {
+  String reply;
+  TEST_ASSERT_EQUAL(200, startSession(imageMD5, false, reply));
+  uint32_t writesAtStart = fakeNVSWrites;
+  uploadFrom(0, image.size() - 100);
+
+  // One offset per checkpoint plus the one stored on disconnect, never
+  // one per sector
+  uint32_t offsetWrites = fakeNVSWrites - writesAtStart;
+  TEST_ASSERT_TRUE(offsetWrites >= 1);
+  TEST_ASSERT_TRUE(offsetWrites <= image.size() / OTA_RESUME_CHECKPOINT_BYTES + 1);
+  TEST_ASSERT_EQUAL(0, savedOffset() % OTA_SECTOR_SIZE);
+  TEST_ASSERT_EQUAL((image.size() - 100) / OTA_SECTOR_SIZE * OTA_SECTOR_SIZE, savedOffset());
+}
+
+uint32_t seed;
+
+uint32_t nextRandom() {
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+void test_random_kill_points() {
+  image = fakeAppImage(5, 200 * 1024, 2);
+  imageMD5 = md5Of(image);
+  int midSectorKills = 0;
+  int midCheckpointLosses = 0;
+  for (seed = 1; seed <= 6; seed++) {
+    fakeFlashReset();
+    fakeNVS.clear();
+    String reply;
+    TEST_ASSERT_EQUAL(200, startSession(imageMD5, false, reply));
+    size_t offset = 0;
+    for (int kill = 0; kill < 8; kill++) {
+      size_t killAt = offset + 1 + nextRandom() % (image.size() - offset - 1);
+      bool isPowerLoss = nextRandom() % 2;
+      if (isPowerLoss) {
+        // Power goes before the disconnect is noticed: the device comes
+        // back with the NVS it had at that moment
+        std::map<std::string, std::map<std::string, std::vector<uint8_t>>> nvs;
+        uploadFrom(offset, killAt - offset, &nvs);
+        fakeNVS = nvs;
+      } else {
+        uploadFrom(offset, killAt - offset);
+      }
+
+      // Only whole sectors, all of them the image's
+      uint32_t saved = savedOffset();
+      TEST_ASSERT_EQUAL(0, saved % OTA_SECTOR_SIZE);
+      TEST_ASSERT_TRUE(saved <= killAt);
+      TEST_ASSERT_EQUAL_MEMORY(image.data(), fakeOTASlots[1].data.data(), saved);
+      if (isPowerLoss) {
+        // Back to the last checkpoint at worst, which counts what is on
+        // flash, not what is still in the writer's ring and sector buffer
+        TEST_ASSERT_TRUE(saved + OTA_RESUME_CHECKPOINT_BYTES + OTA_WRITER_RING_SIZE + OTA_SECTOR_SIZE > killAt);
+        midCheckpointLosses += saved < killAt / OTA_SECTOR_SIZE * OTA_SECTOR_SIZE;
+      } else {
+        TEST_ASSERT_EQUAL(killAt / OTA_SECTOR_SIZE * OTA_SECTOR_SIZE, saved);
+      }
+      midSectorKills += killAt % OTA_SECTOR_SIZE != 0;
+      TEST_ASSERT_EQUAL(0, fakeBootSlot);
+
+      TEST_ASSERT_EQUAL(200, startSession(imageMD5, true, reply));
+      offset = saved > 0 ? reply.toInt() : 0;
+      TEST_ASSERT_EQUAL(saved, offset);
+    }
+    TEST_ASSERT_EQUAL(200, uploadFrom(offset));
+    TEST_ASSERT_EQUAL_MEMORY(image.data(), fakeOTASlots[1].data.data(), image.size());
+    TEST_ASSERT_EQUAL(1, fakeBootSlot);
+    TEST_ASSERT_EQUAL(404, getOTA("/ota/resume", reply));
+  }
+  TEST_ASSERT_TRUE(midSectorKills > 0);
+  TEST_ASSERT_TRUE(midCheckpointLosses > 0);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_no_session_to_resume);
+  RUN_TEST(test_drop_keeps_whole_sectors);
+  RUN_TEST(test_drop_inside_first_sector_starts_over);
+  RUN_TEST(test_resumes_from_offset_and_commits);
+  RUN_TEST(test_resume_twice);
+  RUN_TEST(test_offset_mismatch_is_refused);
+  RUN_TEST(test_other_image_starts_over);
+  RUN_TEST(test_offset_checkpoints_limit_nvs_writes);
+  RUN_TEST(test_random_kill_points);
+  return UNITY_END();
+}
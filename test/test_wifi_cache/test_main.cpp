@@ -0,0 +1,231 @@
+/*
+  -----------------------
+  WiFi Fast-Reconnect Cache Tests
+  -----------------------
+
+  When the cached AP and lease are used, renewed and dropped: a cached
+  attempt that times out, a lease kept until renewal is due, a lease DHCP
+  never confirms, a lease DHCP replaces, new credentials and an entry
+  from another layout.
+*/
+#include <Arduino.h>
+#include <unity.h>
+#include "OTA.h"
+
+void setUp() {
+  fakeNVS.clear();
+  fakeNVSWrites = 0;
+  WiFi.currentStatus = WL_DISCONNECTED;
+  WiFi.isStaticIP = false;
+  WiFi.hasIP = false;
+  WiFi.leaseIP = IPAddress(192, 168, 1, 50);
+  wifiManager.hasSavedCredentials = true;
+  wifiManager.stopConfigPortal();
+  wifiConnectState = WIFI_CONN_IDLE;
+  shouldStartConfigPortal = false;
+  isPortalActive = false;
+  isWiFiLinkUp = false;
+  isLeaseConfirmPending = false;
+  isLeaseRenewing = false;
+  handleOTA();
+}
+
+void tearDown() {}
+
+void connect() {
+  startWiFiConnection();
+  fakeWiFiGotIP();
+  handleOTA();
+}
+
+void linkDown() {
+  fakeWiFiDisconnected();
+  handleOTA();
+}
+
+/**
+ * Reconnect on the cached lease and run until DHCP renewal starts
+ */
+void reconnectUntilRenewal() {
+  startWiFiConnection();
+  fakeWiFiGotIP();
+  handleOTA();
+  fakeAdvanceMillis(WIFI_LEASE_RENEW_AFTER_MS);
+  handleOTA();
+}
+
+bool isCached() {
+  WiFiConnectionCache cache;
+  return loadWiFiCache(cache);
+}
+
+void test_full_scan_fills_cache() {
+  TEST_ASSERT_FALSE(isCached());
+  connect();
+  TEST_ASSERT_FALSE(WiFi.lastBeginUsedCache);
+
+  WiFiConnectionCache cache;
+  TEST_ASSERT_TRUE(loadWiFiCache(cache));
+  TEST_ASSERT_EQUAL_UINT32((uint32_t)IPAddress(192, 168, 1, 50), cache.ip);
+  TEST_ASSERT_EQUAL(WiFi.apChannel, cache.channel);
+  TEST_ASSERT_EQUAL_MEMORY(WiFi.apBSSID, cache.bssid, 6);
+}
+
+void test_reconnect_keeps_cached_lease_until_renewal() {
+  connect();
+  linkDown();
+  startWiFiConnection();
+  TEST_ASSERT_TRUE(WiFi.lastBeginUsedCache);
+  TEST_ASSERT_EQUAL(WiFi.apChannel, WiFi.lastBeginChannel);
+  TEST_ASSERT_TRUE(WiFi.isStaticIP);
+
+  // Up on the cached lease, which stays in use until renewal is due
+  fakeWiFiGotIP();
+  handleOTA();
+  TEST_ASSERT_EQUAL(WIFI_CONN_CONNECTED, wifiConnectState);
+  TEST_ASSERT_TRUE(isLeaseConfirmPending);
+  fakeAdvanceMillis(WIFI_LEASE_RENEW_AFTER_MS - 1);
+  handleOTA();
+  TEST_ASSERT_TRUE(WiFi.isStaticIP);
+  TEST_ASSERT_FALSE(isLeaseRenewing);
+
+  fakeAdvanceMillis(1);
+  handleOTA();
+  TEST_ASSERT_FALSE(WiFi.isStaticIP);
+  TEST_ASSERT_TRUE(isLeaseRenewing);
+}
+
+void test_renewal_waits_for_update_to_finish() {
+  connect();
+  linkDown();
+  startWiFiConnection();
+  fakeWiFiGotIP();
+  handleOTA();
+
+  isOTAWriterActive = true;
+  fakeAdvanceMillis(WIFI_LEASE_RENEW_AFTER_MS);
+  handleOTA();
+  TEST_ASSERT_TRUE(WiFi.isStaticIP);
+  isOTAWriterActive = false;
+  handleOTA();
+  TEST_ASSERT_TRUE(isLeaseRenewing);
+}
+
+void test_confirmed_lease_write_is_skipped_when_unchanged() {
+  connect();
+  linkDown();
+  reconnectUntilRenewal();
+  uint32_t writes = fakeNVSWrites;
+
+  fakeWiFiGotIP();
+  handleOTA();
+  TEST_ASSERT_FALSE(isLeaseConfirmPending);
+  TEST_ASSERT_FALSE(isLeaseRenewing);
+  TEST_ASSERT_TRUE(isCached());
+  TEST_ASSERT_EQUAL(writes, fakeNVSWrites);
+}
+
+void test_new_dhcp_lease_replaces_cache() {
+  connect();
+  linkDown();
+  reconnectUntilRenewal();
+
+  WiFi.leaseIP = IPAddress(192, 168, 1, 77);
+  fakeWiFiGotIP();
+  handleOTA();
+  WiFiConnectionCache cache;
+  TEST_ASSERT_TRUE(loadWiFiCache(cache));
+  TEST_ASSERT_EQUAL_UINT32((uint32_t)IPAddress(192, 168, 1, 77), cache.ip);
+}
+
+void test_unconfirmed_lease_clears_cache() {
+  connect();
+  linkDown();
+  reconnectUntilRenewal();
+
+  fakeAdvanceMillis(WIFI_LEASE_CONFIRM_TIMEOUT_MS - 1);
+  handleOTA();
+  TEST_ASSERT_TRUE(isCached());
+  fakeAdvanceMillis(1);
+  handleOTA();
+  TEST_ASSERT_FALSE(isCached());
+  TEST_ASSERT_FALSE(isLeaseConfirmPending);
+  TEST_ASSERT_FALSE(isLeaseRenewing);
+}
+
+void test_cached_attempt_timeout_falls_back_to_scan() {
+  connect();
+  linkDown();
+  startWiFiConnection();
+  int begins = WiFi.beginCalls;
+
+  fakeAdvanceMillis(WIFI_FAST_CONNECT_TIMEOUT_MS);
+  handleOTA();
+  TEST_ASSERT_FALSE(isCached());
+  TEST_ASSERT_EQUAL(begins + 1, WiFi.beginCalls);
+  TEST_ASSERT_FALSE(WiFi.lastBeginUsedCache);
+  TEST_ASSERT_FALSE(WiFi.isStaticIP);
+  TEST_ASSERT_EQUAL(WIFI_CONN_CONNECTING, wifiConnectState);
+
+  // The full scan gets its own timeout
+  fakeAdvanceMillis(WIFI_CONNECT_TIMEOUT_MS - 1);
+  handleOTA();
+  TEST_ASSERT_EQUAL(WIFI_CONN_CONNECTING, wifiConnectState);
+}
+
+void test_link_loss_during_renewal_keeps_cache() {
+  connect();
+  linkDown();
+  reconnectUntilRenewal();
+  linkDown();
+  TEST_ASSERT_TRUE(isLeaseRenewing);
+
+  // Out of range is not a DHCP failure; the rejoin confirms the lease
+  fakeAdvanceMillis(WIFI_LEASE_CONFIRM_TIMEOUT_MS);
+  handleOTA();
+  TEST_ASSERT_TRUE(isCached());
+  fakeWiFiGotIP();
+  handleOTA();
+  TEST_ASSERT_FALSE(isLeaseRenewing);
+  TEST_ASSERT_TRUE(isCached());
+}
+
+void test_saved_credentials_clear_cache() {
+  connect();
+  TEST_ASSERT_TRUE(isCached());
+  wifiManager.startConfigPortal("test");
+  wifiManager.fakePortalSave();
+  TEST_ASSERT_FALSE(isCached());
+}
+
+void test_other_layout_is_ignored() {
+  connect();
+  Preferences prefs;
+  prefs.begin(WIFI_CACHE_NAMESPACE, false);
+  WiFiConnectionCache cache;
+  prefs.getBytes(WIFI_CACHE_KEY, &cache, sizeof(cache));
+  cache.version = WIFI_CACHE_VERSION + 1;
+  prefs.putBytes(WIFI_CACHE_KEY, &cache, sizeof(cache));
+  prefs.end();
+
+  linkDown();
+  startWiFiConnection();
+  TEST_ASSERT_FALSE(WiFi.lastBeginUsedCache);
+  TEST_ASSERT_FALSE(WiFi.isStaticIP);
+}
+
+int main(int argc, char **argv) {
+  setupOTA();
+  UNITY_BEGIN();
+  RUN_TEST(test_full_scan_fills_cache);
+  RUN_TEST(test_reconnect_keeps_cached_lease_until_renewal);
+  RUN_TEST(test_renewal_waits_for_update_to_finish);
+  RUN_TEST(test_confirmed_lease_write_is_skipped_when_unchanged);
+  RUN_TEST(test_new_dhcp_lease_replaces_cache);
+  RUN_TEST(test_unconfirmed_lease_clears_cache);
+  RUN_TEST(test_cached_attempt_timeout_falls_back_to_scan);
+  RUN_TEST(test_link_loss_during_renewal_keeps_cache);
+  RUN_TEST(test_saved_credentials_clear_cache);
+  RUN_TEST(test_other_layout_is_ignored);
+  return UNITY_END();
+}
@@ -0,0 +1,173 @@
+/*
+  -----------------------
+  WiFi Connection State Machine Tests
+  -----------------------
+
+  Drives startWiFiConnection() and handleOTA() against the WiFi and
+  WiFiManager fakes. Simulated time only moves when a test advances it,
+  so every step also checks that nothing waits inside the loop.
+*/
+#include <Arduino.h>
+#include <unity.h>
+#include "OTA.h"
+
+void setUp() {
+  fakeNVS.clear();
+  WiFi.currentStatus = WL_DISCONNECTED;
+  WiFi.isStaticIP = false;
+  WiFi.hasIP = false;
+  WiFi.beginCalls = 0;
+  wifiManager.hasSavedCredentials = true;
+  wifiManager.portalStarts = 0;
+  wifiManager.stopConfigPortal();
+  wifiConnectState = WIFI_CONN_IDLE;
+  shouldStartConfigPortal = false;
+  isPortalActive = false;
+  isWiFiLinkUp = false;
+  isLeaseConfirmPending = false;
+  handleOTA();
+}
+
+void tearDown() {}
+
+void test_no_saved_credentials_falls_back_to_portal() {
+  wifiManager.hasSavedCredentials = false;
+  startWiFiConnection();
+  TEST_ASSERT_EQUAL(WIFI_CONN_FALLBACK_TO_PORTAL, wifiConnectState);
+  TEST_ASSERT_EQUAL(0, WiFi.beginCalls);
+
+  handleOTA();
+  TEST_ASSERT_EQUAL(WIFI_CONN_IDLE, wifiConnectState);
+  handleOTA();
+  TEST_ASSERT_TRUE(isPortalActive);
+  TEST_ASSERT_EQUAL(1, wifiManager.portalStarts);
+}
+
+void test_connect_returns_without_waiting() {
+  unsigned long before = millis();
+  startWiFiConnection();
+  handleOTA();
+  TEST_ASSERT_EQUAL(before, millis());
+  TEST_ASSERT_EQUAL(WIFI_CONN_CONNECTING, wifiConnectState);
+  TEST_ASSERT_EQUAL(1, WiFi.beginCalls);
+  TEST_ASSERT_FALSE(WiFi.lastBeginUsedCache);
+}
+
+void test_got_ip_connects_and_starts_server() {
+  startWiFiConnection();
+  fakeAdvanceMillis(1200);
+  fakeWiFiGotIP();
+  TEST_ASSERT_EQUAL(WIFI_CONN_CONNECTING, wifiConnectState);
+
+  // Events are applied in loop context, not in the driver callback
+  handleOTA();
+  TEST_ASSERT_EQUAL(WIFI_CONN_CONNECTED, wifiConnectState);
+  TEST_ASSERT_TRUE(isWiFiLinkUp);
+  TEST_ASSERT_TRUE(isOTAServerRunning);
+  TEST_ASSERT_EQUAL(1200, lastTimeToIPMillis);
+}
+
+void test_failed_association_keeps_connecting() {
+  startWiFiConnection();
+  fakeWiFiDisconnected();
+  handleOTA();
+  TEST_ASSERT_EQUAL(WIFI_CONN_CONNECTING, wifiConnectState);
+  TEST_ASSERT_FALSE(shouldStartConfigPortal);
+}
+
+void test_timeout_falls_back_to_portal() {
+  startWiFiConnection();
+  fakeAdvanceMillis(WIFI_CONNECT_TIMEOUT_MS - 1);
+  handleOTA();
+  TEST_ASSERT_EQUAL(WIFI_CONN_CONNECTING, wifiConnectState);
+
+  fakeAdvanceMillis(1);
+  handleOTA();
+  TEST_ASSERT_EQUAL(WIFI_CONN_FALLBACK_TO_PORTAL, wifiConnectState);
+  handleOTA();
+  TEST_ASSERT_EQUAL(WIFI_CONN_IDLE, wifiConnectState);
+  handleOTA();
+  TEST_ASSERT_TRUE(isPortalActive);
+}
+
+void test_portal_waits_for_pending_attempt() {
+  startConfigPortal();
+  handleOTA();
+  TEST_ASSERT_EQUAL(WIFI_CONN_CONNECTING, wifiConnectState);
+  TEST_ASSERT_FALSE(isPortalActive);
+
+  fakeWiFiGotIP();
+  handleOTA();
+  TEST_ASSERT_EQUAL(WIFI_CONN_CONNECTED, wifiConnectState);
+  TEST_ASSERT_TRUE(isPortalActive);
+}
+
+void test_disable_abandons_attempt() {
+  startWiFiConnection();
+  disableWiFi();
+  TEST_ASSERT_EQUAL(WIFI_CONN_IDLE, wifiConnectState);
+  fakeAdvanceMillis(WIFI_CONNECT_TIMEOUT_MS);
+  handleOTA();
+  TEST_ASSERT_EQUAL(WIFI_CONN_IDLE, wifiConnectState);
+  TEST_ASSERT_FALSE(isPortalActive);
+}
+
+/**
+ * Connect once with DHCP to fill the cache, then lose the link
+ */
+void connectAndDrop() {
+  startWiFiConnection();
+  fakeWiFiGotIP();
+  handleOTA();
+  fakeWiFiDisconnected();
+  handleOTA();
+}
+
+void test_full_scan_fallback_forgets_cached_ap() {
+  connectAndDrop();
+  startWiFiConnection();
+  TEST_ASSERT_TRUE(WiFi.lastBeginUsedCache);
+
+  // The retry must scan, not rejoin the AP the driver still has stored
+  fakeAdvanceMillis(WIFI_FAST_CONNECT_TIMEOUT_MS);
+  handleOTA();
+  TEST_ASSERT_FALSE(WiFi.lastBeginUsedCache);
+  TEST_ASSERT_EQUAL(0, WiFi.lastBeginChannel);
+  TEST_ASSERT_FALSE(WiFi.isStaticIP);
+}
+
+void test_fast_reconnect_keeps_cached_lease() {
+  connectAndDrop();
+  IPAddress cachedIP = WiFi.leaseIP;
+  startWiFiConnection();
+  int dhcpStarts = WiFi.dhcpStarts;
+  fakeAdvanceMillis(300);
+  fakeWiFiGotIP();
+  handleOTA();
+  TEST_ASSERT_EQUAL(WIFI_CONN_CONNECTED, wifiConnectState);
+  TEST_ASSERT_EQUAL(300, lastTimeToIPMillis);
+
+  // Still on the cached address: DHCP was not restarted under the link
+  for (int i = 0; i < 10; i++) {
+    fakeAdvanceMillis(100);
+    handleOTA();
+  }
+  TEST_ASSERT_EQUAL(dhcpStarts, WiFi.dhcpStarts);
+  TEST_ASSERT_TRUE(WiFi.isStaticIP);
+  TEST_ASSERT_EQUAL_UINT32((uint32_t)cachedIP, (uint32_t)WiFi.localIP());
+}
+
+int main(int argc, char **argv) {
+  setupOTA();
+  UNITY_BEGIN();
+  RUN_TEST(test_no_saved_credentials_falls_back_to_portal);
+  RUN_TEST(test_connect_returns_without_waiting);
+  RUN_TEST(test_got_ip_connects_and_starts_server);
+  RUN_TEST(test_failed_association_keeps_connecting);
+  RUN_TEST(test_timeout_falls_back_to_portal);
+  RUN_TEST(test_portal_waits_for_pending_attempt);
+  RUN_TEST(test_disable_abandons_attempt);
+  RUN_TEST(test_full_scan_fallback_forgets_cached_ap);
+  RUN_TEST(test_fast_reconnect_keeps_cached_lease);
+  return UNITY_END();
+}
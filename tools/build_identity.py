@@ -0,0 +1,57 @@
+"""
+PlatformIO pre-build script: compile the build identity into the firmware.
+
+Defines OTA_FIRMWARE_VERSION (from `git describe`) and OTA_GIT_HASH, which
+src/BuildIdentity.h reports at GET /ota/identity. A version given
+explicitly in build_flags takes precedence.
+
+A build from a modified working tree gets the hash of its changes after
+the "-dirty" suffix (v1.4.2-dirty.3f9c2a1b). The device refuses an upload
+whose X-Firmware-Version equals its own, so two different dirty builds
+must not share a version.
+
+Enabled in platformio.ini with
+    extra_scripts = pre:tools/build_identity.py
+"""
+import hashlib
+import subprocess
+
+Import("env")  # noqa: F821 (provided by PlatformIO)
+
+
+def git_output(*args):
+    try:
+        return subprocess.check_output(
+            ["git"] + list(args), cwd=env.subst("$PROJECT_DIR"), stderr=subprocess.DEVNULL
+        )
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def git(*args):
+    output = git_output(*args)
+    return output.decode().strip() if output is not None else None
+
+
+def changes_hash():
+    """Short hash of the uncommitted changes to tracked files"""
+    diff = git_output("diff", "HEAD", "--binary")
+    return hashlib.sha256(diff or b"").hexdigest()[:8]
+
+
+build_flags = str(env.GetProjectOption("build_flags", ""))
+defines = []
+
+if "OTA_FIRMWARE_VERSION" not in build_flags:
+    version = git("describe", "--tags", "--always", "--dirty")
+    if version and version.endswith("-dirty"):
+        version += "." + changes_hash()
+    if version:
+        defines.append(("OTA_FIRMWARE_VERSION", env.StringifyMacro(version)))
+
+if "OTA_GIT_HASH" not in build_flags:
+    git_hash = git("rev-parse", "--short", "HEAD")
+    if git_hash:
+        defines.append(("OTA_GIT_HASH", env.StringifyMacro(git_hash)))
+
+env.Append(CPPDEFINES=defines)
@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+"""
+Build a delta OTA patch for the device's streaming patch applier.
+
+The patch turns OLD (the firmware.bin currently running on the device)
+into NEW. It uses bsdiff's algorithm, but interleaves each control record
+with its diff and extra bytes so the device can apply the patch as it
+streams in (see src/OTADeltaPatch.h for the layout).
+
+Usage:
+    pip install bsdiff4
+    python tools/make_delta.py old/firmware.bin new/firmware.bin firmware.delta [--gzip]
+
+Upload the resulting file on the /update page like a normal firmware
+image. With --gzip the patch is also compressed, which usually shrinks it
+much further since diff runs are mostly zeros.
+"""
+import argparse
+import gzip
+import hashlib
+import struct
+import sys
+
+import bsdiff4.core
+
+MAGIC = b"ESPDLT01"
+
+
+def make_patch(old, new):
+    control, diff, extra = bsdiff4.core.diff(old, new)
+
+    out = bytearray()
+    out += MAGIC
+    out += struct.pack("<I", len(new))
+    out += hashlib.sha256(new).digest()
+
+    diff_pos = 0
+    extra_pos = 0
+    for diff_len, extra_len, seek in control:
+        out += struct.pack("<qqq", diff_len, extra_len, seek)
+        out += diff[diff_pos:diff_pos + diff_len]
+        out += extra[extra_pos:extra_pos + extra_len]
+        diff_pos += diff_len
+        extra_pos += extra_len
+
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Build a streaming delta OTA patch")
+    parser.add_argument("old", help="firmware currently running on the device")
+    parser.add_argument("new", help="firmware to update to")
+    parser.add_argument("patch", help="output patch file")
+    parser.add_argument("--gzip", action="store_true", help="gzip-compress the patch")
+    args = parser.parse_args()
+
+    with open(args.old, "rb") as f:
+        old = f.read()
+    with open(args.new, "rb") as f:
+        new = f.read()
+
+    patch = make_patch(old, new)
+    if args.gzip:
+        patch = gzip.compress(patch, compresslevel=9)
+
+    with open(args.patch, "wb") as f:
+        f.write(patch)
+
+    print("%s: %d bytes (%.1f%% of %d-byte image)"
+          % (args.patch, len(patch), 100.0 * len(patch) / len(new), len(new)), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,44 @@
+#!/usr/bin/env python3
+"""
+Write the JSON manifest the device's pull client checks for updates.
+
+Usage:
+    python tools/make_manifest.py firmware.bin 1.4.2 http://192.168.1.10:8000/firmware.bin > manifest.json
+
+Serve manifest.json and firmware.bin from any HTTP server, e.g.
+    python -m http.server 8000
+and build the firmware with
+    -DOTA_PULL_MANIFEST_URL=\\"http://192.168.1.10:8000/manifest.json\\"
+
+The version must match what the new firmware reports as its own version
+(OTA_FIRMWARE_VERSION, which tools/build_identity.py sets from
+`git describe`), or the device will download it again after rebooting.
+"""
+import argparse
+import hashlib
+import json
+import sys
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Write a pull-mode OTA manifest")
+    parser.add_argument("firmware", help="firmware .bin file")
+    parser.add_argument("version", help="version string of this firmware")
+    parser.add_argument("url", help="URL the device downloads the firmware from")
+    args = parser.parse_args()
+
+    with open(args.firmware, "rb") as f:
+        data = f.read()
+
+    manifest = {
+        "version": args.version,
+        "size": len(data),
+        "sha256": hashlib.sha256(data).hexdigest(),
+        "url": args.url,
+    }
+    json.dump(manifest, sys.stdout, indent=2)
+    sys.stdout.write("\n")
+
+
+if __name__ == "__main__":
+    main()
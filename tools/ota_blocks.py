@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+"""
+Update the device by sending only the 4 KB blocks that changed.
+
+The device compares the SHA-256 of every block of the new image with the
+same block of its running partition and replies with a bitmap of the
+blocks it needs (POST /ota/blocks). Only those are sent (PUT
+/ota/blocks/data); the rest are copied from the running partition on the
+device. The full image's SHA-256 is checked before it is booted.
+
+Usage:
+    python tools/ota_blocks.py 192.168.1.100 .pio/build/<env>/firmware.bin
+
+To try the algorithm without a device, --simulate plans and rebuilds the
+image against file-backed partitions: the running slot is read from a
+file (e.g. the firmware.bin the device runs now), and the rebuilt inactive
+slot is checked against the new image:
+    python tools/ota_blocks.py --simulate old/firmware.bin - new/firmware.bin
+"""
+import argparse
+import hashlib
+import http.client
+import sys
+
+BLOCK_SIZE = 4096
+# Bytes of a flash partition that was erased but never written
+ERASED = b"\xff"
+
+
+def split_blocks(data):
+    return [data[i:i + BLOCK_SIZE] for i in range(0, len(data), BLOCK_SIZE)]
+
+
+def block_hashes(data):
+    return b"".join(hashlib.sha256(block).digest() for block in split_blocks(data))
+
+
+def is_needed(bitmap, block):
+    return bitmap[block // 8] >> (block % 8) & 1
+
+
+def needed_body(data, bitmap):
+    return b"".join(block for i, block in enumerate(split_blocks(data)) if is_needed(bitmap, i))
+
+
+def request(args, method, path, body=None, headers=None):
+    conn = http.client.HTTPConnection(args.host, args.port, timeout=args.timeout)
+    try:
+        conn.request(method, path, body=body, headers=headers or {})
+        response = conn.getresponse()
+        return response.status, response.read().decode(errors="replace")
+    finally:
+        conn.close()
+
+
+def plan_on_device(args, data):
+    """Ask the device which blocks it needs; returns the bitmap."""
+    path = "/ota/blocks?size=%d&sha256=%s%s" % (len(data), hashlib.sha256(data).hexdigest(),
+                                                 "&force=1" if args.force else "")
+    status, body = request(args, "POST", path, block_hashes(data),
+                           {"Content-Type": "application/octet-stream"})
+    if status != 200:
+        raise RuntimeError("block plan failed: %d %s" % (status, body))
+    return bytes.fromhex(body.strip())
+
+
+def plan_on_file(running, data):
+    """What the device does in otaBlocksPlan(), against a running-slot file."""
+    hashes = block_hashes(data)
+    blocks = split_blocks(data)
+    bitmap = bytearray((len(blocks) + 7) // 8)
+    for i, block in enumerate(blocks):
+        offset = i * BLOCK_SIZE
+        same = (offset + len(block) <= len(running) and
+                hashlib.sha256(running[offset:offset + len(block)]).digest() == hashes[i * 32:i * 32 + 32])
+        if not same:
+            bitmap[i // 8] |= 1 << (i % 8)
+    return bytes(bitmap)
+
+
+def rebuild_on_file(running, size, bitmap, body):
+    """What the device does with /ota/blocks/data, into an inactive-slot image."""
+    image = bytearray()
+    for i in range((size + BLOCK_SIZE - 1) // BLOCK_SIZE):
+        length = min(BLOCK_SIZE, size - i * BLOCK_SIZE)
+        if is_needed(bitmap, i):
+            image += body[:length]
+            body = body[length:]
+        else:
+            image += running[i * BLOCK_SIZE:i * BLOCK_SIZE + length]
+    if body:
+        raise RuntimeError("more block data than requested")
+    return bytes(image)
+
+
+def report(data, bitmap):
+    blocks = len(split_blocks(data))
+    needed = sum(is_needed(bitmap, i) for i in range(blocks))
+    sent = len(needed_body(data, bitmap))
+    print("Sending %d of %d blocks, %d of %d bytes (%.0f%% saved)" %
+          (needed, blocks, sent, len(data), 100.0 * (len(data) - sent) / len(data)), file=sys.stderr)
+
+
+def simulate(args, data):
+    with open(args.simulate, "rb") as f:
+        running = f.read()
+    # The rest of the running partition, as far as the new image reaches
+    running += ERASED * max(0, len(data) - len(running))
+
+    bitmap = plan_on_file(running, data)
+    report(data, bitmap)
+    image = rebuild_on_file(running, len(data), bitmap, needed_body(data, bitmap))
+    if hashlib.sha256(image).digest() != hashlib.sha256(data).digest():
+        print("Rebuilt image does not match", file=sys.stderr)
+        return 1
+    print("Rebuilt image matches (SHA-256 %s)" % hashlib.sha256(image).hexdigest(), file=sys.stderr)
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Block-dedup OTA update")
+    parser.add_argument("host", help="device IP address or hostname ('-' with --simulate)")
+    parser.add_argument("firmware", help="new firmware .bin file")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--timeout", type=float, default=60.0, help="socket timeout in seconds")
+    parser.add_argument("--force", action="store_true", help="update even if the device runs this image")
+    parser.add_argument("--simulate", metavar="RUNNING_BIN",
+                        help="plan and rebuild against this file instead of a device")
+    args = parser.parse_args()
+
+    with open(args.firmware, "rb") as f:
+        data = f.read()
+
+    if args.simulate:
+        return simulate(args, data)
+
+    try:
+        bitmap = plan_on_device(args, data)
+        report(data, bitmap)
+        status, body = request(args, "PUT", "/ota/blocks/data", needed_body(data, bitmap),
+                               {"Content-Type": "application/octet-stream"})
+        if status != 200:
+            raise RuntimeError("block upload failed: %d %s" % (status, body))
+    except (OSError, http.client.HTTPException, RuntimeError) as e:
+        print(e, file=sys.stderr)
+        return 1
+
+    print("Update complete, device is rebooting", file=sys.stderr)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,420 @@
+#!/usr/bin/env python3
+"""
+Follow the device's /ota/events stream, or load-test it.
+
+    python tools/ota_events.py watch 192.168.1.100
+    python tools/ota_events.py load 192.168.1.100 --subscribers 20 --slow 5 --duration 60
+    python tools/ota_events.py simulate --subscribers 20 --slow 5
+
+watch prints every event as it arrives. load opens many subscribers at
+once, some of them slow readers with a small receive buffer that only
+catch up in the last five seconds. Start an
+upload (e.g. tools/ota_upload.py) while it runs. It then reports what each
+subscriber received: progress messages, the longest gap between them,
+resyncs (snapshots after falling a ring behind) and whether it saw the
+update end. Streams refused with 503 because all
+OTA_EVENTS_MAX_SUBSCRIBERS slots (8 by default) were taken are listed
+too: with 20 subscribers against a default build, 12 are refused.
+
+simulate runs the same subscribers against a model of the device
+(src/OTAEventStream.h) on the loopback interface. The model has the same
+ring of shared messages and one cursor per subscriber, fills each socket
+only up to an lwIP send buffer on a half-second poll, and publishes
+coalesced progress from a simulated upload with a stall and a WiFi drop.
+It reports the most the server ever held for one subscriber, which stays
+under one send buffer however slow the reader is. A slow reader falls a
+ring behind only once that buffer and its own receive window are full,
+so give it a minute.
+"""
+import argparse
+import json
+import random
+import selectors
+import socket
+import struct
+import sys
+import threading
+import time
+
+RING_SIZE = 16                 # OTA_EVENTS_RING_SIZE
+INTERVAL = 0.5                 # OTA_EVENTS_INTERVAL_MS
+STALL = 1.0                    # OTA_EVENTS_STALL_MS
+RATE_WEIGHT = 0.3              # OTA_EVENTS_RATE_WEIGHT
+POLL = 0.5                     # AsyncTCP poll interval
+SEND_BUFFER = 5744             # lwIP TCP_SND_BUF
+RETRY = b"retry: 2000\n\n"
+
+
+class Subscriber(threading.Thread):
+    """One /ota/events client; slow ones read a little at a time"""
+
+    def __init__(self, host, port, slow_delay, duration):
+        super().__init__(daemon=True)
+        self.host, self.port = host, port
+        self.slow_delay = slow_delay
+        self.deadline = time.monotonic() + duration
+        self.status = None
+        self.events = []       # (time, event, data)
+        self.resyncs = -1      # The first snapshot isn't a resync
+        self.error = None
+
+    def run(self):
+        try:
+            self.stream()
+        except (OSError, ValueError) as e:
+            self.error = str(e)
+
+    def stream(self):
+        sock = socket.socket()
+        if self.slow_delay:
+            sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 2048)
+        sock.settimeout(2)
+        sock.connect((self.host, self.port))
+        sock.sendall(b"GET /ota/events HTTP/1.1\r\nHost: %s\r\nAccept: text/event-stream\r\n\r\n" %
+                     self.host.encode())
+        raw = b""
+        while b"\r\n\r\n" not in raw:
+            data = sock.recv(4096)
+            if not data:
+                raise ValueError("closed before the headers")
+            raw += data
+        head, raw = raw.split(b"\r\n\r\n", 1)
+        self.status = int(head.split(b" ")[1])
+        if self.status != 200:
+            sock.close()
+            return
+        chunked = b"transfer-encoding: chunked" in head.lower()
+
+        body = b""
+        while time.monotonic() < self.deadline:
+            # Undo the chunked framing as far as it has arrived
+            while chunked:
+                line_end = raw.find(b"\r\n")
+                if line_end < 0:
+                    break
+                size = int(raw[:line_end], 16)
+                if len(raw) < line_end + 2 + size + 2:
+                    break
+                body += raw[line_end + 2:line_end + 2 + size]
+                raw = raw[line_end + 2 + size + 2:]
+            if not chunked:
+                body, raw = body + raw, b""
+            body = self.parse(body)
+
+            # Slow readers catch up at the end, like a tab brought back
+            is_slow = self.slow_delay and time.monotonic() < self.deadline - 5
+            try:
+                data = sock.recv(64 if is_slow else 65536)
+            except socket.timeout:
+                continue
+            if not data:
+                break
+            raw += data
+            if is_slow:
+                time.sleep(self.slow_delay)
+        sock.close()
+
+    def parse(self, body):
+        while b"\n\n" in body:
+            block, body = body.split(b"\n\n", 1)
+            event, data = "message", ""
+            for line in block.decode().split("\n"):
+                if line.startswith("retry:"):
+                    self.resyncs += 1
+                elif line.startswith("event:"):
+                    event = line[6:].strip()
+                elif line.startswith("data:"):
+                    data = line[5:].strip()
+            if data:
+                self.events.append((time.monotonic(), event, data))
+        return body
+
+
+def watch(args):
+    subscriber = Subscriber(args.host, args.port, 0, float("inf"))
+    seen = 0
+    subscriber.start()
+    t0 = time.monotonic()
+    while subscriber.is_alive():
+        subscriber.join(0.1)
+        for at, event, data in subscriber.events[seen:]:
+            print("%7.2f  %-8s %s" % (at - t0, event, data))
+        seen = len(subscriber.events)
+    if subscriber.status != 200:
+        print("HTTP %s" % subscriber.status, file=sys.stderr)
+    return 0 if subscriber.error is None else 1
+
+
+def run_subscribers(host, port, args):
+    subscribers = []
+    for i in range(args.subscribers):
+        slow = args.slow_delay if i < args.slow else 0
+        subscribers.append(Subscriber(host, port, slow, args.duration))
+    for s in subscribers:
+        s.start()
+    for s in subscribers:
+        s.join()
+    return subscribers
+
+
+def report(subscribers):
+    streamed = sum(s.status == 200 for s in subscribers)
+    refused = sum(s.status == 503 for s in subscribers)
+    print("%d subscribers: %d streamed, %d refused (503)" % (len(subscribers), streamed, refused),
+          file=sys.stderr)
+    for i, s in enumerate(subscribers):
+        if s.status == 503:
+            print("  #%-2d %-4s refused: 503 Too many subscribers" % (i, "slow" if s.slow_delay else "fast"),
+                  file=sys.stderr)
+            continue
+        if s.status != 200:
+            print("  #%-2d failed: %s" % (i, s.error or "HTTP %s" % s.status), file=sys.stderr)
+            continue
+        progress = [at for at, event, _ in s.events if event == "progress"]
+        gap = max((b - a for a, b in zip(progress, progress[1:])), default=0)
+        ended = [data for _, event, data in s.events if event == "ota" and "started" not in data]
+        last = next((data for _, event, data in reversed(s.events) if event == "progress"), "-")
+        print("  #%-2d %-4s %3d events, %3d progress, max gap %4.1f s, %d resyncs, end %s, last %s" %
+              (i, "slow" if s.slow_delay else "fast", len(s.events), len(progress), gap, max(s.resyncs, 0),
+               json.loads(ended[-1])["state"] if ended else "-", last), file=sys.stderr)
+    return 0 if all(s.status in (200, 503) for s in subscribers) else 1
+
+
+def load(args):
+    return report(run_subscribers(args.host, args.port, args))
+
+
+class DeviceModel:
+    """The ring, cursors and progress coalescing of OTAEventStream.h"""
+
+    def __init__(self, max_subscribers):
+        self.max_subscribers = max_subscribers
+        self.ring = [b""] * RING_SIZE
+        self.latest = {"ota": b"", "progress": b"", "wifi": b"", "portal": b""}
+        self.head = 0
+        self.clients = {}
+        self.max_held = 0
+        self.resyncs = 0
+        self.last_bytes = 0
+        self.last_time = time.monotonic()
+        self.rate = 0.0
+
+    def publish(self, event, data):
+        message = b"event: %s\ndata: %s\n\n" % (event.encode(), json.dumps(data, separators=(",", ":")).encode())
+        self.ring[self.head % RING_SIZE] = message
+        self.latest[event] = message
+        self.head += 1
+
+    def start_transfer(self):
+        self.last_bytes, self.last_time, self.rate = 0, time.monotonic(), 0.0
+        self.latest["progress"] = b""
+        self.publish("ota", {"state": "started"})
+
+    def progress(self, done, total, final=False):
+        """publishOTAStreamProgress()"""
+        now = time.monotonic()
+        elapsed = now - self.last_time
+        stalled = done == self.last_bytes
+        if stalled and (self.rate == 0 or (not final and elapsed < STALL)):
+            return
+        if not final and elapsed < INTERVAL:
+            return
+        if elapsed > 0:
+            sample = (done - self.last_bytes) / elapsed if done >= self.last_bytes else 0
+            self.rate = sample if self.rate == 0 else RATE_WEIGHT * sample + (1 - RATE_WEIGHT) * self.rate
+            if self.rate < 1:
+                self.rate = 0
+        self.last_bytes, self.last_time = done, now
+        eta = round((total - done) / self.rate) if self.rate > 0 else -1
+        self.publish("progress", {"bytes": done, "total": total, "rate": int(self.rate), "eta": eta})
+
+    def fill(self, client, space):
+        """fillOTAStream(): what fits of the client's messages, or b"" """
+        out = b""
+        if not client["snapshot"] and self.head - client["cursor"] > RING_SIZE:
+            client["snapshot"] = True
+            self.resyncs += 1
+        if client["snapshot"]:
+            snapshot = RETRY + b"".join(self.latest.values())
+            if len(snapshot) <= space:
+                out = snapshot
+                client["snapshot"] = False
+                client["cursor"] = self.head
+        while not client["snapshot"] and client["cursor"] != self.head:
+            message = self.ring[client["cursor"] % RING_SIZE]
+            if len(out) + len(message) > space:
+                break
+            out += message
+            client["cursor"] += 1
+        return out
+
+
+def unacked(conn):
+    """Bytes sent to the peer that it hasn't taken yet (Linux SIOCOUTQ)"""
+    try:
+        import fcntl
+        import termios
+        return struct.unpack("i", fcntl.ioctl(conn, termios.TIOCOUTQ, b"\0" * 4))[0]
+    except (ImportError, AttributeError, OSError):
+        return 0
+
+
+def serve(model, lock, listener, stop):
+    """The web server side: accept, route, and fill streams on the poll"""
+    selector = selectors.DefaultSelector()
+    selector.register(listener, selectors.EVENT_READ)
+    requests = {}
+    next_poll = time.monotonic()
+    while not stop.is_set():
+        for key, _ in selector.select(0.02):
+            if key.fileobj is listener:
+                conn, _ = listener.accept()
+                conn.setblocking(False)
+                requests[conn] = b""
+                selector.register(conn, selectors.EVENT_READ)
+                continue
+            conn = key.fileobj
+            try:
+                data = conn.recv(4096)
+            except OSError:
+                data = b""
+            if conn in requests:
+                requests[conn] += data
+                if b"\r\n\r\n" in requests[conn]:
+                    route(model, conn, requests.pop(conn))
+                    if conn not in model.clients:
+                        selector.unregister(conn)
+                        conn.close()
+                    continue
+            if not data:
+                selector.unregister(conn)
+                requests.pop(conn, None)
+                model.clients.pop(conn, None)
+                conn.close()
+
+        # Like AsyncClient::space(), a fill only gets what the send buffer
+        # has room for next to the bytes the peer hasn't taken yet
+        now = time.monotonic()
+        is_poll = now >= next_poll
+        if is_poll:
+            next_poll = now + POLL
+        for conn, client in list(model.clients.items()):
+            try:
+                if client["pending"]:
+                    sent = conn.send(client["pending"])
+                    client["pending"] = client["pending"][sent:]
+                    continue
+                if not is_poll:
+                    continue
+                in_flight = unacked(conn)
+                with lock:
+                    data = model.fill(client, SEND_BUFFER - in_flight - 8)
+                if data:
+                    frame = b"%x\r\n%s\r\n" % (len(data), data)
+                    model.max_held = max(model.max_held, in_flight + len(frame))
+                    sent = conn.send(frame)
+                    client["pending"] = frame[sent:]
+            except BlockingIOError:
+                pass
+            except OSError:
+                selector.unregister(conn)
+                del model.clients[conn]
+                conn.close()
+    for conn in list(model.clients):
+        conn.close()
+    selector.close()
+
+
+def route(model, conn, request):
+    line = request.split(b"\r\n", 1)[0]
+    conn.setblocking(True)
+    if not line.startswith(b"GET /ota/events "):
+        conn.sendall(b"HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n")
+    elif len(model.clients) >= model.max_subscribers:
+        body = b"Too many subscribers"
+        conn.sendall(b"HTTP/1.1 503 Service Unavailable\r\nContent-Length: %d\r\n\r\n%s" % (len(body), body))
+    else:
+        conn.sendall(b"HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+                     b"Transfer-Encoding: chunked\r\n\r\n")
+        model.clients[conn] = {"cursor": 0, "snapshot": True, "pending": b""}
+    conn.setblocking(False)
+
+
+def upload(model, lock, args, stop):
+    """A transfer at about --rate KB/s that stalls halfway while WiFi drops"""
+    rng = random.Random(args.seed)
+    total = int(args.rate * 1024 * args.duration * 0.6)
+    done = 0
+    with lock:
+        model.publish("wifi", {"state": "connected", "ip": "127.0.0.1"})
+    time.sleep(1)
+    with lock:
+        model.start_transfer()
+    stall_at = total // 2
+    while done < total and not stop.is_set():
+        time.sleep(0.05)
+        if stall_at <= done < stall_at + 1:
+            with lock:
+                model.publish("wifi", {"state": "disconnected"})
+            time.sleep(args.duration * 0.15)
+            with lock:
+                model.publish("wifi", {"state": "connected", "ip": "127.0.0.1"})
+            stall_at = -1
+        done = min(total, done + int(args.rate * 1024 * 0.05 * rng.uniform(0.5, 1.5)))
+        with lock:
+            model.progress(done, total)
+    with lock:
+        model.progress(done, total, final=True)
+        model.publish("ota", {"state": "finished"})
+
+
+def simulate(args):
+    model = DeviceModel(args.max_subscribers)
+    lock = threading.Lock()
+    listener = socket.socket()
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind(("127.0.0.1", 0))
+    listener.listen(64)
+    listener.setblocking(False)
+    stop = threading.Event()
+
+    server = threading.Thread(target=serve, args=(model, lock, listener, stop), daemon=True)
+    server.start()
+    publisher = threading.Thread(target=upload, args=(model, lock, args, stop), daemon=True)
+    publisher.start()
+
+    subscribers = run_subscribers("127.0.0.1", listener.getsockname()[1], args)
+    stop.set()
+    server.join()
+    listener.close()
+    status = report(subscribers)
+    print("Server held at most %d bytes for one subscriber (send buffer %d); ring %d messages, %d published, "
+          "%d resyncs" % (model.max_held, SEND_BUFFER, RING_SIZE, model.head, model.resyncs), file=sys.stderr)
+    return status
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Follow or load-test /ota/events")
+    parser.add_argument("command", choices=["watch", "load", "simulate"])
+    parser.add_argument("host", nargs="?", help="device IP address or hostname")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--subscribers", type=int, default=20)
+    parser.add_argument("--slow", type=int, default=5, help="how many subscribers read slowly")
+    parser.add_argument("--slow-delay", type=float, default=5.0,
+                        help="seconds between a slow reader's 64-byte reads")
+    parser.add_argument("--duration", type=float, default=90, help="seconds each subscriber stays connected")
+    parser.add_argument("--max-subscribers", type=int, default=8,
+                        help="simulate: OTA_EVENTS_MAX_SUBSCRIBERS of the model")
+    parser.add_argument("--rate", type=float, default=200, help="simulate: upload rate in KB/s")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    if args.command == "simulate":
+        return simulate(args)
+    if not args.host:
+        parser.error("%s needs the device's host" % args.command)
+    return watch(args) if args.command == "watch" else load(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
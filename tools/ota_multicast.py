@@ -0,0 +1,549 @@
+#!/usr/bin/env python3
+"""
+Send a firmware image to every device in a multicast group at once.
+
+The image is cut into groups of --group-symbols symbols of --symbol-size
+bytes (a group must be a whole number of 4 KB flash sectors). Each group
+is sent as its source symbols plus --overhead repair symbols of a
+Cauchy Reed-Solomon code (src/ErasureCode.h), and any k symbols of a
+group rebuild it. After each round the sender sends ROUND_END and waits
+for NACKs. Devices that can't decode a group yet name it and say how many
+symbols it lacks, for as many groups as their buffers can rebuild at
+once. The next round sends that many fresh repair symbols for each named
+group, which serve every device that is short on it. The sender stops
+once a round ends without NACKs.
+
+Devices built with -DOTA_MULTICAST_GROUP=\\"239.255.0.1\\" (src/OTAMulticast.h)
+join on their own. Multicast frames go out at the AP's basic rate without
+link-layer retries, so keep --rate low enough for the slowest device
+to erase and write (about 100 packets/s of 1 KB).
+
+Usage:
+    python tools/ota_multicast.py send .pio/build/<env>/firmware.bin
+
+The simulate command runs the sender against simulated devices on the
+loopback interface. Every device drops each packet it receives, and each
+NACK it sends, with probability --loss. It then compares the airtime
+used with sending the image to each device over TCP:
+    python tools/ota_multicast.py simulate firmware.bin --devices 300 --loss 0.05
+"""
+import argparse
+import hashlib
+import random
+import socket
+import struct
+import sys
+import threading
+import time
+
+MAGIC = 0x314D544F  # "OTM1"
+HEADER = struct.Struct("<IBBHIIHBB")
+ANNOUNCE, SYMBOL, ROUND_END, DONE, NACK = 1, 2, 3, 4, 16
+SECTOR_SIZE = 4096
+MAX_GROUP_SYMBOLS = 64  # FEC_MAX_SYMBOLS on the device
+SPARE_BUFFERS = 32      # OTA_MULTICAST_SPARE_BUFFERS on the device
+
+# Control packets are repeated, they have no repair symbols
+CONTROL_REPEAT = 3
+
+# Airtime model: per-frame contention and PHY preamble (DIFS, average
+# backoff, preamble), 802.11 MAC header/LLC/FCS, IP+UDP and IP+TCP
+# headers, and SIFS plus ACK for unicast frames
+FRAME_OVERHEAD_US = 120
+MAC_BYTES = 36
+UDP_IP_BYTES = 28
+TCP_IP_BYTES = 40
+LINK_ACK_US = 60
+TCP_MSS = 1460
+
+# GF(2^8), polynomial 0x11D, as on the device
+EXP = [0] * 512
+LOG = [0] * 256
+_x = 1
+for _i in range(255):
+    EXP[_i] = _x
+    LOG[_x] = _i
+    _x <<= 1
+    if _x & 0x100:
+        _x ^= 0x11D
+for _i in range(255, 512):
+    EXP[_i] = EXP[_i - 255]
+
+
+def gf_mul(a, b):
+    return EXP[LOG[a] + LOG[b]] if a and b else 0
+
+
+def gf_inv(a):
+    return EXP[255 - LOG[a]]
+
+
+# MUL[c] maps each byte b to c*b, for bytes.translate()
+MUL = [bytes(gf_mul(c, b) for b in range(256)) for c in range(256)]
+
+
+def coefficient(x, i):
+    return gf_inv(x ^ i)
+
+
+def mul_add(acc, row, c):
+    """acc ^ c*row"""
+    if c == 0:
+        return acc
+    product = int.from_bytes(row.translate(MUL[c]), "little")
+    return (int.from_bytes(acc, "little") ^ product).to_bytes(len(acc), "little")
+
+
+def encode_repair(sources, x):
+    acc = 0
+    for i, source in enumerate(sources):
+        acc ^= int.from_bytes(source.translate(MUL[coefficient(x, i)]), "little")
+    return acc.to_bytes(len(sources[0]), "little")
+
+
+def decode_group(k, rows):
+    """Rebuild the k sources of a group from k distinct symbols {index: bytes}"""
+    sources = {i: rows[i] for i in rows if i < k}
+    missing = [i for i in range(k) if i not in sources]
+    repairs = [x for x in rows if x >= k][:len(missing)]
+    # Equations over the missing sources, known sources taken out
+    values = []
+    matrix = []
+    for x in repairs:
+        value = rows[x]
+        for i, source in sources.items():
+            value = mul_add(value, source, coefficient(x, i))
+        values.append(value)
+        matrix.append([coefficient(x, j) for j in missing])
+    m = len(missing)
+    for col in range(m):
+        pivot = next(r for r in range(col, m) if matrix[r][col])
+        matrix[col], matrix[pivot] = matrix[pivot], matrix[col]
+        values[col], values[pivot] = values[pivot], values[col]
+        inverse = gf_inv(matrix[col][col])
+        matrix[col] = [gf_mul(v, inverse) for v in matrix[col]]
+        values[col] = values[col].translate(MUL[inverse])
+        for r in range(m):
+            c = matrix[r][col]
+            if r != col and c:
+                matrix[r] = [a ^ gf_mul(c, b) for a, b in zip(matrix[r], matrix[col])]
+                values[r] = mul_add(values[r], values[col], c)
+    for j, value in zip(missing, values):
+        sources[j] = value
+    return b"".join(sources[i] for i in range(k))
+
+
+class Session:
+    """The image cut into groups, and the packets that carry it"""
+
+    def __init__(self, data, symbol_size, group_symbols, session_id):
+        if (symbol_size * group_symbols) % SECTOR_SIZE or group_symbols > MAX_GROUP_SYMBOLS:
+            raise ValueError("a group must be whole 4 KB sectors of at most %d symbols" % MAX_GROUP_SYMBOLS)
+        self.data = data
+        self.id = session_id
+        self.symbol_size = symbol_size
+        self.group_symbols = group_symbols
+        self.group_bytes = symbol_size * group_symbols
+        self.sha256 = hashlib.sha256(data).digest()
+        self.groups = []
+        for offset in range(0, len(data), self.group_bytes):
+            chunk = data[offset:offset + self.group_bytes]
+            k = (len(chunk) + symbol_size - 1) // symbol_size
+            chunk += b"\0" * (k * symbol_size - len(chunk))
+            self.groups.append([chunk[i * symbol_size:(i + 1) * symbol_size] for i in range(k)])
+        # Next symbol index to send per group, past the initial round
+        self.next_index = [len(g) for g in self.groups]
+
+    def packet(self, kind, group=0, index=0, k=0, payload=b""):
+        return HEADER.pack(MAGIC, kind, self.group_symbols, self.symbol_size, self.id,
+                           len(self.data), group, index, k) + payload
+
+    def symbol(self, group, index):
+        sources = self.groups[group]
+        k = len(sources)
+        if index >= 256:
+            # Repair indices used up; cycle through the sources
+            index %= k
+        payload = sources[index] if index < k else encode_repair(sources, index)
+        return self.packet(SYMBOL, group, index, k, payload)
+
+    def fresh_symbols(self, group, count):
+        first = self.next_index[group]
+        self.next_index[group] += count
+        return [self.symbol(group, first + n) for n in range(count)]
+
+
+def parse_nack(packet, session):
+    """{group: missing} from a NACK packet of this session"""
+    if len(packet) < HEADER.size:
+        return {}
+    magic, kind, _, _, sid, _, _, _, _ = HEADER.unpack_from(packet)
+    if magic != MAGIC or kind != NACK or sid != session.id:
+        return {}
+    entries = {}
+    for offset in range(HEADER.size, len(packet) - 2, 3):
+        group, missing = struct.unpack_from("<HB", packet, offset)
+        if group < len(session.groups):
+            entries[group] = max(entries.get(group, 0), missing)
+    return entries
+
+
+class Sender:
+    def __init__(self, sock, destination, session, args):
+        self.sock = sock
+        # A whole fleet answers a ROUND_END at once
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 << 20)
+        self.destination = destination
+        self.session = session
+        self.args = args
+        self.packets = 0
+        self.bytes = 0
+        self.repairs = 0
+        self.nacks = 0
+        self.rounds = 0
+        self.interval = 1.0 / args.rate if args.rate else 0
+        self.next_send = time.monotonic()
+        # Called before NACKs are collected (simulate: let the devices catch up)
+        self.before_collect = None
+
+    def send(self, packet):
+        if self.interval:
+            delay = self.next_send - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+            self.next_send = max(self.next_send, time.monotonic()) + self.interval
+        self.sock.sendto(packet, self.destination)
+        self.packets += 1
+        self.bytes += len(packet)
+
+    def control(self, kind, group=0, payload=b""):
+        for _ in range(CONTROL_REPEAT):
+            self.send(self.session.packet(kind, group, payload=payload))
+
+    def collect_nacks(self):
+        needed = {}
+        deadline = time.monotonic() + self.args.nack_wait
+        while True:
+            left = deadline - time.monotonic()
+            if left <= 0:
+                return needed
+            self.sock.settimeout(left)
+            try:
+                packet, _ = self.sock.recvfrom(2048)
+            except socket.timeout:
+                return needed
+            entries = parse_nack(packet, self.session)
+            if entries:
+                self.nacks += 1
+            for group, missing in entries.items():
+                needed[group] = max(needed.get(group, 0), missing)
+
+    def run(self):
+        s = self.session
+        repair = [max(1, round(len(g) * self.args.overhead)) if self.args.overhead else 0 for g in s.groups]
+        plan = {g: len(s.groups[g]) + repair[g] for g in range(len(s.groups))}
+        self.control(ANNOUNCE, payload=s.sha256)
+        quiet = 0
+        while True:
+            for group in sorted(plan):
+                if self.rounds == 0:
+                    symbols = [s.symbol(group, i) for i in range(plan[group])]
+                    s.next_index[group] = plan[group]
+                else:
+                    symbols = s.fresh_symbols(group, plan[group])
+                for packet in symbols:
+                    self.send(packet)
+                self.repairs += sum(1 for p in symbols if p[18] >= p[19])
+            # Late joiners learn the session here and NACK everything
+            self.control(ANNOUNCE, payload=s.sha256)
+            self.control(ROUND_END, self.rounds)
+            self.rounds += 1
+            if self.before_collect:
+                self.before_collect()
+            plan = self.collect_nacks()
+            log("Round %d: %d groups to repair" % (self.rounds, len(plan)))
+            # A NACK can be lost too; only stop after a few quiet rounds
+            quiet = 0 if plan else quiet + 1
+            if quiet >= self.args.quiet_rounds:
+                break
+            if self.rounds >= self.args.max_rounds:
+                self.control(DONE)
+                return False
+        self.control(DONE)
+        return True
+
+
+def airtime_seconds(frames, payload_bytes, mbps, link_acks):
+    us = frames * (FRAME_OVERHEAD_US + (LINK_ACK_US if link_acks else 0))
+    us += (payload_bytes + frames * MAC_BYTES) * 8 / mbps
+    return us / 1e6
+
+
+def unicast_airtime(size, devices, loss, mbps):
+    """TCP to each device: full segments plus a TCP ACK every other
+    segment, each frame retried by the link layer until it gets through"""
+    segments = (size + TCP_MSS - 1) // TCP_MSS
+    attempts = 1 / (1 - loss)
+    data = airtime_seconds(segments, size + segments * TCP_IP_BYTES, mbps, True)
+    acks = airtime_seconds(segments // 2, segments // 2 * TCP_IP_BYTES, mbps, True)
+    return devices * attempts * (data + acks), devices * attempts * (size + segments * TCP_IP_BYTES)
+
+
+def log(message):
+    print(message, file=sys.stderr)
+
+
+def report(sender, size, devices, loss, args):
+    mcast = airtime_seconds(sender.packets, sender.bytes + sender.packets * UDP_IP_BYTES, args.mcast_mbps, False)
+    ucast, ucast_bytes = unicast_airtime(size, devices, loss, args.unicast_mbps)
+    log("Multicast: %d packets (%d repair symbols), %.2f MB in %d rounds, %d NACKs; "
+        "airtime %.1f s at %g Mbit/s" % (sender.packets, sender.repairs, sender.bytes / 1e6,
+                                         sender.rounds, sender.nacks, mcast, args.mcast_mbps))
+    log("Unicast to %d devices: %.1f MB; airtime %.1f s at %g Mbit/s" %
+        (devices, ucast_bytes / 1e6, ucast, args.unicast_mbps))
+    log("Multicast needs %.1f%% of the unicast airtime" % (100.0 * mcast / ucast))
+
+
+class Device:
+    """A receiver as in OTAMulticast.h, with flash writes taking no time:
+    sources go straight to flash, repair symbols wait in a bounded pool
+    and are evicted the same way, and NACKs only ask for what fits"""
+
+    def __init__(self, keep_data):
+        self.keep_data = keep_data
+        self.session = None
+        self.seen = {}       # group -> source indices received
+        self.have = {}       # group -> sources received plus repair symbols held
+        self.held = {}       # (group, index) -> repair payload or None
+        self.flash = {}      # group -> {index: source}, or the decoded group
+        self.decoded = set()
+        self.nack_round = -1
+        self.image = None
+        self.asked = set()   # Groups in the last NACK
+        self.evicted = 0
+        self.dropped = 0
+
+    def handle(self, packet):
+        """Returns a NACK packet to send back, or None"""
+        magic, kind, group_symbols, symbol_size, sid, size, group, index, k = HEADER.unpack_from(packet)
+        if magic != MAGIC:
+            return None
+        if kind == ANNOUNCE and self.session is None:
+            self.session = (sid, size, symbol_size, group_symbols)
+            self.groups = (size + symbol_size * group_symbols - 1) // (symbol_size * group_symbols)
+            self.buffers = group_symbols + max(group_symbols, SPARE_BUFFERS)
+        if self.session is None or sid != self.session[0]:
+            return None
+        if kind == SYMBOL and group not in self.decoded:
+            self.store(group, index, k, packet[HEADER.size:] if self.keep_data else None)
+        elif kind == ROUND_END and group != self.nack_round:
+            self.nack_round = group
+            return self.nack()
+        return None
+
+    def store(self, group, index, k, payload):
+        seen = self.seen.setdefault(group, set())
+        if index in seen or (group, index) in self.held:
+            return
+        if index < k:
+            seen.add(index)
+            self.flash.setdefault(group, {})[index] = payload
+        elif len(self.held) < self.buffers or self.evict(group, k):
+            self.held[(group, index)] = payload
+        else:
+            self.dropped += 1
+            return
+        self.have[group] = self.have.get(group, 0) + 1
+        if self.have[group] == k:
+            self.decode(group, k)
+
+    def evict(self, group, k):
+        """Give up a repair symbol of another group: one not asked for
+        first, then the one missing the most. Never for a group further
+        from done, or not asked for when the other one was."""
+        victims = [key for key in self.held if key[0] != group]
+        if not victims:
+            return False
+        victim = min(victims, key=lambda key: (key[0] in self.asked, self.have[key[0]] - self.group_k(key[0])))
+        h = victim[0]
+        if (h in self.asked) > (group in self.asked):
+            return False
+        if (h in self.asked) == (group in self.asked) and \
+                self.group_k(h) - self.have[h] < k - self.have.get(group, 0):
+            return False
+        del self.held[victim]
+        self.have[victim[0]] -= 1
+        self.evicted += 1
+        return True
+
+    def decode(self, group, k):
+        rows = dict(self.flash.get(group, {}))
+        for key in [key for key in self.held if key[0] == group]:
+            rows[key[1]] = self.held.pop(key)
+        if self.keep_data:
+            self.flash[group] = decode_group(k, rows)
+        self.decoded.add(group)
+
+    def group_k(self, group):
+        _, size, symbol_size, group_symbols = self.session
+        left = size - group * symbol_size * group_symbols
+        return min(group_symbols, (left + symbol_size - 1) // symbol_size)
+
+    def nack(self):
+        """Ask for the groups whose repair symbols fit in the pool at once,
+        those already holding some first"""
+        todo = [g for g in range(self.groups) if g not in self.decoded]
+        holding = {key[0] for key in self.held}
+        budget = self.buffers
+        self.asked = set()
+        for g in [g for g in todo if g in holding] + [g for g in todo if g not in holding]:
+            need = self.group_k(g) - len(self.seen.get(g, ()))
+            if need <= budget:
+                budget -= need
+                self.asked.add(g)
+        missing = [(g, self.group_k(g) - self.have.get(g, 0)) for g in todo if g in self.asked]
+        if not missing:
+            return None
+        sid, size, symbol_size, group_symbols = self.session
+        header = HEADER.pack(MAGIC, NACK, 0, 0, sid, 0, 0, 0, 0)
+        return header + b"".join(struct.pack("<HB", g, n) for g, n in missing)
+
+    def is_complete(self):
+        return self.session is not None and len(self.decoded) == self.groups
+
+    def assemble(self):
+        _, size, _, _ = self.session
+        return b"".join(self.flash[g] for g in range(self.groups))[:size]
+
+
+def simulate(args, data):
+    rng = random.Random(args.seed)
+    devices = [Device(keep_data=(i == 0)) for i in range(args.devices)]
+    group_address = (args.group, args.port)
+
+    receiver = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    receiver.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    receiver.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 8 << 20)
+    receiver.bind(("", args.port))
+    receiver.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP,
+                        socket.inet_aton(args.group) + socket.inet_aton("127.0.0.1"))
+    receiver.settimeout(0.2)
+
+    sender_sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sender_sock.bind(("127.0.0.1", 0))
+    sender_sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, socket.inet_aton("127.0.0.1"))
+    sender_sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_LOOP, 1)
+
+    stop = threading.Event()
+    uplink = {"packets": 0, "bytes": 0}
+    received = [0]
+
+    def receive():
+        while not stop.is_set():
+            try:
+                packet, source = receiver.recvfrom(2048)
+            except socket.timeout:
+                continue
+            received[0] += 1
+            for device in devices:
+                if rng.random() < args.loss:
+                    continue
+                reply = device.handle(packet)
+                if reply is not None and rng.random() >= args.loss:
+                    receiver.sendto(reply, source)
+                    uplink["packets"] += 1
+                    uplink["bytes"] += len(reply)
+
+    thread = threading.Thread(target=receive, daemon=True)
+    thread.start()
+    session = Session(data, args.symbol_size, args.group_symbols, rng.getrandbits(32))
+    sender = Sender(sender_sock, group_address, session, args)
+
+    def catch_up():
+        deadline = time.monotonic() + 30
+        while received[0] < sender.packets and time.monotonic() < deadline:
+            time.sleep(0.01)
+
+    sender.before_collect = catch_up
+    t0 = time.monotonic()
+    sender.run()
+    elapsed = time.monotonic() - t0
+    time.sleep(0.3)
+    stop.set()
+    thread.join()
+
+    complete = sum(d.is_complete() for d in devices)
+    log("%d of %d devices complete after %.1f s (%d NACK packets, %d bytes uplink)" %
+        (complete, len(devices), elapsed, uplink["packets"], uplink["bytes"]))
+    # Repair symbols given up for lack of buffers had to be sent again
+    sources = sum(len(g) for g in session.groups)
+    log("Repair overhead %.1f%% of the %d source symbols; devices evicted %d and dropped %d "
+        "repair symbols (worst device %d)" %
+        (100.0 * sender.repairs / sources, sources, sum(d.evicted for d in devices),
+         sum(d.dropped for d in devices), max(d.evicted + d.dropped for d in devices)))
+    report(sender, len(data), args.devices, args.loss, args)
+
+    if not devices[0].is_complete():
+        return 1
+    image = devices[0].assemble()
+    if hashlib.sha256(image).digest() != session.sha256:
+        log("Device 0 rebuilt a different image")
+        return 1
+    log("Device 0 rebuilt the image (SHA-256 %s)" % hashlib.sha256(image).hexdigest())
+    return 0 if complete == len(devices) else 1
+
+
+def send(args, data):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.bind((args.interface or "", 0))
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, args.ttl)
+    if args.interface:
+        sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, socket.inet_aton(args.interface))
+    session = Session(data, args.symbol_size, args.group_symbols, random.getrandbits(32))
+    log("Session %08x: %d bytes in %d groups to %s:%d" %
+        (session.id, len(data), len(session.groups), args.group, args.port))
+    sender = Sender(sock, (args.group, args.port), session, args)
+    ok = sender.run()
+    log("Multicast: %d packets (%d repair symbols), %.2f MB in %d rounds, %d NACKs" %
+        (sender.packets, sender.repairs, sender.bytes / 1e6, sender.rounds, sender.nacks))
+    if not ok:
+        log("Gave up after %d rounds with devices still missing groups" % sender.rounds)
+        return 1
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Multicast OTA update with forward error correction")
+    parser.add_argument("command", choices=["send", "simulate"])
+    parser.add_argument("firmware", help="firmware .bin file")
+    parser.add_argument("--group", default="239.255.0.1", help="multicast group (OTA_MULTICAST_GROUP)")
+    parser.add_argument("--port", type=int, default=5007, help="UDP port (OTA_MULTICAST_PORT)")
+    parser.add_argument("--interface", help="local address of the interface to send on")
+    parser.add_argument("--ttl", type=int, default=1)
+    parser.add_argument("--symbol-size", type=int, default=1024)
+    parser.add_argument("--group-symbols", type=int, default=32)
+    parser.add_argument("--overhead", type=float, default=0.1,
+                        help="repair symbols sent with each group, as a fraction of it")
+    parser.add_argument("--rate", type=float, help="packets per second (default 100, simulate 500)")
+    parser.add_argument("--nack-wait", type=float, default=1.0, help="seconds to collect NACKs after a round")
+    parser.add_argument("--max-rounds", type=int, default=20)
+    parser.add_argument("--quiet-rounds", type=int, default=3,
+                        help="rounds without NACKs before the sender stops")
+    parser.add_argument("--devices", type=int, default=300, help="simulated devices")
+    parser.add_argument("--loss", type=float, default=0.05, help="simulated packet loss per device")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--mcast-mbps", type=float, default=6.0, help="rate multicast frames are sent at")
+    parser.add_argument("--unicast-mbps", type=float, default=54.0, help="rate unicast frames are sent at")
+    args = parser.parse_args()
+    if args.rate is None:
+        args.rate = 500 if args.command == "simulate" else 100
+
+    with open(args.firmware, "rb") as f:
+        data = f.read()
+    if args.command == "simulate":
+        return simulate(args, data)
+    return send(args, data)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+"""
+Upload firmware to the device from the command line, resuming after drops.
+
+Speaks the same protocol as the ElegantOTA page (/ota/start then a
+multipart POST to /ota/upload), plus the device's resume extension: when
+the connection drops mid-upload, the device keeps every complete flash
+sector, and this tool asks where to continue instead of starting over.
+
+Usage:
+    python tools/ota_upload.py 192.168.1.100 .pio/build/<env>/firmware.bin
+    python tools/ota_upload.py 192.168.1.100 firmware.bin --retries 20
+
+The SHA-256 of the image the device should end up with is sent along in
+an X-Image-SHA256 header (for gzip uploads, of the decompressed image),
+so the device verifies it before switching partitions.
+
+Nothing is sent if the device reports (GET /ota/identity) that it is
+already running this exact image; use --force to reinstall it anyway.
+
+Only plain .bin images can be resumed; compressed and delta uploads are
+sent in one piece (and restarted from the beginning on failure).
+"""
+import argparse
+import gzip
+import hashlib
+import http.client
+import json
+import sys
+import time
+import uuid
+
+
+def request(args, method, path, body=None, headers=None):
+    conn = http.client.HTTPConnection(args.host, args.port, timeout=args.timeout)
+    try:
+        conn.request(method, path, body=body, headers=headers or {})
+        response = conn.getresponse()
+        return response.status, response.read().decode(errors="replace")
+    finally:
+        conn.close()
+
+
+def query_resume_offset(args, md5):
+    """Return the offset of an interrupted upload of this image, or None."""
+    try:
+        status, body = request(args, "GET", "/ota/resume")
+    except OSError:
+        return None
+    if status != 200:
+        return None
+    state = json.loads(body)
+    return state["offset"] if state.get("hash", "").lower() == md5 else None
+
+
+def image_sha256(data):
+    """SHA-256 of the image the upload produces, or None for delta patches."""
+    if data[:2] == b"\x1f\x8b":
+        data = gzip.decompress(data)
+    if data[:8] == b"ESPDLT01":
+        return None  # The patch header carries the target hash itself
+    return hashlib.sha256(data).hexdigest()
+
+
+def is_running_image(args, data):
+    """Whether the device reports this file as its running image."""
+    try:
+        status, body = request(args, "GET", "/ota/identity")
+    except OSError:
+        return False
+    if status != 200:
+        return False
+    return json.loads(body).get("sha256", "") == hashlib.sha256(data).hexdigest()
+
+
+def upload_from(args, data, md5, resume):
+    """Run one start+upload round; returns the HTTP status of the upload."""
+    path = "/ota/start?mode=fr&hash=%s%s%s" % (md5, "&resume=1" if resume else "",
+                                               "&force=1" if args.force else "")
+    status, body = request(args, "GET", path)
+    if status != 200:
+        raise RuntimeError("start failed: %d %s" % (status, body))
+    offset = int(body) if resume and body.isdigit() else 0
+    if offset:
+        print("Resuming at %d of %d bytes" % (offset, len(data)), file=sys.stderr)
+
+    boundary = uuid.uuid4().hex
+    payload = (
+        ("--%s\r\nContent-Disposition: form-data; name=\"file\"; filename=\"firmware.bin\"\r\n"
+         "Content-Type: application/octet-stream\r\n\r\n" % boundary).encode()
+        + data[offset:]
+        + ("\r\n--%s--\r\n" % boundary).encode()
+    )
+    headers = {"Content-Type": "multipart/form-data; boundary=%s" % boundary}
+    sha256 = image_sha256(data)
+    if sha256:
+        headers["X-Image-SHA256"] = sha256
+    status, body = request(args, "POST", "/ota/upload?offset=%d" % offset, payload, headers)
+    if status != 200:
+        raise RuntimeError("upload failed: %d %s" % (status, body))
+    return status
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Upload firmware over OTA with resume")
+    parser.add_argument("host", help="device IP address or hostname")
+    parser.add_argument("firmware", help="firmware .bin (or .gz / delta) file")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--retries", type=int, default=10, help="attempts after a dropped connection")
+    parser.add_argument("--timeout", type=float, default=30.0, help="socket timeout in seconds")
+    parser.add_argument("--force", action="store_true", help="upload even if the device runs this image")
+    args = parser.parse_args()
+
+    with open(args.firmware, "rb") as f:
+        data = f.read()
+    md5 = hashlib.md5(data).hexdigest()
+
+    if not args.force and is_running_image(args, data):
+        print("Device is already running this image, nothing to do", file=sys.stderr)
+        return 0
+
+    resume = query_resume_offset(args, md5) is not None
+    for attempt in range(args.retries + 1):
+        try:
+            upload_from(args, data, md5, resume)
+            print("Upload complete, device is rebooting", file=sys.stderr)
+            return 0
+        except (OSError, http.client.HTTPException) as e:
+            print("Attempt %d: connection lost (%s)" % (attempt + 1, e), file=sys.stderr)
+            resume = True
+            time.sleep(2)
+        except RuntimeError as e:
+            print(e, file=sys.stderr)
+            return 1
+
+    print("Giving up after %d attempts" % (args.retries + 1), file=sys.stderr)
+    return 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,366 @@
+#!/usr/bin/env python3
+"""
+Simulate a fleet updating through the peer relay (src/OTAPeerRelay.h).
+
+Every simulated device is an HTTP server on the loopback interface. Once
+it has the image, it serves GET /ota/image with Range support. Devices
+check in one after another. Each one looks for seeders of the image's
+SHA-256 (a registry stands in for mDNS) and fetches 16 KB chunks from up
+to three of them in parallel. Chunks are committed in image order, and a
+chunk whose seeder failed goes back to the others. Whatever the peers
+didn't deliver comes from the central server, from the last whole 4 KB
+sector on. Uplinks are rate-limited, so the central server is the
+bottleneck it is in the field.
+
+The same fleet is then updated from the server alone for comparison:
+    python tools/simulate_peer_relay.py firmware.bin --devices 20
+"""
+import argparse
+import hashlib
+import http.client
+import random
+import re
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+CHUNK_SIZE = 16 * 1024   # OTA_PEER_CHUNK_SIZE
+MAX_SEEDERS = 3          # OTA_PEER_MAX_SEEDERS
+STALL_SECONDS = 10       # OTA_PEER_STALL_MS
+SECTOR_SIZE = 4096
+SEND_SIZE = 4096
+
+
+class Throttle:
+    """Token bucket shared by all connections of one uplink"""
+
+    def __init__(self, bytes_per_second):
+        self.rate = bytes_per_second
+        self.lock = threading.Lock()
+        self.next_free = time.monotonic()
+
+    def take(self, n):
+        with self.lock:
+            start = max(self.next_free, time.monotonic())
+            self.next_free = start + n / self.rate
+        delay = start - time.monotonic()
+        if delay > 0:
+            time.sleep(delay)
+
+
+def parse_range(header, size):
+    """(start, end) of a single "bytes=" range, as the device parses it"""
+    match = re.fullmatch(r"bytes=\s*(\d*)\s*-\s*(\d*)\s*", header)
+    if not match or not (match.group(1) or match.group(2)):
+        return None
+    if not match.group(1):
+        suffix = int(match.group(2))
+        if suffix == 0:
+            return None
+        return max(0, size - suffix), size - 1
+    start = int(match.group(1))
+    end = min(int(match.group(2)), size - 1) if match.group(2) else size - 1
+    return (start, end) if start < size and start <= end else None
+
+
+class ImageHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def do_GET(self):
+        node = self.server.node
+        image = node.served_image()
+        if self.path != node.path or image is None:
+            self.send_error(503 if self.path == node.path else 404)
+            return
+        start, end, status = 0, len(image) - 1, 200
+        if "Range" in self.headers:
+            parsed = parse_range(self.headers["Range"], len(image))
+            if parsed is None:
+                self.send_response(416)
+                self.send_header("Content-Range", "bytes */%d" % len(image))
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+            start, end = parsed
+            status = 206
+        self.send_response(status)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(end - start + 1))
+        self.send_header("Accept-Ranges", "bytes")
+        self.send_header("X-Image-SHA256", node.sha256)
+        if status == 206:
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (start, end, len(image)))
+        self.end_headers()
+
+        fail_at = None
+        if node.flaky and node.rng.random() < node.flaky:
+            fail_at = node.rng.randint(start, end)
+        for offset in range(start, end + 1, SEND_SIZE):
+            piece = image[offset:min(offset + SEND_SIZE, end + 1)]
+            if fail_at is not None and offset + len(piece) > fail_at:
+                # The seeder went away mid-response
+                self.close_connection = True
+                return
+            node.throttle.take(len(piece))
+            self.wfile.write(piece)
+            node.sent += len(piece)
+
+    def log_message(self, *args):
+        pass
+
+
+class Node:
+    """An HTTP uplink serving one image at one path"""
+
+    def __init__(self, path, sha256, rate, flaky, seed):
+        self.path = path
+        self.sha256 = sha256
+        self.throttle = Throttle(rate)
+        self.flaky = flaky
+        self.rng = random.Random(seed)
+        self.sent = 0
+        self.image = None
+        self.httpd = ThreadingHTTPServer(("127.0.0.1", 0), ImageHandler)
+        self.httpd.daemon_threads = True
+        self.httpd.node = self
+        self.port = self.httpd.server_address[1]
+        threading.Thread(target=self.httpd.serve_forever, daemon=True).start()
+
+    def served_image(self):
+        return self.image
+
+    def close(self):
+        self.httpd.shutdown()
+        self.httpd.server_close()
+
+
+class Registry:
+    """Stands in for mDNS: seeders and the image they advertise"""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.seeders = []
+
+    def advertise(self, device):
+        with self.lock:
+            self.seeders.append(device)
+
+    def find(self, sha256, exclude, rng):
+        with self.lock:
+            found = [d for d in self.seeders if d is not exclude and d.node.sha256 == sha256]
+        # mDNS answers come in no particular order
+        rng.shuffle(found)
+        return found[:MAX_SEEDERS]
+
+
+def get_range(conn, path, start, end, sha256):
+    """One Range request; returns the body or None"""
+    conn.request("GET", path, headers={"Range": "bytes=%d-%d" % (start, end)})
+    response = conn.getresponse()
+    body = response.read()
+    if (response.status != 206 or len(body) != end - start + 1 or
+            response.getheader("X-Image-SHA256", "").lower() != sha256):
+        return None
+    return body
+
+
+class PeerFetch:
+    """fetchOTAFromPeers(): one task per seeder, chunks committed in order"""
+
+    def __init__(self, seeders, size, sha256):
+        self.size = size
+        self.sha256 = sha256
+        self.chunk_count = (size + CHUNK_SIZE - 1) // CHUNK_SIZE
+        self.next_chunk = 0
+        self.retry = []
+        self.ready = {}  # chunk -> bytes, at most one per task
+        self.running = len(seeders)
+        self.cancelled = False
+        self.bytes = {}
+        self.cond = threading.Condition()
+        self.threads = [threading.Thread(target=self.worker, args=(s,), daemon=True) for s in seeders]
+
+    def take(self):
+        with self.cond:
+            if self.retry:
+                self.retry.sort(reverse=True)
+                return self.retry.pop()
+            if self.next_chunk < self.chunk_count:
+                self.next_chunk += 1
+                return self.next_chunk - 1
+            return None
+
+    def worker(self, seeder):
+        conn = http.client.HTTPConnection("127.0.0.1", seeder.node.port, timeout=5)
+        try:
+            while not self.cancelled:
+                chunk = self.take()
+                if chunk is None:
+                    break
+                start = chunk * CHUNK_SIZE
+                end = min(start + CHUNK_SIZE, self.size) - 1
+                try:
+                    body = get_range(conn, seeder.node.path, start, end, self.sha256)
+                except (OSError, http.client.HTTPException):
+                    body = None
+                if body is None:
+                    with self.cond:
+                        self.retry.append(chunk)
+                        self.cond.notify_all()
+                    break
+                with self.cond:
+                    self.bytes[seeder.name] = self.bytes.get(seeder.name, 0) + len(body)
+                    self.ready[chunk] = body
+                    self.cond.notify_all()
+                    # The buffer is reused once the chunk is written
+                    while chunk in self.ready and not self.cancelled:
+                        self.cond.wait()
+        finally:
+            conn.close()
+            with self.cond:
+                self.running -= 1
+                self.cond.notify_all()
+
+    def run(self, image):
+        """Fill image in order; returns the number of bytes committed"""
+        for t in self.threads:
+            t.start()
+        committed = 0
+        last_progress = time.monotonic()
+        with self.cond:
+            while committed < self.chunk_count:
+                if committed in self.ready:
+                    body = self.ready.pop(committed)
+                    image[committed * CHUNK_SIZE:committed * CHUNK_SIZE + len(body)] = body
+                    committed += 1
+                    last_progress = time.monotonic()
+                    self.cond.notify_all()
+                elif self.running == 0 or time.monotonic() - last_progress > STALL_SECONDS:
+                    break
+                elif self.ready and len(self.ready) == self.running:
+                    # releaseOTAPeerWorker(): every live task is parked past
+                    # the chunk a failed peer dropped
+                    furthest = max(self.ready)
+                    del self.ready[furthest]
+                    self.retry.append(furthest)
+                    self.cond.notify_all()
+                else:
+                    self.cond.wait(0.1)
+            self.cancelled = True
+            self.cond.notify_all()
+        for t in self.threads:
+            t.join()
+        return min(committed * CHUNK_SIZE, self.size)
+
+
+class Device:
+    def __init__(self, name, sha256, args, seed):
+        self.name = name
+        self.node = Node("/ota/image", sha256, args.device_kbps * 1024, args.flaky, seed)
+        self.rng = random.Random(seed)
+        self.from_server = 0
+        self.from_peers = {}
+        self.done_at = None
+
+    def update(self, server, registry, size, sha256, relay):
+        image = bytearray(size)
+        committed = 0
+        if relay:
+            seeders = registry.find(sha256, self, self.rng)
+            if seeders:
+                fetch = PeerFetch(seeders, size, sha256)
+                committed = fetch.run(image)
+                self.from_peers = fetch.bytes
+        # The rest from the server, from the last whole sector on
+        offset = committed if committed == size else committed // SECTOR_SIZE * SECTOR_SIZE
+        if offset < size:
+            conn = http.client.HTTPConnection("127.0.0.1", server.port, timeout=30)
+            body = get_range(conn, server.path, offset, size - 1, sha256)
+            conn.close()
+            if body is None:
+                raise RuntimeError("%s: server download failed" % self.name)
+            image[offset:] = body
+            self.from_server = len(body)
+        if hashlib.sha256(image).hexdigest() != sha256:
+            raise RuntimeError("%s: SHA-256 mismatch" % self.name)
+        # Rebooted, passed its self-test: seed
+        self.node.image = bytes(image)
+        registry.advertise(self)
+
+
+def run_fleet(args, data, relay):
+    sha256 = hashlib.sha256(data).hexdigest()
+    server = Node("/firmware.bin", sha256, args.server_kbps * 1024, 0, 0)
+    server.image = data
+    registry = Registry()
+    devices = [Device("device-%02d" % i, sha256, args, args.seed * 1000 + i) for i in range(args.devices)]
+    errors = []
+    t0 = time.monotonic()
+
+    def update(device):
+        try:
+            device.update(server, registry, len(data), sha256, relay)
+            device.done_at = time.monotonic() - t0
+        except (RuntimeError, OSError, http.client.HTTPException) as e:
+            errors.append(str(e))
+
+    threads = []
+    for i, device in enumerate(devices):
+        start = t0 + i * args.stagger
+        time.sleep(max(0, start - time.monotonic()))
+        thread = threading.Thread(target=update, args=(device,), daemon=True)
+        thread.start()
+        threads.append(thread)
+    for thread in threads:
+        thread.join()
+
+    elapsed = time.monotonic() - t0
+    for device in devices:
+        device.node.close()
+    server.close()
+    return devices, server.sent, elapsed, errors
+
+
+def report(title, devices, server_sent, elapsed, errors, size, verbose):
+    peers = sum(sum(d.from_peers.values()) for d in devices)
+    updated = sum(d.done_at is not None for d in devices)
+    print("%-9s %d of %d devices updated in %.1f s; server sent %.2f MB (%.1f images), peers %.2f MB" %
+          (title + ":", updated, len(devices), elapsed, server_sent / 1e6, server_sent / size, peers / 1e6),
+          file=sys.stderr)
+    if verbose:
+        for d in devices:
+            print("  %s done at %5.1f s: %7d bytes from server, peers %s" %
+                  (d.name, d.done_at or 0, d.from_server,
+                   ", ".join("%s %d" % p for p in sorted(d.from_peers.items())) or "-"), file=sys.stderr)
+    for e in errors:
+        print("  " + e, file=sys.stderr)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Simulate peer relay OTA on the host")
+    parser.add_argument("firmware", help="firmware .bin file")
+    parser.add_argument("--devices", type=int, default=20)
+    parser.add_argument("--stagger", type=float, default=0.25, help="seconds between device check-ins")
+    parser.add_argument("--server-kbps", type=float, default=256, help="central server uplink, KB/s")
+    parser.add_argument("--device-kbps", type=float, default=512, help="device uplink, KB/s")
+    parser.add_argument("--flaky", type=float, default=0.01,
+                        help="chance a seeder drops a response halfway")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--no-baseline", action="store_true", help="skip the server-only run")
+    parser.add_argument("-v", "--verbose", action="store_true", help="per-device sources")
+    args = parser.parse_args()
+
+    with open(args.firmware, "rb") as f:
+        data = f.read()
+
+    results = [("Relay", run_fleet(args, data, True))]
+    if not args.no_baseline:
+        results.append(("Server", run_fleet(args, data, False)))
+    for title, (devices, server_sent, elapsed, errors) in results:
+        report(title, devices, server_sent, elapsed, errors, len(data), args.verbose)
+    return 1 if any(errors for _, (_, _, _, errors) in results) else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+"""
+Simulate a fleet polling the update manifest, to compare schedules.
+
+Models the device scheduler in src/OTAUpdateCheck.h against a naive fixed
+schedule. All devices come online at t=0 (e.g. after a power cut), and the
+update server is down for a while to show how failed checks are retried.
+
+    fixed     check on coming online, then every interval; retry failed
+              checks after a fixed delay; unconditional GET of the manifest
+    jittered  first check within the startup window, then every
+              interval/2..3*interval/2; exponential backoff with jitter on
+              failure; conditional GET (304 while the manifest is unchanged)
+
+Reports peak and mean requests per second and bytes served by the server.
+
+Usage:
+    python tools/simulate_update_polling.py
+    python tools/simulate_update_polling.py --devices 10000 --hours 24 --outage 5.5:6.5
+"""
+import argparse
+import heapq
+import random
+from collections import Counter
+
+# Keep in sync with src/OTAUpdateCheck.h
+INTERVAL = 6 * 3600
+STARTUP_WINDOW = 5 * 60
+BACKOFF_BASE = 60
+BACKOFF_MAX = INTERVAL
+
+# Typical response sizes, headers included
+MANIFEST_200_BYTES = 180 + 220
+MANIFEST_304_BYTES = 160
+ERROR_BYTES = 150
+
+
+def jittered(base):
+    return base / 2 + random.random() * base
+
+
+def simulate(args, strategy):
+    outage_start, outage_end = args.outage
+    duration = args.hours * 3600
+    requests = Counter()
+    served = 0
+    failures = [0] * args.devices
+    has_validators = [False] * args.devices
+
+    events = []
+    for device in range(args.devices):
+        first = 0 if strategy == "fixed" else random.random() * STARTUP_WINDOW
+        heapq.heappush(events, (first, device))
+
+    while events:
+        t, device = heapq.heappop(events)
+        if t >= duration:
+            break
+        requests[int(t)] += 1
+
+        if outage_start * 3600 <= t < outage_end * 3600:
+            served += ERROR_BYTES
+            if strategy == "fixed":
+                delay = BACKOFF_BASE
+            else:
+                delay = jittered(min(BACKOFF_BASE * 2 ** failures[device], BACKOFF_MAX))
+            failures[device] += 1
+        else:
+            if strategy == "jittered" and has_validators[device]:
+                served += MANIFEST_304_BYTES
+            else:
+                served += MANIFEST_200_BYTES
+            has_validators[device] = True
+            failures[device] = 0
+            delay = INTERVAL if strategy == "fixed" else jittered(INTERVAL)
+
+        heapq.heappush(events, (t + delay, device))
+
+    total = sum(requests.values())
+    return {
+        "requests": total,
+        "peak_rps": max(requests.values()) if requests else 0,
+        "mean_rps": total / duration,
+        "bytes": served,
+    }
+
+
+def parse_outage(value):
+    start, end = value.split(":")
+    return float(start), float(end)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Simulate fleet update polling")
+    parser.add_argument("--devices", type=int, default=10000)
+    parser.add_argument("--hours", type=float, default=24)
+    parser.add_argument("--outage", type=parse_outage, default=(5.5, 6.5),
+                        help="server outage as START:END in hours (default 5.5:6.5)")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    print("%d devices, %.0f h, server down %.1f-%.1f h" % ((args.devices, args.hours) + args.outage))
+    print("%-10s %10s %10s %10s %12s" % ("schedule", "requests", "peak/s", "mean/s", "bytes"))
+    for strategy in ("fixed", "jittered"):
+        random.seed(args.seed)
+        r = simulate(args, strategy)
+        print("%-10s %10d %10d %10.2f %12d" % (strategy, r["requests"], r["peak_rps"], r["mean_rps"], r["bytes"]))
+
+
+if __name__ == "__main__":
+    main()